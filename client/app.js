@@ -1,5 +1,6 @@
 (() => {
-  const apiBase = 'http://localhost:8080';
+  // Pages served by ESA itself carry an empty esa-api-base: same origin.
+  const apiBase = document.querySelector('meta[name="esa-api-base"]')?.content ?? 'http://localhost:8080';
   let token = sessionStorage.getItem('esa_token');
   let currentUser = sessionStorage.getItem('esa_user');
   let role = { admin: false, developer: false };
@@ -9,8 +10,15 @@
   let editingApp = null;
   let activeApp = null;
   let activeComponents = [];
+  // Chart images by component id. The server tags each image with an ETag
+  // that changes with the chart's source data, so a refresh that changed
+  // nothing comes back as 304 and the current image stays.
+  const chartImages = new Map();
   let appDirty = false;
   let workbookApp = null;
+  // Live /excel/events stream of the launched app, if the server keeps one
+  // open: outputs arrive as they change and edits need not re-query them.
+  let outputPush = null;
   let builderTarget = null;
   let builderWidgets = [];
   let builderSelectedWidget = null;
@@ -119,6 +127,7 @@
   const builderClose = qs('#ui-builder-close');
   const builderAppLabel = qs('#builder-app-label');
   const builderSaveLayoutBtn = qs('#builder-save-layout');
+  const builderMemoize = qs('#builder-memoize');
   const propImportExcel = qs('#prop-import-excel');
   // Import dialog elements
   const importModal = qs('#import-excel-modal');
@@ -127,6 +136,9 @@
   const importForm = qs('#import-excel-form');
   const importClose = qs('#import-excel-close');
   const importCancel = qs('#import-excel-cancel');
+  const importAll = qs('#import-excel-all');
+  const importProgress = qs('#import-progress');
+  let importJob = null; // { id, controller } while an all-sheets import runs
   const builderWidgetTree = qs('#builder-widget-tree');
   const builderTreeRoot = qs('#builder-tree-root');
   const builderEmpty = qs('#builder-empty');
@@ -336,6 +348,7 @@
   builderSaveLayoutBtn?.addEventListener('click', () => saveBuilderLayout());
   propImportExcel?.addEventListener('click', openImportDialog);
   importForm?.addEventListener('submit', handleExcelImport);
+  importAll?.addEventListener('click', handleWorkbookImport);
   importClose?.addEventListener('click', closeImportDialog);
   importCancel?.addEventListener('click', closeImportDialog);
   importModal?.addEventListener('click', (e) => {
@@ -520,6 +533,7 @@
       appDirty = false;
       renderAppUi(schema);
       await refreshActiveApp(true, false);
+      startOutputPush();
       updateWorkspaceState({ title: name, desc: 'Workbook synced. Edit inputs to push values back to Excel.', busy: false });
       if (appRefreshBtn) appRefreshBtn.disabled = false;
       if (appExitBtn) appExitBtn.disabled = false;
@@ -559,6 +573,7 @@
   }
 
   async function closeWorkbook() {
+    stopOutputPush();
     if (!workbookApp) return;
     try {
       await apiFetch(`${apiBase}/excel/close`, { method: 'POST', headers: { ...authHeaders() } });
@@ -567,8 +582,11 @@
   }
 
   function resetWorkspace() {
+    stopOutputPush();
     activeApp = null;
     activeComponents = [];
+    chartImages.forEach(({ url }) => URL.revokeObjectURL(url));
+    chartImages.clear();
     appUiForm?.classList.add('hidden');
     if (appUiForm) appUiForm.innerHTML = '';
     appUiEmpty?.classList.remove('hidden');
@@ -588,13 +606,13 @@
     if (appProgress) appProgress.classList.add('hidden');
   }
 
-  async function refreshActiveApp(showToastOnError = false, notifyOnSuccess = true) {
-    if (!activeApp || !activeComponents.length) return;
-    console.log('refreshActiveApp: activeComponents=', activeComponents);
+  async function refreshActiveApp(showToastOnError = false, notifyOnSuccess = true, components = activeComponents) {
+    if (!activeApp || !components.length) return;
+    console.log('refreshActiveApp: components=', components);
     showAppProgress('Refreshing data...');
     const failures = [];
     try {
-      await Promise.all(activeComponents.map(async (component) => {
+      await Promise.all(components.map(async (component) => {
         if (!component?.sheet || !component?.cell) return;
         try {
           console.log('Querying component:', component.id, component.componentType, component.sheet, component.cell);
@@ -642,12 +660,97 @@
     }
   }
 
+  // Subscribes to the cell outputs of the launched app and applies the
+  // changes the server pushes. If the server has no event stream, or it
+  // drops, edits go back to re-querying every output.
+  async function startOutputPush() {
+    stopOutputPush();
+    const components = activeComponents.filter(c => c?.sheet && c?.cell && c.componentType !== 'chart');
+    if (!components.length) return;
+    const push = { controller: new AbortController(), values: new Map() };
+    try {
+      const ranges = components.map(c => ({ sheet: c.sheet, range: c.cell }));
+      const sub = await apiFetch(`${apiBase}/excel/subscribe`, {
+        method: 'POST',
+        headers: { 'Content-Type': 'application/json', ...authHeaders() },
+        body: JSON.stringify({ ranges })
+      });
+      if (!sub.ok) return;
+      const res = await apiFetch(`${apiBase}/excel/events`, { headers: { ...authHeaders() }, signal: push.controller.signal });
+      if (!res.ok || !res.body) return;
+      outputPush = push;
+      for await (const { event, data } of readEvents(res)) {
+        if (event === 'cells') applyPushedCells(push, JSON.parse(data));
+      }
+    } catch (err) {
+      if (err?.name !== 'AbortError') console.warn('Output push stopped:', err?.message);
+    } finally {
+      if (outputPush === push) outputPush = null;
+    }
+  }
+
+  function stopOutputPush() {
+    if (!outputPush) return;
+    outputPush.controller.abort();
+    outputPush = null;
+  }
+
+  // Yields {event, data} for each server-sent event of a response.
+  async function* readEvents(res) {
+    const reader = res.body.getReader();
+    const decoder = new TextDecoder();
+    let buffered = '';
+    for (;;) {
+      const { value, done } = await reader.read();
+      if (done) return;
+      buffered += decoder.decode(value, { stream: true });
+      let end;
+      while ((end = buffered.indexOf('\n\n')) >= 0) {
+        const block = buffered.slice(0, end);
+        buffered = buffered.slice(end + 2);
+        let event = 'message';
+        const data = [];
+        for (const line of block.split('\n')) {
+          if (line.startsWith('event:')) event = line.slice(6).trim();
+          else if (line.startsWith('data:')) data.push(line.slice(5).trimStart());
+        }
+        if (data.length) yield { event, data: data.join('\n') };
+      }
+    }
+  }
+
+  // An update carries a range's whole value, or the cells that changed as
+  // [row, col, value] against the last value sent for it.
+  function applyPushedCells(push, { ranges = [] }) {
+    for (const update of ranges) {
+      const key = `${update.sheet}!${update.range}`;
+      if (update.error) {
+        console.warn('Pushed output failed:', key, update.error);
+        continue;
+      }
+      let value = update.value;
+      if (update.cells) {
+        value = push.values.get(key);
+        for (const [row, col, cell] of update.cells) {
+          if (Array.isArray(value?.[0])) value[row][col] = cell;
+          else if (Array.isArray(value)) value[col] = cell;
+          else value = cell;
+        }
+      }
+      push.values.set(key, value);
+      showRangeValue(update.sheet, update.range, value);
+    }
+  }
+
   async function queryChartImage(component) {
     if (!component?.sheet || !component?.cell) return null;
     if (!activeApp?.owner || !activeApp?.name) return null;
+    const cached = chartImages.get(component.id);
+    const headers = { 'Content-Type': 'application/json', Accept: 'image/png', ...authHeaders() };
+    if (cached?.etag) headers['If-None-Match'] = cached.etag;
     const res = await apiFetch(`${apiBase}/excel/chart`, {
       method: 'POST',
-      headers: { 'Content-Type': 'application/json', ...authHeaders() },
+      headers,
       body: JSON.stringify({ 
         owner: activeApp.owner, 
         name: activeApp.name, 
@@ -655,23 +758,28 @@
         cell: component.cell 
       })
     });
-    const data = await res.json().catch(() => ({}));
+    if (res.status === 304 && cached) return cached.url;
     if (!res.ok) {
+      const data = await res.json().catch(() => ({}));
       throw new Error(data?.error || 'Unable to get chart image');
     }
-    return data?.image || null;
+    const blob = await res.blob();
+    if (cached) URL.revokeObjectURL(cached.url);
+    const url = URL.createObjectURL(blob);
+    chartImages.set(component.id, { etag: res.headers.get('ETag'), url });
+    return url;
   }
 
-  function updateChartDisplay(id, base64Image) {
+  function updateChartDisplay(id, imageUrl) {
     const container = appUiForm?.querySelector(`[data-component="${id}"]`);
     if (!container) return;
     
     const img = container.querySelector('.chart-image');
     const loading = container.querySelector('.chart-loading');
     
-    if (base64Image) {
+    if (imageUrl) {
       if (img) {
-        img.src = `data:image/png;base64,${base64Image}`;
+        img.src = imageUrl;
         img.style.display = 'block';
       }
       if (loading) loading.style.display = 'none';
@@ -684,13 +792,149 @@
     }
   }
 
+  // Binary form of /excel/query results, asked for with an Accept header.
+  // The layout is described in the server's "Binary cell encoding" section:
+  // a header, then frames of column blocks, all padded to 8 bytes so typed
+  // arrays can be laid over the response buffer without copying.
+  const CELLS_TYPE = 'application/vnd.esa.cells';
+  const alignCells = (pos) => (pos + 7) & ~7;
+  const unixDaysToIso = (days) => new Date(Math.floor(days) * 86400000).toISOString().slice(0, 10);
+
+  function decodeCells(buffer) {
+    const view = new DataView(buffer);
+    const bytes = new Uint8Array(buffer);
+    const utf8 = new TextDecoder();
+    if (utf8.decode(bytes.subarray(0, 4)) !== 'ESAC' || view.getUint8(4) !== 1) {
+      throw new Error('Unsupported cell format');
+    }
+    const cols = view.getUint32(12, true);
+    const tokenLength = view.getUint16(24, true);
+    const result = {
+      rows: view.getUint32(8, true),
+      cols,
+      paged: (view.getUint8(5) & 1) !== 0,
+      offset: view.getUint32(16, true),
+      totalRows: view.getUint32(20, true),
+      nextPageToken: tokenLength ? utf8.decode(bytes.subarray(26, 26 + tokenLength)) : null,
+      frames: []
+    };
+    let pos = alignCells(26 + tokenLength);
+    for (;;) {
+      const n = view.getUint32(pos, true);
+      pos += 8;
+      if (!n) break;
+      const bitmap = () => {
+        const bits = bytes.subarray(pos, pos + ((n + 7) >> 3));
+        pos = alignCells(pos + bits.length);
+        return bits;
+      };
+      const columns = [];
+      for (let c = 0; c < cols; c++) {
+        const encoding = view.getUint8(pos);
+        const arg = view.getUint32(pos + 4, true);
+        pos += 8;
+        let column;
+        switch (encoding) {
+          case 0:
+            column = { type: 'empty' };
+            break;
+          case 1:
+          case 5: {
+            const valid = bitmap();
+            column = { type: encoding === 1 ? 'float64' : 'date', valid, values: new Float64Array(buffer, pos, n) };
+            pos += n * 8;
+            break;
+          }
+          case 2: {
+            const valid = bitmap();
+            column = { type: 'int32', valid, values: new Int32Array(buffer, pos, n) };
+            pos = alignCells(pos + n * 4);
+            break;
+          }
+          case 3: {
+            const valid = bitmap();
+            column = { type: 'bool', valid, bits: bitmap() };
+            break;
+          }
+          case 4: {
+            const dict = [];
+            for (let i = 0; i < arg; i++) {
+              const len = view.getUint32(pos, true);
+              dict.push(utf8.decode(bytes.subarray(pos + 4, pos + 4 + len)));
+              pos += 4 + len;
+            }
+            pos = alignCells(pos);
+            column = { type: 'string', dict, index: new Uint32Array(buffer, pos, n) };
+            pos = alignCells(pos + n * 4);
+            break;
+          }
+          case 6: {
+            const tags = bytes.subarray(pos, pos + n);
+            pos = alignCells(pos + n);
+            const values = new Array(n).fill(null);
+            let p = pos;
+            for (let r = 0; r < n; r++) {
+              if (tags[r] === 1 || tags[r] === 4) {
+                const num = view.getFloat64(p, true);
+                values[r] = tags[r] === 4 ? unixDaysToIso(num) : num;
+                p += 8;
+              } else if (tags[r] === 2) {
+                values[r] = bytes[p] !== 0;
+                p += 1;
+              } else if (tags[r] === 3) {
+                const len = view.getUint32(p, true);
+                values[r] = utf8.decode(bytes.subarray(p + 4, p + 4 + len));
+                p += 4 + len;
+              }
+            }
+            pos = alignCells(pos + arg);
+            column = { type: 'mixed', values };
+            break;
+          }
+          default:
+            throw new Error(`Unknown column encoding ${encoding}`);
+        }
+        columns.push(column);
+      }
+      result.frames.push({ rows: n, columns });
+    }
+    return result;
+  }
+
+  // Rows of plain values, matching the JSON form (dates as YYYY-MM-DD).
+  function cellsToRows(decoded) {
+    const rows = [];
+    const has = (bits, r) => (bits[r >> 3] >> (r & 7)) & 1;
+    decoded.frames.forEach(frame => {
+      const start = rows.length;
+      for (let r = 0; r < frame.rows; r++) rows.push(new Array(decoded.cols).fill(null));
+      frame.columns.forEach((col, c) => {
+        for (let r = 0; r < frame.rows; r++) {
+          let v = null;
+          if (col.type === 'mixed') v = col.values[r];
+          else if (col.type === 'string') v = col.index[r] === 0xFFFFFFFF ? null : col.dict[col.index[r]];
+          else if (col.type !== 'empty' && has(col.valid, r)) {
+            if (col.type === 'bool') v = has(col.bits, r) === 1;
+            else if (col.type === 'date') v = unixDaysToIso(col.values[r]);
+            else v = col.values[r];
+          }
+          rows[start + r][c] = v;
+        }
+      });
+    });
+    return rows;
+  }
+
   async function queryExcelRange(component) {
     if (!component?.sheet || !component?.cell) return null;
     const res = await apiFetch(`${apiBase}/excel/query`, {
       method: 'POST',
-      headers: { 'Content-Type': 'application/json', ...authHeaders() },
+      headers: { 'Content-Type': 'application/json', 'Accept': `${CELLS_TYPE}, application/json`, ...authHeaders() },
       body: JSON.stringify({ sheet: component.sheet, range: component.cell })
     });
+    if (res.ok && (res.headers.get('Content-Type') || '').startsWith(CELLS_TYPE)) {
+      return cellsToRows(decodeCells(await res.arrayBuffer()));
+    }
     const data = await res.json().catch(() => ({}));
     if (!res.ok) {
       throw new Error(data?.error || 'Unable to read range');
@@ -698,6 +942,35 @@
     return data?.value ?? null;
   }
 
+  // Console helper: payload size and decode time of both encodings for a
+  // range of the loaded workbook, e.g. esaWireBench('Sheet1', 'A1:J5000').
+  window.esaWireBench = async (sheet, range) => {
+    const fetchAs = (accept) => apiFetch(`${apiBase}/excel/query`, {
+      method: 'POST',
+      headers: { 'Content-Type': 'application/json', 'Accept': accept, ...authHeaders() },
+      body: JSON.stringify({ sheet, range })
+    });
+    const jsonBuffer = await (await fetchAs('application/json')).arrayBuffer();
+    const jsonBody = new TextDecoder().decode(jsonBuffer);
+    const binaryBody = await (await fetchAs(CELLS_TYPE)).arrayBuffer();
+    const best = (fn) => {
+      let ms = Infinity;
+      for (let i = 0; i < 10; i++) {
+        const t0 = performance.now();
+        fn();
+        ms = Math.min(ms, performance.now() - t0);
+      }
+      return ms;
+    };
+    const results = {
+      json: { bytes: jsonBuffer.byteLength, decodeMs: best(() => JSON.parse(jsonBody)) },
+      binary: { bytes: binaryBody.byteLength, decodeMs: best(() => decodeCells(binaryBody)) },
+      'binary + rows': { bytes: binaryBody.byteLength, decodeMs: best(() => cellsToRows(decodeCells(binaryBody))) }
+    };
+    console.table(results);
+    return results;
+  };
+
   function updateExcelGridDisplay(id, data, component) {
     const container = appUiForm?.querySelector(`[data-component="${id}"]`);
     if (!container) return;
@@ -1342,6 +1615,9 @@
       payload.value = rawValue ?? '';
     }
     
+    // Pushed outputs update themselves; otherwise the reply carries the
+    // schema outputs the edit reached.
+    if (outputPush) payload.outputs = false;
     showAppProgress('Updating Excel...');
     try {
       const res = await apiFetch(`${apiBase}/excel/set`, {
@@ -1352,7 +1628,15 @@
       const data = await res.json().catch(() => ({}));
       if (!res.ok) throw new Error(data?.error || 'Failed to push value');
       appDirty = true;
-      await refreshActiveApp();
+      let stale = activeComponents;
+      if (outputPush || Array.isArray(data.outputs)) {
+        (data.outputs || []).forEach(applySetOutput);
+        // Charts, and components the schema does not bind as inputs or
+        // outputs, are still fetched.
+        const bound = ['input', 'output', 'bidirectional'];
+        stale = activeComponents.filter(c => c.componentType === 'chart' || (!outputPush && !bound.includes(c.mode)));
+      }
+      await refreshActiveApp(false, true, stale);
     } catch (err) {
       showToast(err.message || 'Failed to push value', true);
     } finally {
@@ -1360,6 +1644,24 @@
     }
   }
 
+  function applySetOutput({ sheet, range, value, error }) {
+    if (error) return console.warn('Output read failed:', `${sheet}!${range}`, error);
+    showRangeValue(sheet, range, value);
+  }
+
+  // Shows a value read for a range in every non-chart component bound to it.
+  function showRangeValue(sheet, range, value) {
+    activeComponents
+      .filter(c => c.sheet === sheet && c.cell === range && c.componentType !== 'chart')
+      .forEach(component => {
+        if (component.componentType === 'excelgrid' || component.componentType === 'datagrid') {
+          updateExcelGridDisplay(component.id, value, component);
+        } else {
+          updateComponentDisplay(component.id, value ?? '');
+        }
+      });
+  }
+
   function updateWorkspaceState({ title, desc, busy }) {
     if (title && appWorkspaceTitle) appWorkspaceTitle.textContent = title;
     if (desc && appWorkspaceDesc) appWorkspaceDesc.textContent = desc;
@@ -1438,6 +1740,7 @@
       } else {
         builderWidgets = [];
       }
+      if (builderMemoize) builderMemoize.checked = !!schema?.memoize;
       
       builderSelectedWidget = null;
       builderSavedState = JSON.stringify(builderWidgets);
@@ -2349,6 +2652,7 @@
   async function saveBuilderLayout() {
     if (!builderTarget) return showToast('Select an app to design', true);
     const schema = { widgets: builderWidgets };
+    if (builderMemoize?.checked) schema.memoize = true;
     try {
       const res = await apiFetch(`${apiBase}/apps/ui/save`, {
         method: 'POST',
@@ -2393,6 +2697,7 @@
   }
 
   function closeImportDialog() {
+    cancelWorkbookImport();
     if (importModal) {
       if (importModal.contains(document.activeElement)) {
         document.activeElement.blur();
@@ -2442,6 +2747,104 @@
     }
   }
 
+  function setImportProgress(text) {
+    if (!importProgress) return;
+    importProgress.textContent = text;
+    importProgress.classList.toggle('hidden', !text);
+  }
+
+  // Yields each line of a newline-delimited JSON response as it arrives.
+  async function* readNdjson(res) {
+    const reader = res.body.getReader();
+    const decoder = new TextDecoder();
+    let buffered = '';
+    for (;;) {
+      const { value, done } = await reader.read();
+      buffered += decoder.decode(value || new Uint8Array(), { stream: !done });
+      let nl;
+      while ((nl = buffered.indexOf('\n')) >= 0) {
+        const line = buffered.slice(0, nl).trim();
+        buffered = buffered.slice(nl + 1);
+        if (line) yield JSON.parse(line);
+      }
+      if (done) break;
+    }
+    if (buffered.trim()) yield JSON.parse(buffered);
+  }
+
+  function cancelWorkbookImport() {
+    if (!importJob) return;
+    const { id, controller } = importJob;
+    importJob = null;
+    if (id) {
+      apiFetch(`${apiBase}/excel/analyze/cancel`, {
+        method: 'POST',
+        headers: { 'Content-Type': 'application/json', ...authHeaders() },
+        body: JSON.stringify({ job: id })
+      }).catch(() => {});
+    }
+    controller.abort();
+    setImportProgress('');
+  }
+
+  // Analyzes every sheet on the server and adds a notebook with one tab
+  // per sheet. Sheets stream in as they finish, in any order.
+  async function handleWorkbookImport() {
+    if (!builderTarget) return showToast('No app selected', true);
+    if (importJob) return;
+    const job = { id: null, controller: new AbortController() };
+    importJob = job;
+    setImportProgress('Starting analysis...');
+    let order = [];
+    const grids = new Map();
+    let failed = 0;
+    try {
+      const res = await apiFetch(`${apiBase}/excel/analyze/workbook`, {
+        method: 'POST',
+        headers: { 'Content-Type': 'application/json', ...authHeaders() },
+        body: JSON.stringify({ owner: builderTarget.owner, name: builderTarget.name }),
+        signal: job.controller.signal
+      });
+      if (!res.ok) {
+        const data = await res.json().catch(() => ({}));
+        throw new Error(data?.error || 'Failed to analyze workbook');
+      }
+      for await (const msg of readNdjson(res)) {
+        if (msg.job) {
+          job.id = msg.job;
+          order = msg.sheets || [];
+          setImportProgress(`Analyzing ${msg.total} sheet${msg.total !== 1 ? 's' : ''}...`);
+        } else if (msg.sheet) {
+          if (msg.error) failed++;
+          else if (msg.result?.cells?.length) {
+            grids.set(msg.sheet, createGridFromCells(msg.result.cells, msg.result.rowCount, msg.result.colCount, msg.sheet));
+          }
+          setImportProgress(`Analyzed ${msg.done} of ${msg.total}: ${msg.sheet}`);
+        } else if (msg.cancelled) {
+          throw new DOMException('Analysis cancelled', 'AbortError');
+        }
+      }
+    } catch (err) {
+      if (importJob === job) importJob = null;
+      setImportProgress('');
+      if (err.name !== 'AbortError') showToast(err.message || 'Failed to import from Excel', true);
+      return;
+    }
+    importJob = null;
+    setImportProgress('');
+    const panels = order.filter(sheet => grids.has(sheet)).map(sheet => ({
+      id: createWidgetId(),
+      type: 'panel',
+      name: sheet,
+      properties: { label: sheet },
+      children: [grids.get(sheet)]
+    }));
+    if (!panels.length) return showToast('No cells found in workbook', true);
+    addImportedWidgets([{ id: createWidgetId(), type: 'notebook', name: 'WorkbookNotebook', children: panels }]);
+    closeImportDialog();
+    showToast(`Imported ${panels.length} sheet${panels.length !== 1 ? 's' : ''}${failed ? ` (${failed} failed)` : ''}`);
+  }
+
   function createGridFromCells(cells, rowCount, colCount, sheet) {
     // Create a grid sizer to match Excel layout
     const grid = {
@@ -2741,16 +3144,15 @@
       const imageFile = imageInput && imageInput.files ? imageInput.files[0] : null;
       const image_base64 = imageFile ? await resizeImageFile(imageFile) : null;
       if (!isUpdate) {
-        const file_base64 = await fileToBase64(file);
-        if (!file_base64) return showToast('Failed to read file', true);
+        const upload = await uploadWorkbook(file);
         // Extract file extension from filename
         const fileName = file.name || '';
         const lowerName = fileName.toLowerCase();
         const fileExt = lowerName.endsWith('.xlsm') ? '.xlsm' : lowerName.endsWith('.xls') ? '.xls' : '.xlsx';
-        const payload = { name, description, file_base64, file_extension: fileExt, public: isPublic };
+        const payload = { name, description, upload, file_extension: fileExt, public: isPublic };
         if (access_group) payload.access_group = access_group;
         if (image_base64) payload.image_base64 = image_base64;
-        console.log('Creating app with payload:', { name, description, hasFile: !!file_base64, fileLen: file_base64?.length, fileExt, public: isPublic, access_group });
+        console.log('Creating app with payload:', { name, description, upload, fileLen: file.size, fileExt, public: isPublic, access_group });
         const res = await apiFetch(`${apiBase}/apps`, {
           method: 'POST',
           headers: { 'Content-Type': 'application/json', ...authHeaders() },
@@ -2763,15 +3165,17 @@
       } else if (hasFile) {
         const payload = { name, description, public: isPublic };
         if (access_group) payload.access_group = access_group;
-        payload.file_base64 = await fileToBase64(file);
+        payload.upload = await uploadWorkbook(file);
         if (image_base64) payload.image_base64 = image_base64;
         const res = await apiFetch(`${apiBase}/apps/version`, {
           method: 'POST',
           headers: { 'Content-Type': 'application/json', ...authHeaders() },
           body: JSON.stringify(payload)
         });
-        if (!res.ok) throw new Error('Version publish failed');
-        showToast('New version published');
+        const job = await res.json().catch(() => ({}));
+        if (!res.ok) throw new Error(job?.error || 'Version publish failed');
+        const version = await waitForPublish(job);
+        showToast(`Version ${version} published`);
       } else {
         const payload = { description, public: isPublic };
         if (access_group) payload.access_group = access_group;
@@ -2858,16 +3262,64 @@
     return `${normalized.slice(0, 117).trimEnd()}...`;
   };
 
-  const fileToBase64 = (file) => new Promise((resolve, reject) => {
-    const reader = new FileReader();
-    reader.onload = () => {
-      const res = reader.result;
-      const base64 = res.substring(res.indexOf(',') + 1);
-      resolve(base64);
-    };
-    reader.onerror = () => reject(reader.error);
-    reader.readAsDataURL(file);
-  });
+  // Sends a workbook to /uploads in chunks and returns the upload id for
+  // /apps or /apps/version. A chunk that fails is retried from the offset
+  // the server reports, so a dropped connection does not restart the file.
+  const UPLOAD_CHUNK = 4 * 1024 * 1024;
+  async function uploadWorkbook(file) {
+    const res = await apiFetch(`${apiBase}/uploads`, {
+      method: 'POST',
+      headers: { 'Content-Type': 'application/json', ...authHeaders() },
+      body: JSON.stringify({ size: file.size })
+    });
+    const created = await res.json().catch(() => ({}));
+    if (!res.ok) throw new Error(created?.error || 'Upload failed');
+    const url = `${apiBase}/uploads/${created.upload}`;
+    let offset = 0;
+    let failures = 0;
+    while (offset < file.size) {
+      const end = Math.min(offset + UPLOAD_CHUNK, file.size);
+      showToast(`Uploading ${Math.floor((offset / file.size) * 100)}%`);
+      try {
+        const put = await apiFetch(url, {
+          method: 'PUT',
+          headers: { 'Content-Type': 'application/octet-stream', 'Content-Range': `bytes ${offset}-${end - 1}/${file.size}`, ...authHeaders() },
+          body: file.slice(offset, end)
+        });
+        const state = await put.json().catch(() => ({}));
+        if (!put.ok && put.status !== 409) throw new Error(state?.error || 'Upload failed');
+        offset = state.offset ?? end;
+        failures = 0;
+      } catch (err) {
+        if (++failures > 3) throw err;
+        const status = await apiFetch(url, { headers: { ...authHeaders() } }).catch(() => null);
+        const state = status?.ok ? await status.json().catch(() => ({})) : {};
+        if (typeof state.offset === 'number') offset = state.offset;
+      }
+    }
+    return created.upload;
+  }
+
+  // /apps/version answers once the request is accepted and builds the
+  // version in the background; this follows the job until the version is
+  // live or has failed.
+  const PUBLISH_STAGES = { queued: 'Queued', storing: 'Storing workbook', validating: 'Checking workbook', saving: 'Saving version', prewarming: 'Preparing workbook', activating: 'Activating' };
+  async function waitForPublish(job) {
+    let status = job;
+    while (status.state === 'publishing') {
+      showToast(`${PUBLISH_STAGES[status.stage] || 'Publishing'}...`);
+      await new Promise(resolve => setTimeout(resolve, 500));
+      const res = await apiFetch(`${apiBase}/apps/version/status`, {
+        method: 'POST',
+        headers: { 'Content-Type': 'application/json', ...authHeaders() },
+        body: JSON.stringify({ job: job.job })
+      });
+      status = await res.json().catch(() => ({}));
+      if (!res.ok) throw new Error(status?.error || 'Version publish failed');
+    }
+    if (status.state !== 'published') throw new Error(status.error || 'Version publish failed');
+    return status.version;
+  }
 
   const resizeImageFile = (file, maxSize = 512) => new Promise((resolve, reject) => {
     const reader = new FileReader();
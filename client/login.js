@@ -1,5 +1,6 @@
 (() => {
-  const apiBase = 'http://localhost:8080';
+  // Pages served by ESA itself carry an empty esa-api-base: same origin.
+  const apiBase = document.querySelector('meta[name="esa-api-base"]')?.content ?? 'http://localhost:8080';
   const toastEl = document.querySelector('#toast');
   const showToast = (msg, isError = false) => {
     toastEl.textContent = msg;
@@ -0,0 +1,203 @@
+// Offline summary of ESA access logs (logs/access.log and rotated access-*.log[.gz]).
+// Usage:
+//   esa_logstat [--field total_us|excel_us|queue_us] [--user NAME] <file> [file...]
+// Prints, per method and route, the request count, error count, and latency
+// percentiles of the chosen field in milliseconds, slowest p99 first.
+// Gzipped files need a zlib build (ESA_HAVE_ZLIB); plain files always work.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef ESA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace
+{
+    struct RouteStats
+    {
+        std::vector<double> samples_ms;
+        size_t errors = 0;
+        unsigned long long bytes_out = 0;
+    };
+
+    // The access log is written by the server with a fixed key order and no
+    // nested objects, so a flat scan for "key": is enough here.
+    bool find_value(const std::string &line, const std::string &key, std::string &out)
+    {
+        std::string needle = "\"" + key + "\":";
+        size_t pos = line.find(needle);
+        if (pos == std::string::npos)
+            return false;
+        pos += needle.size();
+        if (pos < line.size() && line[pos] == '"')
+        {
+            std::string v;
+            for (size_t i = pos + 1; i < line.size(); ++i)
+            {
+                if (line[i] == '\\' && i + 1 < line.size())
+                {
+                    v.push_back(line[++i]);
+                    continue;
+                }
+                if (line[i] == '"')
+                {
+                    out = v;
+                    return true;
+                }
+                v.push_back(line[i]);
+            }
+            return false;
+        }
+        size_t end = line.find_first_of(",}", pos);
+        out = line.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        return !out.empty();
+    }
+
+    double percentile(const std::vector<double> &sorted, double p)
+    {
+        if (sorted.empty())
+            return 0.0;
+        size_t idx = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+        return sorted[std::min(idx, sorted.size() - 1)];
+    }
+
+#ifndef ESA_HAVE_ZLIB
+    bool is_gzip(const std::string &path)
+    {
+        return path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0;
+    }
+#endif
+
+    template <typename Fn>
+    bool for_each_line(const std::string &path, Fn fn)
+    {
+#ifdef ESA_HAVE_ZLIB
+        // gzopen also reads uncompressed files transparently.
+        gzFile in = gzopen(path.c_str(), "rb");
+        if (!in)
+            return false;
+        std::string line;
+        char buf[8192];
+        while (gzgets(in, buf, sizeof(buf)))
+        {
+            line += buf;
+            if (!line.empty() && line.back() == '\n')
+            {
+                line.pop_back();
+                fn(line);
+                line.clear();
+            }
+        }
+        if (!line.empty())
+            fn(line);
+        gzclose(in);
+        return true;
+#else
+        if (is_gzip(path))
+        {
+            std::cerr << "skipping " << path << ": built without zlib\n";
+            return false;
+        }
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+        std::string line;
+        while (std::getline(in, line))
+            fn(line);
+        return true;
+#endif
+    }
+} // namespace
+
+static const char *kUsage = "usage: esa_logstat [--field total_us|excel_us|queue_us] [--user NAME] <file> [file...]\n";
+
+int main(int argc, char **argv)
+{
+    std::string field = "total_us";
+    std::string user_filter;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--field" && i + 1 < argc)
+            field = argv[++i];
+        else if (arg == "--user" && i + 1 < argc)
+            user_filter = argv[++i];
+        else if (arg == "-h" || arg == "--help")
+        {
+            std::cout << kUsage;
+            return 0;
+        }
+        else
+            files.push_back(arg);
+    }
+    if (files.empty())
+    {
+        std::cerr << kUsage;
+        return 2;
+    }
+
+    std::map<std::string, RouteStats> routes;
+    size_t lines = 0, skipped = 0;
+    for (const auto &path : files)
+    {
+        bool ok = for_each_line(path, [&](const std::string &line)
+                                {
+            std::string method, route, status, value, bytes, user;
+            if (!find_value(line, "method", method) || !find_value(line, "route", route) ||
+                !find_value(line, "status", status) || !find_value(line, field, value))
+            {
+                ++skipped;
+                return;
+            }
+            if (!user_filter.empty() && (!find_value(line, "user", user) || user != user_filter))
+                return;
+            RouteStats &rs = routes[method + " " + route];
+            rs.samples_ms.push_back(std::strtod(value.c_str(), nullptr) / 1000.0);
+            if (std::atoi(status.c_str()) >= 500)
+                ++rs.errors;
+            if (find_value(line, "resp_bytes", bytes))
+                rs.bytes_out += std::strtoull(bytes.c_str(), nullptr, 10);
+            ++lines; });
+        if (!ok)
+            std::cerr << "could not read " << path << "\n";
+    }
+
+    struct Row
+    {
+        std::string key;
+        size_t count;
+        size_t errors;
+        double p50, p90, p99, max, mean;
+        unsigned long long bytes_out;
+    };
+    std::vector<Row> rows;
+    for (auto &kv : routes)
+    {
+        std::vector<double> &v = kv.second.samples_ms;
+        std::sort(v.begin(), v.end());
+        double sum = 0.0;
+        for (double d : v)
+            sum += d;
+        rows.push_back({kv.first, v.size(), kv.second.errors, percentile(v, 0.50), percentile(v, 0.90),
+                        percentile(v, 0.99), v.back(), sum / static_cast<double>(v.size()), kv.second.bytes_out});
+    }
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b)
+              { return a.p99 > b.p99; });
+
+    std::printf("%zu request(s), %zu unparsable line(s); field=%s (ms)\n", lines, skipped, field.c_str());
+    std::printf("%-32s %8s %6s %9s %9s %9s %9s %9s %12s\n", "route", "count", "5xx", "p50", "p90", "p99", "max", "mean", "bytes_out");
+    for (const auto &r : rows)
+    {
+        std::printf("%-32s %8zu %6zu %9.2f %9.2f %9.2f %9.2f %9.2f %12llu\n", r.key.c_str(), r.count, r.errors,
+                    r.p50, r.p90, r.p99, r.max, r.mean, r.bytes_out);
+    }
+    return 0;
+}
@@ -9,56 +9,140 @@
 #include <windows.h>
 #include <atlbase.h>
 #include <comdef.h>
+#include <bcrypt.h>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <list>
+#include <map>
 #include <algorithm>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <memory>
 #include <mutex>
 #include <random>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #pragma comment(lib, "Ws2_32.lib")
 #pragma comment(lib, "Ole32.lib")
 #pragma comment(lib, "OleAut32.lib")
+#pragma comment(lib, "Bcrypt.lib")
+
+#ifdef ESA_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 namespace fs = std::filesystem;
 
+enum class LogLevel
+{
+    Debug = 0,
+    Info,
+    Warn,
+    Error
+};
+
+// What producers do when the ring is full: wait for the writer, or drop the
+// line and have the writer report how many were lost.
+enum class LogOverflow
+{
+    Block,
+    Drop
+};
+
+// Asynchronous logger. Producers format "[LEVEL] msg" straight into a slot
+// of a bounded lock-free MPSC ring (Vyukov sequence numbers); a single writer thread drains the ring, prefixes the timestamp
+// (formatted once per second), and writes batches to stdout and the log file.
+// The file is flushed once a second, after 64 KB, or after any ERROR line.
 class Logger
 {
 public:
-    void init(const fs::path &path)
+    Logger() : cells_(kCapacity)
+    {
+        for (size_t i = 0; i < kCapacity; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~Logger() { shutdown(); }
+
+    void init(const fs::path &path, LogLevel level = LogLevel::Info, LogOverflow overflow = LogOverflow::Block)
+    {
+        shutdown();
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (file_.is_open())
+                file_.close();
+            log_path_ = path;
+            file_.open(path, std::ios::app);
+            if (!file_)
+            {
+                std::cerr << "Failed to open log file: " << path << "\n";
+            }
+        }
+        level_.store(static_cast<int>(level), std::memory_order_relaxed);
+        overflow_ = overflow;
+        stop_ = false;
+        running_.store(true, std::memory_order_release);
+        writer_ = std::thread([this]()
+                              { writer_loop(); });
+    }
+
+    // Stops the writer after draining everything already queued.
+    void shutdown()
     {
-        std::lock_guard<std::mutex> lock(mu_);
-        if (file_.is_open())
-            file_.close();
-        log_path_ = path;
-        file_.open(path, std::ios::app);
-        if (!file_)
         {
-            std::cerr << "Failed to open log file: " << path << "\n";
+            std::lock_guard<std::mutex> lock(wake_mu_);
+            if (!writer_.joinable())
+                return;
+            running_.store(false, std::memory_order_release);
+            stop_ = true;
         }
+        wake_cv_.notify_all();
+        writer_.join();
     }
 
-    void log(const std::string &level, const std::string &msg)
+    bool enabled(LogLevel level) const
     {
+        return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+    }
+
+    void log(LogLevel level, const std::string &msg)
+    {
+        int64_t now = static_cast<int64_t>(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+        while (running_.load(std::memory_order_acquire))
+        {
+            if (try_push(now, level, msg))
+                return;
+            if (overflow_ == LogOverflow::Drop)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            wake_cv_.notify_one();
+            std::this_thread::yield();
+        }
+        // Before init / after shutdown: write synchronously.
         std::lock_guard<std::mutex> lock(mu_);
-        auto now = std::chrono::system_clock::now();
-        auto now_time = std::chrono::system_clock::to_time_t(now);
-        std::tm tm_buf{};
-        localtime_s(&tm_buf, &now_time);
-        std::ostringstream line;
-        line << "[" << std::put_time(&tm_buf, "%Y-%m-%d %H:%M:%S") << "] [" << level << "] " << msg << "\n";
-        std::string text = line.str();
+        std::string text = stamp(now) + '[' + level_name(level) + "] " + msg + '\n';
         std::cout << text;
         if (file_.is_open())
         {
@@ -68,16 +152,192 @@ public:
     }
 
 private:
-    std::mutex mu_;
+    static const size_t kCapacity = 8192; // power of two
+    static const size_t kFlushBytes = 64 * 1024;
+
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> seq{0};
+        int64_t unix_sec = 0;
+        bool urgent = false;
+        std::string text; // capacity is reused once warmed up
+    };
+
+    static const char *level_name(LogLevel level)
+    {
+        switch (level)
+        {
+        case LogLevel::Debug:
+            return "DEBUG";
+        case LogLevel::Warn:
+            return "WARN";
+        case LogLevel::Error:
+            return "ERROR";
+        default:
+            return "INFO";
+        }
+    }
+
+    bool try_push(int64_t unix_sec, LogLevel level, const std::string &msg)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;)
+        {
+            cell = &cells_[pos & (kCapacity - 1)];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->unix_sec = unix_sec;
+        cell->urgent = level == LogLevel::Error;
+        cell->text += '[';
+        cell->text += level_name(level);
+        cell->text += "] ";
+        cell->text += msg;
+        cell->text += '\n';
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Single consumer: appends every ready entry to batch and returns how many
+    // there were; urgent is set if any of them was an ERROR line.
+    size_t drain(std::string &batch, bool &urgent)
+    {
+        size_t n = 0;
+        for (;;)
+        {
+            Cell &cell = cells_[head_ & (kCapacity - 1)];
+            if (cell.seq.load(std::memory_order_acquire) != head_ + 1)
+                break;
+            batch += stamp(cell.unix_sec);
+            batch += cell.text;
+            urgent = urgent || cell.urgent;
+            cell.text.clear();
+            cell.seq.store(head_ + kCapacity, std::memory_order_release);
+            ++head_;
+            ++n;
+        }
+        return n;
+    }
+
+    // Only the writer (or a synchronous caller holding mu_) uses the cache.
+    const std::string &stamp(int64_t unix_sec)
+    {
+        if (unix_sec != stamp_sec_)
+        {
+            std::time_t t = static_cast<std::time_t>(unix_sec);
+            std::tm tm_buf{};
+            localtime_s(&tm_buf, &t);
+            char buf[32];
+            std::strftime(buf, sizeof(buf), "[%Y-%m-%d %H:%M:%S] ", &tm_buf);
+            stamp_text_ = buf;
+            stamp_sec_ = unix_sec;
+        }
+        return stamp_text_;
+    }
+
+    void writer_loop()
+    {
+        std::string batch;
+        size_t unflushed = 0;
+        auto last_flush = std::chrono::steady_clock::now();
+        for (;;)
+        {
+            bool urgent = false;
+            size_t n;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                n = drain(batch, urgent);
+                size_t lost = dropped_.exchange(0, std::memory_order_relaxed);
+                if (lost)
+                {
+                    batch += stamp(static_cast<int64_t>(std::time(nullptr)));
+                    batch += "[WARN] Logger dropped " + std::to_string(lost) + " line(s)\n";
+                }
+                if (!batch.empty())
+                {
+                    std::cout.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                    if (file_.is_open())
+                        file_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                    unflushed += batch.size();
+                    batch.clear();
+                }
+                auto now = std::chrono::steady_clock::now();
+                if (unflushed && (urgent || unflushed >= kFlushBytes || now - last_flush >= std::chrono::seconds(1)))
+                {
+                    std::cout.flush();
+                    if (file_.is_open())
+                        file_.flush();
+                    unflushed = 0;
+                    last_flush = now;
+                }
+            }
+            if (n)
+                continue;
+            std::unique_lock<std::mutex> lock(wake_mu_);
+            if (stop_)
+                break;
+            wake_cv_.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        // Producers that raced the stop flag may still have pushed entries.
+        std::lock_guard<std::mutex> lock(mu_);
+        bool urgent = false;
+        drain(batch, urgent);
+        std::cout << batch;
+        std::cout.flush();
+        if (file_.is_open())
+        {
+            file_ << batch;
+            file_.flush();
+        }
+    }
+
+    std::vector<Cell> cells_;
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) size_t head_ = 0;
+    std::atomic<size_t> dropped_{0};
+    std::atomic<int> level_{static_cast<int>(LogLevel::Info)};
+    std::atomic<bool> running_{false};
+    LogOverflow overflow_ = LogOverflow::Block;
+
+    std::mutex mu_; // guards file_ and the timestamp cache
     std::ofstream file_;
     fs::path log_path_;
+    int64_t stamp_sec_ = -1;
+    std::string stamp_text_;
+
+    std::mutex wake_mu_;
+    std::condition_variable wake_cv_;
+    bool stop_ = false;
+    std::thread writer_;
 };
 
 Logger g_logger;
 
-void log_info(const std::string &msg) { g_logger.log("INFO", msg); }
-void log_warn(const std::string &msg) { g_logger.log("WARN", msg); }
-void log_error(const std::string &msg) { g_logger.log("ERROR", msg); }
+// Macros so the level check happens before the message is concatenated.
+#define ESA_LOG(level, msg)               \
+    do                                    \
+    {                                     \
+        if (g_logger.enabled(level))      \
+            g_logger.log((level), (msg)); \
+    } while (0)
+#define ESA_LOG_DEBUG(msg) ESA_LOG(LogLevel::Debug, msg)
+#define ESA_LOG_INFO(msg) ESA_LOG(LogLevel::Info, msg)
+#define ESA_LOG_WARN(msg) ESA_LOG(LogLevel::Warn, msg)
+#define ESA_LOG_ERROR(msg) ESA_LOG(LogLevel::Error, msg)
 
 // -------------------- Utility: base64 decode --------------------
 static const std::string kBase64Alphabet =
@@ -86,14 +346,18 @@ static const std::string kBase64Alphabet =
 static const size_t kMaxHeaderLine = 8 * 1024;       // 8 KB
 static const size_t kMaxHeaders = 100;               // cap header count
 static const size_t kMaxBodyBytes = 5 * 1024 * 1024; // 5 MB
+static const size_t kMaxDrainBytes = 8 * 1024 * 1024; // unread upload chunk read off before closing
+static const size_t kQueryBlockCells = 16 * 1024;    // cells per block of a streamed range read
 static const int kListenBacklog = SOMAXCONN;
 
 // Forward declarations for helpers
 std::string trim(const std::string &s);
 std::vector<std::string> split_csv(const std::string &csv);
 std::string to_lower(const std::string &s);
+std::string to_upper(const std::string &s);
 std::string normalize_sheet_key(const std::string &name);
 std::string sanitize_range_address(const std::string &address);
+std::string json_escape(const std::string &s);
 
 std::string base64_decode(const std::string &input)
 {
@@ -256,9 +520,18 @@ int extract_json_int(const std::string &body, const std::string &key, int def =
     if (start == std::string::npos)
         return def;
     size_t end = start;
+    if (body[end] == '-')
+        end++;
     while (end < body.size() && isdigit(body[end]))
         end++;
-    return std::stoi(body.substr(start, end - start));
+    try
+    {
+        return std::stoi(body.substr(start, end - start));
+    }
+    catch (...)
+    {
+        return def;
+    }
 }
 
 bool extract_json_bool(const std::string &body, const std::string &key, bool def = false)
@@ -293,6 +566,8 @@ double extract_json_double(const std::string &body, const std::string &key, doub
     if (start == std::string::npos)
         return def;
     size_t end = start;
+    if (body[end] == '-')
+        end++;
     while (end < body.size() && (isdigit(body[end]) || body[end] == '.'))
         end++;
     try
@@ -312,12 +587,40 @@ bool json_has_key(const std::string &body, const std::string &key)
 
 // Forward declarations
 std::string variant_to_json(const VARIANT &v);
+void append_variant_json(const VARIANT &v, std::string &out);
+struct CellGrid;
+void variant_to_grid(const VARIANT &v, CellGrid &grid);
+std::string column_name(uint32_t col);
 
 // -------------------- Config --------------------
+// A token bucket for one route, or for all of them with "*". Each user
+// (or, on routes without a session, each client address) has its own.
+struct RateLimit
+{
+    std::string route;     // "POST /excel/query", as in the route label
+    double per_second = 0; // refill rate
+    double burst = 0;      // bucket size
+};
+
 struct Config
 {
     int port = 8080;
     int excel_instances = 1;
+    int session_idle_minutes = 60; // sliding expiry, refreshed on every authenticated request
+    int session_max_hours = 12;    // absolute expiry from login regardless of activity
+    LogLevel log_level = LogLevel::Info;
+    LogOverflow log_overflow = LogOverflow::Block;
+    int access_log_max_mb = 64; // rotate logs/access.log past this size (and daily)
+    int access_log_keep = 14;   // rotated access logs to retain
+    bool native_engine = false; // calculate .xlsx workbooks in-process when every feature is supported
+    int query_cache_mb = 64;    // range reads cached for unmodified Excel workbooks; 0 turns the cache off
+    int calc_memo_mb = 32;      // outputs of memoized calculator apps by input values; 0 turns memoization off
+    int analysis_threads = 4;   // sheets of one /excel/analyze/workbook job analyzed at once
+    int chart_cache_mb = 32;    // rendered /excel/chart images; 0 turns the cache off
+    int upload_max_mb = 1024;   // largest workbook accepted through /uploads
+    std::string client_dir = "client"; // browser client served at /; empty turns it off
+    int excel_concurrency = 0;  // Excel operations running at once; 0 means one per CPU
+    std::vector<RateLimit> rate_limits;
     std::unordered_map<std::string, std::string> users; // username -> password
     std::unordered_set<std::string> admins;             // admin usernames from config only
 };
@@ -337,6 +640,44 @@ Config load_config(const std::string &path)
     std::string body = buffer.str();
     cfg.port = extract_json_int(body, "port", 8080);
     cfg.excel_instances = extract_json_int(body, "excel_instances", 1);
+    cfg.session_idle_minutes = extract_json_int(body, "session_idle_minutes", 60);
+    cfg.session_max_hours = extract_json_int(body, "session_max_hours", 12);
+    std::string level = extract_json_string(body, "log_level");
+    if (level == "debug")
+        cfg.log_level = LogLevel::Debug;
+    else if (level == "warn")
+        cfg.log_level = LogLevel::Warn;
+    else if (level == "error")
+        cfg.log_level = LogLevel::Error;
+    if (extract_json_string(body, "log_overflow") == "drop")
+        cfg.log_overflow = LogOverflow::Drop;
+    cfg.access_log_max_mb = extract_json_int(body, "access_log_max_mb", 64);
+    cfg.access_log_keep = extract_json_int(body, "access_log_keep", 14);
+    cfg.native_engine = extract_json_bool(body, "native_engine", false);
+    cfg.query_cache_mb = std::max(0, extract_json_int(body, "query_cache_mb", 64));
+    cfg.calc_memo_mb = std::max(0, extract_json_int(body, "calc_memo_mb", 32));
+    cfg.analysis_threads = std::max(1, extract_json_int(body, "analysis_threads", 4));
+    cfg.chart_cache_mb = std::max(0, extract_json_int(body, "chart_cache_mb", 32));
+    cfg.upload_max_mb = std::max(1, extract_json_int(body, "upload_max_mb", 1024));
+    if (body.find("\"client_dir\"") != std::string::npos)
+        cfg.client_dir = extract_json_string(body, "client_dir");
+    cfg.excel_concurrency = std::max(0, extract_json_int(body, "excel_concurrency", 0));
+    // Rate limits: [{"route":"POST /excel/query","per_second":5,"burst":20}, ...] under "rate_limits"
+    size_t rl = body.find("\"rate_limits\"");
+    size_t rl_end = rl == std::string::npos ? rl : body.find(']', rl);
+    for (size_t lb = rl == std::string::npos ? rl : body.find('{', rl); lb < rl_end; lb = body.find('{', lb + 1))
+    {
+        size_t rb = body.find('}', lb);
+        if (rb == std::string::npos || rb > rl_end)
+            break;
+        std::string item = body.substr(lb, rb - lb + 1);
+        RateLimit limit;
+        limit.route = extract_json_string(item, "route");
+        limit.per_second = extract_json_double(item, "per_second", 0.0);
+        limit.burst = std::max(1.0, extract_json_double(item, "burst", limit.per_second));
+        if (!limit.route.empty() && limit.per_second > 0)
+            cfg.rate_limits.push_back(limit);
+    }
     // Users: expects [{"username":"u","password":"p"}]
     size_t pos = 0;
     while ((pos = body.find("\"username\"", pos)) != std::string::npos)
@@ -409,6 +750,280 @@ std::string mask_token(const std::string &token)
     return token.substr(0, 8) + "***";
 }
 
+// Shortest decimal text that reads back as the same double. JSON has no
+// NaN or infinity, so those become null.
+std::string format_json_number(double d)
+{
+    if (!std::isfinite(d))
+        return "null";
+    char buf[32];
+    auto res = std::to_chars(buf, buf + sizeof(buf), d);
+    return std::string(buf, res.ptr);
+}
+
+// -------------------- Metrics --------------------
+// Counters and log2 latency histograms for GET /metrics (Prometheus text).
+// Each metric is split into cache-line-aligned shards; a thread always
+// records into the same shard with relaxed atomics, and a scrape sums them.
+
+inline int64_t steady_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const size_t kMetricShards = 8;
+
+inline size_t metric_shard()
+{
+    static std::atomic<size_t> next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+    return shard;
+}
+
+class Counter
+{
+public:
+    void add(uint64_t n = 1) { shards_[metric_shard()].v.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t value() const
+    {
+        uint64_t total = 0;
+        for (const auto &s : shards_)
+            total += s.v.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> v{0};
+    };
+    Shard shards_[kMetricShards];
+};
+
+// Bucket k counts samples below 2^k microseconds; the last bucket is open-ended.
+class Histogram
+{
+public:
+    static const size_t kBuckets = 36; // up to 2^35 us, about 9.5 hours
+
+    void record(int64_t us)
+    {
+        uint64_t v = us > 0 ? static_cast<uint64_t>(us) : 0;
+        size_t bucket = 0;
+        while (bucket + 1 < kBuckets && (v >> bucket) != 0)
+            ++bucket;
+        Shard &s = shards_[metric_shard()];
+        s.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        s.sum_us.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    void snapshot(uint64_t (&buckets)[kBuckets], uint64_t &sum_us) const
+    {
+        sum_us = 0;
+        for (size_t b = 0; b < kBuckets; ++b)
+            buckets[b] = 0;
+        for (const auto &s : shards_)
+        {
+            for (size_t b = 0; b < kBuckets; ++b)
+                buckets[b] += s.buckets[b].load(std::memory_order_relaxed);
+            sum_us += s.sum_us.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> buckets[kBuckets] = {};
+        std::atomic<uint64_t> sum_us{0};
+    };
+    Shard shards_[kMetricShards];
+};
+
+// Named metric families, each holding one series per label set. Lookups
+// take a shared lock; hot call sites keep the returned reference.
+class MetricsRegistry
+{
+public:
+    Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "")
+    {
+        return get<Counter>(counters_, name, help, labels);
+    }
+
+    Histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = "")
+    {
+        return get<Histogram>(histograms_, name, help, labels);
+    }
+
+    void render(std::string &out)
+    {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        for (const auto &fam : counters_)
+        {
+            out += "# HELP " + fam.first + " " + fam.second.help + "\n";
+            out += "# TYPE " + fam.first + " counter\n";
+            for (const auto &series : fam.second.series)
+                out += fam.first + braces(series.first) + " " + std::to_string(series.second->value()) + "\n";
+        }
+        for (const auto &fam : histograms_)
+        {
+            out += "# HELP " + fam.first + " " + fam.second.help + "\n";
+            out += "# TYPE " + fam.first + " histogram\n";
+            for (const auto &series : fam.second.series)
+            {
+                uint64_t buckets[Histogram::kBuckets];
+                uint64_t sum_us = 0;
+                series.second->snapshot(buckets, sum_us);
+                std::string sep = series.first.empty() ? "" : series.first + ",";
+                uint64_t cumulative = 0;
+                for (size_t b = 0; b + 1 < Histogram::kBuckets; ++b)
+                {
+                    cumulative += buckets[b];
+                    if (b < 4 || b > 27) // exported bounds run 16us .. ~134s
+                        continue;
+                    out += fam.first + "_bucket{" + sep + "le=\"" + seconds(uint64_t(1) << b) + "\"} " + std::to_string(cumulative) + "\n";
+                }
+                cumulative += buckets[Histogram::kBuckets - 1];
+                out += fam.first + "_bucket{" + sep + "le=\"+Inf\"} " + std::to_string(cumulative) + "\n";
+                out += fam.first + "_sum" + braces(series.first) + " " + seconds(sum_us) + "\n";
+                out += fam.first + "_count" + braces(series.first) + " " + std::to_string(cumulative) + "\n";
+            }
+        }
+    }
+
+private:
+    template <typename T>
+    struct Family
+    {
+        std::string help;
+        std::map<std::string, std::unique_ptr<T>> series; // labels -> metric
+    };
+
+    template <typename T>
+    T &get(std::map<std::string, Family<T>> &families, const std::string &name, const std::string &help, const std::string &labels)
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(mu_);
+            auto fam = families.find(name);
+            if (fam != families.end())
+            {
+                auto it = fam->second.series.find(labels);
+                if (it != fam->second.series.end())
+                    return *it->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        Family<T> &fam = families[name];
+        if (fam.help.empty())
+            fam.help = help;
+        auto &slot = fam.series[labels];
+        if (!slot)
+            slot.reset(new T());
+        return *slot;
+    }
+
+    static std::string braces(const std::string &labels)
+    {
+        return labels.empty() ? "" : "{" + labels + "}";
+    }
+
+    static std::string seconds(uint64_t us)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6g", static_cast<double>(us) / 1e6);
+        return buf;
+    }
+
+    std::shared_mutex mu_;
+    std::map<std::string, Family<Counter>> counters_;
+    std::map<std::string, Family<Histogram>> histograms_;
+};
+
+MetricsRegistry g_metrics;
+
+// Records its own lifetime into a histogram.
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Histogram &h) : h_(h), start_(steady_us()) {}
+    ~ScopedTimer() { h_.record(steady_us() - start_); }
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    Histogram &h_;
+    int64_t start_;
+};
+
+// Label values are route paths and COM member names; escape just in case.
+std::string metric_label(const std::string &key, const std::string &value)
+{
+    std::string out = key + "=\"";
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+            out.push_back('\\');
+        if (c == '\n')
+        {
+            out += "\\n";
+            continue;
+        }
+        out.push_back(c);
+    }
+    out += "\"";
+    return out;
+}
+
+// The request series of one route, looked up in the registry the first
+// time each is used and then kept, so serving a request takes no registry
+// lock. Held by the router for each route.
+class RouteMetrics
+{
+public:
+    explicit RouteMetrics(const std::string &route) : label_(metric_label("route", route)) {}
+
+    Counter &requests(int status)
+    {
+        if (status < kMinStatus || status > kMaxStatus)
+            return g_metrics.counter("esa_http_requests_total", "Requests by route and status", label_ + "," + metric_label("status", std::to_string(status)));
+        return resolve(by_status_[status - kMinStatus], [&]
+                       { return &g_metrics.counter("esa_http_requests_total", "Requests by route and status", label_ + "," + metric_label("status", std::to_string(status))); });
+    }
+
+    Histogram &latency()
+    {
+        return resolve(latency_, [&]
+                       { return &g_metrics.histogram("esa_http_request_seconds", "Request latency by route", label_); });
+    }
+
+    Counter &rate_limited()
+    {
+        return resolve(rate_limited_, [&]
+                       { return &g_metrics.counter("esa_rate_limited_total", "Requests refused by a rate limit", label_); });
+    }
+
+private:
+    static const int kMinStatus = 100, kMaxStatus = 599;
+
+    // Racing first uses look up the same series; either pointer will do.
+    template <typename T, typename Lookup>
+    static T &resolve(std::atomic<T *> &slot, Lookup lookup)
+    {
+        T *m = slot.load(std::memory_order_acquire);
+        if (!m)
+        {
+            m = lookup();
+            slot.store(m, std::memory_order_release);
+        }
+        return *m;
+    }
+
+    std::string label_;
+    std::atomic<Counter *> by_status_[kMaxStatus - kMinStatus + 1] = {};
+    std::atomic<Histogram *> latency_{nullptr};
+    std::atomic<Counter *> rate_limited_{nullptr};
+};
+
 // -------------------- Binary database --------------------
 enum class Role : uint32_t
 {
@@ -538,10 +1153,26 @@ public:
     }
 
     bool upsert_user(const UserRecord &u)
+    {
+        std::function<void(const std::string &)> hook;
+        bool ok = false;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            users_[u.name] = u;
+            ok = save_locked();
+            hook = user_changed_;
+        }
+        // Run outside the lock; listeners may call back into the database.
+        if (hook)
+            hook(u.name);
+        return ok;
+    }
+
+    // Called with the user name after every upsert so cached copies can be dropped.
+    void set_user_changed_hook(std::function<void(const std::string &)> hook)
     {
         std::lock_guard<std::mutex> lock(mu_);
-        users_[u.name] = u;
-        return save_locked();
+        user_changed_ = std::move(hook);
     }
 
     bool list_users(std::vector<UserRecord> &out)
@@ -590,6 +1221,8 @@ public:
 private:
     bool save_locked()
     {
+        static Histogram &save_time = g_metrics.histogram("esa_db_save_seconds", "Time to write and rename db.bin");
+        ScopedTimer timer(save_time);
         std::string tmp = path_ + ".tmp";
         std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
         if (!out.is_open())
@@ -643,36 +1276,401 @@ private:
     std::string path_;
     std::unordered_map<std::string, UserRecord> users_;
     std::unordered_map<std::string, AppRecord> apps_;
+    std::function<void(const std::string &)> user_changed_;
     std::mutex mu_;
 };
 
-// -------------------- Excel Pool --------------------
-bool dispatch_put_bool(IDispatch *disp, const wchar_t *name, bool value)
+// -------------------- Request context --------------------
+// Per-request accounting. Each request is served start to finish on one
+// thread, so the counters live in a thread_local that handle_client resets.
+struct RequestContext
 {
-    if (!disp)
-        return false;
-    DISPID dispid;
-    LPOLESTR names[1];
-    names[0] = const_cast<LPOLESTR>(name);
-    if (FAILED(disp->GetIDsOfNames(IID_NULL, names, 1, LOCALE_USER_DEFAULT, &dispid)))
+    uint64_t id = 0;
+    std::string user;
+    std::string route;
+    int64_t queue_us = 0; // waiting for the Excel pool lock or a turn in its fair queue
+    int64_t excel_us = 0; // inside COM calls
+    size_t streamed_bytes = 0; // request body read by the handler itself (uploads)
+    int64_t deadline_us = 0; // steady_us() after which Excel work is abandoned; 0 for none
+    SOCKET client = INVALID_SOCKET; // probed for a hang-up between Excel operations
+    int64_t probed_us = 0;
+    int cancelled = 0; // 504 once the deadline passed, 499 once the client hung up
+    RouteMetrics *metrics = nullptr; // series of the route that served it, if it has its own
+};
+
+thread_local RequestContext t_request;
+
+// How often a running request looks at its client socket.
+constexpr int64_t kCancelProbeUs = 50000;
+
+// Whether the peer has closed its end of `s`. The socket is made
+// non-blocking for a one-byte peek: no bytes means an orderly close, an
+// error other than "would block" a reset. Unread body bytes are left.
+bool client_hung_up(SOCKET s)
+{
+    u_long nonblocking = 1;
+    if (ioctlsocket(s, FIONBIO, &nonblocking) != 0)
         return false;
-    VARIANTARG arg;
-    VariantInit(&arg);
-    arg.vt = VT_BOOL;
-    arg.boolVal = value ? VARIANT_TRUE : VARIANT_FALSE;
-    DISPPARAMS params{};
-    params.rgvarg = &arg;
-    params.cArgs = 1;
-    DISPID named = DISPID_PROPERTYPUT;
-    params.rgdispidNamedArgs = &named;
-    params.cNamedArgs = 1;
-    return SUCCEEDED(disp->Invoke(dispid, IID_NULL, LOCALE_USER_DEFAULT, DISPATCH_PROPERTYPUT, &params, nullptr, nullptr, nullptr));
+    char c;
+    int n = recv(s, &c, 1, MSG_PEEK);
+    int code = n < 0 ? WSAGetLastError() : 0;
+    nonblocking = 0;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+    return n == 0 || (n < 0 && code != WSAEWOULDBLOCK);
 }
 
-void dispatch_call_noargs(IDispatch *disp, const wchar_t *name)
+// Whether the current request should stop before its next Excel
+// operation: its deadline has passed or its client has gone. Once true it
+// stays true, and `err` says which.
+bool request_cancelled(std::string &err)
+{
+    RequestContext &ctx = t_request;
+    if (!ctx.cancelled)
+    {
+        int64_t now = steady_us();
+        if (ctx.deadline_us && now >= ctx.deadline_us)
+        {
+            ctx.cancelled = 504;
+        }
+        else if (ctx.client != INVALID_SOCKET && now - ctx.probed_us >= kCancelProbeUs)
+        {
+            ctx.probed_us = now;
+            if (client_hung_up(ctx.client))
+                ctx.cancelled = 499;
+        }
+    }
+    if (!ctx.cancelled)
+        return false;
+    err = ctx.cancelled == 504 ? "deadline exceeded" : "client closed request";
+    return true;
+}
+
+// Holds off cancellation for work that must not stop halfway, such as
+// replaying a restored session's edits.
+class CancelShield
+{
+public:
+    CancelShield() : saved_(t_request)
+    {
+        t_request.deadline_us = 0;
+        t_request.client = INVALID_SOCKET;
+        t_request.cancelled = 0;
+    }
+    ~CancelShield()
+    {
+        t_request.deadline_us = saved_.deadline_us;
+        t_request.client = saved_.client;
+        t_request.cancelled = saved_.cancelled;
+    }
+    CancelShield(const CancelShield &) = delete;
+    CancelShield &operator=(const CancelShield &) = delete;
+
+private:
+    RequestContext saved_;
+};
+
+// Latency histogram for one COM member, cached per thread by name.
+Histogram &com_histogram(const wchar_t *member)
+{
+    thread_local std::unordered_map<std::wstring, Histogram *> cache;
+    auto it = cache.find(member);
+    if (it != cache.end())
+        return *it->second;
+    std::wstring wname(member);
+    std::string name;
+    for (wchar_t c : wname)
+        name.push_back(c < 0x80 ? static_cast<char>(c) : '?');
+    Histogram &h = g_metrics.histogram("esa_com_call_seconds", "COM IDispatch calls by member name", metric_label("member", name));
+    cache.emplace(std::move(wname), &h);
+    return h;
+}
+
+// Charges the lifetime of the guard to t_request.excel_us and to the
+// member's COM latency histogram.
+class ExcelTimer
+{
+public:
+    explicit ExcelTimer(const wchar_t *member) : member_(member), start_(steady_us()) {}
+    ~ExcelTimer()
+    {
+        int64_t elapsed = steady_us() - start_;
+        t_request.excel_us += elapsed;
+        com_histogram(member_).record(elapsed);
+    }
+
+private:
+    const wchar_t *member_;
+    int64_t start_;
+};
+
+// Pool mutex guard that charges any time spent waiting to t_request.queue_us.
+class PoolLock
+{
+public:
+    explicit PoolLock(std::mutex &mu) : mu_(mu)
+    {
+        static Histogram &wait = g_metrics.histogram("esa_excel_slot_wait_seconds", "Time spent waiting for the Excel pool lock");
+        if (mu_.try_lock())
+        {
+            wait.record(0);
+            return;
+        }
+        int64_t start = steady_us();
+        mu_.lock();
+        int64_t waited = steady_us() - start;
+        t_request.queue_us += waited;
+        wait.record(waited);
+    }
+    ~PoolLock() { mu_.unlock(); }
+    PoolLock(const PoolLock &) = delete;
+    PoolLock &operator=(const PoolLock &) = delete;
+
+private:
+    std::mutex &mu_;
+};
+
+// -------------------- Access log --------------------
+// One JSON object per request in logs/access.log. The file rotates when it
+// passes max_bytes or the local date changes; rotated files are gzipped (when
+// built with zlib) and pruned to the newest `keep` by a background thread,
+// which also flushes the active file once a second. esa_logstat reads them.
+class AccessLog
+{
+public:
+    ~AccessLog() { shutdown(); }
+
+    void init(const fs::path &dir, size_t max_bytes, int keep)
+    {
+        dir_ = dir;
+        max_bytes_ = max_bytes;
+        keep_ = keep;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            open_locked();
+        }
+        worker_ = std::thread([this]()
+                              { worker_loop(); });
+    }
+
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (!worker_.joinable())
+                return;
+            stop_ = true;
+        }
+        cv_.notify_all();
+        worker_.join();
+        std::lock_guard<std::mutex> lock(mu_);
+        if (file_.is_open())
+            file_.close();
+    }
+
+    void write(const std::string &method, int status, size_t bytes_in, size_t bytes_out, int64_t total_us)
+    {
+        const RequestContext &ctx = t_request;
+        int64_t ts = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        thread_local std::string line;
+        line.clear();
+        line += "{\"ts\":" + std::to_string(ts);
+        line += ",\"id\":" + std::to_string(ctx.id);
+        line += ",\"user\":\"" + json_escape(ctx.user) + "\"";
+        line += ",\"method\":\"" + json_escape(method) + "\"";
+        line += ",\"route\":\"" + json_escape(ctx.route) + "\"";
+        line += ",\"status\":" + std::to_string(status);
+        line += ",\"req_bytes\":" + std::to_string(bytes_in);
+        line += ",\"resp_bytes\":" + std::to_string(bytes_out);
+        line += ",\"queue_us\":" + std::to_string(ctx.queue_us);
+        line += ",\"excel_us\":" + std::to_string(ctx.excel_us);
+        line += ",\"total_us\":" + std::to_string(total_us);
+        line += "}\n";
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!file_.is_open())
+            return;
+        if (written_ + line.size() > max_bytes_ || today() != day_)
+            rotate_locked();
+        file_.write(line.data(), static_cast<std::streamsize>(line.size()));
+        written_ += line.size();
+        dirty_ = true;
+    }
+
+private:
+    static int today()
+    {
+        std::time_t t = std::time(nullptr);
+        std::tm tm_buf{};
+        localtime_s(&tm_buf, &t);
+        return (tm_buf.tm_year + 1900) * 10000 + (tm_buf.tm_mon + 1) * 100 + tm_buf.tm_mday;
+    }
+
+    fs::path active_path() const { return dir_ / "access.log"; }
+
+    void open_locked()
+    {
+        file_.open(active_path(), std::ios::app | std::ios::binary);
+        if (!file_)
+        {
+            ESA_LOG_ERROR("Failed to open access log " + active_path().u8string());
+            return;
+        }
+        std::error_code ec;
+        auto size = fs::file_size(active_path(), ec);
+        written_ = ec ? 0 : static_cast<size_t>(size);
+        day_ = today();
+    }
+
+    void rotate_locked()
+    {
+        file_.close();
+        std::time_t t = std::time(nullptr);
+        std::tm tm_buf{};
+        localtime_s(&tm_buf, &t);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_buf);
+        fs::path target;
+        std::error_code ec;
+        for (int n = 0;; ++n)
+        {
+            char name[64];
+            std::snprintf(name, sizeof(name), "access-%s-%03d.log", stamp, n);
+            target = dir_ / name;
+            if (!fs::exists(target, ec) && !fs::exists(target.u8string() + ".gz", ec))
+                break;
+        }
+        fs::rename(active_path(), target, ec);
+        if (ec)
+            ESA_LOG_WARN("Access log rotation failed: " + ec.message());
+        else
+            pending_.push_back(target);
+        open_locked();
+        dirty_ = false;
+        cv_.notify_all();
+    }
+
+    void worker_loop()
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (!stop_)
+        {
+            cv_.wait_for(lock, std::chrono::seconds(1));
+            if (dirty_ && file_.is_open())
+            {
+                file_.flush();
+                dirty_ = false;
+            }
+            if (pending_.empty())
+                continue;
+            std::vector<fs::path> batch;
+            batch.swap(pending_);
+            lock.unlock();
+            for (const auto &p : batch)
+                compress(p);
+            lock.lock();
+            prune_locked();
+        }
+    }
+
+    static void compress(const fs::path &path)
+    {
+#ifdef ESA_HAVE_ZLIB
+        std::ifstream in(path, std::ios::binary);
+        std::string gz_path = path.u8string() + ".gz";
+        gzFile out = gzopen(gz_path.c_str(), "wb6");
+        if (!in || !out)
+        {
+            if (out)
+                gzclose(out);
+            ESA_LOG_WARN("Could not compress rotated access log " + path.u8string());
+            return;
+        }
+        std::vector<char> buf(64 * 1024);
+        bool ok = true;
+        while (in)
+        {
+            in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+            std::streamsize n = in.gcount();
+            if (n > 0 && gzwrite(out, buf.data(), static_cast<unsigned>(n)) != n)
+            {
+                ok = false;
+                break;
+            }
+        }
+        ok = gzclose(out) == Z_OK && ok;
+        in.close();
+        std::error_code ec;
+        fs::remove(ok ? path : fs::path(gz_path), ec);
+#else
+        (void)path;
+#endif
+    }
+
+    // Keeps the newest keep_ rotated files (names sort chronologically),
+    // leaving alone any that are still queued for compression.
+    void prune_locked()
+    {
+        if (keep_ <= 0)
+            return;
+        std::vector<fs::path> rotated;
+        std::error_code ec;
+        for (const auto &entry : fs::directory_iterator(dir_, ec))
+        {
+            std::string name = entry.path().filename().u8string();
+            if (name.rfind("access-", 0) == 0 && std::find(pending_.begin(), pending_.end(), entry.path()) == pending_.end())
+                rotated.push_back(entry.path());
+        }
+        if (rotated.size() <= static_cast<size_t>(keep_))
+            return;
+        std::sort(rotated.begin(), rotated.end());
+        for (size_t i = 0; i + keep_ < rotated.size(); ++i)
+            fs::remove(rotated[i], ec);
+    }
+
+    fs::path dir_;
+    size_t max_bytes_ = 64 * 1024 * 1024;
+    int keep_ = 14;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::ofstream file_;
+    size_t written_ = 0;
+    int day_ = 0;
+    bool dirty_ = false;
+    bool stop_ = false;
+    std::vector<fs::path> pending_;
+    std::thread worker_;
+};
+
+AccessLog g_access_log;
+
+// -------------------- Excel Pool --------------------
+bool dispatch_put_bool(IDispatch *disp, const wchar_t *name, bool value)
+{
+    if (!disp)
+        return false;
+    ExcelTimer timer(name);
+    DISPID dispid;
+    LPOLESTR names[1];
+    names[0] = const_cast<LPOLESTR>(name);
+    if (FAILED(disp->GetIDsOfNames(IID_NULL, names, 1, LOCALE_USER_DEFAULT, &dispid)))
+        return false;
+    VARIANTARG arg;
+    VariantInit(&arg);
+    arg.vt = VT_BOOL;
+    arg.boolVal = value ? VARIANT_TRUE : VARIANT_FALSE;
+    DISPPARAMS params{};
+    params.rgvarg = &arg;
+    params.cArgs = 1;
+    DISPID named = DISPID_PROPERTYPUT;
+    params.rgdispidNamedArgs = &named;
+    params.cNamedArgs = 1;
+    return SUCCEEDED(disp->Invoke(dispid, IID_NULL, LOCALE_USER_DEFAULT, DISPATCH_PROPERTYPUT, &params, nullptr, nullptr, nullptr));
+}
+
+void dispatch_call_noargs(IDispatch *disp, const wchar_t *name)
 {
     if (!disp)
         return;
+    ExcelTimer timer(name);
     DISPID dispid;
     LPOLESTR names[1];
     names[0] = const_cast<LPOLESTR>(name);
@@ -686,6 +1684,7 @@ bool dispatch_invoke(IDispatch *disp, const wchar_t *name, WORD flags, VARIANT *
 {
     if (!disp)
         return false;
+    ExcelTimer timer(name);
     DISPID dispid;
     LPOLESTR names[1];
     names[0] = const_cast<LPOLESTR>(name);
@@ -744,60 +1743,441 @@ bool dispatch_put_variant(IDispatch *disp, const wchar_t *name, VARIANT *val)
     return dispatch_invoke(disp, name, DISPATCH_PROPERTYPUT, val, 1, nullptr);
 }
 
-// Forward declaration for use in ExcelPool methods
-std::string json_escape(const std::string &s);
+// Indexed member such as Cells(r, c), Areas.Item(i) or SpecialCells(type).
+CComPtr<IDispatch> dispatch_get_indexed(IDispatch *disp, const wchar_t *name, long first, long second = 0, WORD flags = DISPATCH_PROPERTYGET)
+{
+    VARIANT args[2];
+    VariantInit(&args[0]);
+    VariantInit(&args[1]);
+    UINT cargs = second > 0 ? 2 : 1;
+    // Arguments go right to left.
+    args[cargs - 1].vt = VT_I4;
+    args[cargs - 1].lVal = first;
+    if (cargs == 2)
+    {
+        args[0].vt = VT_I4;
+        args[0].lVal = second;
+    }
+    VARIANT res;
+    VariantInit(&res);
+    if (!dispatch_invoke(disp, name, flags, args, cargs, &res))
+        return nullptr;
+    if (res.vt == VT_DISPATCH)
+    {
+        CComPtr<IDispatch> out = res.pdispVal;
+        VariantClear(&res);
+        return out;
+    }
+    VariantClear(&res);
+    return nullptr;
+}
 
-class ExcelPool
+long dispatch_get_long(IDispatch *disp, const wchar_t *name, long fallback)
+{
+    VARIANT res;
+    VariantInit(&res);
+    long out = fallback;
+    if (dispatch_invoke(disp, name, DISPATCH_PROPERTYGET, nullptr, 0, &res) && SUCCEEDED(VariantChangeType(&res, &res, 0, VT_I4)))
+        out = res.lVal;
+    VariantClear(&res);
+    return out;
+}
+
+double dispatch_get_double(IDispatch *disp, const wchar_t *name, double fallback)
+{
+    VARIANT res;
+    VariantInit(&res);
+    double out = fallback;
+    if (dispatch_invoke(disp, name, DISPATCH_PROPERTYGET, nullptr, 0, &res) && SUCCEEDED(VariantChangeType(&res, &res, 0, VT_R8)))
+        out = res.dblVal;
+    VariantClear(&res);
+    return out;
+}
+
+// A string property, or false when it is not a string (Excel answers Null
+// for a property that differs across the cells of a range).
+bool dispatch_get_string(IDispatch *disp, const wchar_t *name, std::string &out)
+{
+    VARIANT res;
+    VariantInit(&res);
+    bool ok = dispatch_invoke(disp, name, DISPATCH_PROPERTYGET, nullptr, 0, &res) && res.vt == VT_BSTR;
+    if (ok)
+    {
+        std::wstring ws(res.bstrVal ? res.bstrVal : L"");
+        out.assign(ws.begin(), ws.end());
+    }
+    VariantClear(&res);
+    return ok;
+}
+
+// A property of a whole range read in one call, e.g. Range.Value: Excel
+// returns a 2-D array for a block and a scalar for a single cell or a
+// property that is the same across the range.
+class VariantTable
 {
 public:
-    ~ExcelPool() { shutdown(); }
+    VariantTable() { VariantInit(&value_); }
+    ~VariantTable()
+    {
+        if (data_)
+            SafeArrayUnaccessData(value_.parray);
+        VariantClear(&value_);
+    }
+    VariantTable(const VariantTable &) = delete;
+    VariantTable &operator=(const VariantTable &) = delete;
 
-    bool init(int count)
+    bool read(IDispatch *range, const wchar_t *name)
     {
-        log_info("Initializing Excel pool with " + std::to_string(count) + " instance(s)");
-        HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-        if (FAILED(hr) && hr != RPC_E_CHANGED_MODE)
+        if (!dispatch_invoke(range, name, DISPATCH_PROPERTYGET, nullptr, 0, &value_))
+            return false;
+        if (!(value_.vt & VT_ARRAY))
+            return true;
+        SAFEARRAY *arr = value_.parray;
+        LONG lbound1 = 0, ubound1 = -1, lbound2 = 0, ubound2 = -1;
+        if (!(value_.vt & VT_VARIANT) || !arr || SafeArrayGetDim(arr) != 2)
+            return false;
+        SafeArrayGetLBound(arr, 1, &lbound1);
+        SafeArrayGetUBound(arr, 1, &ubound1);
+        SafeArrayGetLBound(arr, 2, &lbound2);
+        SafeArrayGetUBound(arr, 2, &ubound2);
+        if (FAILED(SafeArrayAccessData(arr, reinterpret_cast<void **>(&data_))))
         {
-            log_error("COM initialization failed while creating Excel pool");
+            data_ = nullptr;
             return false;
         }
-        com_initialized_ = (hr == S_OK || hr == S_FALSE);
-        for (int i = 0; i < count; ++i)
+        rows_ = std::max<long>(0, ubound1 - lbound1 + 1);
+        cols_ = std::max<long>(0, ubound2 - lbound2 + 1);
+        return true;
+    }
+
+    bool scalar() const { return data_ == nullptr; }
+    const VARIANT &value() const { return value_; }
+
+    // Cell (r, c) of the range, from 0. A scalar stands for every cell.
+    const VARIANT &at(long r, long c) const
+    {
+        if (!data_)
+            return value_;
+        if (r >= rows_ || c >= cols_)
+            return empty_;
+        return data_[r + c * rows_];
+    }
+
+private:
+    VARIANT value_;
+    VARIANT empty_{};
+    VARIANT *data_ = nullptr;
+    long rows_ = 0, cols_ = 0;
+};
+
+
+// What /excel/analyze needs to know of a cell's value.
+enum class AnalyzedKind
+{
+    Empty,
+    Text,
+    Number,
+    Date,
+    Bool,
+    Other
+};
+
+// The UI type /excel/analyze reports for a cell, from its value, number
+// format, whether it holds a formula and whether it has a list validation.
+std::string classify_cell(AnalyzedKind kind, const std::string &number_format, bool is_formula, bool is_list)
+{
+    if (is_list)
+        return "dropdown";
+    // Include empty cells as "empty" type for grid layout (spacers)
+    if (kind == AnalyzedKind::Empty)
+        return "empty";
+    // Format-based types (currency, percentage) take priority for input cells
+    bool is_currency_fmt = number_format.find('$') != std::string::npos ||
+                           number_format.find("Currency") != std::string::npos ||
+                           number_format.find('\xa3') != std::string::npos || // £
+                           number_format.find('\x80') != std::string::npos;   // €
+    bool is_percent_fmt = number_format.find('%') != std::string::npos;
+    bool is_date_fmt = number_format.find('d') != std::string::npos &&
+                       number_format.find('m') != std::string::npos;
+
+    // For cells with special formatting (currency, percentage, date), treat as input fields
+    // unless they contain a formula (then they're calculated outputs)
+    if (is_currency_fmt && !is_formula)
+        return "currency";
+    if (is_percent_fmt && !is_formula)
+        return "percentage";
+    if (is_date_fmt && !is_formula && kind == AnalyzedKind::Date)
+        return "date";
+    if (is_formula)
+        return "formula";
+    if (kind == AnalyzedKind::Bool)
+        return "checkbox";
+    if (kind == AnalyzedKind::Number)
+        return "number";
+    if (kind == AnalyzedKind::Date)
+        return "date";
+    return "text";
+}
+
+// A cell reference of a chart's data as a sheet and a range.
+struct ChartRef
+{
+    std::string sheet;
+    std::string range;
+};
+
+// Splits the references a chart series is built from, such as
+// "Sheet1!$B$2:$B$9" or "('My Sheet'!$A$1,'My Sheet'!$A$5)". Literal
+// values and names without a sheet are skipped.
+void split_chart_refs(const std::string &text, std::vector<ChartRef> &out)
+{
+    std::string s = trim(text);
+    if (!s.empty() && s.front() == '=')
+        s = s.substr(1);
+    if (s.size() >= 2 && s.front() == '(' && s.back() == ')')
+        s = s.substr(1, s.size() - 2);
+    std::string part;
+    bool quoted = false;
+    for (size_t i = 0; i <= s.size(); ++i)
+    {
+        if (i < s.size() && (quoted || s[i] != ','))
         {
-            CComPtr<IDispatch> app = create_instance();
-            if (!app)
+            if (s[i] == '\'')
+                quoted = !quoted;
+            part.push_back(s[i]);
+            continue;
+        }
+        size_t bang = part.rfind('!');
+        if (bang != std::string::npos && bang > 0 && bang + 1 < part.size())
+        {
+            ChartRef ref;
+            ref.sheet = trim(part.substr(0, bang));
+            ref.range = part.substr(bang + 1);
+            if (ref.sheet.size() >= 2 && ref.sheet.front() == '\'' && ref.sheet.back() == '\'')
             {
-                log_error("Excel instance creation failed for slot " + std::to_string(i));
-                return false;
+                std::string unquoted;
+                for (size_t k = 1; k + 1 < ref.sheet.size(); ++k)
+                {
+                    unquoted.push_back(ref.sheet[k]);
+                    if (ref.sheet[k] == '\'' && ref.sheet[k + 1] == '\'')
+                        ++k;
+                }
+                ref.sheet = unquoted;
             }
-            Slot slot;
-            slot.app = app;
-            slots_.push_back(slot);
+            out.push_back(ref);
         }
-        log_info("Excel pool initialized successfully");
-        return true;
+        part.clear();
     }
+}
 
-    void shutdown()
+// The arguments of a series formula, "=SERIES(name, categories, values,
+// order)", split at the top-level commas.
+std::vector<std::string> series_formula_args(const std::string &formula)
+{
+    std::vector<std::string> args;
+    size_t open = formula.find('(');
+    size_t close = formula.rfind(')');
+    if (open == std::string::npos || close == std::string::npos || close < open)
+        return args;
+    std::string arg;
+    int depth = 0;
+    char quote = 0;
+    for (size_t i = open + 1; i < close; ++i)
     {
-        std::lock_guard<std::mutex> lock(mu_);
-        if (shutdown_)
-            return;
-        shutdown_ = true;
-        log_info("Shutting down Excel pool");
-        for (size_t i = 0; i < slots_.size(); ++i)
+        char c = formula[i];
+        if (quote)
+            quote = c == quote ? 0 : quote;
+        else if (c == '\'' || c == '"')
+            quote = c;
+        else if (c == '(' || c == '{')
+            ++depth;
+        else if (c == ')' || c == '}')
+            --depth;
+        else if (c == ',' && depth == 0)
         {
-            try
-            {
-                if (slots_[i].workbook)
-                    dispatch_call_noargs(slots_[i].workbook, L"Close");
-            }
-            catch (...)
-            {
-            }
-            try
-            {
-                if (slots_[i].app)
+            args.push_back(arg);
+            arg.clear();
+            continue;
+        }
+        arg.push_back(c);
+    }
+    args.push_back(arg);
+    return args;
+}
+
+// Admits Excel operations a few at a time, in start-time fair order: each
+// user's operations are stamped with a virtual finish time that grows by
+// their estimated cost, and the waiting operation with the earliest stamp
+// goes next. A user running heavy analyses falls behind users making
+// small reads instead of holding them up. An operation started inside
+// another one runs at once. A request that is cancelled while it waits
+// gives up its place.
+class FairQueue
+{
+public:
+    class Turn
+    {
+    public:
+        explicit Turn(FairQueue *queue) : queue_(queue) {}
+        Turn(Turn &&o) noexcept : queue_(o.queue_) { o.queue_ = nullptr; }
+        ~Turn()
+        {
+            if (queue_)
+                queue_->leave();
+        }
+        Turn(const Turn &) = delete;
+        Turn &operator=(const Turn &) = delete;
+
+        // False when the request was cancelled instead of admitted.
+        explicit operator bool() const { return queue_ != nullptr; }
+
+    private:
+        FairQueue *queue_;
+    };
+
+    void configure(int running)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        free_ = std::max(1, running);
+    }
+
+    // Blocks until the operation may run; the time waited is charged to
+    // t_request.queue_us. Returns an empty turn, with `err` set, when the
+    // request is cancelled before then.
+    Turn enter(const std::string &user, double cost, std::string &err)
+    {
+        static Histogram &wait = g_metrics.histogram("esa_excel_fair_wait_seconds", "Time Excel operations waited for their turn");
+        if (t_depth_++)
+            return Turn(this);
+        if (request_cancelled(err))
+        {
+            --t_depth_;
+            return Turn(nullptr);
+        }
+        std::unique_lock<std::mutex> lock(mu_);
+        double &last = last_finish_[user.empty() ? "(background)" : user];
+        double start = std::max(vtime_, last);
+        last = start + cost;
+        std::pair<double, uint64_t> key(last, ++seq_);
+        int64_t since = steady_us();
+        if (free_ <= 0 || !waiting_.empty())
+        {
+            waiting_.insert(key);
+            while (!(free_ > 0 && *waiting_.begin() == key))
+            {
+                if (request_cancelled(err))
+                {
+                    waiting_.erase(key);
+                    --t_depth_;
+                    lock.unlock();
+                    cv_.notify_all();
+                    t_request.queue_us += steady_us() - since;
+                    return Turn(nullptr);
+                }
+                cv_.wait_for(lock, std::chrono::microseconds(kCancelProbeUs));
+            }
+            waiting_.erase(waiting_.begin());
+        }
+        --free_;
+        vtime_ = std::max(vtime_, start);
+        if (last_finish_.size() > kMaxUsers)
+        {
+            for (auto it = last_finish_.begin(); it != last_finish_.end();)
+                it = it->second <= vtime_ ? last_finish_.erase(it) : std::next(it);
+        }
+        lock.unlock();
+        cv_.notify_all();
+        int64_t waited = steady_us() - since;
+        t_request.queue_us += waited;
+        wait.record(waited);
+        return Turn(this);
+    }
+
+private:
+    static const size_t kMaxUsers = 1024;
+
+    void leave()
+    {
+        if (--t_depth_)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            ++free_;
+        }
+        cv_.notify_all();
+    }
+
+    static thread_local int t_depth_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    int free_ = 1;
+    double vtime_ = 0;
+    uint64_t seq_ = 0;
+    std::unordered_map<std::string, double> last_finish_; // user -> finish stamp of their latest operation
+    std::set<std::pair<double, uint64_t>> waiting_;
+};
+
+thread_local int FairQueue::t_depth_ = 0;
+
+// Estimated cost of reading a range, in units of a one-cell read.
+double range_read_cost(const std::string &range);
+
+class ExcelPool
+{
+public:
+    ~ExcelPool() { shutdown(); }
+
+    // How many operations may run at once across all instances; the rest
+    // wait their turn in the fair queue.
+    void set_concurrency(int running) { fair_.configure(running); }
+
+    bool init(int count)
+    {
+        ESA_LOG_INFO("Initializing Excel pool with " + std::to_string(count) + " instance(s)");
+        HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        if (FAILED(hr) && hr != RPC_E_CHANGED_MODE)
+        {
+            ESA_LOG_ERROR("COM initialization failed while creating Excel pool");
+            return false;
+        }
+        com_initialized_ = (hr == S_OK || hr == S_FALSE);
+        for (int i = 0; i < count; ++i)
+        {
+            CComPtr<IDispatch> app = create_instance();
+            if (!app)
+            {
+                ESA_LOG_ERROR("Excel instance creation failed for slot " + std::to_string(i));
+                return false;
+            }
+            Slot slot;
+            slot.app = app;
+            slots_.push_back(slot);
+            slot_count_.store(static_cast<int>(slots_.size()), std::memory_order_relaxed);
+        }
+        ESA_LOG_INFO("Excel pool initialized successfully");
+        return true;
+    }
+
+    void shutdown()
+    {
+        PoolLock lock(mu_);
+        if (shutdown_)
+            return;
+        shutdown_ = true;
+        ESA_LOG_INFO("Shutting down Excel pool");
+        for (size_t i = 0; i < slots_.size(); ++i)
+        {
+            try
+            {
+                if (slots_[i].workbook)
+                    dispatch_call_noargs(slots_[i].workbook, L"Close");
+            }
+            catch (...)
+            {
+            }
+            try
+            {
+                if (slots_[i].app)
                     dispatch_call_noargs(slots_[i].app, L"Quit");
             }
             catch (...)
@@ -807,30 +2187,35 @@ public:
             cleanup_temp_dir(i);
         }
         slots_.clear();
+        slot_count_.store(0, std::memory_order_relaxed);
+        in_use_count_.store(0, std::memory_order_relaxed);
         if (com_initialized_)
         {
             CoUninitialize();
             com_initialized_ = false;
         }
-        log_info("Excel pool shutdown complete");
+        ESA_LOG_INFO("Excel pool shutdown complete");
     }
 
     bool load_workbook(const std::string &session_id, const std::string &user, const fs::path &path, std::string &err)
     {
+        FairQueue::Turn turn = fair_.enter(t_request.user, kLoadCost, err);
+        if (!turn)
+            return false;
         int slot_index = -1;
         CComPtr<IDispatch> app;
         CComPtr<IDispatch> old_wb;
         fs::path resolved_path = fs::absolute(path);
         std::string path_str = resolved_path.u8string();
         std::string session_mask = mask_token(session_id);
-        log_info("Load workbook request session=" + session_mask + " user=" + user + " path=" + path_str);
+        ESA_LOG_INFO("Load workbook request session=" + session_mask + " user=" + user + " path=" + path_str);
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             slot_index = find_or_acquire_slot_locked(session_id, user);
             if (slot_index < 0)
             {
                 err = "no available excel instances";
-                log_error("No available Excel instances when loading path=" + path_str + " session=" + session_mask);
+                ESA_LOG_ERROR("No available Excel instances when loading path=" + path_str + " session=" + session_mask);
                 return false;
             }
             app = slots_[slot_index].app;
@@ -840,11 +2225,14 @@ public:
         }
         if (old_wb)
         {
-            log_info("Closing prior workbook for session=" + session_mask + " slot=" + std::to_string(slot_index));
+            ESA_LOG_INFO("Closing prior workbook for session=" + session_mask + " slot=" + std::to_string(slot_index));
             dispatch_call_noargs(old_wb, L"Close");
         }
 
         // Create temporary working directory and copy app files
+        std::error_code stamp_ec;
+        fs::file_time_type source_stamp = fs::last_write_time(resolved_path, stamp_ec);
+        int64_t copy_start = steady_us();
         fs::path source_dir = resolved_path.parent_path();
         std::string temp_id = generate_temp_id();
         fs::path temp_base = fs::temp_directory_path() / "esa_sessions";
@@ -855,12 +2243,12 @@ public:
         if (!fs::create_directories(temp_dir, ec) && !fs::exists(temp_dir, ec))
         {
             err = "failed to create temp directory";
-            log_error("Failed to create temp directory: " + temp_dir.u8string() + " error=" + ec.message());
-            std::lock_guard<std::mutex> lock(mu_);
+            ESA_LOG_ERROR("Failed to create temp directory: " + temp_dir.u8string() + " error=" + ec.message());
+            PoolLock lock(mu_);
             release_slot_by_index_locked(static_cast<size_t>(slot_index));
             return false;
         }
-        log_info("Created temporary directory: " + temp_dir.u8string() + " for session=" + session_mask);
+        ESA_LOG_INFO("Created temporary directory: " + temp_dir.u8string() + " for session=" + session_mask);
 
         // Copy all files from source directory to temp directory
         for (const auto &entry : fs::directory_iterator(source_dir, ec))
@@ -872,27 +2260,28 @@ public:
                 fs::copy_file(entry.path(), dest_file, fs::copy_options::overwrite_existing, copy_ec);
                 if (copy_ec)
                 {
-                    log_warn("Failed to copy file: " + entry.path().u8string() + " error=" + copy_ec.message());
+                    ESA_LOG_WARN("Failed to copy file: " + entry.path().u8string() + " error=" + copy_ec.message());
                 }
                 else
                 {
-                    log_info("Copied file to temp: " + entry.path().filename().u8string());
+                    ESA_LOG_DEBUG("Copied file to temp: " + entry.path().filename().u8string());
                 }
             }
         }
         if (ec)
         {
-            log_warn("Error iterating source directory: " + source_dir.u8string() + " error=" + ec.message());
+            ESA_LOG_WARN("Error iterating source directory: " + source_dir.u8string() + " error=" + ec.message());
         }
+        load_phase_histogram("copy").record(steady_us() - copy_start);
 
         // Build path to workbook in temp directory
         fs::path temp_workbook_path = temp_dir / resolved_path.filename();
         if (!fs::exists(temp_workbook_path, ec))
         {
             err = "workbook not copied to temp directory";
-            log_error("Workbook file not found in temp directory: " + temp_workbook_path.u8string());
+            ESA_LOG_ERROR("Workbook file not found in temp directory: " + temp_workbook_path.u8string());
             fs::remove_all(temp_dir, ec);
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             release_slot_by_index_locked(static_cast<size_t>(slot_index));
             return false;
         }
@@ -902,40 +2291,50 @@ public:
         if (!workbooks)
         {
             err = "failed to reach Workbooks";
-            log_error("Failed to get Workbooks collection slot=" + std::to_string(slot_index) + " session=" + session_mask);
+            ESA_LOG_ERROR("Failed to get Workbooks collection slot=" + std::to_string(slot_index) + " session=" + session_mask);
             fs::remove_all(temp_dir, ec);
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             release_slot_by_index_locked(static_cast<size_t>(slot_index));
             restart_slot_locked(static_cast<size_t>(slot_index));
             return false;
         }
+        int64_t open_start = steady_us();
         CComPtr<IDispatch> workbook = dispatch_call_bstr(workbooks, L"Open", wpath);
+        load_phase_histogram("open").record(steady_us() - open_start);
         if (!workbook)
         {
             err = "failed to open workbook";
-            log_error("Excel failed to open path=" + temp_workbook_path.u8string() + " slot=" + std::to_string(slot_index));
+            ESA_LOG_ERROR("Excel failed to open path=" + temp_workbook_path.u8string() + " slot=" + std::to_string(slot_index));
             fs::remove_all(temp_dir, ec);
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             release_slot_by_index_locked(static_cast<size_t>(slot_index));
             restart_slot_locked(static_cast<size_t>(slot_index));
             return false;
         }
         dispatch_put_bool(app, L"DisplayAlerts", false);
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             slots_[slot_index].workbook = workbook;
             slots_[slot_index].workbook_path = temp_workbook_path;
             slots_[slot_index].temp_dir = temp_dir;
+            slots_[slot_index].source_path = resolved_path;
+            slots_[slot_index].source_stamp = source_stamp;
+            slots_[slot_index].generation = ++generation_;
+            slots_[slot_index].pristine = true;
+            slots_[slot_index].charts.clear();
             slots_[slot_index].session_id = session_id;
             slots_[slot_index].user = user;
-            slots_[slot_index].in_use = true;
+            mark_in_use_locked(static_cast<size_t>(slot_index), true);
         }
-        log_info("Workbook loaded successfully slot=" + std::to_string(slot_index) + " session=" + session_mask + " path=" + temp_workbook_path.u8string());
+        ESA_LOG_INFO("Workbook loaded successfully slot=" + std::to_string(slot_index) + " session=" + session_mask + " path=" + temp_workbook_path.u8string());
         return true;
     }
 
     bool query_range(const std::string &session_id, const std::string &sheet, const std::string &range, std::string &json_out, std::string &err)
     {
+        FairQueue::Turn turn = fair_.enter(t_request.user, range_read_cost(range), err);
+        if (!turn)
+            return false;
         CComPtr<IDispatch> range_obj;
         if (!get_range(session_id, sheet, range, range_obj, err))
             return false;
@@ -951,8 +2350,125 @@ public:
         return true;
     }
 
+    // Reads several ranges in one pass: the workbook and each sheet are
+    // looked up once. A range that fails leaves its error in `errs` and
+    // does not stop the rest.
+    bool query_ranges(const std::string &session_id, const std::vector<std::pair<std::string, std::string>> &ranges,
+                      std::vector<std::string> &json_out, std::vector<std::string> &errs, std::string &err)
+    {
+        double cost = 0;
+        for (const auto &r : ranges)
+            cost += range_read_cost(r.second);
+        FairQueue::Turn turn = fair_.enter(t_request.user, cost, err);
+        if (!turn)
+            return false;
+        json_out.assign(ranges.size(), std::string());
+        errs.assign(ranges.size(), std::string());
+        CComPtr<IDispatch> wb;
+        {
+            PoolLock lock(mu_);
+            int idx = find_slot_locked(session_id);
+            if (idx < 0 || !slots_[idx].workbook)
+            {
+                err = "no workbook loaded";
+                return false;
+            }
+            wb = slots_[idx].workbook;
+        }
+        CComPtr<IDispatch> sheets = dispatch_get(wb, L"Worksheets");
+        if (!sheets)
+        {
+            err = "worksheets not available";
+            return false;
+        }
+        std::map<std::string, CComPtr<IDispatch>> sheet_objs;
+        for (size_t i = 0; i < ranges.size(); ++i)
+        {
+            if (request_cancelled(err))
+                return false;
+            std::string address = sanitize_range_address(ranges[i].second);
+            CComPtr<IDispatch> &sheet_obj = sheet_objs[ranges[i].first];
+            if (!sheet_obj && !resolve_sheet_object(sheets, ranges[i].first, sheet_obj))
+            {
+                errs[i] = "sheet not found";
+                continue;
+            }
+            std::wstring wrange(address.begin(), address.end());
+            CComPtr<IDispatch> rng;
+            if (!address.empty())
+                rng = dispatch_call_bstr(sheet_obj, L"Range", wrange, DISPATCH_PROPERTYGET);
+            VARIANT res;
+            VariantInit(&res);
+            if (!rng)
+                errs[i] = "range not found";
+            else if (!dispatch_invoke(rng, L"Value", DISPATCH_PROPERTYGET, nullptr, 0, &res))
+                errs[i] = "failed to read value";
+            else
+                json_out[i] = variant_to_json(res);
+            VariantClear(&res);
+        }
+        return true;
+    }
+
+    // As query_range, for the binary encoder.
+    bool query_range_grid(const std::string &session_id, const std::string &sheet, const std::string &range, CellGrid &grid, std::string &err)
+    {
+        FairQueue::Turn turn = fair_.enter(t_request.user, range_read_cost(range), err);
+        if (!turn)
+            return false;
+        CComPtr<IDispatch> range_obj;
+        if (!get_range(session_id, sheet, range, range_obj, err))
+            return false;
+        VARIANT res;
+        VariantInit(&res);
+        if (!dispatch_invoke(range_obj, L"Value", DISPATCH_PROPERTYGET, nullptr, 0, &res))
+        {
+            err = "failed to read value";
+            return false;
+        }
+        variant_to_grid(res, grid);
+        VariantClear(&res);
+        return true;
+    }
+
+    // Address of a range or workbook name as Excel reports it ("$A$1:$C$10").
+    bool range_address(const std::string &session_id, const std::string &sheet, const std::string &range, std::string &address, std::string &err)
+    {
+        FairQueue::Turn turn = fair_.enter(t_request.user, 1.0, err);
+        if (!turn)
+            return false;
+        CComPtr<IDispatch> range_obj;
+        if (!get_range(session_id, sheet, range, range_obj, err))
+            return false;
+        VARIANT res;
+        VariantInit(&res);
+        if (!dispatch_invoke(range_obj, L"Address", DISPATCH_PROPERTYGET, nullptr, 0, &res) || res.vt != VT_BSTR)
+        {
+            VariantClear(&res);
+            err = "failed to read address";
+            return false;
+        }
+        std::wstring ws(res.bstrVal ? res.bstrVal : L"");
+        address.assign(ws.begin(), ws.end());
+        VariantClear(&res);
+        return true;
+    }
+
     bool set_range_value(const std::string &session_id, const std::string &sheet, const std::string &range, VARIANT &val, std::string &err)
     {
+        FairQueue::Turn turn = fair_.enter(t_request.user, 1.0, err);
+        if (!turn)
+            return false;
+        {
+            // Before the write, so a read racing with it is never cached.
+            PoolLock lock(mu_);
+            int idx = find_slot_locked(session_id);
+            if (idx >= 0)
+            {
+                slots_[idx].generation = ++generation_;
+                slots_[idx].pristine = false;
+            }
+        }
         CComPtr<IDispatch> range_obj;
         if (!get_range(session_id, sheet, range, range_obj, err))
             return false;
@@ -964,14 +2480,19 @@ public:
         return true;
     }
 
-    // Analyze a range of cells to detect types and layout for auto-generating UI
+    // Analyze a range of cells to detect types and layout for auto-generating UI.
+    // Values, formats and formulas are read for the whole range at once, and
+    // validations per area Excel reports them in; a property is only asked
+    // of single cells where it differs within the range.
     bool analyze_range(const std::string &session_id, const std::string &sheet, const std::string &range, std::string &json_out, std::string &err)
     {
+        FairQueue::Turn turn = fair_.enter(t_request.user, kAnalyzeCost * range_read_cost(range), err);
+        if (!turn)
+            return false;
         CComPtr<IDispatch> range_obj;
         if (!get_range(session_id, sheet, range, range_obj, err))
             return false;
 
-        // Get range dimensions
         CComPtr<IDispatch> rows = dispatch_get(range_obj, L"Rows");
         CComPtr<IDispatch> cols = dispatch_get(range_obj, L"Columns");
         if (!rows || !cols)
@@ -979,192 +2500,153 @@ public:
             err = "failed to get range dimensions";
             return false;
         }
+        long row_count = dispatch_get_long(rows, L"Count", 1);
+        long col_count = dispatch_get_long(cols, L"Count", 1);
+        long start_row = dispatch_get_long(range_obj, L"Row", 1);
+        long start_col = dispatch_get_long(range_obj, L"Column", 1);
+        size_t cell_count = static_cast<size_t>(row_count) * static_cast<size_t>(col_count);
+        auto index = [col_count](long r, long c)
+        { return static_cast<size_t>(r) * col_count + c; };
 
-        VARIANT row_count_var, col_count_var;
-        VariantInit(&row_count_var);
-        VariantInit(&col_count_var);
-        dispatch_invoke(rows, L"Count", DISPATCH_PROPERTYGET, nullptr, 0, &row_count_var);
-        dispatch_invoke(cols, L"Count", DISPATCH_PROPERTYGET, nullptr, 0, &col_count_var);
-        
-        long row_count = (row_count_var.vt == VT_I4) ? row_count_var.lVal : 1;
-        long col_count = (col_count_var.vt == VT_I4) ? col_count_var.lVal : 1;
-        VariantClear(&row_count_var);
-        VariantClear(&col_count_var);
-
-        // Get the starting row and column
-        CComPtr<IDispatch> first_cell = dispatch_get(range_obj, L"Cells");
-        VARIANT row_var, col_var;
-        VariantInit(&row_var);
-        VariantInit(&col_var);
-        dispatch_invoke(range_obj, L"Row", DISPATCH_PROPERTYGET, nullptr, 0, &row_var);
-        dispatch_invoke(range_obj, L"Column", DISPATCH_PROPERTYGET, nullptr, 0, &col_var);
-        long start_row = (row_var.vt == VT_I4) ? row_var.lVal : 1;
-        long start_col = (col_var.vt == VT_I4) ? col_var.lVal : 1;
-        VariantClear(&row_var);
-        VariantClear(&col_var);
-
-        std::ostringstream json;
-        json << "{\"cells\":[";
-        bool first = true;
-
-        // Iterate through each cell in the range
-        for (long r = 1; r <= row_count; ++r)
-        {
-            for (long c = 1; c <= col_count; ++c)
-            {
-                // Get cell at (r, c) within the range
-                VARIANT args[2];
-                VariantInit(&args[0]);
-                VariantInit(&args[1]);
-                args[1].vt = VT_I4;
-                args[1].lVal = r;
-                args[0].vt = VT_I4;
-                args[0].lVal = c;
-                
-                VARIANT cell_var;
-                VariantInit(&cell_var);
-                if (!dispatch_invoke(range_obj, L"Cells", DISPATCH_PROPERTYGET, args, 2, &cell_var) || cell_var.vt != VT_DISPATCH)
-                {
-                    VariantClear(&cell_var);
-                    continue;
-                }
-                CComPtr<IDispatch> cell = cell_var.pdispVal;
-                VariantClear(&cell_var);
-
-                // Get cell address
-                VARIANT addr_var;
-                VariantInit(&addr_var);
-                dispatch_invoke(cell, L"Address", DISPATCH_PROPERTYGET, nullptr, 0, &addr_var);
-                std::string address;
-                if (addr_var.vt == VT_BSTR && addr_var.bstrVal)
-                {
-                    std::wstring waddr(addr_var.bstrVal);
-                    address = std::string(waddr.begin(), waddr.end());
-                    // Remove $ signs for cleaner address
-                    address.erase(std::remove(address.begin(), address.end(), '$'), address.end());
-                }
-                VariantClear(&addr_var);
-
-                // Get cell value
-                VARIANT val;
-                VariantInit(&val);
-                dispatch_invoke(cell, L"Value", DISPATCH_PROPERTYGET, nullptr, 0, &val);
-                std::string value_json = variant_to_json(val);
-                
-                // Get number format to detect currency, percentage, date formats
-                std::string number_format;
-                VARIANT fmt_var;
-                VariantInit(&fmt_var);
-                if (dispatch_invoke(cell, L"NumberFormat", DISPATCH_PROPERTYGET, nullptr, 0, &fmt_var) && fmt_var.vt == VT_BSTR && fmt_var.bstrVal)
-                {
-                    std::wstring wfmt(fmt_var.bstrVal);
-                    number_format = std::string(wfmt.begin(), wfmt.end());
-                }
-                VariantClear(&fmt_var);
-                
-                // Pre-detect format-based types (currency, percentage) - these take priority for input cells
-                bool is_currency_fmt = number_format.find('$') != std::string::npos ||
-                                   number_format.find("Currency") != std::string::npos ||
-                                   number_format.find('\xa3') != std::string::npos || // £
-                                   number_format.find('\x80') != std::string::npos;   // €
-                bool is_percent_fmt = number_format.find('%') != std::string::npos;
-                bool is_date_fmt = number_format.find('d') != std::string::npos &&
-                                   number_format.find('m') != std::string::npos;
-                
-                // Determine value type
-                std::string cell_type = "text";
-                std::string value_str;
-                bool is_formula = false;
-                bool is_empty = (val.vt == VT_EMPTY || (val.vt == VT_BSTR && (!val.bstrVal || wcslen(val.bstrVal) == 0)));
-                
-                // Check if cell has a formula first
-                VARIANT formula_var;
-                VariantInit(&formula_var);
-                dispatch_invoke(cell, L"HasFormula", DISPATCH_PROPERTYGET, nullptr, 0, &formula_var);
-                if (formula_var.vt == VT_BOOL && formula_var.boolVal)
-                {
-                    is_formula = true;
-                }
-                VariantClear(&formula_var);
-                
-                // For cells with special formatting (currency, percentage, date), treat as input fields
-                // unless they contain a formula (then they're calculated outputs)
-                if (is_currency_fmt && !is_formula)
-                {
-                    cell_type = "currency";
-                }
-                else if (is_percent_fmt && !is_formula)
-                {
-                    cell_type = "percentage";
-                }
-                else if (is_date_fmt && !is_formula && (val.vt == VT_DATE || is_empty))
-                {
-                    cell_type = "date";
-                }
-                else if (is_formula)
-                {
-                    cell_type = "formula";
-                }
-                else if (val.vt == VT_BOOL)
-                {
-                    cell_type = "checkbox";
-                }
-                else if (val.vt == VT_R8 || val.vt == VT_I4 || val.vt == VT_I2)
-                {
-                    cell_type = "number";
-                }
-                else if (val.vt == VT_DATE)
-                {
-                    cell_type = "date";
-                }
-                else if (val.vt == VT_BSTR && val.bstrVal)
-                {
-                    std::wstring ws(val.bstrVal);
-                    value_str = std::string(ws.begin(), ws.end());
-                    cell_type = "text";
-                }
-                VariantClear(&val);
+        VariantTable values;
+        if (!values.read(range_obj, L"Value"))
+        {
+            err = "failed to read value";
+            return false;
+        }
+        if (request_cancelled(err))
+            return false;
 
-                // Check for data validation (dropdowns)
-                std::string dropdown_options;
-                CComPtr<IDispatch> validation = dispatch_get(cell, L"Validation");
-                if (validation)
+        // Number formats: one string when the whole range shares it, else
+        // per column, and per cell only in columns that mix formats.
+        std::vector<std::string> formats(cell_count);
+        std::string shared_format;
+        if (dispatch_get_string(range_obj, L"NumberFormat", shared_format))
+        {
+            std::fill(formats.begin(), formats.end(), shared_format);
+        }
+        else
+        {
+            for (long c = 0; c < col_count; ++c)
+            {
+                if (request_cancelled(err))
+                    return false;
+                std::string column_format;
+                CComPtr<IDispatch> column = dispatch_get_indexed(cols, L"Item", c + 1);
+                bool uniform = column && dispatch_get_string(column, L"NumberFormat", column_format);
+                for (long r = 0; r < row_count; ++r)
                 {
-                    VARIANT type_var;
-                    VariantInit(&type_var);
-                    dispatch_invoke(validation, L"Type", DISPATCH_PROPERTYGET, nullptr, 0, &type_var);
-                    // Type 3 = xlValidateList (dropdown)
-                    if (type_var.vt == VT_I4 && type_var.lVal == 3)
+                    if (!uniform)
+                    {
+                        CComPtr<IDispatch> cell = dispatch_get_indexed(range_obj, L"Cells", r + 1, c + 1);
+                        if (cell)
+                            dispatch_get_string(cell, L"NumberFormat", formats[index(r, c)]);
+                    }
+                    else
                     {
-                        cell_type = "dropdown";
-                        VARIANT formula1_var;
-                        VariantInit(&formula1_var);
-                        dispatch_invoke(validation, L"Formula1", DISPATCH_PROPERTYGET, nullptr, 0, &formula1_var);
-                        if (formula1_var.vt == VT_BSTR && formula1_var.bstrVal)
-                        {
-                            std::wstring wf(formula1_var.bstrVal);
-                            dropdown_options = std::string(wf.begin(), wf.end());
-                        }
-                        VariantClear(&formula1_var);
+                        formats[index(r, c)] = column_format;
                     }
-                    VariantClear(&type_var);
                 }
+            }
+        }
+
+        // Formulas: HasFormula answers for the range unless it is mixed,
+        // and then the formula cells are the ones SpecialCells finds.
+        if (request_cancelled(err))
+            return false;
+        std::vector<uint8_t> formulas(cell_count, 0);
+        VARIANT has_formula;
+        VariantInit(&has_formula);
+        dispatch_invoke(range_obj, L"HasFormula", DISPATCH_PROPERTYGET, nullptr, 0, &has_formula);
+        if (has_formula.vt == VT_BOOL)
+        {
+            std::fill(formulas.begin(), formulas.end(), has_formula.boolVal ? 1 : 0);
+        }
+        else
+        {
+            for_each_special_area(range_obj, kCellTypeFormulas, start_row, start_col, row_count, col_count,
+                                  [&](IDispatch *, long r1, long c1, long r2, long c2)
+                                  {
+                                      for (long r = r1; r <= r2; ++r)
+                                          for (long c = c1; c <= c2; ++c)
+                                              formulas[index(r, c)] = 1;
+                                  });
+        }
+        VariantClear(&has_formula);
+        if (request_cancelled(err))
+            return false;
 
-                // Include empty cells as "empty" type for grid layout (spacers)
-                if (is_empty && cell_type != "dropdown")
+        // List validations (dropdowns), by area. SpecialCells on a single
+        // cell searches the whole sheet, so one cell is asked directly.
+        std::vector<uint8_t> lists(cell_count, 0);
+        std::vector<std::string> options(cell_count);
+        auto read_validation = [&](IDispatch *target, long r1, long c1, long r2, long c2)
+        {
+            CComPtr<IDispatch> validation = dispatch_get(target, L"Validation");
+            long type = validation ? dispatch_get_long(validation, L"Type", -1) : -1;
+            if (type != kValidateList)
+                return false;
+            std::string formula1;
+            dispatch_get_string(validation, L"Formula1", formula1);
+            for (long r = r1; r <= r2; ++r)
+            {
+                for (long c = c1; c <= c2; ++c)
                 {
-                    cell_type = "empty";
+                    lists[index(r, c)] = 1;
+                    options[index(r, c)] = formula1;
                 }
+            }
+            return true;
+        };
+        if (cell_count == 1)
+        {
+            read_validation(range_obj, 0, 0, 0, 0);
+        }
+        else
+        {
+            for_each_special_area(range_obj, kCellTypeAllValidation, start_row, start_col, row_count, col_count,
+                                  [&](IDispatch *area, long r1, long c1, long r2, long c2)
+                                  {
+                                      // An area whose cells differ in validation has no
+                                      // single Validation.Type; ask its cells one by one.
+                                      if (read_validation(area, r1, c1, r2, c2) || (r1 == r2 && c1 == c2))
+                                          return;
+                                      for (long r = r1; r <= r2; ++r)
+                                      {
+                                          for (long c = c1; c <= c2; ++c)
+                                          {
+                                              CComPtr<IDispatch> cell = dispatch_get_indexed(range_obj, L"Cells", r + 1, c + 1);
+                                              if (cell)
+                                                  read_validation(cell, r, c, r, c);
+                                          }
+                                      }
+                                  });
+        }
+        if (request_cancelled(err))
+            return false;
+
+        std::ostringstream json;
+        json << "{\"cells\":[";
+        bool first = true;
+        for (long r = 0; r < row_count; ++r)
+        {
+            for (long c = 0; c < col_count; ++c)
+            {
+                const VARIANT &val = values.at(r, c);
+                const std::string &number_format = formats[index(r, c)];
+                const std::string &dropdown_options = options[index(r, c)];
+                bool is_formula = formulas[index(r, c)] != 0;
+                std::string cell_type = classify_cell(analyzed_kind(val), number_format, is_formula, lists[index(r, c)] != 0);
 
                 if (!first) json << ",";
                 first = false;
 
                 json << "{";
-                json << "\"address\":\"" << json_escape(address) << "\",";
-                json << "\"row\":" << (start_row + r - 1) << ",";
-                json << "\"col\":" << (start_col + c - 1) << ",";
+                json << "\"address\":\"" << column_name(static_cast<uint32_t>(start_col + c - 1)) << (start_row + r) << "\",";
+                json << "\"row\":" << (start_row + r) << ",";
+                json << "\"col\":" << (start_col + c) << ",";
                 json << "\"type\":\"" << cell_type << "\",";
-                json << "\"value\":" << value_json << ",";
+                json << "\"value\":" << variant_to_json(val) << ",";
                 json << "\"isFormula\":" << (is_formula ? "true" : "false");
                 if (!dropdown_options.empty())
                 {
@@ -1183,181 +2665,134 @@ public:
         return true;
     }
 
-    // Export chart image overlapping a specific cell
-    bool export_chart_at_cell(const std::string &session_id, const std::string &sheet, const std::string &cell, std::string &base64_out, std::string &err)
+    // A chart object of a worksheet: its name, where it sits in points and
+    // the ranges its series read.
+    struct ChartInfo
     {
-        std::lock_guard<std::mutex> lock(mu_);
-        int idx = find_slot_locked(session_id);
-        if (idx < 0)
-        {
-            err = "session not found";
-            return false;
-        }
-        auto &slot = slots_[idx];
-        if (!slot.workbook)
-        {
-            err = "no workbook loaded";
-            return false;
-        }
+        std::string name;
+        double left = 0, top = 0, right = 0, bottom = 0;
+        std::vector<ChartRef> sources;
+    };
 
-        // Get the worksheet
-        CComPtr<IDispatch> sheets = dispatch_get(slot.workbook, L"Worksheets");
-        if (!sheets)
-        {
-            err = "failed to access worksheets";
+    // The first chart overlapping a cell. Chart positions and series are
+    // read from Excel once per loaded workbook and sheet.
+    bool find_chart_at_cell(const std::string &session_id, const std::string &sheet, const std::string &cell, ChartInfo &out, std::string &err)
+    {
+        FairQueue::Turn turn = fair_.enter(t_request.user, kChartFindCost, err);
+        if (!turn)
             return false;
-        }
-
-        std::wstring wsheet(sheet.begin(), sheet.end());
-        VARIANT sheet_arg;
-        VariantInit(&sheet_arg);
-        sheet_arg.vt = VT_BSTR;
-        sheet_arg.bstrVal = SysAllocString(wsheet.c_str());
-        VARIANT ws_res;
-        VariantInit(&ws_res);
-        if (!dispatch_invoke(sheets, L"Item", DISPATCH_PROPERTYGET, &sheet_arg, 1, &ws_res) || ws_res.vt != VT_DISPATCH)
+        CComPtr<IDispatch> wb;
+        std::shared_ptr<const std::vector<ChartInfo>> charts;
+        std::string sheet_key = normalize_sheet_key(sheet);
         {
-            SysFreeString(sheet_arg.bstrVal);
-            VariantClear(&ws_res);
-            err = "sheet not found: " + sheet;
-            return false;
+            PoolLock lock(mu_);
+            int idx = find_slot_locked(session_id);
+            if (idx < 0 || !slots_[idx].workbook)
+            {
+                err = "no workbook loaded";
+                return false;
+            }
+            wb = slots_[idx].workbook;
+            auto it = slots_[idx].charts.find(sheet_key);
+            if (it != slots_[idx].charts.end())
+                charts = it->second;
         }
-        SysFreeString(sheet_arg.bstrVal);
+        CComPtr<IDispatch> sheets = dispatch_get(wb, L"Worksheets");
         CComPtr<IDispatch> ws;
-        ws.Attach(ws_res.pdispVal);
-
-        // Get the target cell range to find its position
-        std::wstring wcell(cell.begin(), cell.end());
-        VARIANT cell_arg;
-        VariantInit(&cell_arg);
-        cell_arg.vt = VT_BSTR;
-        cell_arg.bstrVal = SysAllocString(wcell.c_str());
-        VARIANT cell_res;
-        VariantInit(&cell_res);
-        if (!dispatch_invoke(ws, L"Range", DISPATCH_PROPERTYGET, &cell_arg, 1, &cell_res) || cell_res.vt != VT_DISPATCH)
-        {
-            SysFreeString(cell_arg.bstrVal);
-            VariantClear(&cell_res);
-            err = "invalid cell reference: " + cell;
+        if (!sheets || !resolve_sheet_object(sheets, sheet, ws))
+        {
+            err = "sheet not found: " + sheet;
             return false;
         }
-        SysFreeString(cell_arg.bstrVal);
-        CComPtr<IDispatch> cell_range;
-        cell_range.Attach(cell_res.pdispVal);
-
-        // Get cell position (left, top, width, height)
-        VARIANT left_v, top_v, width_v, height_v;
-        VariantInit(&left_v);
-        VariantInit(&top_v);
-        VariantInit(&width_v);
-        VariantInit(&height_v);
-        dispatch_invoke(cell_range, L"Left", DISPATCH_PROPERTYGET, nullptr, 0, &left_v);
-        dispatch_invoke(cell_range, L"Top", DISPATCH_PROPERTYGET, nullptr, 0, &top_v);
-        dispatch_invoke(cell_range, L"Width", DISPATCH_PROPERTYGET, nullptr, 0, &width_v);
-        dispatch_invoke(cell_range, L"Height", DISPATCH_PROPERTYGET, nullptr, 0, &height_v);
-        
-        double cell_left = (left_v.vt == VT_R8) ? left_v.dblVal : 0;
-        double cell_top = (top_v.vt == VT_R8) ? top_v.dblVal : 0;
-        double cell_width = (width_v.vt == VT_R8) ? width_v.dblVal : 0;
-        double cell_height = (height_v.vt == VT_R8) ? height_v.dblVal : 0;
-        double cell_right = cell_left + cell_width;
-        double cell_bottom = cell_top + cell_height;
-        
-        VariantClear(&left_v);
-        VariantClear(&top_v);
-        VariantClear(&width_v);
-        VariantClear(&height_v);
-
-        // Get ChartObjects collection (ChartObjects is a method, not a property)
-        VARIANT chart_objs_res;
-        VariantInit(&chart_objs_res);
-        if (!dispatch_invoke(ws, L"ChartObjects", DISPATCH_METHOD, nullptr, 0, &chart_objs_res) || chart_objs_res.vt != VT_DISPATCH)
+        if (!charts)
         {
-            VariantClear(&chart_objs_res);
-            err = "no chart objects on sheet";
-            return false;
+            charts = std::make_shared<const std::vector<ChartInfo>>(read_chart_objects(ws));
+            PoolLock lock(mu_);
+            int idx = find_slot_locked(session_id);
+            if (idx >= 0 && slots_[idx].workbook == wb)
+                slots_[idx].charts[sheet_key] = charts;
         }
-        CComPtr<IDispatch> chart_objects;
-        chart_objects.Attach(chart_objs_res.pdispVal);
-
-        // Get count of chart objects
-        VARIANT count_v;
-        VariantInit(&count_v);
-        dispatch_invoke(chart_objects, L"Count", DISPATCH_PROPERTYGET, nullptr, 0, &count_v);
-        long chart_count = (count_v.vt == VT_I4) ? count_v.lVal : 0;
-        VariantClear(&count_v);
-
-        if (chart_count == 0)
+        if (charts->empty())
         {
             err = "no charts on sheet";
             return false;
         }
+        if (request_cancelled(err))
+            return false;
 
-        // Find chart overlapping the cell
-        CComPtr<IDispatch> found_chart;
-        for (long i = 1; i <= chart_count; ++i)
+        std::wstring wcell(cell.begin(), cell.end());
+        CComPtr<IDispatch> cell_range = dispatch_call_bstr(ws, L"Range", wcell, DISPATCH_PROPERTYGET);
+        if (!cell_range)
+        {
+            err = "invalid cell reference: " + cell;
+            return false;
+        }
+        double cell_left = dispatch_get_double(cell_range, L"Left", 0);
+        double cell_top = dispatch_get_double(cell_range, L"Top", 0);
+        double cell_right = cell_left + dispatch_get_double(cell_range, L"Width", 0);
+        double cell_bottom = cell_top + dispatch_get_double(cell_range, L"Height", 0);
+        for (const ChartInfo &chart : *charts)
         {
-            VARIANT idx_arg;
-            VariantInit(&idx_arg);
-            idx_arg.vt = VT_I4;
-            idx_arg.lVal = i;
-            VARIANT co_res;
-            VariantInit(&co_res);
-            if (!dispatch_invoke(chart_objects, L"Item", DISPATCH_METHOD, &idx_arg, 1, &co_res) || co_res.vt != VT_DISPATCH)
+            // Any intersection counts.
+            if (!(chart.right < cell_left || chart.left > cell_right || chart.bottom < cell_top || chart.top > cell_bottom))
             {
-                VariantClear(&co_res);
-                continue;
-            }
-            CComPtr<IDispatch> chart_obj;
-            chart_obj.Attach(co_res.pdispVal);
-
-            // Get chart position
-            VARIANT cl, ct, cw, ch;
-            VariantInit(&cl);
-            VariantInit(&ct);
-            VariantInit(&cw);
-            VariantInit(&ch);
-            dispatch_invoke(chart_obj, L"Left", DISPATCH_PROPERTYGET, nullptr, 0, &cl);
-            dispatch_invoke(chart_obj, L"Top", DISPATCH_PROPERTYGET, nullptr, 0, &ct);
-            dispatch_invoke(chart_obj, L"Width", DISPATCH_PROPERTYGET, nullptr, 0, &cw);
-            dispatch_invoke(chart_obj, L"Height", DISPATCH_PROPERTYGET, nullptr, 0, &ch);
-
-            double chart_left = (cl.vt == VT_R8) ? cl.dblVal : 0;
-            double chart_top = (ct.vt == VT_R8) ? ct.dblVal : 0;
-            double chart_width = (cw.vt == VT_R8) ? cw.dblVal : 0;
-            double chart_height = (ch.vt == VT_R8) ? ch.dblVal : 0;
-            double chart_right = chart_left + chart_width;
-            double chart_bottom = chart_top + chart_height;
-
-            VariantClear(&cl);
-            VariantClear(&ct);
-            VariantClear(&cw);
-            VariantClear(&ch);
-
-            // Check if chart overlaps cell (any intersection)
-            bool overlaps = !(chart_right < cell_left || chart_left > cell_right ||
-                              chart_bottom < cell_top || chart_top > cell_bottom);
-            
-            if (overlaps)
-            {
-                found_chart = chart_obj;
-                break;
+                out = chart;
+                return true;
             }
         }
+        err = "no chart overlapping cell " + cell;
+        return false;
+    }
 
-        if (!found_chart)
+    // Exports a chart found by find_chart_at_cell as PNG bytes.
+    bool export_chart_png(const std::string &session_id, const std::string &sheet, const std::string &chart_name, std::string &png, std::string &err)
+    {
+        FairQueue::Turn turn = fair_.enter(t_request.user, kChartExportCost, err);
+        if (!turn)
+            return false;
+        CComPtr<IDispatch> wb;
+        {
+            PoolLock lock(mu_);
+            int idx = find_slot_locked(session_id);
+            if (idx < 0 || !slots_[idx].workbook)
+            {
+                err = "no workbook loaded";
+                return false;
+            }
+            wb = slots_[idx].workbook;
+        }
+        CComPtr<IDispatch> sheets = dispatch_get(wb, L"Worksheets");
+        CComPtr<IDispatch> ws;
+        if (!sheets || !resolve_sheet_object(sheets, sheet, ws))
         {
-            err = "no chart overlapping cell " + cell;
+            err = "sheet not found: " + sheet;
             return false;
         }
-
-        // Get the Chart object from ChartObject
-        CComPtr<IDispatch> chart = dispatch_get(found_chart, L"Chart");
+        // ChartObjects is a method, not a property.
+        VARIANT name_arg;
+        VariantInit(&name_arg);
+        name_arg.vt = VT_BSTR;
+        name_arg.bstrVal = SysAllocString(std::wstring(chart_name.begin(), chart_name.end()).c_str());
+        VARIANT co_res;
+        VariantInit(&co_res);
+        bool found = dispatch_invoke(ws, L"ChartObjects", DISPATCH_METHOD, &name_arg, 1, &co_res) && co_res.vt == VT_DISPATCH;
+        VariantClear(&name_arg);
+        if (!found)
+        {
+            VariantClear(&co_res);
+            err = "chart not found: " + chart_name;
+            return false;
+        }
+        CComPtr<IDispatch> chart_obj;
+        chart_obj.Attach(co_res.pdispVal);
+        CComPtr<IDispatch> chart = dispatch_get(chart_obj, L"Chart");
         if (!chart)
         {
             err = "failed to get chart object";
             return false;
         }
+        if (request_cancelled(err))
+            return false;
 
         // Create temporary file path for export
         wchar_t temp_path[MAX_PATH];
@@ -1395,7 +2830,6 @@ public:
             return false;
         }
 
-        // Read the PNG file and encode as base64
         std::ifstream file(png_path, std::ios::binary);
         if (!file)
         {
@@ -1403,29 +2837,9 @@ public:
             DeleteFileW(png_path.c_str());
             return false;
         }
-
-        std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(file), {});
+        png.assign(std::istreambuf_iterator<char>(file), {});
         file.close();
         DeleteFileW(png_path.c_str());
-
-        // Base64 encode
-        static const char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-        std::string encoded;
-        encoded.reserve(((buffer.size() + 2) / 3) * 4);
-        
-        for (size_t i = 0; i < buffer.size(); i += 3)
-        {
-            unsigned int n = buffer[i] << 16;
-            if (i + 1 < buffer.size()) n |= buffer[i + 1] << 8;
-            if (i + 2 < buffer.size()) n |= buffer[i + 2];
-            
-            encoded.push_back(b64_chars[(n >> 18) & 0x3F]);
-            encoded.push_back(b64_chars[(n >> 12) & 0x3F]);
-            encoded.push_back((i + 1 < buffer.size()) ? b64_chars[(n >> 6) & 0x3F] : '=');
-            encoded.push_back((i + 2 < buffer.size()) ? b64_chars[n & 0x3F] : '=');
-        }
-
-        base64_out = encoded;
         return true;
     }
 
@@ -1434,19 +2848,19 @@ public:
         fs::path resolved = fs::absolute(path);
         std::error_code ec;
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             int idx = find_slot_locked(session_id);
             if (idx >= 0 && slots_[idx].workbook && !slots_[idx].workbook_path.empty())
             {
-                if (fs::equivalent(slots_[idx].workbook_path, resolved, ec) && !ec)
+                if (fs::equivalent(slots_[idx].source_path, resolved, ec) && !ec)
                 {
                     return true;
                 }
                 if (ec)
                 {
-                    log_warn("Path comparison failed while ensuring workbook: " + ec.message());
+                    ESA_LOG_WARN("Path comparison failed while ensuring workbook: " + ec.message());
                 }
-                log_info("Reloading workbook for session " + mask_token(session_id));
+                ESA_LOG_INFO("Reloading workbook for session " + mask_token(session_id));
             }
         }
         return load_workbook(session_id, user, resolved, err);
@@ -1454,9 +2868,12 @@ public:
 
     bool list_sheets(const std::string &session_id, std::vector<std::string> &sheets_out, std::string &err)
     {
+        FairQueue::Turn turn = fair_.enter(t_request.user, 1.0, err);
+        if (!turn)
+            return false;
         CComPtr<IDispatch> wb;
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             int idx = find_slot_locked(session_id);
             if (idx < 0 || !slots_[idx].workbook)
             {
@@ -1516,45 +2933,86 @@ public:
         return true;
     }
 
+    // Lock-free snapshot for /metrics; a slot being restarted counts as neither
+    // free nor in use.
+    void slot_states(int &free_out, int &in_use_out, int &restarting_out) const
+    {
+        int total = slot_count_.load(std::memory_order_relaxed);
+        in_use_out = in_use_count_.load(std::memory_order_relaxed);
+        restarting_out = restarting_count_.load(std::memory_order_relaxed);
+        free_out = std::max(0, total - in_use_out - restarting_out);
+    }
+
+    // What a session has open, for the query cache. The generation changes
+    // on every load and every write; pristine holds until the first write.
+    struct WorkbookState
+    {
+        fs::path source;
+        fs::file_time_type stamp{};
+        uint64_t generation = 0;
+        bool pristine = false;
+    };
+
+    bool workbook_state(const std::string &session_id, WorkbookState &state)
+    {
+        PoolLock lock(mu_);
+        int idx = find_slot_locked(session_id);
+        if (idx < 0 || !slots_[idx].workbook)
+            return false;
+        state.source = slots_[idx].source_path;
+        state.stamp = slots_[idx].source_stamp;
+        state.generation = slots_[idx].generation;
+        state.pristine = slots_[idx].pristine;
+        return true;
+    }
+
+    bool has_session(const std::string &session_id)
+    {
+        PoolLock lock(mu_);
+        int idx = find_slot_locked(session_id);
+        return idx >= 0 && slots_[idx].workbook != nullptr;
+    }
+
     bool close_session(const std::string &session_id, bool restart, std::string &err)
     {
         int idx = -1;
         CComPtr<IDispatch> wb;
         std::string session_mask = mask_token(session_id);
-        log_info("Close Excel session requested session=" + session_mask + (restart ? " restart" : ""));
+        ESA_LOG_INFO("Close Excel session requested session=" + session_mask + (restart ? " restart" : ""));
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             idx = find_slot_locked(session_id);
             if (idx < 0)
             {
                 err = "no active session";
-                log_warn("Close session requested for unknown token " + session_mask);
+                ESA_LOG_WARN("Close session requested for unknown token " + session_mask);
                 return false;
             }
             wb = slots_[idx].workbook;
         }
         if (wb)
         {
-            log_info("Closing workbook for session=" + session_mask + " slot=" + std::to_string(idx));
+            ESA_LOG_INFO("Closing workbook for session=" + session_mask + " slot=" + std::to_string(idx));
             dispatch_call_noargs(wb, L"Close");
         }
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             slots_[idx].workbook.Release();
             slots_[idx].workbook_path.clear();
+            slots_[idx].source_path.clear();
             // Clean up temporary directory
             cleanup_temp_dir(static_cast<size_t>(idx));
             slots_[idx].session_id.clear();
             slots_[idx].user.clear();
-            slots_[idx].in_use = false;
+            mark_in_use_locked(static_cast<size_t>(idx), false);
             if (restart && !restart_slot_locked(static_cast<size_t>(idx)))
             {
                 err = "failed to restart excel";
-                log_error("Failed to restart Excel slot " + std::to_string(idx) + " after closing session " + session_mask);
+                ESA_LOG_ERROR("Failed to restart Excel slot " + std::to_string(idx) + " after closing session " + session_mask);
                 return false;
             }
         }
-        log_info("Session closed session=" + session_mask + " restart=" + std::string(restart ? "true" : "false"));
+        ESA_LOG_INFO("Session closed session=" + session_mask + " restart=" + std::string(restart ? "true" : "false"));
         return true;
     }
 
@@ -1567,9 +3025,133 @@ private:
         std::string user;
         fs::path workbook_path;
         fs::path temp_dir;  // Temporary working directory for this session
+        fs::path source_path; // The published file the workbook was copied from
+        fs::file_time_type source_stamp{};
+        uint64_t generation = 0;
+        bool pristine = false;
         bool in_use = false;
+        // Chart objects by sheet, read on first use after each load.
+        std::unordered_map<std::string, std::shared_ptr<const std::vector<ChartInfo>>> charts;
     };
 
+    // Name, position and series sources of every chart object on a sheet.
+    static std::vector<ChartInfo> read_chart_objects(IDispatch *ws)
+    {
+        std::vector<ChartInfo> charts;
+        VARIANT co_res;
+        VariantInit(&co_res);
+        if (!dispatch_invoke(ws, L"ChartObjects", DISPATCH_METHOD, nullptr, 0, &co_res) || co_res.vt != VT_DISPATCH)
+        {
+            VariantClear(&co_res);
+            return charts;
+        }
+        CComPtr<IDispatch> chart_objects;
+        chart_objects.Attach(co_res.pdispVal);
+        long count = dispatch_get_long(chart_objects, L"Count", 0);
+        for (long i = 1; i <= count; ++i)
+        {
+            CComPtr<IDispatch> chart_obj = dispatch_get_indexed(chart_objects, L"Item", i, 0, DISPATCH_METHOD);
+            if (!chart_obj)
+                continue;
+            ChartInfo info;
+            dispatch_get_string(chart_obj, L"Name", info.name);
+            info.left = dispatch_get_double(chart_obj, L"Left", 0);
+            info.top = dispatch_get_double(chart_obj, L"Top", 0);
+            info.right = info.left + dispatch_get_double(chart_obj, L"Width", 0);
+            info.bottom = info.top + dispatch_get_double(chart_obj, L"Height", 0);
+            CComPtr<IDispatch> chart = dispatch_get(chart_obj, L"Chart");
+            VARIANT sc_res;
+            VariantInit(&sc_res);
+            if (chart && dispatch_invoke(chart, L"SeriesCollection", DISPATCH_METHOD, nullptr, 0, &sc_res) && sc_res.vt == VT_DISPATCH)
+            {
+                CComPtr<IDispatch> series;
+                series.Attach(sc_res.pdispVal);
+                VariantInit(&sc_res);
+                long series_count = dispatch_get_long(series, L"Count", 0);
+                for (long k = 1; k <= series_count; ++k)
+                {
+                    CComPtr<IDispatch> ser = dispatch_get_indexed(series, L"Item", k, 0, DISPATCH_METHOD);
+                    std::string formula;
+                    if (!ser || !dispatch_get_string(ser, L"Formula", formula))
+                        continue;
+                    std::vector<std::string> args = series_formula_args(formula);
+                    for (size_t a = 0; a < args.size() && a < 3; ++a)
+                        split_chart_refs(args[a], info.sources);
+                }
+            }
+            VariantClear(&sc_res);
+            charts.push_back(std::move(info));
+        }
+        return charts;
+    }
+
+    static constexpr long kCellTypeFormulas = -4123;      // xlCellTypeFormulas
+    static constexpr long kCellTypeAllValidation = -4174; // xlCellTypeAllValidation
+    static constexpr long kValidateList = 3;              // xlValidateList
+
+    static AnalyzedKind analyzed_kind(const VARIANT &val)
+    {
+        switch (val.vt)
+        {
+        case VT_EMPTY:
+            return AnalyzedKind::Empty;
+        case VT_BSTR:
+            return val.bstrVal && wcslen(val.bstrVal) > 0 ? AnalyzedKind::Text : AnalyzedKind::Empty;
+        case VT_R8:
+        case VT_I4:
+        case VT_I2:
+            return AnalyzedKind::Number;
+        case VT_DATE:
+            return AnalyzedKind::Date;
+        case VT_BOOL:
+            return AnalyzedKind::Bool;
+        default:
+            return AnalyzedKind::Other;
+        }
+    }
+
+    // Calls fn(area, r1, c1, r2, c2) for each area of range.SpecialCells(type),
+    // with corners relative to the range and clipped to it. SpecialCells
+    // fails when no cell matches, which is not an error here.
+    template <typename Fn>
+    static void for_each_special_area(IDispatch *range, long type, long start_row, long start_col, long row_count, long col_count, Fn fn)
+    {
+        CComPtr<IDispatch> found = dispatch_get_indexed(range, L"SpecialCells", type, 0, DISPATCH_METHOD);
+        CComPtr<IDispatch> areas = found ? dispatch_get(found, L"Areas") : nullptr;
+        long count = areas ? dispatch_get_long(areas, L"Count", 0) : 0;
+        for (long i = 1; i <= count; ++i)
+        {
+            CComPtr<IDispatch> area = dispatch_get_indexed(areas, L"Item", i);
+            CComPtr<IDispatch> area_rows = area ? dispatch_get(area, L"Rows") : nullptr;
+            CComPtr<IDispatch> area_cols = area ? dispatch_get(area, L"Columns") : nullptr;
+            if (!area_rows || !area_cols)
+                continue;
+            long r1 = dispatch_get_long(area, L"Row", 0) - start_row;
+            long c1 = dispatch_get_long(area, L"Column", 0) - start_col;
+            long r2 = r1 + dispatch_get_long(area_rows, L"Count", 0) - 1;
+            long c2 = c1 + dispatch_get_long(area_cols, L"Count", 0) - 1;
+            r1 = std::max(r1, 0L);
+            c1 = std::max(c1, 0L);
+            r2 = std::min(r2, row_count - 1);
+            c2 = std::min(c2, col_count - 1);
+            if (r1 <= r2 && c1 <= c2)
+                fn(area.p, r1, c1, r2, c2);
+        }
+    }
+
+    void mark_in_use_locked(size_t idx, bool in_use)
+    {
+        if (slots_[idx].in_use == in_use)
+            return;
+        slots_[idx].in_use = in_use;
+        in_use_count_.fetch_add(in_use ? 1 : -1, std::memory_order_relaxed);
+    }
+
+    static Histogram &load_phase_histogram(const char *phase)
+    {
+        return g_metrics.histogram("esa_excel_load_phase_seconds", "load_workbook time by phase (copy files, open in Excel)", metric_label("phase", phase));
+    }
+
     // Generate a unique temporary directory name
     std::string generate_temp_id()
     {
@@ -1590,11 +3172,11 @@ private:
         std::error_code ec;
         if (fs::exists(slots_[idx].temp_dir, ec))
         {
-            log_info("Removing temporary directory: " + slots_[idx].temp_dir.u8string());
+            ESA_LOG_INFO("Removing temporary directory: " + slots_[idx].temp_dir.u8string());
             fs::remove_all(slots_[idx].temp_dir, ec);
             if (ec)
             {
-                log_warn("Failed to remove temp directory: " + slots_[idx].temp_dir.u8string() + " error=" + ec.message());
+                ESA_LOG_WARN("Failed to remove temp directory: " + slots_[idx].temp_dir.u8string() + " error=" + ec.message());
             }
         }
         slots_[idx].temp_dir.clear();
@@ -1605,13 +3187,13 @@ private:
         CLSID clsid;
         if (FAILED(::CLSIDFromProgID(L"Excel.Application", &clsid)))
         {
-            log_error("Excel not registered on this host");
+            ESA_LOG_ERROR("Excel not registered on this host");
             return nullptr;
         }
         CComPtr<IDispatch> app;
         if (FAILED(CoCreateInstance(clsid, nullptr, CLSCTX_LOCAL_SERVER, IID_IDispatch, reinterpret_cast<void **>(&app))))
         {
-            log_error("CoCreateInstance failed while creating Excel.Application");
+            ESA_LOG_ERROR("CoCreateInstance failed while creating Excel.Application");
             return nullptr;
         }
         dispatch_put_bool(app, L"Visible", false);
@@ -1638,11 +3220,12 @@ private:
         {
             if (!slots_[i].in_use)
             {
-                slots_[i].in_use = true;
+                mark_in_use_locked(i, true);
                 slots_[i].session_id = session_id;
                 slots_[i].user = user;
                 slots_[i].workbook.Release();
                 slots_[i].workbook_path.clear();
+                slots_[i].source_path.clear();
                 // Clean up any leftover temp directory (should not happen, but be safe)
                 cleanup_temp_dir(i);
                 return static_cast<int>(i);
@@ -1655,21 +3238,23 @@ private:
     {
         if (idx >= slots_.size())
             return false;
-        log_info("Restarting Excel slot " + std::to_string(idx));
+        ESA_LOG_INFO("Restarting Excel slot " + std::to_string(idx));
         if (slots_[idx].app)
             dispatch_call_noargs(slots_[idx].app, L"Quit");
         slots_[idx].app.Release();
         slots_[idx].workbook.Release();
         // Clean up temporary directory
         cleanup_temp_dir(idx);
+        restarting_count_.fetch_add(1, std::memory_order_relaxed);
         CComPtr<IDispatch> app = create_instance();
+        restarting_count_.fetch_sub(1, std::memory_order_relaxed);
         if (!app)
         {
-            log_error("Excel slot restart failed for slot " + std::to_string(idx));
+            ESA_LOG_ERROR("Excel slot restart failed for slot " + std::to_string(idx));
             return false;
         }
         slots_[idx].app = app;
-        log_info("Excel slot " + std::to_string(idx) + " restarted successfully");
+        ESA_LOG_INFO("Excel slot " + std::to_string(idx) + " restarted successfully");
         return true;
     }
 
@@ -1683,7 +3268,7 @@ private:
         }
         CComPtr<IDispatch> wb;
         {
-            std::lock_guard<std::mutex> lock(mu_);
+            PoolLock lock(mu_);
             int idx = find_slot_locked(session_id);
             if (idx < 0 || !slots_[idx].workbook)
             {
@@ -1729,11 +3314,12 @@ private:
             return;
         slots_[idx].workbook.Release();
         slots_[idx].workbook_path.clear();
+        slots_[idx].source_path.clear();
         // Clean up temporary directory
         cleanup_temp_dir(idx);
         slots_[idx].session_id.clear();
         slots_[idx].user.clear();
-        slots_[idx].in_use = false;
+        mark_in_use_locked(idx, false);
     }
 
     bool resolve_sheet_object(IDispatch *sheets, const std::string &sheet_name, CComPtr<IDispatch> &sheet_out)
@@ -1800,7 +3386,17 @@ private:
     std::vector<Slot> slots_;
     bool com_initialized_ = false;
     bool shutdown_ = false;
+    std::atomic<int> slot_count_{0};
+    std::atomic<int> in_use_count_{0};
+    std::atomic<int> restarting_count_{0};
+    uint64_t generation_ = 0;
     std::mutex mu_;
+    // Fair queue costs, in one-cell reads; range reads scale with their size.
+    static constexpr double kLoadCost = 16.0;
+    static constexpr double kAnalyzeCost = 8.0;
+    static constexpr double kChartFindCost = 4.0;
+    static constexpr double kChartExportCost = 16.0;
+    FairQueue fair_;
 };
 
 ExcelPool *g_excel_pool = nullptr;
@@ -1816,733 +3412,11987 @@ BOOL WINAPI ConsoleCtrlHandler(DWORD ctrl_type)
     case CTRL_SHUTDOWN_EVENT:
         if (g_excel_pool)
             g_excel_pool->shutdown();
+        g_access_log.shutdown();
+        g_logger.shutdown();
         return FALSE;
     default:
         return FALSE;
     }
 }
 
-// -------------------- Session store --------------------
-class SessionStore
+// -------------------- Native engine: zip archive --------------------
+// Just enough of the zip format to read .xlsx packages: central directory,
+// stored and deflated entries. No zip64, encryption or multi-disk archives.
+
+// Raw DEFLATE decoder (RFC 1951). Huffman codes up to 9 bits resolve with one
+// table lookup; longer codes fall back to canonical bit-by-bit decoding.
+class Inflater
 {
 public:
-    std::string login(const std::string &user)
-    {
-        std::lock_guard<std::mutex> lock(mu_);
-        std::string token = generate_token();
-        sessions_[token] = user;
-        return token;
-    }
-
-    void logout(const std::string &token)
-    {
-        std::lock_guard<std::mutex> lock(mu_);
-        sessions_.erase(token);
-    }
-
-    bool verify(const std::string &token, std::string &user_out)
+    // Fails as soon as the output would pass `limit` bytes, so a stream
+    // that expands past its declared size is never held in full.
+    static bool inflate(const uint8_t *src, size_t len, std::string &out, size_t limit)
     {
-        std::lock_guard<std::mutex> lock(mu_);
-        auto it = sessions_.find(token);
-        if (it == sessions_.end())
-            return false;
-        user_out = it->second;
+        Inflater inf(src, len, limit);
+        out.clear();
+        // `limit` is only what the header claims; past a typical ratio the
+        // string grows as bytes actually arrive.
+        out.reserve(std::min<size_t>(limit, len * 4 + 64 * 1024));
+        bool last = false;
+        while (!last)
+        {
+            last = inf.bits(1) != 0;
+            int type = static_cast<int>(inf.bits(2));
+            bool ok = false;
+            if (type == 0)
+                ok = inf.stored(out);
+            else if (type == 1)
+                ok = inf.fixed(out);
+            else if (type == 2)
+                ok = inf.dynamic(out);
+            if (!ok || inf.err_)
+                return false;
+        }
         return true;
     }
 
 private:
-    std::string generate_token()
+    static const int kFastBits = 9;
+    static const int kMaxBits = 15;
+
+    struct Huffman
     {
-        static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
-        thread_local std::mt19937 rng{std::random_device{}()};
-        std::uniform_int_distribution<int> dist(0, static_cast<int>(sizeof(charset) - 2));
-        std::string t(40, ' ');
-        for (char &c : t)
-            c = charset[dist(rng)];
-        return t;
-    }
-    std::unordered_map<std::string, std::string> sessions_;
-    std::mutex mu_;
-};
+        uint16_t fast[1 << kFastBits]; // (length << 9) | symbol; 0 when longer than kFastBits
+        int16_t count[kMaxBits + 1];
+        int16_t symbol[320];
+    };
 
-// -------------------- HTTP primitives --------------------
-struct HttpRequest
-{
-    std::string method;
-    std::string path;
-    std::unordered_map<std::string, std::string> headers;
-    std::string body;
-};
+    Inflater(const uint8_t *src, size_t len, size_t limit) : src_(src), len_(len), limit_(limit) {}
 
-struct HttpResponse
-{
-    int status = 200;
-    std::string content_type = "application/json";
-    std::string body = "{}";
-};
+    void refill()
+    {
+        while (bitcnt_ <= 56 && pos_ < len_)
+        {
+            bitbuf_ |= static_cast<uint64_t>(src_[pos_++]) << bitcnt_;
+            bitcnt_ += 8;
+        }
+    }
 
-std::string read_line(SOCKET s)
-{
-    std::string line;
-    char c;
-    while (recv(s, &c, 1, 0) == 1)
+    uint32_t bits(int n)
     {
-        if (c == '\r')
+        if (bitcnt_ < n)
         {
-            recv(s, &c, 1, 0); // consume \n
-            break;
+            refill();
+            if (bitcnt_ < n)
+            {
+                err_ = true;
+                return 0;
+            }
         }
-        line.push_back(c);
-        if (line.size() > kMaxHeaderLine)
-            return ""; // line too long
+        uint32_t v = static_cast<uint32_t>(bitbuf_ & ((uint64_t(1) << n) - 1));
+        bitbuf_ >>= n;
+        bitcnt_ -= n;
+        return v;
     }
-    return line;
-}
 
-bool read_request(SOCKET s, HttpRequest &req)
-{
-    std::string request_line = read_line(s);
-    if (request_line.empty())
-        return false;
-    std::istringstream rl(request_line);
-    rl >> req.method >> req.path;
-    if (req.method.empty() || req.path.empty())
-        return false;
-    size_t header_count = 0;
-    while (true)
+    // Returns false for over-subscribed code sets; incomplete sets are allowed
+    // (a lone distance code is legal).
+    static bool build(Huffman &h, const uint8_t *lengths, int n)
     {
-        std::string header_line = read_line(s);
-        if (header_line.empty())
-            break;
-        if (++header_count > kMaxHeaders)
-            return false;
-        size_t colon = header_line.find(':');
-        if (colon == std::string::npos)
-            continue;
-        std::string key = header_line.substr(0, colon);
-        std::string val = header_line.substr(colon + 1);
-        while (!val.empty() && (val.front() == ' ' || val.front() == '\t'))
-            val.erase(val.begin());
-        req.headers[key] = val;
+        std::memset(h.count, 0, sizeof(h.count));
+        std::memset(h.fast, 0, sizeof(h.fast));
+        for (int i = 0; i < n; ++i)
+            h.count[lengths[i]]++;
+        h.count[0] = 0;
+        int left = 1;
+        for (int len = 1; len <= kMaxBits; ++len)
+        {
+            left <<= 1;
+            left -= h.count[len];
+            if (left < 0)
+                return false;
+        }
+        int16_t offs[kMaxBits + 1];
+        offs[1] = 0;
+        for (int len = 1; len < kMaxBits; ++len)
+            offs[len + 1] = static_cast<int16_t>(offs[len] + h.count[len]);
+        for (int i = 0; i < n; ++i)
+        {
+            if (lengths[i])
+                h.symbol[offs[lengths[i]]++] = static_cast<int16_t>(i);
+        }
+        // Canonical codes, bit-reversed into the fast table.
+        int code = 0;
+        int index = 0;
+        for (int len = 1; len <= kFastBits; ++len)
+        {
+            for (int k = 0; k < h.count[len]; ++k, ++code, ++index)
+            {
+                int rev = 0;
+                for (int b = 0; b < len; ++b)
+                    rev |= ((code >> b) & 1) << (len - 1 - b);
+                for (int fill = rev; fill < (1 << kFastBits); fill += 1 << len)
+                    h.fast[fill] = static_cast<uint16_t>((len << 9) | h.symbol[index]);
+            }
+            code <<= 1;
+        }
+        return true;
     }
-    auto it = req.headers.find("Content-Length");
-    if (it != req.headers.end())
+
+    int decode(const Huffman &h)
     {
-        long long len = 0;
-        try
+        if (bitcnt_ < kFastBits)
+            refill();
+        uint16_t e = h.fast[bitbuf_ & ((1u << kFastBits) - 1)];
+        if (e && (e >> 9) <= bitcnt_)
         {
-            len = std::stoll(it->second);
+            bitbuf_ >>= (e >> 9);
+            bitcnt_ -= (e >> 9);
+            return e & 0x1FF;
         }
-        catch (...)
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len <= kMaxBits; ++len)
         {
+            code |= static_cast<int>(bits(1));
+            if (err_)
+                return -1;
+            int count = h.count[len];
+            if (code - count < first)
+                return h.symbol[index + (code - first)];
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    bool stored(std::string &out)
+    {
+        bitbuf_ >>= (bitcnt_ & 7);
+        bitcnt_ -= (bitcnt_ & 7);
+        uint32_t n = bits(16);
+        uint32_t cmp = bits(16);
+        if (err_ || n != (~cmp & 0xFFFF) || n > limit_ - out.size())
             return false;
+        while (n && bitcnt_ >= 8)
+        {
+            out.push_back(static_cast<char>(bits(8)));
+            --n;
         }
-        if (len < 0 || static_cast<size_t>(len) > kMaxBodyBytes)
+        if (pos_ + n > len_)
             return false;
-        req.body.resize(static_cast<size_t>(len));
-        size_t received = 0;
-        while (received < static_cast<size_t>(len))
+        out.append(reinterpret_cast<const char *>(src_ + pos_), n);
+        pos_ += n;
+        return true;
+    }
+
+    bool codes(std::string &out, const Huffman &lit, const Huffman &dist)
+    {
+        static const uint16_t kLenBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t kLenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t kDistBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const uint8_t kDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        for (;;)
         {
-            int r = recv(s, &req.body[received], static_cast<int>(len - received), 0);
-            if (r <= 0)
+            int sym = decode(lit);
+            if (sym < 0)
                 return false;
-            received += static_cast<size_t>(r);
+            if (sym < 256)
+            {
+                if (out.size() == limit_)
+                    return false;
+                out.push_back(static_cast<char>(sym));
+                continue;
+            }
+            if (sym == 256)
+                return true;
+            sym -= 257;
+            if (sym >= 29)
+                return false;
+            size_t length = kLenBase[sym] + bits(kLenExtra[sym]);
+            int dsym = decode(dist);
+            if (dsym < 0 || dsym >= 30)
+                return false;
+            size_t distance = kDistBase[dsym] + bits(kDistExtra[dsym]);
+            if (err_ || distance > out.size() || length > limit_ - out.size())
+                return false;
+            size_t from = out.size() - distance;
+            for (size_t i = 0; i < length; ++i)
+                out.push_back(out[from + i]);
         }
     }
-    return true;
-}
-
-void send_response(SOCKET s, const HttpResponse &resp)
-{
-    std::ostringstream oss;
-    oss << "HTTP/1.1 " << resp.status << "\r\n";
-    oss << "Content-Type: " << resp.content_type << "\r\n";
-    oss << "Content-Length: " << resp.body.size() << "\r\n";
-    oss << "Access-Control-Allow-Origin: *\r\n";
-    oss << "Access-Control-Allow-Headers: Content-Type, Authorization\r\n";
-    oss << "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n";
-    oss << "Connection: close\r\n\r\n";
-    oss << resp.body;
-    std::string data = oss.str();
-    send(s, data.c_str(), static_cast<int>(data.size()), 0);
-}
 
-// -------------------- App management --------------------
-struct AppInfo
+    bool fixed(std::string &out)
+    {
+        static Huffman lit, dist;
+        static bool built = [&]()
+        {
+            uint8_t lengths[288];
+            int i = 0;
+            for (; i < 144; ++i)
+                lengths[i] = 8;
+            for (; i < 256; ++i)
+                lengths[i] = 9;
+            for (; i < 280; ++i)
+                lengths[i] = 7;
+            for (; i < 288; ++i)
+                lengths[i] = 8;
+            build(lit, lengths, 288);
+            for (i = 0; i < 30; ++i)
+                lengths[i] = 5;
+            build(dist, lengths, 30);
+            return true;
+        }();
+        (void)built;
+        return codes(out, lit, dist);
+    }
+
+    bool dynamic(std::string &out)
+    {
+        static const uint8_t kOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        int nlen = static_cast<int>(bits(5)) + 257;
+        int ndist = static_cast<int>(bits(5)) + 1;
+        int ncode = static_cast<int>(bits(4)) + 4;
+        if (err_ || nlen > 286 || ndist > 30)
+            return false;
+        uint8_t lengths[320] = {};
+        for (int i = 0; i < ncode; ++i)
+            lengths[kOrder[i]] = static_cast<uint8_t>(bits(3));
+        Huffman lencode;
+        if (!build(lencode, lengths, 19))
+            return false;
+        int index = 0;
+        while (index < nlen + ndist)
+        {
+            int sym = decode(lencode);
+            if (sym < 0)
+                return false;
+            if (sym < 16)
+            {
+                lengths[index++] = static_cast<uint8_t>(sym);
+                continue;
+            }
+            uint8_t len = 0;
+            int repeat;
+            if (sym == 16)
+            {
+                if (index == 0)
+                    return false;
+                len = lengths[index - 1];
+                repeat = 3 + static_cast<int>(bits(2));
+            }
+            else if (sym == 17)
+            {
+                repeat = 3 + static_cast<int>(bits(3));
+            }
+            else
+            {
+                repeat = 11 + static_cast<int>(bits(7));
+            }
+            if (index + repeat > nlen + ndist)
+                return false;
+            while (repeat--)
+                lengths[index++] = len;
+        }
+        if (lengths[256] == 0)
+            return false;
+        Huffman lit, dist;
+        if (!build(lit, lengths, nlen) || !build(dist, lengths + nlen, ndist))
+            return false;
+        return codes(out, lit, dist);
+    }
+
+    const uint8_t *src_;
+    size_t len_;
+    size_t limit_;
+    size_t pos_ = 0;
+    uint64_t bitbuf_ = 0;
+    int bitcnt_ = 0;
+    bool err_ = false;
+};
+
+class ZipArchive
 {
-    std::string name;
-    int version = 1;
-    std::string description;
+public:
+    bool open(const fs::path &path, std::string &err)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            err = "cannot open file";
+            return false;
+        }
+        std::ostringstream buf;
+        buf << in.rdbuf();
+        data_ = buf.str();
+        const size_t n = data_.size();
+        if (n < 22)
+        {
+            err = "not a zip archive";
+            return false;
+        }
+        size_t eocd = std::string::npos;
+        size_t stop = n > 22 + 65535 ? n - 22 - 65535 : 0;
+        for (size_t i = n - 22 + 1; i-- > stop;)
+        {
+            if (u32(i) == 0x06054b50)
+            {
+                eocd = i;
+                break;
+            }
+        }
+        if (eocd == std::string::npos)
+        {
+            err = "not a zip archive";
+            return false;
+        }
+        size_t count = u16(eocd + 10);
+        size_t pos = u32(eocd + 16);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (pos + 46 > n || u32(pos) != 0x02014b50)
+            {
+                err = "corrupt zip directory";
+                return false;
+            }
+            Entry e;
+            e.method = u16(pos + 10);
+            e.comp_size = u32(pos + 20);
+            e.size = u32(pos + 24);
+            size_t name_len = u16(pos + 28);
+            size_t extra_len = u16(pos + 30);
+            size_t comment_len = u16(pos + 32);
+            e.local_offset = u32(pos + 42);
+            if (pos + 46 + name_len > n)
+            {
+                err = "corrupt zip directory";
+                return false;
+            }
+            std::string name = data_.substr(pos + 46, name_len);
+            std::replace(name.begin(), name.end(), '\\', '/');
+            entries_[to_lower(name)] = e;
+            pos += 46 + name_len + extra_len + comment_len;
+        }
+        return true;
+    }
+
+    bool contains(const std::string &name) const
+    {
+        return entries_.count(to_lower(name)) > 0;
+    }
+
+    // Part names, lower-cased.
+    std::vector<std::string> names() const
+    {
+        std::vector<std::string> out;
+        out.reserve(entries_.size());
+        for (const auto &kv : entries_)
+            out.push_back(kv.first);
+        return out;
+    }
+
+    bool read(const std::string &name, std::string &out) const
+    {
+        auto it = entries_.find(to_lower(name));
+        if (it == entries_.end())
+            return false;
+        const Entry &e = it->second;
+        size_t lh = e.local_offset;
+        if (lh + 30 > data_.size() || u32(lh) != 0x04034b50)
+            return false;
+        size_t start = lh + 30 + u16(lh + 26) + u16(lh + 28);
+        if (start + e.comp_size > data_.size() || e.size > kMaxPartBytes || e.comp_size > kMaxPartBytes)
+            return false;
+        const uint8_t *src = reinterpret_cast<const uint8_t *>(data_.data()) + start;
+        if (e.method == 0)
+        {
+            out.assign(reinterpret_cast<const char *>(src), e.comp_size);
+            return true;
+        }
+        if (e.method == 8)
+            return Inflater::inflate(src, e.comp_size, out, e.size) && out.size() == e.size;
+        return false;
+    }
+
+private:
+    // Largest part read, whatever the directory declares.
+    static const uint32_t kMaxPartBytes = 256u << 20;
+
+    struct Entry
+    {
+        uint16_t method = 0;
+        uint32_t comp_size = 0;
+        uint32_t size = 0;
+        uint32_t local_offset = 0;
+    };
+
+    uint32_t u16(size_t at) const
+    {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data_.data()) + at;
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8);
+    }
+
+    uint32_t u32(size_t at) const
+    {
+        return u16(at) | (u16(at + 2) << 16);
+    }
+
+    std::string data_;
+    std::unordered_map<std::string, Entry> entries_;
 };
 
-fs::path app_root()
+// -------------------- Native engine: XML scanner --------------------
+// Pull scanner for the SpreadsheetML parts we read. Reports start tags (with
+// attributes), end tags and character data; self-closing tags produce both a
+// start and an end event. Comments, PIs and DOCTYPE are skipped and names are
+// matched without their namespace prefix.
+class XmlScanner
 {
-    return fs::path("app");
+public:
+    enum class Event
+    {
+        Start,
+        End,
+        Text,
+        Eof,
+        Error
+    };
+
+    explicit XmlScanner(const std::string &doc) : doc_(doc) {}
+
+    Event next()
+    {
+        if (pending_end_)
+        {
+            pending_end_ = false;
+            return Event::End;
+        }
+        const size_t n = doc_.size();
+        while (pos_ < n)
+        {
+            if (doc_[pos_] != '<')
+            {
+                size_t lt = doc_.find('<', pos_);
+                if (lt == std::string::npos)
+                    lt = n;
+                text_b_ = pos_;
+                text_e_ = lt;
+                cdata_ = false;
+                pos_ = lt;
+                return Event::Text;
+            }
+            if (doc_.compare(pos_, 4, "<!--") == 0)
+            {
+                size_t e = doc_.find("-->", pos_ + 4);
+                pos_ = e == std::string::npos ? n : e + 3;
+                continue;
+            }
+            if (doc_.compare(pos_, 9, "<![CDATA[") == 0)
+            {
+                size_t e = doc_.find("]]>", pos_ + 9);
+                if (e == std::string::npos)
+                    return Event::Error;
+                text_b_ = pos_ + 9;
+                text_e_ = e;
+                cdata_ = true;
+                pos_ = e + 3;
+                return Event::Text;
+            }
+            if (pos_ + 1 < n && (doc_[pos_ + 1] == '?' || doc_[pos_ + 1] == '!'))
+            {
+                size_t e = doc_.find('>', pos_);
+                pos_ = e == std::string::npos ? n : e + 1;
+                continue;
+            }
+            bool closing = pos_ + 1 < n && doc_[pos_ + 1] == '/';
+            size_t p = pos_ + (closing ? 2 : 1);
+            size_t name_b = p;
+            while (p < n && !is_space(doc_[p]) && doc_[p] != '>' && doc_[p] != '/')
+                ++p;
+            set_name(name_b, p);
+            attrs_.clear();
+            if (closing)
+            {
+                size_t e = doc_.find('>', p);
+                if (e == std::string::npos)
+                    return Event::Error;
+                pos_ = e + 1;
+                return Event::End;
+            }
+            for (;;)
+            {
+                while (p < n && is_space(doc_[p]))
+                    ++p;
+                if (p >= n)
+                    return Event::Error;
+                if (doc_[p] == '>')
+                {
+                    pos_ = p + 1;
+                    return Event::Start;
+                }
+                if (doc_[p] == '/')
+                {
+                    if (p + 1 >= n || doc_[p + 1] != '>')
+                        return Event::Error;
+                    pos_ = p + 2;
+                    pending_end_ = true;
+                    return Event::Start;
+                }
+                Attr a;
+                a.name_b = p;
+                while (p < n && doc_[p] != '=' && !is_space(doc_[p]) && doc_[p] != '>')
+                    ++p;
+                a.name_e = p;
+                while (p < n && is_space(doc_[p]))
+                    ++p;
+                if (p >= n || doc_[p] != '=')
+                    return Event::Error;
+                ++p;
+                while (p < n && is_space(doc_[p]))
+                    ++p;
+                if (p >= n || (doc_[p] != '"' && doc_[p] != '\''))
+                    return Event::Error;
+                char q = doc_[p++];
+                size_t e = doc_.find(q, p);
+                if (e == std::string::npos)
+                    return Event::Error;
+                a.val_b = p;
+                a.val_e = e;
+                attrs_.push_back(a);
+                p = e + 1;
+            }
+        }
+        return Event::Eof;
+    }
+
+    // Local name of the current start or end tag.
+    bool is(const char *local) const
+    {
+        size_t len = std::strlen(local);
+        return name_e_ - name_b_ == len && doc_.compare(name_b_, len, local) == 0;
+    }
+
+    std::string name() const { return doc_.substr(name_b_, name_e_ - name_b_); }
+
+    bool attr(const char *local, std::string &out) const
+    {
+        size_t len = std::strlen(local);
+        for (const auto &a : attrs_)
+        {
+            size_t b = a.name_b;
+            for (size_t i = a.name_b; i < a.name_e; ++i)
+            {
+                if (doc_[i] == ':')
+                    b = i + 1;
+            }
+            if (a.name_e - b == len && doc_.compare(b, len, local) == 0)
+            {
+                out.clear();
+                decode(a.val_b, a.val_e, out);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string attr_or(const char *local, const std::string &def = "") const
+    {
+        std::string v;
+        return attr(local, v) ? v : def;
+    }
+
+    void append_text(std::string &out) const
+    {
+        if (cdata_)
+            out.append(doc_, text_b_, text_e_ - text_b_);
+        else
+            decode(text_b_, text_e_, out);
+    }
+
+    // Skips to the end tag matching the start tag just returned.
+    void skip_element()
+    {
+        int depth = 1;
+        while (depth > 0)
+        {
+            Event e = next();
+            if (e == Event::Start)
+                ++depth;
+            else if (e == Event::End)
+                --depth;
+            else if (e == Event::Eof || e == Event::Error)
+                return;
+        }
+    }
+
+private:
+    struct Attr
+    {
+        size_t name_b, name_e, val_b, val_e;
+    };
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+    void set_name(size_t b, size_t e)
+    {
+        name_b_ = b;
+        for (size_t i = b; i < e; ++i)
+        {
+            if (doc_[i] == ':')
+                name_b_ = i + 1;
+        }
+        name_e_ = e;
+    }
+
+    static void append_utf8(uint32_t cp, std::string &out)
+    {
+        if (cp < 0x80)
+        {
+            out.push_back(static_cast<char>(cp));
+        }
+        else if (cp < 0x800)
+        {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else if (cp < 0x10000)
+        {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else
+        {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    void decode(size_t b, size_t e, std::string &out) const
+    {
+        for (size_t i = b; i < e; ++i)
+        {
+            char c = doc_[i];
+            if (c != '&')
+            {
+                out.push_back(c);
+                continue;
+            }
+            size_t semi = doc_.find(';', i);
+            if (semi == std::string::npos || semi >= e)
+            {
+                out.push_back(c);
+                continue;
+            }
+            std::string ent = doc_.substr(i + 1, semi - i - 1);
+            if (ent == "amp")
+                out.push_back('&');
+            else if (ent == "lt")
+                out.push_back('<');
+            else if (ent == "gt")
+                out.push_back('>');
+            else if (ent == "quot")
+                out.push_back('"');
+            else if (ent == "apos")
+                out.push_back('\'');
+            else if (!ent.empty() && ent[0] == '#')
+            {
+                bool hex = ent.size() > 1 && (ent[1] == 'x' || ent[1] == 'X');
+                append_utf8(static_cast<uint32_t>(std::strtoul(ent.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10)), out);
+            }
+            else
+            {
+                out.append(doc_, i, semi - i + 1);
+            }
+            i = semi;
+        }
+    }
+
+    const std::string &doc_;
+    size_t pos_ = 0;
+    size_t name_b_ = 0, name_e_ = 0;
+    size_t text_b_ = 0, text_e_ = 0;
+    bool cdata_ = false;
+    bool pending_end_ = false;
+    std::vector<Attr> attrs_;
+};
+
+// -------------------- Native engine: values and formulas --------------------
+// In-process evaluation of .xlsx workbooks. Formulas are parsed into an
+// expression pool; shared formulas keep one tree and evaluate relative
+// references against each cell's offset from the anchor.
+
+static const uint32_t kSheetMaxRows = 1048576;
+static const uint32_t kSheetMaxCols = 16384;
+
+enum class CellError : uint8_t
+{
+    Null,
+    Div0,
+    Value,
+    Ref,
+    Name,
+    Num,
+    NA
+};
+
+struct CellValue
+{
+    enum Type : uint8_t
+    {
+        Empty,
+        Number,
+        Text,
+        Bool,
+        Error
+    };
+    Type type = Empty;
+    CellError error = CellError::Value;
+    double num = 0.0; // Number, or 0/1 for Bool
+    std::string text;
+
+    static CellValue number(double d)
+    {
+        CellValue v;
+        v.type = Number;
+        v.num = d;
+        return v;
+    }
+    static CellValue string(std::string s)
+    {
+        CellValue v;
+        v.type = Text;
+        v.text = std::move(s);
+        return v;
+    }
+    static CellValue boolean(bool b)
+    {
+        CellValue v;
+        v.type = Bool;
+        v.num = b ? 1.0 : 0.0;
+        return v;
+    }
+    static CellValue err(CellError e)
+    {
+        CellValue v;
+        v.type = Error;
+        v.error = e;
+        return v;
+    }
+};
+
+// A block of cells in row-major order, as handed to the binary encoder.
+// Date cells are flagged and hold days since 1970-01-01 rather than a
+// workbook serial.
+struct CellGrid
+{
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    std::vector<CellValue> values;
+    std::vector<uint8_t> dates;
+};
+
+const char *cell_error_text(CellError e)
+{
+    switch (e)
+    {
+    case CellError::Null:
+        return "#NULL!";
+    case CellError::Div0:
+        return "#DIV/0!";
+    case CellError::Ref:
+        return "#REF!";
+    case CellError::Name:
+        return "#NAME?";
+    case CellError::Num:
+        return "#NUM!";
+    case CellError::NA:
+        return "#N/A";
+    default:
+        return "#VALUE!";
+    }
 }
 
-bool ensure_dir(const fs::path &p)
+bool parse_cell_error(const std::string &s, CellError &out)
 {
-    std::error_code ec;
-    if (fs::exists(p, ec))
-        return true;
-    return fs::create_directories(p, ec);
+    static const std::pair<const char *, CellError> kErrors[] = {
+        {"#NULL!", CellError::Null}, {"#DIV/0!", CellError::Div0}, {"#VALUE!", CellError::Value}, {"#REF!", CellError::Ref}, {"#NAME?", CellError::Name}, {"#NUM!", CellError::Num}, {"#N/A", CellError::NA}};
+    for (const auto &e : kErrors)
+    {
+        if (s == e.first)
+        {
+            out = e.second;
+            return true;
+        }
+    }
+    return false;
 }
 
-bool is_safe_name(const std::string &name)
+// Rectangular block of cells on one sheet, zero-based and inclusive.
+struct CellArea
 {
-    if (name.empty() || name.size() > 128)
-        return false;
-    for (char c : name)
+    uint32_t sheet = 0;
+    uint32_t r1 = 0, c1 = 0, r2 = 0, c2 = 0;
+
+    bool contains(uint32_t s, uint32_t r, uint32_t c) const
     {
-        if (!(isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.' || c == ' '))
+        return s == sheet && r >= r1 && r <= r2 && c >= c1 && c <= c2;
+    }
+    uint64_t cell_count() const { return uint64_t(r2 - r1 + 1) * (c2 - c1 + 1); }
+};
+
+// "AB12" / "$AB$12" -> zero-based row/col. Either part may be absent when
+// allow_partial is set (whole-column "A" or whole-row "12" references).
+bool parse_a1(const std::string &s, size_t &pos, uint32_t &row, uint32_t &col, bool &row_abs, bool &col_abs, bool &has_row, bool &has_col)
+{
+    size_t p = pos;
+    col_abs = row_abs = has_row = has_col = false;
+    if (p < s.size() && s[p] == '$')
+    {
+        col_abs = true;
+        ++p;
+    }
+    uint32_t c = 0;
+    size_t letters = 0;
+    while (p < s.size() && std::isalpha(static_cast<unsigned char>(s[p])) && letters < 4)
+    {
+        c = c * 26 + static_cast<uint32_t>(std::toupper(static_cast<unsigned char>(s[p])) - 'A' + 1);
+        ++p;
+        ++letters;
+    }
+    if (letters == 0 && col_abs)
+    {
+        // "$12" is an absolute row
+        col_abs = false;
+        row_abs = true;
+    }
+    else if (letters > 0)
+    {
+        if (letters > 3 || c > kSheetMaxCols)
             return false;
+        has_col = true;
+        col = c - 1;
+        if (p < s.size() && s[p] == '$')
+        {
+            row_abs = true;
+            ++p;
+        }
     }
-    if (name.find("..") != std::string::npos)
+    uint64_t r = 0;
+    size_t digits = 0;
+    while (p < s.size() && std::isdigit(static_cast<unsigned char>(s[p])) && digits < 8)
+    {
+        r = r * 10 + static_cast<uint64_t>(s[p] - '0');
+        ++p;
+        ++digits;
+    }
+    if (digits > 0)
+    {
+        if (r == 0 || r > kSheetMaxRows)
+            return false;
+        has_row = true;
+        row = static_cast<uint32_t>(r - 1);
+    }
+    else if (row_abs && !has_col)
+    {
         return false;
-    return name.find_first_of("/\\") == std::string::npos;
+    }
+    if (!has_row && !has_col)
+        return false;
+    if (p < s.size() && (std::isalnum(static_cast<unsigned char>(s[p])) || s[p] == '_' || s[p] == '.'))
+        return false;
+    pos = p;
+    return true;
 }
 
-std::string to_lower(const std::string &s)
+std::string column_name(uint32_t col)
 {
     std::string out;
-    out.reserve(s.size());
-    for (char c : s)
-        out.push_back(static_cast<char>(::tolower(static_cast<unsigned char>(c))));
+    for (uint32_t c = col + 1; c > 0; c = (c - 1) / 26)
+        out.insert(out.begin(), static_cast<char>('A' + (c - 1) % 26));
     return out;
 }
 
-std::string normalize_sheet_key(const std::string &name)
-{
-    return to_lower(trim(name));
-}
+// Plain "A1" or "A1:C3" (no sheet prefix) -> area on the given sheet.
+bool parse_area_address(const std::string &text, uint32_t sheet, CellArea &out)
+{
+    std::string s = trim(text);
+    size_t pos = 0;
+    uint32_t r1 = 0, c1 = 0, r2 = 0, c2 = 0;
+    bool ra, ca, hr, hc;
+    if (!parse_a1(s, pos, r1, c1, ra, ca, hr, hc) || !hr || !hc)
+        return false;
+    r2 = r1;
+    c2 = c1;
+    if (pos < s.size())
+    {
+        if (s[pos] != ':')
+            return false;
+        ++pos;
+        if (!parse_a1(s, pos, r2, c2, ra, ca, hr, hc) || !hr || !hc || pos != s.size())
+            return false;
+    }
+    out.sheet = sheet;
+    out.r1 = std::min(r1, r2);
+    out.r2 = std::max(r1, r2);
+    out.c1 = std::min(c1, c2);
+    out.c2 = std::max(c1, c2);
+    return true;
+}
+
+// Names and other ranges that are not an A1 block count as one cell.
+double range_read_cost(const std::string &range)
+{
+    CellArea area;
+    if (!parse_area_address(sanitize_range_address(range), 0, area))
+        return 1.0;
+    return 1.0 + static_cast<double>(area.cell_count()) / 4096.0;
+}
+
+enum class ExprOp : uint8_t
+{
+    Literal,
+    Ref,
+    Array,
+    Missing, // omitted argument, e.g. IF(A1,,2)
+    Neg,
+    Percent,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Pow,
+    Concat,
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+    Call
+};
+
+// Reference flags: which corners are absolute (not shifted for shared formulas).
+enum : uint8_t
+{
+    kRefRow1Abs = 1,
+    kRefCol1Abs = 2,
+    kRefRow2Abs = 4,
+    kRefCol2Abs = 8
+};
+
+struct Expr
+{
+    ExprOp op = ExprOp::Literal;
+    uint8_t ref_flags = 0;
+    uint16_t func = 0;          // index into the function table for Call
+    uint32_t rows = 0, cols = 0; // Array constant shape
+    std::vector<uint32_t> args; // operands, call arguments or array elements
+    CellValue value;            // Literal
+    CellArea area;              // Ref, at the anchor cell
+};
+
+class NativeWorkbook;
+struct EvalContext;
+struct Operand;
+
+typedef Operand (*NativeFunction)(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx);
+
+enum : uint8_t
+{
+    kFnVolatile = 1, // recalculated after every edit
+};
+
+struct FunctionDef
+{
+    const char *name;
+    uint8_t min_args;
+    uint8_t max_args; // 255 = unbounded
+    uint8_t flags;
+    NativeFunction fn;
+};
+
+const FunctionDef *find_function(const std::string &upper_name, uint16_t &index);
+const FunctionDef &function_at(uint16_t index);
+
+// Converts formula text (without the leading '=') to Expr nodes.
+class FormulaParser
+{
+public:
+    struct Env
+    {
+        std::function<bool(const std::string &, uint32_t &)> sheet_index;
+        std::function<bool(const std::string &, uint32_t, std::string &)> defined_name; // name, current sheet -> formula text
+    };
+
+    // Excel's own limits. Every '(' and sign recurses once more, in parsing
+    // and in evaluation, so nesting is what bounds the stack.
+    static const size_t kMaxFormulaChars = 8192;
+    static const int kMaxNesting = 64;
+
+    FormulaParser(std::vector<Expr> &pool, const Env &env, uint32_t sheet, uint32_t row, uint32_t col)
+        : pool_(pool), env_(env), sheet_(sheet), row_(row), col_(col) {}
+
+    bool parse(const std::string &text, uint32_t &root, std::string &err)
+    {
+        if (text.size() > kMaxFormulaChars &&
+            static_cast<size_t>(std::count_if(text.begin(), text.end(), [](char c)
+                                              { return (static_cast<unsigned char>(c) & 0xC0) != 0x80; })) > kMaxFormulaChars)
+        {
+            err = "formula longer than " + std::to_string(kMaxFormulaChars) + " characters";
+            return false;
+        }
+        s_ = text;
+        pos_ = 0;
+        err_.clear();
+        root = parse_comparison();
+        skip_ws();
+        if (err_.empty() && pos_ < s_.size())
+            fail("unexpected '" + s_.substr(pos_, 1) + "'");
+        err = err_;
+        return err_.empty();
+    }
+
+    bool is_volatile() const { return volatile_; }
+
+private:
+    uint32_t add(Expr e)
+    {
+        pool_.push_back(std::move(e));
+        return static_cast<uint32_t>(pool_.size() - 1);
+    }
+
+    uint32_t fail(const std::string &msg)
+    {
+        if (err_.empty())
+            err_ = msg + " at " + std::to_string(pos_);
+        return 0;
+    }
+
+    void skip_ws()
+    {
+        while (pos_ < s_.size() && (s_[pos_] == ' ' || s_[pos_] == '\n' || s_[pos_] == '\r' || s_[pos_] == '\t'))
+            ++pos_;
+    }
+
+    bool eat(char c)
+    {
+        skip_ws();
+        if (pos_ < s_.size() && s_[pos_] == c)
+        {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    uint32_t binary(ExprOp op, uint32_t a, uint32_t b)
+    {
+        Expr e;
+        e.op = op;
+        e.args = {a, b};
+        return add(std::move(e));
+    }
+
+    uint32_t parse_comparison()
+    {
+        uint32_t left = parse_concat();
+        for (;;)
+        {
+            skip_ws();
+            if (!err_.empty() || pos_ >= s_.size())
+                return left;
+            ExprOp op;
+            if (s_.compare(pos_, 2, "<>") == 0)
+                op = ExprOp::Ne, pos_ += 2;
+            else if (s_.compare(pos_, 2, "<=") == 0)
+                op = ExprOp::Le, pos_ += 2;
+            else if (s_.compare(pos_, 2, ">=") == 0)
+                op = ExprOp::Ge, pos_ += 2;
+            else if (s_[pos_] == '=')
+                op = ExprOp::Eq, ++pos_;
+            else if (s_[pos_] == '<')
+                op = ExprOp::Lt, ++pos_;
+            else if (s_[pos_] == '>')
+                op = ExprOp::Gt, ++pos_;
+            else
+                return left;
+            left = binary(op, left, parse_concat());
+        }
+    }
+
+    uint32_t parse_concat()
+    {
+        uint32_t left = parse_additive();
+        while (err_.empty() && eat('&'))
+            left = binary(ExprOp::Concat, left, parse_additive());
+        return left;
+    }
+
+    uint32_t parse_additive()
+    {
+        uint32_t left = parse_multiplicative();
+        for (;;)
+        {
+            if (!err_.empty())
+                return left;
+            if (eat('+'))
+                left = binary(ExprOp::Add, left, parse_multiplicative());
+            else if (eat('-'))
+                left = binary(ExprOp::Sub, left, parse_multiplicative());
+            else
+                return left;
+        }
+    }
+
+    uint32_t parse_multiplicative()
+    {
+        uint32_t left = parse_power();
+        for (;;)
+        {
+            if (!err_.empty())
+                return left;
+            if (eat('*'))
+                left = binary(ExprOp::Mul, left, parse_power());
+            else if (eat('/'))
+                left = binary(ExprOp::Div, left, parse_power());
+            else
+                return left;
+        }
+    }
+
+    // Excel binds unary minus tighter than ^ (-2^2 = 4) and ^ is left-associative.
+    uint32_t parse_power()
+    {
+        uint32_t left = parse_unary();
+        while (err_.empty() && eat('^'))
+            left = binary(ExprOp::Pow, left, parse_unary());
+        return left;
+    }
+
+    uint32_t parse_unary()
+    {
+        if (nesting_ >= kMaxNesting)
+            return fail("more than " + std::to_string(kMaxNesting) + " levels of nesting");
+        ++nesting_;
+        uint32_t v = parse_signed();
+        --nesting_;
+        return v;
+    }
+
+    uint32_t parse_signed()
+    {
+        if (eat('-'))
+        {
+            Expr e;
+            e.op = ExprOp::Neg;
+            e.args = {parse_unary()};
+            return add(std::move(e));
+        }
+        if (eat('+'))
+            return parse_unary();
+        uint32_t v = parse_primary();
+        while (err_.empty() && eat('%'))
+        {
+            Expr e;
+            e.op = ExprOp::Percent;
+            e.args = {v};
+            v = add(std::move(e));
+        }
+        return v;
+    }
+
+    uint32_t literal(CellValue v)
+    {
+        Expr e;
+        e.op = ExprOp::Literal;
+        e.value = std::move(v);
+        return add(std::move(e));
+    }
+
+    bool parse_number_literal(double &out)
+    {
+        size_t p = pos_;
+        while (p < s_.size() && (std::isdigit(static_cast<unsigned char>(s_[p])) || s_[p] == '.'))
+            ++p;
+        if (p < s_.size() && (s_[p] == 'e' || s_[p] == 'E'))
+        {
+            size_t q = p + 1;
+            if (q < s_.size() && (s_[q] == '+' || s_[q] == '-'))
+                ++q;
+            if (q < s_.size() && std::isdigit(static_cast<unsigned char>(s_[q])))
+            {
+                p = q;
+                while (p < s_.size() && std::isdigit(static_cast<unsigned char>(s_[p])))
+                    ++p;
+            }
+        }
+        if (p == pos_)
+            return false;
+        std::string num = s_.substr(pos_, p - pos_);
+        char *end = nullptr;
+        out = std::strtod(num.c_str(), &end);
+        if (!end || *end != '\0')
+            return false;
+        pos_ = p;
+        return true;
+    }
+
+    // Tries "A1", "A1:B2", "A:C" or "1:3" at pos_ for the given sheet.
+    bool try_reference(uint32_t sheet, uint32_t &node)
+    {
+        uint32_t r1 = 0, c1 = 0, r2 = 0, c2 = 0;
+        bool ra1, ca1, hr1, hc1, ra2 = false, ca2 = false, hr2 = false, hc2 = false;
+        size_t p = pos_;
+        if (!parse_a1(s_, p, r1, c1, ra1, ca1, hr1, hc1))
+            return false;
+        bool range = false;
+        if (p < s_.size() && s_[p] == ':')
+        {
+            size_t q = p + 1;
+            if (parse_a1(s_, q, r2, c2, ra2, ca2, hr2, hc2) && hr2 == hr1 && hc2 == hc1)
+            {
+                range = true;
+                p = q;
+            }
+        }
+        if (!range)
+        {
+            if (!hr1 || !hc1)
+                return false;
+            r2 = r1, c2 = c1, ra2 = ra1, ca2 = ca1, hr2 = hr1, hc2 = hc1;
+        }
+        // A bare identifier followed by '(' is a function (e.g. LOG10).
+        size_t q = p;
+        while (q < s_.size() && s_[q] == ' ')
+            ++q;
+        if (q < s_.size() && s_[q] == '(')
+            return false;
+        Expr e;
+        e.op = ExprOp::Ref;
+        e.area.sheet = sheet;
+        if (!hr1)
+        {
+            // Whole columns: rows are implicitly absolute.
+            r1 = 0, r2 = kSheetMaxRows - 1, ra1 = ra2 = true;
+        }
+        if (!hc1)
+        {
+            c1 = 0, c2 = kSheetMaxCols - 1, ca1 = ca2 = true;
+        }
+        e.area.r1 = r1, e.area.c1 = c1, e.area.r2 = r2, e.area.c2 = c2;
+        e.ref_flags = static_cast<uint8_t>((ra1 ? kRefRow1Abs : 0) | (ca1 ? kRefCol1Abs : 0) | (ra2 ? kRefRow2Abs : 0) | (ca2 ? kRefCol2Abs : 0));
+        pos_ = p;
+        node = add(std::move(e));
+        return true;
+    }
+
+    uint32_t parse_array()
+    {
+        Expr e;
+        e.op = ExprOp::Array;
+        uint32_t row_cols = 0;
+        e.rows = 1;
+        for (;;)
+        {
+            skip_ws();
+            CellValue v;
+            bool neg = eat('-');
+            skip_ws();
+            double d;
+            if (pos_ < s_.size() && s_[pos_] == '"')
+            {
+                v = CellValue::string(read_string());
+            }
+            else if (parse_number_literal(d))
+            {
+                v = CellValue::number(neg ? -d : d);
+            }
+            else
+            {
+                std::string word = read_word();
+                std::string upper = word;
+                for (auto &c : upper)
+                    c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+                CellError ce;
+                if (upper == "TRUE" || upper == "FALSE")
+                    v = CellValue::boolean(upper == "TRUE");
+                else if (parse_cell_error(upper, ce))
+                    v = CellValue::err(ce);
+                else
+                    return fail("bad array constant");
+            }
+            e.args.push_back(literal(std::move(v)));
+            ++row_cols;
+            if (eat(','))
+                continue;
+            if (eat(';'))
+            {
+                if (e.rows == 1)
+                    e.cols = row_cols;
+                else if (row_cols != e.cols)
+                    return fail("ragged array constant");
+                ++e.rows;
+                row_cols = 0;
+                continue;
+            }
+            if (eat('}'))
+                break;
+            return fail("unterminated array constant");
+        }
+        if (e.rows == 1)
+            e.cols = row_cols;
+        else if (row_cols != e.cols)
+            return fail("ragged array constant");
+        return add(std::move(e));
+    }
+
+    std::string read_string()
+    {
+        std::string out;
+        ++pos_; // opening quote
+        while (pos_ < s_.size())
+        {
+            if (s_[pos_] == '"')
+            {
+                if (pos_ + 1 < s_.size() && s_[pos_ + 1] == '"')
+                {
+                    out.push_back('"');
+                    pos_ += 2;
+                    continue;
+                }
+                ++pos_;
+                return out;
+            }
+            out.push_back(s_[pos_++]);
+        }
+        fail("unterminated string");
+        return out;
+    }
+
+    std::string read_word()
+    {
+        size_t b = pos_;
+        while (pos_ < s_.size() && (std::isalnum(static_cast<unsigned char>(s_[pos_])) || s_[pos_] == '_' || s_[pos_] == '.' ||
+                                    s_[pos_] == '\\' || s_[pos_] == '#' || s_[pos_] == '/' || s_[pos_] == '!' || s_[pos_] == '?' ||
+                                    static_cast<unsigned char>(s_[pos_]) >= 0x80))
+        {
+            // '!' and '/' only belong to error literals such as #DIV/0!.
+            if ((s_[pos_] == '!' || s_[pos_] == '/' || s_[pos_] == '?') && s_[b] != '#')
+                break;
+            ++pos_;
+        }
+        return s_.substr(b, pos_ - b);
+    }
+
+    uint32_t parse_call(const std::string &name)
+    {
+        std::string upper = name;
+        for (auto &c : upper)
+            c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        for (const char *prefix : {"_XLFN._XLWS.", "_XLFN.", "_XLWS."})
+        {
+            size_t len = std::strlen(prefix);
+            if (upper.compare(0, len, prefix) == 0)
+                upper = upper.substr(len);
+        }
+        uint16_t index = 0;
+        const FunctionDef *def = find_function(upper, index);
+        if (!def)
+            return fail("unsupported function " + upper);
+        if (def->flags & kFnVolatile)
+            volatile_ = true;
+        Expr e;
+        e.op = ExprOp::Call;
+        e.func = index;
+        ++pos_; // '('
+        skip_ws();
+        if (!eat(')'))
+        {
+            for (;;)
+            {
+                skip_ws();
+                if (pos_ < s_.size() && (s_[pos_] == ',' || s_[pos_] == ')'))
+                {
+                    Expr missing;
+                    missing.op = ExprOp::Missing;
+                    e.args.push_back(add(std::move(missing)));
+                }
+                else
+                {
+                    e.args.push_back(parse_comparison());
+                }
+                if (!err_.empty())
+                    return 0;
+                if (eat(','))
+                    continue;
+                if (eat(')'))
+                    break;
+                return fail("expected ',' or ')'");
+            }
+        }
+        if (e.args.size() < def->min_args || (def->max_args != 255 && e.args.size() > def->max_args))
+            return fail("wrong argument count for " + upper);
+        return add(std::move(e));
+    }
+
+    uint32_t parse_primary()
+    {
+        skip_ws();
+        if (pos_ >= s_.size())
+            return fail("unexpected end of formula");
+        char c = s_[pos_];
+        if (c == '(')
+        {
+            ++pos_;
+            uint32_t inner = parse_comparison();
+            if (!eat(')'))
+                return fail("expected ')'");
+            return inner;
+        }
+        if (c == '"')
+            return literal(CellValue::string(read_string()));
+        if (c == '{')
+        {
+            ++pos_;
+            return parse_array();
+        }
+        if (c == '#')
+        {
+            std::string word = read_word();
+            CellError ce;
+            if (!parse_cell_error(word, ce))
+                return fail("unknown error literal " + word);
+            return literal(CellValue::err(ce));
+        }
+        if (c == '[')
+            return fail("external references are not supported");
+        uint32_t node = 0;
+        if (c == '\'')
+        {
+            // 'Sheet name'!A1
+            std::string sheet_name;
+            ++pos_;
+            while (pos_ < s_.size())
+            {
+                if (s_[pos_] == '\'')
+                {
+                    if (pos_ + 1 < s_.size() && s_[pos_ + 1] == '\'')
+                    {
+                        sheet_name.push_back('\'');
+                        pos_ += 2;
+                        continue;
+                    }
+                    break;
+                }
+                sheet_name.push_back(s_[pos_++]);
+            }
+            if (pos_ + 1 >= s_.size() || s_[pos_ + 1] != '!')
+                return fail("expected sheet reference");
+            pos_ += 2;
+            return sheet_reference(sheet_name);
+        }
+        if (std::isdigit(static_cast<unsigned char>(c)) || c == '.')
+        {
+            // Row ranges ("1:3") look like numbers; try them first.
+            if (try_reference(sheet_, node))
+                return node;
+            double d;
+            if (!parse_number_literal(d))
+                return fail("bad number");
+            return literal(CellValue::number(d));
+        }
+        if (c == '$')
+        {
+            if (try_reference(sheet_, node))
+                return node;
+            return fail("bad reference");
+        }
+        // Identifier: sheet prefix, function, reference, boolean or defined name.
+        size_t b = pos_;
+        while (pos_ < s_.size() && (std::isalnum(static_cast<unsigned char>(s_[pos_])) || s_[pos_] == '_' || s_[pos_] == '.' ||
+                                    s_[pos_] == '\\' || static_cast<unsigned char>(s_[pos_]) >= 0x80))
+            ++pos_;
+        std::string word = s_.substr(b, pos_ - b);
+        if (word.empty())
+            return fail("unexpected '" + std::string(1, c) + "'");
+        if (pos_ < s_.size() && s_[pos_] == '!')
+        {
+            ++pos_;
+            return sheet_reference(word);
+        }
+        if (pos_ < s_.size() && s_[pos_] == ':')
+        {
+            // Sheet1:Sheet3!A1
+            size_t q = pos_ + 1;
+            while (q < s_.size() && (std::isalnum(static_cast<unsigned char>(s_[q])) || s_[q] == '_' || s_[q] == '.'))
+                ++q;
+            if (q < s_.size() && s_[q] == '!')
+                return fail("3-D references are not supported");
+        }
+        size_t after = pos_;
+        while (after < s_.size() && s_[after] == ' ')
+            ++after;
+        if (after < s_.size() && s_[after] == '(')
+        {
+            pos_ = after;
+            return parse_call(word);
+        }
+        pos_ = b;
+        if (try_reference(sheet_, node))
+            return node;
+        pos_ = b + word.size();
+        std::string upper = word;
+        for (auto &ch : upper)
+            ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+        if (upper == "TRUE" || upper == "FALSE")
+            return literal(CellValue::boolean(upper == "TRUE"));
+        return defined_name(word);
+    }
+
+    uint32_t sheet_reference(const std::string &sheet_name)
+    {
+        uint32_t sheet = 0;
+        if (!env_.sheet_index || !env_.sheet_index(sheet_name, sheet))
+            return fail("unknown sheet " + sheet_name);
+        uint32_t node = 0;
+        if (!try_reference(sheet, node))
+            return fail("bad reference after " + sheet_name + "!");
+        return node;
+    }
+
+    uint32_t defined_name(const std::string &name)
+    {
+        std::string text;
+        if (!env_.defined_name || !env_.defined_name(name, sheet_, text))
+            return fail("unknown name " + name);
+        if (depth_ > 8)
+            return fail("defined names nest too deeply");
+        FormulaParser sub(pool_, env_, sheet_, row_, col_);
+        sub.depth_ = depth_ + 1;
+        sub.nesting_ = nesting_;
+        uint32_t root = 0;
+        std::string sub_err;
+        if (!sub.parse(text, root, sub_err))
+            return fail("name " + name + ": " + sub_err);
+        volatile_ = volatile_ || sub.volatile_;
+        return root;
+    }
+
+    std::vector<Expr> &pool_;
+    Env env_;
+    uint32_t sheet_, row_, col_;
+    std::string s_;
+    size_t pos_ = 0;
+    std::string err_;
+    bool volatile_ = false;
+    int depth_ = 0;   // defined names being expanded
+    int nesting_ = 0; // open parentheses and signs
+};
+
+// -------------------- Native engine: evaluation --------------------
+
+// Function results and intermediate values: a single value, a reference that
+// is read lazily, or an array computed element-wise.
+struct Operand
+{
+    enum Kind : uint8_t
+    {
+        Scalar,
+        Range,
+        Matrix
+    };
+    Kind kind = Scalar;
+    CellValue value;
+    CellArea area;
+    uint32_t rows = 1, cols = 1;
+    std::vector<CellValue> cells; // Matrix, row-major
+
+    static Operand scalar(CellValue v)
+    {
+        Operand o;
+        o.value = std::move(v);
+        return o;
+    }
+    static Operand range(const CellArea &a)
+    {
+        Operand o;
+        o.kind = Range;
+        o.area = a;
+        o.rows = a.r2 - a.r1 + 1;
+        o.cols = a.c2 - a.c1 + 1;
+        return o;
+    }
+    static Operand matrix(uint32_t rows, uint32_t cols, std::vector<CellValue> cells)
+    {
+        Operand o;
+        o.kind = Matrix;
+        o.rows = rows;
+        o.cols = cols;
+        o.cells = std::move(cells);
+        return o;
+    }
+    bool is_error() const { return kind == Scalar && value.type == CellValue::Error; }
+};
+
+struct EvalContext
+{
+    uint32_t sheet = 0, row = 0, col = 0; // cell being calculated
+    int32_t dr = 0, dc = 0;               // shared formula offset from its anchor
+    bool array = false;                   // element-wise instead of implicit intersection
+};
+
+bool text_to_number(const std::string &text, double &out)
+{
+    std::string s = trim(text);
+    if (s.empty())
+        return false;
+    bool percent = false;
+    if (s.back() == '%')
+    {
+        percent = true;
+        s.pop_back();
+    }
+    std::string digits;
+    digits.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        // Thousands separators, as Excel accepts "1,234" in arithmetic.
+        if (s[i] == ',' && i > 0 && std::isdigit(static_cast<unsigned char>(s[i - 1])))
+            continue;
+        digits.push_back(s[i]);
+    }
+    char *end = nullptr;
+    out = std::strtod(digits.c_str(), &end);
+    if (!end || *end != '\0' || digits.empty() || !std::isfinite(out))
+        return false;
+    if (percent)
+        out /= 100.0;
+    return true;
+}
+
+// Serial dates. Excel's 1900 system counts 1900-01-01 as 1 and keeps the
+// fictitious 1900-02-29 (serial 60); the 1904 system starts at 0.
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+void civil_from_days(int64_t z, int &y, int &m, int &d)
+{
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    d = static_cast<int>(doy - (153 * mp + 2) / 5 + 1);
+    m = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+    y = static_cast<int>(static_cast<int64_t>(yoe) + era * 400 + (m <= 2));
+}
+
+double date_serial(int y, int m, int d, bool date1904)
+{
+    // Month overflow carries into the year, day overflow is plain day arithmetic.
+    int64_t ym = static_cast<int64_t>(y) * 12 + (m - 1);
+    int64_t yy = ym >= 0 ? ym / 12 : (ym - 11) / 12;
+    unsigned mm = static_cast<unsigned>(ym - yy * 12 + 1);
+    int64_t days = days_from_civil(yy, mm, 1) + (d - 1);
+    if (date1904)
+        return static_cast<double>(days - days_from_civil(1904, 1, 1));
+    int64_t serial = days - days_from_civil(1899, 12, 31);
+    if (serial >= 60)
+        ++serial; // skip the phantom leap day
+    return static_cast<double>(serial);
+}
+
+bool serial_to_date(double serial, bool date1904, int &y, int &m, int &d)
+{
+    if (!std::isfinite(serial) || serial < 0 || serial >= 2958466.0)
+        return false;
+    int64_t s = static_cast<int64_t>(std::floor(serial));
+    if (date1904)
+    {
+        civil_from_days(days_from_civil(1904, 1, 1) + s, y, m, d);
+        return true;
+    }
+    if (s == 60)
+    {
+        y = 1900, m = 2, d = 29;
+        return true;
+    }
+    if (s == 0)
+    {
+        y = 1900, m = 1, d = 0;
+        return true;
+    }
+    civil_from_days(days_from_civil(1899, 12, 31) + (s < 60 ? s : s - 1), y, m, d);
+    return true;
+}
+
+// Days since 1970-01-01 with the time of day as the fraction. Serial 0 and
+// the phantom 1900-02-29 have no calendar day and are refused.
+bool serial_to_unix_days(double serial, bool date1904, double &days)
+{
+    int y, m, d;
+    if (!serial_to_date(serial, date1904, y, m, d) || d == 0 || (y == 1900 && m == 2 && d == 29))
+        return false;
+    days = static_cast<double>(days_from_civil(y, m, d)) + (serial - std::floor(serial));
+    return true;
+}
+
+// "YYYY-MM-DD", optionally followed by a time, as accepted from clients.
+bool parse_iso_date(const std::string &text, int &y, int &m, int &d)
+{
+    std::string s = trim(text);
+    if (s.size() < 10 || s[4] != '-' || s[7] != '-')
+        return false;
+    for (size_t i : {0, 1, 2, 3, 5, 6, 8, 9})
+    {
+        if (!std::isdigit(static_cast<unsigned char>(s[i])))
+            return false;
+    }
+    if (s.size() > 10 && s[10] != 'T' && s[10] != ' ')
+        return false;
+    y = std::atoi(s.substr(0, 4).c_str());
+    m = std::atoi(s.substr(5, 2).c_str());
+    d = std::atoi(s.substr(8, 2).c_str());
+    return m >= 1 && m <= 12 && d >= 1 && d <= 31;
+}
+
+// True when a number format displays dates or times (d, m, y, h or s
+// outside quoted literals and [color]/[condition] brackets).
+bool number_format_is_date(const std::string &code)
+{
+    bool in_quotes = false, in_brackets = false;
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        char c = code[i];
+        if (c == '"')
+            in_quotes = !in_quotes;
+        else if (in_quotes)
+            continue;
+        else if (c == '\\' || c == '_' || c == '*')
+            ++i;
+        else if (c == '[')
+            in_brackets = true;
+        else if (c == ']')
+            in_brackets = false;
+        else if (in_brackets)
+            continue;
+        else if (c == ';')
+            return false;
+        else if (std::strchr("dmyhsDMYHS", c))
+            return true;
+    }
+    return false;
+}
+
+// Excel's "General" display of a number: up to 15 significant digits.
+std::string format_general(double d)
+{
+    if (d == 0.0)
+        return "0";
+    char buf[40];
+    std::snprintf(buf, sizeof(buf), "%.15G", d);
+    std::string s = buf;
+    size_t e = s.find('E');
+    std::string mantissa = e == std::string::npos ? s : s.substr(0, e);
+    std::string exponent = e == std::string::npos ? "" : s.substr(e);
+    if (mantissa.find('.') != std::string::npos)
+    {
+        while (!mantissa.empty() && mantissa.back() == '0')
+            mantissa.pop_back();
+        if (!mantissa.empty() && mantissa.back() == '.')
+            mantissa.pop_back();
+    }
+    if (!exponent.empty())
+    {
+        // E+020 -> E+20
+        std::string sign = exponent.substr(1, 1);
+        std::string digits = exponent.substr(2);
+        size_t nz = digits.find_first_not_of('0');
+        exponent = "E" + sign + (nz == std::string::npos ? "0" : digits.substr(nz));
+    }
+    return mantissa + exponent;
+}
+
+std::string value_to_text(const CellValue &v)
+{
+    switch (v.type)
+    {
+    case CellValue::Number:
+        return format_general(v.num);
+    case CellValue::Text:
+        return v.text;
+    case CellValue::Bool:
+        return v.num != 0.0 ? "TRUE" : "FALSE";
+    case CellValue::Error:
+        return cell_error_text(v.error);
+    default:
+        return "";
+    }
+}
+
+// Numeric coercion for operators and scalar function arguments.
+bool value_to_number(const CellValue &v, double &out, CellError &err)
+{
+    switch (v.type)
+    {
+    case CellValue::Number:
+    case CellValue::Bool:
+        out = v.num;
+        return true;
+    case CellValue::Empty:
+        out = 0.0;
+        return true;
+    case CellValue::Text:
+    {
+        if (text_to_number(v.text, out))
+            return true;
+        int y, m, d;
+        if (parse_iso_date(v.text, y, m, d))
+        {
+            out = date_serial(y, m, d, false);
+            return true;
+        }
+        err = CellError::Value;
+        return false;
+    }
+    default:
+        err = v.error;
+        return false;
+    }
+}
+
+bool value_to_bool(const CellValue &v, bool &out, CellError &err)
+{
+    switch (v.type)
+    {
+    case CellValue::Number:
+    case CellValue::Bool:
+        out = v.num != 0.0;
+        return true;
+    case CellValue::Empty:
+        out = false;
+        return true;
+    case CellValue::Text:
+    {
+        std::string u = v.text;
+        for (auto &c : u)
+            c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        if (u == "TRUE" || u == "FALSE")
+        {
+            out = u == "TRUE";
+            return true;
+        }
+        err = CellError::Value;
+        return false;
+    }
+    default:
+        err = v.error;
+        return false;
+    }
+}
+
+int compare_text_ci(const std::string &a, const std::string &b)
+{
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; ++i)
+    {
+        int x = std::tolower(static_cast<unsigned char>(a[i]));
+        int y = std::tolower(static_cast<unsigned char>(b[i]));
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+    return a.size() == b.size() ? 0 : (a.size() < b.size() ? -1 : 1);
+}
+
+// Excel ordering for comparisons and lookups: numbers < text < booleans,
+// text case-insensitive, and a blank compares as 0, "" or FALSE.
+int compare_values(const CellValue &a, const CellValue &b)
+{
+    auto rank = [](CellValue::Type t)
+    { return t == CellValue::Number ? 0 : (t == CellValue::Text ? 1 : 2); };
+    CellValue::Type ta = a.type, tb = b.type;
+    if (ta == CellValue::Empty && tb == CellValue::Empty)
+        return 0;
+    if (ta == CellValue::Empty)
+        ta = tb;
+    if (tb == CellValue::Empty)
+        tb = ta;
+    if (rank(ta) != rank(tb))
+        return rank(ta) < rank(tb) ? -1 : 1;
+    if (ta == CellValue::Text)
+        return compare_text_ci(a.type == CellValue::Empty ? std::string() : a.text, b.type == CellValue::Empty ? std::string() : b.text);
+    double x = a.type == CellValue::Empty ? 0.0 : a.num;
+    double y = b.type == CellValue::Empty ? 0.0 : b.num;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+CellValue apply_unary(ExprOp op, const CellValue &a)
+{
+    double x;
+    CellError e;
+    if (!value_to_number(a, x, e))
+        return CellValue::err(e);
+    return CellValue::number(op == ExprOp::Neg ? -x : x / 100.0);
+}
+
+CellValue apply_binary(ExprOp op, const CellValue &a, const CellValue &b)
+{
+    if (a.type == CellValue::Error)
+        return a;
+    if (b.type == CellValue::Error)
+        return b;
+    switch (op)
+    {
+    case ExprOp::Concat:
+        return CellValue::string(value_to_text(a) + value_to_text(b));
+    case ExprOp::Eq:
+        return CellValue::boolean(compare_values(a, b) == 0);
+    case ExprOp::Ne:
+        return CellValue::boolean(compare_values(a, b) != 0);
+    case ExprOp::Lt:
+        return CellValue::boolean(compare_values(a, b) < 0);
+    case ExprOp::Le:
+        return CellValue::boolean(compare_values(a, b) <= 0);
+    case ExprOp::Gt:
+        return CellValue::boolean(compare_values(a, b) > 0);
+    case ExprOp::Ge:
+        return CellValue::boolean(compare_values(a, b) >= 0);
+    default:
+        break;
+    }
+    double x, y;
+    CellError e;
+    if (!value_to_number(a, x, e) || !value_to_number(b, y, e))
+        return CellValue::err(e);
+    double r = 0.0;
+    switch (op)
+    {
+    case ExprOp::Add:
+        r = x + y;
+        break;
+    case ExprOp::Sub:
+        r = x - y;
+        break;
+    case ExprOp::Mul:
+        r = x * y;
+        break;
+    case ExprOp::Div:
+        if (y == 0.0)
+            return CellValue::err(CellError::Div0);
+        r = x / y;
+        break;
+    case ExprOp::Pow:
+        if (x == 0.0 && y == 0.0)
+            return CellValue::err(CellError::Num);
+        if (x == 0.0 && y < 0.0)
+            return CellValue::err(CellError::Div0);
+        r = std::pow(x, y);
+        break;
+    default:
+        return CellValue::err(CellError::Value);
+    }
+    if (!std::isfinite(r))
+        return CellValue::err(CellError::Num);
+    return CellValue::number(r);
+}
+
+// Parsed form of one workbook file: cells, formulas and the reverse
+// dependency index. Immutable once NativeWorkbook::load_model hands it out,
+// so any number of sessions of the same app version read it without locking;
+// each NativeWorkbook keeps its own edits and recalculated values on top.
+//
+// Cells are stored by column as runs of consecutive non-blank rows. A run
+// keeps typed parallel arrays (a tag byte, doubles, dictionary ids for text,
+// formula ids only where present); the gaps between runs are the blanks.
+// Reading a range is then a forward scan over a few arrays per column.
+class WorkbookModel
+{
+public:
+    static constexpr uint32_t kNoFormula = 0xFFFFFFFFu;
+    static constexpr uint8_t kTagType = 0x07; // CellValue::Type
+    static constexpr uint8_t kTagDate = 0x80; // number formatted as a date
+
+    struct Run
+    {
+        uint32_t first_row = 0;
+        std::vector<uint8_t> tags;
+        std::vector<double> nums;       // number, 0/1 for bool, CellError for errors
+        std::vector<uint32_t> strings;  // dictionary ids; empty unless the run has text
+        std::vector<uint32_t> formulas; // empty unless the run has formulas
+        uint32_t end_row() const { return first_row + static_cast<uint32_t>(tags.size()); }
+    };
+
+    // A stored cell: its run and offset within it. Null for blanks.
+    struct CellSlot
+    {
+        const Run *run = nullptr;
+        uint32_t index = 0;
+        explicit operator bool() const { return run != nullptr; }
+        uint8_t type() const { return run->tags[index] & kTagType; }
+        bool date() const { return (run->tags[index] & kTagDate) != 0; }
+        double num() const { return run->nums[index]; }
+        uint32_t formula() const { return run->formulas.empty() ? kNoFormula : run->formulas[index]; }
+    };
+
+    // Walks one column downwards, stepping from run to run instead of
+    // searching for each row. Rows passed to at() must not decrease.
+    class ColumnCursor
+    {
+    public:
+        ColumnCursor(const WorkbookModel &model, uint32_t sheet, uint32_t col, uint32_t start_row)
+        {
+            const Sheet &sh = model.sheets_[sheet];
+            if (col >= sh.columns.size())
+                return;
+            runs_ = &sh.columns[col];
+            next_ = std::partition_point(runs_->begin(), runs_->end(), [start_row](const Run &r)
+                                         { return r.end_row() <= start_row; }) -
+                    runs_->begin();
+        }
+
+        CellSlot at(uint32_t row)
+        {
+            CellSlot slot;
+            if (!runs_)
+                return slot;
+            while (next_ < runs_->size() && (*runs_)[next_].end_row() <= row)
+                ++next_;
+            if (next_ < runs_->size() && (*runs_)[next_].first_row <= row)
+            {
+                slot.run = &(*runs_)[next_];
+                slot.index = row - slot.run->first_row;
+            }
+            return slot;
+        }
+
+    private:
+        const std::vector<Run> *runs_ = nullptr;
+        size_t next_ = 0;
+    };
+
+    struct Formula
+    {
+        uint32_t root = 0;
+        uint32_t sheet = 0, row = 0, col = 0;
+        int32_t dr = 0, dc = 0;
+        bool is_volatile = false;
+        bool array = false;
+        std::vector<CellArea> precedents;
+    };
+
+    size_t sheet_count() const { return sheets_.size(); }
+    size_t formula_count() const { return formulas_.size(); }
+    size_t cell_count() const
+    {
+        size_t n = 0;
+        for (const auto &sh : sheets_)
+            n += sh.cell_count;
+        return n;
+    }
+    bool date1904() const { return date1904_; }
+    const Expr &node(uint32_t index) const { return pool_[index]; }
+    const Formula &formula(uint32_t index) const { return formulas_[index]; }
+    const std::vector<uint32_t> &volatile_formulas() const { return volatile_; }
+    uint32_t used_rows() const { return used_rows_; }
+    uint32_t used_cols() const { return used_cols_; }
+
+    static uint64_t cell_key(uint32_t row, uint32_t col) { return (uint64_t(row) << 14) | col; }
+    static uint64_t global_key(uint32_t sheet, uint32_t row, uint32_t col) { return (uint64_t(sheet) << 34) | cell_key(row, col); }
+
+    CellSlot find_cell(uint32_t sheet, uint32_t row, uint32_t col) const
+    {
+        CellSlot slot;
+        slot.run = const_cast<WorkbookModel *>(this)->locate(sheet, row, col, slot.index);
+        return slot;
+    }
+
+    CellValue value(const CellSlot &slot) const
+    {
+        switch (slot.type())
+        {
+        case CellValue::Number:
+            return CellValue::number(slot.num());
+        case CellValue::Text:
+            return CellValue::string(text(slot));
+        case CellValue::Bool:
+            return CellValue::boolean(slot.num() != 0.0);
+        case CellValue::Error:
+            return CellValue::err(static_cast<CellError>(static_cast<int>(slot.num())));
+        default:
+            return CellValue();
+        }
+    }
+
+    const std::string &text(const CellSlot &slot) const { return strings_[slot.run->strings[slot.index]]; }
+
+    bool find_sheet(const std::string &name, uint32_t &index) const
+    {
+        for (size_t i = 0; i < sheets_.size(); ++i)
+        {
+            if (sheets_[i].name == name)
+            {
+                index = static_cast<uint32_t>(i);
+                return true;
+            }
+        }
+        std::string key = normalize_sheet_key(name);
+        for (size_t i = 0; i < sheets_.size(); ++i)
+        {
+            if (normalize_sheet_key(sheets_[i].name) == key)
+            {
+                index = static_cast<uint32_t>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Range text as accepted by /excel/query: "B3", "A1:C10" or a workbook name.
+    bool resolve_area(const std::string &sheet, const std::string &range, CellArea &area, std::string &err) const
+    {
+        uint32_t s = 0;
+        if (!find_sheet(sheet, s))
+        {
+            err = "sheet not found";
+            return false;
+        }
+        std::string address = sanitize_range_address(range);
+        if (parse_area_address(address, s, area))
+            return true;
+        std::string text;
+        if (lookup_name(address, s, text))
+        {
+            std::vector<Expr> scratch;
+            FormulaParser parser(scratch, parser_env(), s, 0, 0);
+            uint32_t root = 0;
+            std::string perr;
+            if (parser.parse(text, root, perr) && scratch[root].op == ExprOp::Ref)
+            {
+                area = scratch[root].area;
+                return true;
+            }
+        }
+        err = "invalid range";
+        return false;
+    }
+
+    static bool shift_area(const Expr &e, const EvalContext &ctx, CellArea &out)
+    {
+        out = e.area;
+        if (ctx.dr == 0 && ctx.dc == 0)
+            return true;
+        auto shift = [](uint32_t v, int32_t d, bool abs, uint32_t limit, uint32_t &res)
+        {
+            if (abs)
+            {
+                res = v;
+                return true;
+            }
+            int64_t n = static_cast<int64_t>(v) + d;
+            if (n < 0 || n >= static_cast<int64_t>(limit))
+                return false;
+            res = static_cast<uint32_t>(n);
+            return true;
+        };
+        uint8_t f = e.ref_flags;
+        return shift(e.area.r1, ctx.dr, (f & kRefRow1Abs) != 0, kSheetMaxRows, out.r1) &&
+               shift(e.area.r2, ctx.dr, (f & kRefRow2Abs) != 0, kSheetMaxRows, out.r2) &&
+               shift(e.area.c1, ctx.dc, (f & kRefCol1Abs) != 0, kSheetMaxCols, out.c1) &&
+               shift(e.area.c2, ctx.dc, (f & kRefCol2Abs) != 0, kSheetMaxCols, out.c2);
+    }
+
+    // Formulas that read the given cell, directly.
+    template <typename Fn>
+    void for_each_dependent(uint32_t sheet, uint32_t row, uint32_t col, Fn fn) const
+    {
+        auto pit = point_deps_.find(global_key(sheet, row, col));
+        if (pit != point_deps_.end())
+        {
+            for (uint32_t f : pit->second)
+                fn(f);
+        }
+        auto cit = column_deps_.find((uint64_t(sheet) << 14) | col);
+        if (cit != column_deps_.end())
+        {
+            for (uint32_t d : cit->second)
+            {
+                if (range_deps_[d].area.contains(sheet, row, col))
+                    fn(range_deps_[d].formula);
+            }
+        }
+        for (uint32_t d : wide_deps_)
+        {
+            if (range_deps_[d].area.contains(sheet, row, col))
+                fn(range_deps_[d].formula);
+        }
+    }
+
+    template <typename Fn>
+    void for_each_formula_in(const CellArea &a, Fn fn) const
+    {
+        const Sheet &sh = sheets_[a.sheet];
+        if (sh.formula_cols.empty())
+            return;
+        uint32_t c_end = std::min<uint32_t>(a.c2, static_cast<uint32_t>(sh.formula_cols.size()) - 1);
+        for (uint32_t c = a.c1; c <= c_end; ++c)
+        {
+            const auto &col = sh.formula_cols[c];
+            auto it = std::lower_bound(col.begin(), col.end(), std::make_pair(a.r1, 0u));
+            for (; it != col.end() && it->first <= a.r2; ++it)
+                fn(it->second);
+        }
+    }
+
+    // Stored cells of the rows x cols block at the area's corner, as global
+    // keys in column order.
+    void collect_cells_in(const CellArea &a, uint32_t rows, uint32_t cols, std::vector<uint64_t> &out) const
+    {
+        const Sheet &sh = sheets_[a.sheet];
+        uint32_t r_end = a.r1 + rows;
+        uint32_t c_end = std::min<uint32_t>(a.c1 + cols, static_cast<uint32_t>(sh.columns.size()));
+        for (uint32_t c = a.c1; c < c_end; ++c)
+        {
+            const auto &runs = sh.columns[c];
+            auto it = std::partition_point(runs.begin(), runs.end(), [&](const Run &r)
+                                           { return r.end_row() <= a.r1; });
+            for (; it != runs.end() && it->first_row < r_end; ++it)
+            {
+                for (uint32_t r = std::max(it->first_row, a.r1); r < std::min(it->end_row(), r_end); ++r)
+                    out.push_back(global_key(a.sheet, r, c));
+            }
+        }
+    }
+
+    size_t sheet_cell_count(uint32_t sheet) const { return sheets_[sheet].cell_count; }
+
+    // Formulas a write to the area can change: those reading its cells,
+    // directly or through other formulas, and every volatile formula with
+    // what depends on it. False for areas too large to trace cell by cell.
+    bool collect_downstream(const CellArea &a, std::unordered_set<uint32_t> &out) const
+    {
+        if (a.cell_count() > kTraceMaxCells)
+            return false;
+        std::vector<uint64_t> work;
+        for (uint32_t r = a.r1; r <= a.r2; ++r)
+            for (uint32_t c = a.c1; c <= a.c2; ++c)
+                work.push_back(global_key(a.sheet, r, c));
+        auto visit = [&](uint32_t f)
+        {
+            if (!out.insert(f).second)
+                return;
+            const Formula &fm = formulas_[f];
+            work.push_back(global_key(fm.sheet, fm.row, fm.col));
+        };
+        for (uint32_t f : volatile_)
+            visit(f);
+        while (!work.empty())
+        {
+            uint64_t key = work.back();
+            work.pop_back();
+            for_each_dependent(static_cast<uint32_t>(key >> 34), static_cast<uint32_t>((key >> 14) & 0xFFFFF),
+                               static_cast<uint32_t>(key & 0x3FFF), visit);
+        }
+        return true;
+    }
+
+    bool any_formula_in(const CellArea &a, const std::unordered_set<uint32_t> &formulas) const
+    {
+        bool found = false;
+        for_each_formula_in(a, [&](uint32_t f)
+                            { found = found || formulas.count(f) != 0; });
+        return found;
+    }
+
+private:
+    friend class NativeWorkbook;
+    friend class WorkbookAnalyzer;
+
+    // Ranges read by a formula up to this many cells are indexed per cell;
+    // larger ones are bucketed by column, or kept in a scan list when wide.
+    static const uint64_t kPointDepCells = 16;
+    static const uint32_t kColumnDepMaxCols = 64;
+    static const uint64_t kTraceMaxCells = 4096;
+
+    struct Sheet
+    {
+        std::string name;
+        std::vector<std::vector<Run>> columns; // runs sorted by first_row
+        size_t cell_count = 0;
+        // column -> (row, formula) sorted by row, for finding formulas in a range
+        std::vector<std::vector<std::pair<uint32_t, uint32_t>>> formula_cols;
+    };
+
+    // A cell as parsed, before the sheet is packed into column runs.
+    struct Cell
+    {
+        CellValue value;
+        uint32_t formula = kNoFormula;
+        bool date = false;
+    };
+
+    struct RangeDep
+    {
+        CellArea area;
+        uint32_t formula;
+    };
+
+    struct DefinedName
+    {
+        int local_sheet; // -1 for workbook scope
+        std::string text;
+    };
+
+    WorkbookModel() = default;
+
+    Run *locate(uint32_t sheet, uint32_t row, uint32_t col, uint32_t &index)
+    {
+        Sheet &sh = sheets_[sheet];
+        if (col >= sh.columns.size())
+            return nullptr;
+        auto &runs = sh.columns[col];
+        auto it = std::upper_bound(runs.begin(), runs.end(), row, [](uint32_t r, const Run &run)
+                                   { return r < run.first_row; });
+        if (it == runs.begin())
+            return nullptr;
+        --it;
+        if (row >= it->end_row())
+            return nullptr;
+        index = row - it->first_row;
+        return &*it;
+    }
+
+    uint32_t intern(const std::string &s)
+    {
+        auto it = string_ids_.find(s);
+        if (it != string_ids_.end())
+            return it->second;
+        uint32_t id = static_cast<uint32_t>(strings_.size());
+        strings_.push_back(s);
+        string_ids_.emplace(s, id);
+        return id;
+    }
+
+    void put(Run &run, uint32_t i, const CellValue &v)
+    {
+        run.tags[i] = static_cast<uint8_t>(v.type) | (run.tags[i] & kTagDate);
+        run.nums[i] = v.type == CellValue::Error ? static_cast<double>(v.error) : v.num;
+        if (v.type == CellValue::Text)
+        {
+            if (run.strings.empty())
+                run.strings.resize(run.tags.size());
+            run.strings[i] = intern(v.text);
+        }
+    }
+
+    // Loading only: overwrites the cached value of a stored cell.
+    void store(uint32_t sheet, uint32_t row, uint32_t col, const CellValue &v)
+    {
+        uint32_t index = 0;
+        if (Run *run = locate(sheet, row, col, index))
+            put(*run, index, v);
+    }
+
+    // Packs parsed cells into column runs. A coordinate given twice keeps the
+    // later cell, as the old map-based store did.
+    void build_columns(Sheet &sh, std::vector<std::pair<uint64_t, Cell>> &cells)
+    {
+        std::stable_sort(cells.begin(), cells.end(), [](const std::pair<uint64_t, Cell> &a, const std::pair<uint64_t, Cell> &b)
+                         {
+            uint64_t ca = a.first & 0x3FFF, cb = b.first & 0x3FFF;
+            return ca != cb ? ca < cb : a.first < b.first; });
+        for (size_t i = 0; i < cells.size(); ++i)
+        {
+            if (i + 1 < cells.size() && cells[i + 1].first == cells[i].first)
+                continue;
+            uint32_t row = static_cast<uint32_t>(cells[i].first >> 14), col = static_cast<uint32_t>(cells[i].first & 0x3FFF);
+            const Cell &cell = cells[i].second;
+            if (sh.columns.size() <= col)
+                sh.columns.resize(col + 1);
+            auto &runs = sh.columns[col];
+            if (runs.empty() || runs.back().end_row() != row)
+            {
+                runs.emplace_back();
+                runs.back().first_row = row;
+            }
+            Run &run = runs.back();
+            uint32_t at = static_cast<uint32_t>(run.tags.size());
+            run.tags.push_back(cell.date ? kTagDate : 0);
+            run.nums.push_back(0.0);
+            if (!run.strings.empty())
+                run.strings.push_back(0);
+            if (cell.formula != kNoFormula || !run.formulas.empty())
+            {
+                run.formulas.resize(at, kNoFormula);
+                run.formulas.push_back(cell.formula);
+            }
+            put(run, at, cell.value);
+            ++sh.cell_count;
+        }
+        for (auto &runs : sh.columns)
+        {
+            for (auto &run : runs)
+            {
+                run.tags.shrink_to_fit();
+                run.nums.shrink_to_fit();
+                run.strings.shrink_to_fit();
+                run.formulas.shrink_to_fit();
+            }
+        }
+        cells.clear();
+        cells.shrink_to_fit();
+    }
+
+    FormulaParser::Env parser_env() const
+    {
+        FormulaParser::Env env;
+        env.sheet_index = [this](const std::string &name, uint32_t &index)
+        { return find_sheet(name, index); };
+        env.defined_name = [this](const std::string &name, uint32_t sheet, std::string &text)
+        { return lookup_name(name, sheet, text); };
+        return env;
+    }
+
+    bool lookup_name(const std::string &name, uint32_t sheet, std::string &text) const
+    {
+        auto it = names_.find(to_lower(name));
+        if (it == names_.end())
+            return false;
+        const DefinedName *global = nullptr;
+        for (const auto &dn : it->second)
+        {
+            if (dn.local_sheet == static_cast<int>(sheet))
+            {
+                text = dn.text;
+                return true;
+            }
+            if (dn.local_sheet < 0)
+                global = &dn;
+        }
+        if (!global)
+            return false;
+        text = global->text;
+        return true;
+    }
+
+    void collect_precedents(Formula &fm)
+    {
+        EvalContext ctx;
+        ctx.dr = fm.dr;
+        ctx.dc = fm.dc;
+        std::vector<uint32_t> work{fm.root};
+        while (!work.empty())
+        {
+            const Expr &e = pool_[work.back()];
+            work.pop_back();
+            if (e.op == ExprOp::Ref)
+            {
+                CellArea a;
+                if (shift_area(e, ctx, a))
+                    fm.precedents.push_back(a);
+                continue;
+            }
+            if (e.op != ExprOp::Array)
+                work.insert(work.end(), e.args.begin(), e.args.end());
+        }
+    }
+
+    void build_dependencies()
+    {
+        for (uint32_t f = 0; f < formulas_.size(); ++f)
+        {
+            Formula &fm = formulas_[f];
+            collect_precedents(fm);
+            Sheet &sh = sheets_[fm.sheet];
+            if (sh.formula_cols.size() <= fm.col)
+                sh.formula_cols.resize(fm.col + 1);
+            sh.formula_cols[fm.col].push_back({fm.row, f});
+            for (const CellArea &a : fm.precedents)
+            {
+                if (a.cell_count() <= kPointDepCells)
+                {
+                    for (uint32_t r = a.r1; r <= a.r2; ++r)
+                        for (uint32_t c = a.c1; c <= a.c2; ++c)
+                            point_deps_[global_key(a.sheet, r, c)].push_back(f);
+                    continue;
+                }
+                uint32_t d = static_cast<uint32_t>(range_deps_.size());
+                range_deps_.push_back({a, f});
+                if (a.c2 - a.c1 + 1 > kColumnDepMaxCols)
+                {
+                    wide_deps_.push_back(d);
+                    continue;
+                }
+                for (uint32_t c = a.c1; c <= a.c2; ++c)
+                    column_deps_[(uint64_t(a.sheet) << 14) | c].push_back(d);
+            }
+            if (fm.is_volatile)
+                volatile_.push_back(f);
+        }
+        for (auto &sh : sheets_)
+        {
+            for (auto &col : sh.formula_cols)
+                std::sort(col.begin(), col.end());
+        }
+    }
+
+    // -- Loading
+
+    static bool is_builtin_date_format(int id)
+    {
+        return (id >= 14 && id <= 22) || (id >= 27 && id <= 36) || (id >= 45 && id <= 47) || (id >= 50 && id <= 58);
+    }
+
+    static std::string part_path(const std::string &target)
+    {
+        if (!target.empty() && target[0] == '/')
+            return target.substr(1);
+        std::string t = target;
+        std::string base = "xl/";
+        while (t.compare(0, 3, "../") == 0)
+        {
+            t = t.substr(3);
+            base.clear();
+        }
+        return base + t;
+    }
+
+    bool load_package(const fs::path &path, std::string &reason)
+    {
+        ZipArchive zip;
+        if (!zip.open(path, reason))
+            return false;
+        if (zip.contains("xl/vbaProject.bin"))
+        {
+            reason = "workbook contains macros";
+            return false;
+        }
+        std::string workbook_xml, rels_xml;
+        if (!zip.read("xl/workbook.xml", workbook_xml) || !zip.read("xl/_rels/workbook.xml.rels", rels_xml))
+        {
+            reason = "not an xlsx package";
+            return false;
+        }
+        std::unordered_map<std::string, std::string> rels;
+        {
+            XmlScanner x(rels_xml);
+            for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+            {
+                if (ev == XmlScanner::Event::Start && x.is("Relationship"))
+                    rels[x.attr_or("Id")] = x.attr_or("Target");
+            }
+        }
+        std::vector<std::string> sheet_parts;
+        {
+            XmlScanner x(workbook_xml);
+            for (auto ev = x.next(); ev != XmlScanner::Event::Eof; ev = x.next())
+            {
+                if (ev == XmlScanner::Event::Error)
+                {
+                    reason = "malformed workbook.xml";
+                    return false;
+                }
+                if (ev != XmlScanner::Event::Start)
+                    continue;
+                if (x.is("sheet"))
+                {
+                    Sheet sh;
+                    sh.name = x.attr_or("name");
+                    sheets_.push_back(std::move(sh));
+                    std::string target = rels[x.attr_or("id")];
+                    sheet_parts.push_back(target.empty() ? "" : part_path(target));
+                }
+                else if (x.is("workbookPr"))
+                {
+                    std::string v = x.attr_or("date1904");
+                    date1904_ = v == "1" || v == "true";
+                }
+                else if (x.is("calcPr"))
+                {
+                    std::string v = x.attr_or("iterate");
+                    if (v == "1" || v == "true")
+                    {
+                        reason = "iterative calculation is enabled";
+                        return false;
+                    }
+                }
+                else if (x.is("definedName"))
+                {
+                    DefinedName dn;
+                    std::string local;
+                    dn.local_sheet = x.attr("localSheetId", local) ? std::atoi(local.c_str()) : -1;
+                    std::string name = x.attr_or("name");
+                    for (auto ev2 = x.next(); ev2 == XmlScanner::Event::Text; ev2 = x.next())
+                        x.append_text(dn.text);
+                    names_[to_lower(name)].push_back(std::move(dn));
+                }
+            }
+        }
+        if (sheets_.empty())
+        {
+            reason = "workbook has no sheets";
+            return false;
+        }
+        std::vector<std::string> shared_strings;
+        std::string xml;
+        if (zip.read("xl/sharedStrings.xml", xml))
+            load_shared_strings(xml, shared_strings);
+        std::vector<bool> date_styles;
+        if (zip.read("xl/styles.xml", xml))
+            load_styles(xml, date_styles);
+        for (size_t i = 0; i < sheets_.size(); ++i)
+        {
+            // Chart sheets have no cells; keep their slot so sheet indexes line up.
+            if (sheet_parts[i].empty() || sheet_parts[i].find("worksheets/") == std::string::npos)
+                continue;
+            if (!zip.read(sheet_parts[i], xml))
+            {
+                reason = "missing part " + sheet_parts[i];
+                return false;
+            }
+            if (!load_sheet(static_cast<uint32_t>(i), xml, shared_strings, date_styles, reason))
+            {
+                reason = sheets_[i].name + ": " + reason;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void load_shared_strings(const std::string &xml, std::vector<std::string> &out)
+    {
+        XmlScanner x(xml);
+        std::string current;
+        bool in_si = false, in_t = false;
+        int skip_depth = 0; // inside <rPh> phonetic runs
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Start)
+            {
+                if (x.is("si"))
+                {
+                    in_si = true;
+                    current.clear();
+                }
+                else if (x.is("rPh"))
+                    ++skip_depth;
+                else if (x.is("t") && in_si && skip_depth == 0)
+                    in_t = true;
+            }
+            else if (ev == XmlScanner::Event::End)
+            {
+                if (x.is("si"))
+                {
+                    out.push_back(current);
+                    in_si = false;
+                }
+                else if (x.is("rPh"))
+                    --skip_depth;
+                else if (x.is("t"))
+                    in_t = false;
+            }
+            else if (ev == XmlScanner::Event::Text && in_t)
+            {
+                x.append_text(current);
+            }
+        }
+    }
+
+    static void load_styles(const std::string &xml, std::vector<bool> &date_styles)
+    {
+        XmlScanner x(xml);
+        std::unordered_map<int, bool> custom;
+        bool in_cell_xfs = false;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Start)
+            {
+                if (x.is("numFmt"))
+                    custom[std::atoi(x.attr_or("numFmtId", "0").c_str())] = number_format_is_date(x.attr_or("formatCode"));
+                else if (x.is("cellXfs"))
+                    in_cell_xfs = true;
+                else if (x.is("xf") && in_cell_xfs)
+                {
+                    int id = std::atoi(x.attr_or("numFmtId", "0").c_str());
+                    auto it = custom.find(id);
+                    date_styles.push_back(it != custom.end() ? it->second : is_builtin_date_format(id));
+                }
+            }
+            else if (ev == XmlScanner::Event::End && x.is("cellXfs"))
+            {
+                in_cell_xfs = false;
+            }
+        }
+    }
+
+    struct SharedAnchor
+    {
+        uint32_t root = 0;
+        uint32_t row = 0, col = 0;
+        bool is_volatile = false;
+        bool seen = false;
+    };
+
+    bool load_sheet(uint32_t sheet_index, const std::string &xml, const std::vector<std::string> &shared_strings,
+                    const std::vector<bool> &date_styles, std::string &reason)
+    {
+        std::vector<std::pair<uint64_t, Cell>> cells;
+        FormulaParser::Env env = parser_env();
+        std::unordered_map<std::string, SharedAnchor> shared;
+        struct Follower
+        {
+            uint32_t formula;
+            std::string si;
+        };
+        std::vector<Follower> followers;
+        XmlScanner x(xml);
+        uint32_t next_row = 0, next_col = 0;
+        bool in_data = false;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Error)
+            {
+                reason = "malformed sheet xml";
+                return false;
+            }
+            if (ev == XmlScanner::Event::End && x.is("sheetData"))
+                break;
+            if (ev != XmlScanner::Event::Start)
+                continue;
+            if (x.is("sheetData"))
+            {
+                in_data = true;
+                continue;
+            }
+            if (!in_data)
+                continue;
+            if (x.is("row"))
+            {
+                std::string r;
+                next_row = x.attr("r", r) ? static_cast<uint32_t>(std::max(1, std::atoi(r.c_str())) - 1) : next_row + 1;
+                next_col = 0;
+                continue;
+            }
+            if (!x.is("c"))
+                continue;
+            uint32_t row = next_row, col = next_col;
+            std::string ref;
+            if (x.attr("r", ref))
+            {
+                CellArea a;
+                if (!parse_area_address(ref, sheet_index, a))
+                {
+                    reason = "bad cell reference " + ref;
+                    return false;
+                }
+                row = a.r1;
+                col = a.c1;
+            }
+            next_col = col + 1;
+            std::string type = x.attr_or("t", "n");
+            int style = std::atoi(x.attr_or("s", "0").c_str());
+            std::string v_text, f_text, f_type, f_ref, f_si;
+            bool has_v = false, has_f = false;
+            for (auto cev = x.next(); !(cev == XmlScanner::Event::End && x.is("c")); cev = x.next())
+            {
+                if (cev == XmlScanner::Event::Eof || cev == XmlScanner::Event::Error)
+                {
+                    reason = "malformed cell";
+                    return false;
+                }
+                if (cev != XmlScanner::Event::Start)
+                    continue;
+                if (x.is("v") || x.is("t"))
+                {
+                    has_v = true;
+                    for (auto tev = x.next(); tev == XmlScanner::Event::Text; tev = x.next())
+                        x.append_text(v_text);
+                }
+                else if (x.is("f"))
+                {
+                    has_f = true;
+                    f_type = x.attr_or("t", "normal");
+                    f_ref = x.attr_or("ref");
+                    f_si = x.attr_or("si");
+                    for (auto tev = x.next(); tev == XmlScanner::Event::Text; tev = x.next())
+                        x.append_text(f_text);
+                }
+            }
+            Cell cell;
+            cell.date = style >= 0 && static_cast<size_t>(style) < date_styles.size() && date_styles[style];
+            if (has_v)
+            {
+                if (type == "s")
+                {
+                    size_t idx = static_cast<size_t>(std::atoll(v_text.c_str()));
+                    cell.value = CellValue::string(idx < shared_strings.size() ? shared_strings[idx] : std::string());
+                }
+                else if (type == "str" || type == "inlineStr")
+                    cell.value = CellValue::string(v_text);
+                else if (type == "b")
+                    cell.value = CellValue::boolean(v_text == "1" || v_text == "true");
+                else if (type == "e")
+                {
+                    CellError ce = CellError::Value;
+                    parse_cell_error(v_text, ce);
+                    cell.value = CellValue::err(ce);
+                }
+                else if (type == "d")
+                {
+                    int y, m, d;
+                    if (parse_iso_date(v_text, y, m, d))
+                        cell.value = CellValue::number(date_serial(y, m, d, date1904_));
+                    cell.date = true;
+                }
+                else if (!v_text.empty())
+                    cell.value = CellValue::number(std::strtod(v_text.c_str(), nullptr));
+            }
+            if (has_f)
+            {
+                if (f_type == "dataTable")
+                {
+                    reason = "data tables are not supported";
+                    return false;
+                }
+                if (f_type == "array" && !f_ref.empty() && f_ref.find(':') != std::string::npos)
+                {
+                    CellArea a;
+                    if (!parse_area_address(f_ref, sheet_index, a) || a.r1 != a.r2 || a.c1 != a.c2)
+                    {
+                        reason = "multi-cell array formulas are not supported";
+                        return false;
+                    }
+                }
+                Formula fm;
+                fm.sheet = sheet_index;
+                fm.row = row;
+                fm.col = col;
+                fm.array = f_type == "array";
+                uint32_t fid = static_cast<uint32_t>(formulas_.size());
+                if (!has_v)
+                    stale_.push_back(fid);
+                if (f_type == "shared" && f_text.empty())
+                {
+                    followers.push_back({fid, f_si});
+                }
+                else
+                {
+                    FormulaParser parser(pool_, env, sheet_index, row, col);
+                    std::string perr;
+                    if (!parser.parse(f_text, fm.root, perr))
+                    {
+                        reason = column_name(col) + std::to_string(row + 1) + ": " + perr;
+                        return false;
+                    }
+                    fm.is_volatile = parser.is_volatile();
+                    if (f_type == "shared")
+                    {
+                        SharedAnchor &anchor = shared[f_si];
+                        anchor.root = fm.root;
+                        anchor.row = row;
+                        anchor.col = col;
+                        anchor.is_volatile = fm.is_volatile;
+                        anchor.seen = true;
+                    }
+                }
+                formulas_.push_back(std::move(fm));
+                cell.formula = fid;
+            }
+            if (cell.value.type == CellValue::Empty && cell.formula == kNoFormula)
+                continue;
+            used_rows_ = std::max(used_rows_, row + 1);
+            used_cols_ = std::max(used_cols_, col + 1);
+            cells.push_back({cell_key(row, col), std::move(cell)});
+        }
+        for (const auto &fw : followers)
+        {
+            auto it = shared.find(fw.si);
+            if (it == shared.end() || !it->second.seen)
+            {
+                reason = "shared formula " + fw.si + " has no anchor";
+                return false;
+            }
+            Formula &fm = formulas_[fw.formula];
+            fm.root = it->second.root;
+            fm.is_volatile = it->second.is_volatile;
+            fm.dr = static_cast<int32_t>(fm.row) - static_cast<int32_t>(it->second.row);
+            fm.dc = static_cast<int32_t>(fm.col) - static_cast<int32_t>(it->second.col);
+        }
+        build_columns(sheets_[sheet_index], cells);
+        return true;
+    }
+
+    std::vector<Sheet> sheets_;
+    std::vector<std::string> strings_; // text dictionary shared by all sheets
+    std::unordered_map<std::string, uint32_t> string_ids_; // loading only
+    std::vector<Expr> pool_;
+    std::vector<Formula> formulas_;
+    std::unordered_map<std::string, std::vector<DefinedName>> names_;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> point_deps_;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> column_deps_; // (sheet, column) -> range_deps_ index
+    std::vector<RangeDep> range_deps_;
+    std::vector<uint32_t> wide_deps_;
+    std::vector<uint32_t> volatile_;
+    std::vector<uint32_t> stale_; // saved without a cached value; settled by load_model
+    uint32_t used_rows_ = 1, used_cols_ = 1;
+    bool date1904_ = false;
+};
+
+// Calculation state of one session over a shared WorkbookModel. Only cells
+// the session changed, and formulas recalculated because of that, are held
+// here; everything else is read straight from the model, so a session costs
+// memory in proportion to its edits rather than to the workbook.
+class NativeWorkbook
+{
+public:
+    // Parses a workbook and calculates any formula Excel saved without a
+    // value, giving a model that sessions can share as-is.
+    static std::shared_ptr<const WorkbookModel> load_model(const fs::path &path, std::string &reason)
+    {
+        std::shared_ptr<WorkbookModel> model(new WorkbookModel());
+        if (!model->load_package(path, reason))
+            return nullptr;
+        model->build_dependencies();
+        if (!model->stale_.empty())
+        {
+            NativeWorkbook wb(model);
+            for (uint32_t f : model->stale_)
+                wb.mark_formula_dirty(f);
+            std::vector<uint32_t> pending(wb.dirty_.begin(), wb.dirty_.end());
+            for (uint32_t f : pending)
+            {
+                if (wb.dirty_.count(f))
+                    wb.recalc(f);
+            }
+            for (const auto &kv : wb.overlay_)
+            {
+                model->store(static_cast<uint32_t>(kv.first >> 34), static_cast<uint32_t>((kv.first >> 14) & 0xFFFFF),
+                             static_cast<uint32_t>(kv.first & 0x3FFF), kv.second.value);
+            }
+            model->stale_.clear();
+            model->stale_.shrink_to_fit();
+        }
+        model->string_ids_ = {};
+        return model;
+    }
+
+    explicit NativeWorkbook(std::shared_ptr<const WorkbookModel> model)
+        : model_(std::move(model)), used_rows_(model_->used_rows()), used_cols_(model_->used_cols()), rng_(std::random_device{}())
+    {
+        // Volatile formulas start dirty so each session sees its own NOW().
+        for (uint32_t f : model_->volatile_formulas())
+            mark_formula_dirty(f);
+    }
+
+    const WorkbookModel &model() const { return *model_; }
+    size_t sheet_count() const { return model_->sheet_count(); }
+    size_t formula_count() const { return model_->formula_count(); }
+    size_t overlay_size() const { return overlay_.size(); }
+    bool date1904() const { return model_->date1904(); }
+    std::mt19937_64 &rng() { return rng_; }
+    const Expr &node(uint32_t index) const { return model_->node(index); }
+
+    bool resolve_area(const std::string &sheet, const std::string &range, CellArea &area, std::string &err) const
+    {
+        return model_->resolve_area(sheet, range, area, err);
+    }
+
+    // Same JSON shapes as the COM path: a scalar for one cell, rows of values otherwise.
+    std::string query_json(const CellArea &area)
+    {
+        std::string out;
+        if (area.r1 == area.r2 && area.c1 == area.c2)
+        {
+            append_value_json(value_at(area.sheet, area.r1, area.c1), is_date(area.sheet, area.r1, area.c1), out);
+            return out;
+        }
+        out.push_back('[');
+        append_rows_json(area, out);
+        out.push_back(']');
+        return out;
+    }
+
+    // Appends the area's rows as "[..],[..]" without the enclosing brackets,
+    // so a range can be written out one block of rows at a time.
+    void append_rows_json(const CellArea &area, std::string &out)
+    {
+        out.reserve(out.size() + static_cast<size_t>(area.cell_count()) * 4);
+        scan_area(area, [&](uint32_t r, uint32_t c, const Overlay *local, const WorkbookModel::CellSlot &slot)
+                  {
+            if (c == area.c1)
+            {
+                if (r != area.r1)
+                    out += "],";
+                out.push_back('[');
+            }
+            else
+            {
+                out.push_back(',');
+            }
+            if (local)
+                append_value_json(local->value, local->date, out);
+            else if (slot)
+                append_slot_json(slot, out);
+            else
+                out += "null"; });
+        out.push_back(']');
+    }
+
+    // The area's values for the binary encoder, with date cells converted
+    // to days since 1970-01-01.
+    void read_grid(const CellArea &area, CellGrid &grid)
+    {
+        grid.rows = area.r2 - area.r1 + 1;
+        grid.cols = area.c2 - area.c1 + 1;
+        grid.values.assign(static_cast<size_t>(grid.rows) * grid.cols, CellValue());
+        grid.dates.assign(grid.values.size(), 0);
+        size_t i = 0;
+        scan_area(area, [&](uint32_t, uint32_t, const Overlay *local, const WorkbookModel::CellSlot &slot)
+                  {
+            CellValue &v = grid.values[i];
+            bool date = false;
+            if (local)
+            {
+                v = local->value;
+                date = local->date;
+            }
+            else if (slot)
+            {
+                v.type = static_cast<CellValue::Type>(slot.type());
+                v.num = slot.num();
+                date = slot.date();
+                if (v.type == CellValue::Text)
+                    v.text = model_->text(slot);
+            }
+            if (date && v.type == CellValue::Number && serial_to_unix_days(v.num, model_->date1904(), v.num))
+                grid.dates[i] = 1;
+            ++i; });
+    }
+
+    // Largest area one write may cover; each cell written becomes an
+    // overlay entry held for the rest of the session.
+    static const uint64_t kMaxWriteCells = 65536;
+
+    // Writes a constant into every cell of the area (replacing any formula
+    // there) and marks everything downstream dirty. Values are recalculated
+    // lazily when read. False, with nothing written, for areas over
+    // kMaxWriteCells.
+    bool set_value(const CellArea &area, const CellValue &value, bool is_date)
+    {
+        if (area.cell_count() > kMaxWriteCells)
+            return false;
+        for (uint32_t r = area.r1; r <= area.r2; ++r)
+        {
+            for (uint32_t c = area.c1; c <= area.c2; ++c)
+            {
+                WorkbookModel::CellSlot base = model_->find_cell(area.sheet, r, c);
+                if (base && base.formula() != WorkbookModel::kNoFormula && replaced_.insert(base.formula()).second)
+                    dirty_.erase(base.formula());
+                uint64_t key = WorkbookModel::global_key(area.sheet, r, c);
+                auto it = overlay_.find(key);
+                bool was_date = it != overlay_.end() ? it->second.date : base && base.date();
+                Overlay &cell = overlay_[key];
+                cell.value = value;
+                cell.date = is_date || (was_date && value.type == CellValue::Number);
+                cell.constant = true;
+                if (value.type != CellValue::Empty)
+                {
+                    used_rows_ = std::max(used_rows_, r + 1);
+                    used_cols_ = std::max(used_cols_, c + 1);
+                }
+                mark_dependents(area.sheet, r, c);
+            }
+        }
+        for (uint32_t f : model_->volatile_formulas())
+            mark_formula_dirty(f);
+        return true;
+    }
+
+    // Cell value with any pending recalculation of it done first.
+    CellValue value_at(uint32_t sheet, uint32_t row, uint32_t col)
+    {
+        WorkbookModel::CellSlot base = model_->find_cell(sheet, row, col);
+        if (base && !dirty_.empty())
+        {
+            uint32_t f = base.formula();
+            if (f != WorkbookModel::kNoFormula && dirty_.count(f) && !on_stack_.count(f))
+                recalc(f);
+        }
+        if (!overlay_.empty())
+        {
+            auto it = overlay_.find(WorkbookModel::global_key(sheet, row, col));
+            if (it != overlay_.end())
+                return it->second.value;
+        }
+        return base ? model_->value(base) : CellValue();
+    }
+
+    Operand eval(uint32_t index, const EvalContext &ctx)
+    {
+        const Expr &e = model_->node(index);
+        switch (e.op)
+        {
+        case ExprOp::Literal:
+            return Operand::scalar(e.value);
+        case ExprOp::Missing:
+            return Operand::scalar(CellValue());
+        case ExprOp::Ref:
+        {
+            CellArea a;
+            if (!WorkbookModel::shift_area(e, ctx, a))
+                return Operand::scalar(CellValue::err(CellError::Ref));
+            return Operand::range(a);
+        }
+        case ExprOp::Array:
+        {
+            std::vector<CellValue> cells;
+            cells.reserve(e.args.size());
+            for (uint32_t a : e.args)
+                cells.push_back(model_->node(a).value);
+            return Operand::matrix(e.rows, e.cols, std::move(cells));
+        }
+        case ExprOp::Neg:
+        case ExprOp::Percent:
+        {
+            Operand a = eval(e.args[0], ctx);
+            if (!ctx.array || a.kind == Operand::Scalar)
+                return Operand::scalar(apply_unary(e.op, to_scalar(a, ctx)));
+            uint32_t rows, cols;
+            dims(a, rows, cols);
+            std::vector<CellValue> cells;
+            cells.reserve(static_cast<size_t>(rows) * cols);
+            for (uint32_t r = 0; r < rows; ++r)
+                for (uint32_t c = 0; c < cols; ++c)
+                    cells.push_back(apply_unary(e.op, element(a, r, c)));
+            return Operand::matrix(rows, cols, std::move(cells));
+        }
+        case ExprOp::Call:
+            return function_at(e.func).fn(*this, e, ctx);
+        default:
+            break;
+        }
+        Operand a = eval(e.args[0], ctx);
+        Operand b = eval(e.args[1], ctx);
+        if (!ctx.array || (is_single(a) && is_single(b)))
+            return Operand::scalar(apply_binary(e.op, to_scalar(a, ctx), to_scalar(b, ctx)));
+        uint32_t ra, ca, rb, cb;
+        dims(a, ra, ca);
+        dims(b, rb, cb);
+        uint32_t rows = ra == 1 ? rb : (rb == 1 ? ra : std::max(ra, rb));
+        uint32_t cols = ca == 1 ? cb : (cb == 1 ? ca : std::max(ca, cb));
+        std::vector<CellValue> cells;
+        cells.reserve(static_cast<size_t>(rows) * cols);
+        for (uint32_t r = 0; r < rows; ++r)
+            for (uint32_t c = 0; c < cols; ++c)
+                cells.push_back(apply_binary(e.op, element(a, r, c), element(b, r, c)));
+        return Operand::matrix(rows, cols, std::move(cells));
+    }
+
+    CellValue eval_scalar(uint32_t index, const EvalContext &ctx)
+    {
+        return to_scalar(eval(index, ctx), ctx);
+    }
+
+    // Implicit intersection: a one-column reference yields the cell on the
+    // formula's row, a one-row reference the cell in its column.
+    CellValue to_scalar(const Operand &op, const EvalContext &ctx)
+    {
+        if (op.kind == Operand::Scalar)
+            return op.value;
+        if (op.kind == Operand::Matrix)
+            return op.cells.empty() ? CellValue::err(CellError::Value) : op.cells[0];
+        const CellArea &a = op.area;
+        if (a.r1 == a.r2 && a.c1 == a.c2)
+            return value_at(a.sheet, a.r1, a.c1);
+        if (a.c1 == a.c2 && ctx.row >= a.r1 && ctx.row <= a.r2)
+            return value_at(a.sheet, ctx.row, a.c1);
+        if (a.r1 == a.r2 && ctx.col >= a.c1 && ctx.col <= a.c2)
+            return value_at(a.sheet, a.r1, ctx.col);
+        return CellValue::err(CellError::Value);
+    }
+
+    static bool is_single(const Operand &op)
+    {
+        return op.kind == Operand::Scalar || (op.rows == 1 && op.cols == 1);
+    }
+
+    // Shape of an operand, with whole-row/column references trimmed to the
+    // used part of the workbook so element-wise work stays proportional.
+    void dims(const Operand &op, uint32_t &rows, uint32_t &cols) const
+    {
+        if (op.kind == Operand::Scalar)
+        {
+            rows = cols = 1;
+            return;
+        }
+        rows = op.rows;
+        cols = op.cols;
+        if (op.kind == Operand::Range)
+        {
+            if (op.area.r2 >= used_rows_ && op.rows > 1)
+                rows = op.area.r1 >= used_rows_ ? 1 : used_rows_ - op.area.r1;
+            if (op.area.c2 >= used_cols_ && op.cols > 1)
+                cols = op.area.c1 >= used_cols_ ? 1 : used_cols_ - op.area.c1;
+        }
+    }
+
+    // Element (r, c) of an operand; single rows/columns broadcast, anything
+    // outside the shape is #N/A as in Excel array arithmetic.
+    CellValue element(const Operand &op, uint32_t r, uint32_t c)
+    {
+        if (op.kind == Operand::Scalar)
+            return op.value;
+        if (op.rows == 1)
+            r = 0;
+        if (op.cols == 1)
+            c = 0;
+        if (r >= op.rows || c >= op.cols)
+            return CellValue::err(CellError::NA);
+        if (op.kind == Operand::Matrix)
+            return op.cells[static_cast<size_t>(r) * op.cols + c];
+        return value_at(op.area.sheet, op.area.r1 + r, op.area.c1 + c);
+    }
+
+    // Visits each value of an operand in row-major order. References skip
+    // the unused tail of whole-row/column ranges (those cells are blank).
+    template <typename Fn>
+    void for_each_value(const Operand &op, Fn fn)
+    {
+        if (op.kind != Operand::Range)
+        {
+            if (op.kind == Operand::Scalar)
+                fn(op.value);
+            else
+                for (const auto &v : op.cells)
+                    fn(v);
+            return;
+        }
+        uint32_t rows, cols;
+        dims(op, rows, cols);
+        const CellArea &a = op.area;
+        if (uint64_t(rows) * cols > model_->sheet_cell_count(a.sheet) * 4 + overlay_.size() + 64)
+        {
+            // Sparse: walk stored cells in the area instead of every coordinate.
+            std::vector<uint64_t> hits;
+            model_->collect_cells_in(a, rows, cols, hits);
+            for (const auto &kv : overlay_)
+            {
+                uint32_t s = static_cast<uint32_t>(kv.first >> 34);
+                uint32_t r = static_cast<uint32_t>((kv.first >> 14) & 0xFFFFF), c = static_cast<uint32_t>(kv.first & 0x3FFF);
+                if (s == a.sheet && r >= a.r1 && r < a.r1 + rows && c >= a.c1 && c < a.c1 + cols)
+                    hits.push_back(kv.first);
+            }
+            std::sort(hits.begin(), hits.end());
+            hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+            for (uint64_t h : hits)
+                fn(value_at(a.sheet, static_cast<uint32_t>((h >> 14) & 0xFFFFF), static_cast<uint32_t>(h & 0x3FFF)));
+            return;
+        }
+        for (uint32_t r = 0; r < rows; ++r)
+            for (uint32_t c = 0; c < cols; ++c)
+                fn(value_at(a.sheet, a.r1 + r, a.c1 + c));
+    }
+
+    // Serial number of the current local time, for NOW() and TODAY().
+    double now_serial() const
+    {
+        std::time_t t = std::time(nullptr);
+        std::tm tm_buf{};
+        localtime_s(&tm_buf, &t);
+        return date_serial(tm_buf.tm_year + 1900, tm_buf.tm_mon + 1, tm_buf.tm_mday, model_->date1904()) +
+               (tm_buf.tm_hour * 3600 + tm_buf.tm_min * 60 + tm_buf.tm_sec) / 86400.0;
+    }
+
+private:
+    // A cell this session changed or recalculated. `constant` marks a value
+    // the session wrote, which hides any formula the model has there.
+    struct Overlay
+    {
+        CellValue value;
+        bool date = false;
+        bool constant = false;
+    };
+
+    bool formula_active(uint32_t f) const
+    {
+        return replaced_.empty() || !replaced_.count(f);
+    }
+
+    // Visits every cell of the area in row-major order, passing this
+    // session's entry for it if there is one and otherwise the model's slot
+    // (empty for blanks). Dirty formulas in the area are recalculated up
+    // front; the model is read through column cursors, with the session's
+    // cells merged in key order.
+    template <typename Fn>
+    void scan_area(const CellArea &area, Fn fn)
+    {
+        if (!dirty_.empty())
+        {
+            model_->for_each_formula_in(area, [&](uint32_t f)
+                                        {
+                if (dirty_.count(f) && !on_stack_.count(f))
+                    recalc(f); });
+        }
+        std::vector<std::pair<uint64_t, const Overlay *>> local;
+        for (const auto &kv : overlay_)
+        {
+            uint32_t s = static_cast<uint32_t>(kv.first >> 34);
+            uint32_t r = static_cast<uint32_t>((kv.first >> 14) & 0xFFFFF), c = static_cast<uint32_t>(kv.first & 0x3FFF);
+            if (area.contains(s, r, c))
+                local.push_back({kv.first, &kv.second});
+        }
+        std::sort(local.begin(), local.end(), [](const std::pair<uint64_t, const Overlay *> &a, const std::pair<uint64_t, const Overlay *> &b)
+                  { return a.first < b.first; });
+        std::vector<WorkbookModel::ColumnCursor> cursors;
+        cursors.reserve(area.c2 - area.c1 + 1);
+        for (uint32_t c = area.c1; c <= area.c2; ++c)
+            cursors.emplace_back(*model_, area.sheet, c, area.r1);
+        size_t next = 0;
+        for (uint32_t r = area.r1; r <= area.r2; ++r)
+        {
+            for (uint32_t c = area.c1; c <= area.c2; ++c)
+            {
+                WorkbookModel::CellSlot slot = cursors[c - area.c1].at(r);
+                const Overlay *entry = nullptr;
+                if (next < local.size() && local[next].first == WorkbookModel::global_key(area.sheet, r, c))
+                    entry = local[next++].second;
+                fn(r, c, entry, slot);
+            }
+        }
+    }
+
+    bool is_date(uint32_t sheet, uint32_t row, uint32_t col) const
+    {
+        auto it = overlay_.find(WorkbookModel::global_key(sheet, row, col));
+        if (it != overlay_.end())
+            return it->second.date;
+        WorkbookModel::CellSlot base = model_->find_cell(sheet, row, col);
+        return base && base.date();
+    }
+
+    void append_number_json(double num, bool date, std::string &out) const
+    {
+        int y, m, d;
+        if (date && serial_to_date(num, model_->date1904(), y, m, d) && d > 0)
+        {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "\"%04d-%02d-%02d\"", y, m, d);
+            out += buf;
+        }
+        else
+        {
+            out += format_json_number(num);
+        }
+    }
+
+    void append_value_json(const CellValue &v, bool date, std::string &out) const
+    {
+        switch (v.type)
+        {
+        case CellValue::Number:
+            append_number_json(v.num, date, out);
+            break;
+        case CellValue::Text:
+            out += "\"" + json_escape(v.text) + "\"";
+            break;
+        case CellValue::Bool:
+            out += v.num != 0.0 ? "true" : "false";
+            break;
+        default:
+            out += "null"; // blanks and error values, as VT_EMPTY/VT_ERROR on the COM path
+            break;
+        }
+    }
+
+    // As append_value_json, straight from the model's arrays.
+    void append_slot_json(const WorkbookModel::CellSlot &slot, std::string &out) const
+    {
+        switch (slot.type())
+        {
+        case CellValue::Number:
+            append_number_json(slot.num(), slot.date(), out);
+            break;
+        case CellValue::Text:
+            out.push_back('"');
+            out += json_escape(model_->text(slot));
+            out.push_back('"');
+            break;
+        case CellValue::Bool:
+            out += slot.num() != 0.0 ? "true" : "false";
+            break;
+        default:
+            out += "null";
+            break;
+        }
+    }
+
+    // -- Calculation
+
+    void mark_formula_dirty(uint32_t f)
+    {
+        if (!formula_active(f) || !dirty_.insert(f).second)
+            return;
+        const WorkbookModel::Formula &fm = model_->formula(f);
+        mark_dependents(fm.sheet, fm.row, fm.col);
+    }
+
+    // Flags every formula downstream of a changed cell. Iterative, so long
+    // dependency chains cannot exhaust the stack.
+    void mark_dependents(uint32_t sheet, uint32_t row, uint32_t col)
+    {
+        std::vector<uint64_t> work{WorkbookModel::global_key(sheet, row, col)};
+        auto visit = [&](uint32_t f)
+        {
+            if (!formula_active(f) || !dirty_.insert(f).second)
+                return;
+            const WorkbookModel::Formula &fm = model_->formula(f);
+            work.push_back(WorkbookModel::global_key(fm.sheet, fm.row, fm.col));
+        };
+        while (!work.empty())
+        {
+            uint64_t key = work.back();
+            work.pop_back();
+            model_->for_each_dependent(static_cast<uint32_t>(key >> 34), static_cast<uint32_t>((key >> 14) & 0xFFFFF),
+                                       static_cast<uint32_t>(key & 0x3FFF), visit);
+        }
+    }
+
+    // Recalculates a dirty formula after its dirty precedents, depth-first
+    // with an explicit stack. A formula met again while still on the stack is
+    // a circular reference; it keeps its previous value, as Excel does with
+    // iteration off.
+    void recalc(uint32_t target)
+    {
+        std::vector<std::pair<uint32_t, bool>> stack{{target, false}};
+        while (!stack.empty())
+        {
+            uint32_t f = stack.back().first;
+            if (!dirty_.count(f))
+            {
+                on_stack_.erase(f);
+                stack.pop_back();
+                continue;
+            }
+            if (!stack.back().second)
+            {
+                if (on_stack_.count(f))
+                {
+                    stack.pop_back(); // duplicate entry deeper in a cycle
+                    continue;
+                }
+                stack.back().second = true;
+                on_stack_.insert(f);
+                for (const CellArea &a : model_->formula(f).precedents)
+                {
+                    model_->for_each_formula_in(a, [&](uint32_t p)
+                                                {
+                        if (dirty_.count(p) && !on_stack_.count(p))
+                            stack.push_back({p, false}); });
+                }
+                continue;
+            }
+            stack.pop_back();
+            evaluate(f);
+            dirty_.erase(f);
+            on_stack_.erase(f);
+        }
+    }
+
+    void evaluate(uint32_t f)
+    {
+        const WorkbookModel::Formula &fm = model_->formula(f);
+        EvalContext ctx;
+        ctx.sheet = fm.sheet;
+        ctx.row = fm.row;
+        ctx.col = fm.col;
+        ctx.dr = fm.dr;
+        ctx.dc = fm.dc;
+        ctx.array = fm.array;
+        CellValue v = eval_scalar(fm.root, ctx);
+        // A formula that refers to an empty cell shows 0, not a blank.
+        if (v.type == CellValue::Empty)
+            v = CellValue::number(0.0);
+        ++recalc_count_;
+        Overlay &cell = overlay_[WorkbookModel::global_key(fm.sheet, fm.row, fm.col)];
+        cell.value = std::move(v);
+        cell.date = model_->find_cell(fm.sheet, fm.row, fm.col).date();
+    }
+
+    std::shared_ptr<const WorkbookModel> model_;
+    std::unordered_map<uint64_t, Overlay> overlay_; // global_key -> cell
+    std::unordered_set<uint32_t> dirty_;
+    std::unordered_set<uint32_t> on_stack_;
+    std::unordered_set<uint32_t> replaced_; // model formulas overwritten by set_value
+    uint32_t used_rows_, used_cols_;
+    uint64_t recalc_count_ = 0;
+    std::mt19937_64 rng_;
+};
+
+// -------------------- Native engine: functions --------------------
+// Each function receives its call node and evaluates arguments itself, so
+// IF/IFERROR/CHOOSE only evaluate the branch they return.
+
+// Argument access for function bodies. The first error met is kept and
+// becomes the function's result.
+struct FnArgs
+{
+    NativeWorkbook &wb;
+    const Expr &call;
+    const EvalContext &ctx;
+    bool failed = false;
+    CellError error = CellError::Value;
+
+    FnArgs(NativeWorkbook &w, const Expr &c, const EvalContext &x) : wb(w), call(c), ctx(x) {}
+
+    size_t count() const { return call.args.size(); }
+    bool has(size_t i) const { return i < call.args.size(); }
+    bool missing(size_t i) const { return i >= call.args.size() || wb.node(call.args[i]).op == ExprOp::Missing; }
+    Operand operand(size_t i) { return wb.eval(call.args[i], ctx); }
+    CellValue value(size_t i) { return wb.eval_scalar(call.args[i], ctx); }
+
+    void fail(CellError e)
+    {
+        if (!failed)
+        {
+            failed = true;
+            error = e;
+        }
+    }
+
+    double number(size_t i, double def = 0.0)
+    {
+        if (failed)
+            return 0.0;
+        if (!has(i))
+            return def;
+        double d = 0.0;
+        CellError e;
+        if (!value_to_number(value(i), d, e))
+            fail(e);
+        return d;
+    }
+
+    bool boolean(size_t i, bool def = false)
+    {
+        if (failed)
+            return false;
+        if (!has(i))
+            return def;
+        bool b = false;
+        CellError e;
+        if (!value_to_bool(value(i), b, e))
+            fail(e);
+        return b;
+    }
+
+    std::string text(size_t i, const std::string &def = "")
+    {
+        if (failed)
+            return "";
+        if (!has(i))
+            return def;
+        CellValue v = value(i);
+        if (v.type == CellValue::Error)
+        {
+            fail(v.error);
+            return "";
+        }
+        return value_to_text(v);
+    }
+
+    Operand result(CellValue v) const
+    {
+        return Operand::scalar(failed ? CellValue::err(error) : std::move(v));
+    }
+
+    Operand number_result(double d) const
+    {
+        if (failed)
+            return Operand::scalar(CellValue::err(error));
+        if (!std::isfinite(d))
+            return Operand::scalar(CellValue::err(CellError::Num));
+        return Operand::scalar(CellValue::number(d));
+    }
+
+    Operand error_result(CellError e) const
+    {
+        return Operand::scalar(CellValue::err(failed ? error : e));
+    }
+};
+
+// Aggregate rules: references and arrays contribute only their numbers,
+// direct arguments are coerced (so SUM("2",TRUE) is 3), and any error
+// value is the result.
+template <typename Fn>
+void for_each_number(FnArgs &a, size_t first, Fn fn)
+{
+    for (size_t i = first; i < a.count() && !a.failed; ++i)
+    {
+        if (a.missing(i))
+            continue;
+        Operand op = a.operand(i);
+        if (op.kind == Operand::Scalar)
+        {
+            const CellValue &v = op.value;
+            double d;
+            if (v.type == CellValue::Error)
+                a.fail(v.error);
+            else if (v.type == CellValue::Text)
+            {
+                if (text_to_number(v.text, d))
+                    fn(d);
+                else
+                    a.fail(CellError::Value);
+            }
+            else if (v.type != CellValue::Empty)
+                fn(v.num);
+            continue;
+        }
+        a.wb.for_each_value(op, [&](const CellValue &v)
+                            {
+            if (a.failed)
+                return;
+            if (v.type == CellValue::Error)
+                a.fail(v.error);
+            else if (v.type == CellValue::Number)
+                fn(v.num); });
+    }
+}
+
+std::vector<double> collect_numbers(FnArgs &a, size_t first)
+{
+    std::vector<double> out;
+    for_each_number(a, first, [&](double d)
+                    { out.push_back(d); });
+    return out;
+}
+
+bool has_wildcards(const std::string &s)
+{
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        if (s[i] == '~')
+            ++i;
+        else if (s[i] == '*' || s[i] == '?')
+            return true;
+    }
+    return false;
+}
+
+// Case-insensitive match with Excel wildcards: * any run, ? one character,
+// ~ escapes the next one.
+bool wildcard_match(const std::string &pattern, const std::string &text)
+{
+    size_t p = 0, t = 0, star = std::string::npos, mark = 0;
+    while (t < text.size())
+    {
+        if (p < pattern.size() && pattern[p] == '*')
+        {
+            star = ++p;
+            mark = t;
+            continue;
+        }
+        if (p < pattern.size())
+        {
+            char pc = pattern[p];
+            size_t step = 1;
+            bool literal = false;
+            if (pc == '~' && p + 1 < pattern.size())
+            {
+                pc = pattern[p + 1];
+                step = 2;
+                literal = true;
+            }
+            if ((!literal && pc == '?') || std::tolower(static_cast<unsigned char>(pc)) == std::tolower(static_cast<unsigned char>(text[t])))
+            {
+                p += step;
+                ++t;
+                continue;
+            }
+        }
+        if (star == std::string::npos)
+            return false;
+        p = star;
+        t = ++mark;
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        ++p;
+    return p == pattern.size();
+}
+
+// Where the first run of `text` at or after `from` that matches `pattern`
+// starts, as SEARCH finds it; npos if there is none. Only the part before
+// the first * is tried at each start. Past it the rest is found leftmost
+// first, and if that fails a later start cannot do better, so the search
+// is O(n*m) rather than one full match per start and end.
+size_t wildcard_find(const std::string &pattern, const std::string &text, size_t from)
+{
+    for (size_t i = from; i <= text.size(); ++i)
+    {
+        size_t p = 0, t = i, star = std::string::npos, mark = 0;
+        for (;;)
+        {
+            if (p == pattern.size())
+                return i;
+            if (pattern[p] == '*')
+            {
+                while (p < pattern.size() && pattern[p] == '*')
+                    ++p;
+                if (p == pattern.size())
+                    return i;
+                star = p;
+                mark = t;
+                continue;
+            }
+            if (t < text.size())
+            {
+                char pc = pattern[p];
+                size_t step = 1;
+                bool literal = false;
+                if (pc == '~' && p + 1 < pattern.size())
+                {
+                    pc = pattern[p + 1];
+                    step = 2;
+                    literal = true;
+                }
+                if ((!literal && pc == '?') || std::tolower(static_cast<unsigned char>(pc)) == std::tolower(static_cast<unsigned char>(text[t])))
+                {
+                    p += step;
+                    ++t;
+                    continue;
+                }
+            }
+            if (star == std::string::npos)
+                break; // the part before the first * does not match here
+            if (mark >= text.size())
+                return std::string::npos;
+            p = star;
+            t = ++mark;
+        }
+    }
+    return std::string::npos;
+}
+
+// COUNTIF-style criteria: ">=10", "<>done", "a*", or a plain value.
+struct Criterion
+{
+    ExprOp op = ExprOp::Eq;
+    CellValue operand;
+    bool wildcard = false;
+
+    static Criterion parse(const CellValue &v)
+    {
+        Criterion c;
+        if (v.type != CellValue::Text)
+        {
+            c.operand = v.type == CellValue::Empty ? CellValue::string("") : v;
+            return c;
+        }
+        std::string s = v.text;
+        static const std::pair<const char *, ExprOp> kOps[] = {
+            {"<=", ExprOp::Le}, {">=", ExprOp::Ge}, {"<>", ExprOp::Ne}, {"<", ExprOp::Lt}, {">", ExprOp::Gt}, {"=", ExprOp::Eq}};
+        for (const auto &o : kOps)
+        {
+            size_t len = std::strlen(o.first);
+            if (s.compare(0, len, o.first) == 0)
+            {
+                c.op = o.second;
+                s = s.substr(len);
+                break;
+            }
+        }
+        double d;
+        CellError e;
+        std::string upper = s;
+        for (auto &ch : upper)
+            ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+        if (text_to_number(s, d))
+            c.operand = CellValue::number(d);
+        else if (upper == "TRUE" || upper == "FALSE")
+            c.operand = CellValue::boolean(upper == "TRUE");
+        else if (parse_cell_error(upper, e))
+            c.operand = CellValue::err(e);
+        else
+        {
+            c.operand = CellValue::string(s);
+            c.wildcard = (c.op == ExprOp::Eq || c.op == ExprOp::Ne) && has_wildcards(s);
+        }
+        return c;
+    }
+
+    bool matches(const CellValue &cell) const
+    {
+        bool same_kind = false;
+        int cmp = 0;
+        switch (operand.type)
+        {
+        case CellValue::Number:
+            same_kind = cell.type == CellValue::Number;
+            if (same_kind)
+                cmp = cell.num < operand.num ? -1 : (cell.num > operand.num ? 1 : 0);
+            break;
+        case CellValue::Bool:
+            same_kind = cell.type == CellValue::Bool;
+            if (same_kind)
+                cmp = cell.num < operand.num ? -1 : (cell.num > operand.num ? 1 : 0);
+            break;
+        case CellValue::Error:
+            same_kind = cell.type == CellValue::Error;
+            cmp = same_kind && cell.error == operand.error ? 0 : 1;
+            break;
+        default:
+            if (operand.text.empty() && (op == ExprOp::Eq || op == ExprOp::Ne))
+            {
+                bool blank = cell.type == CellValue::Empty || (cell.type == CellValue::Text && cell.text.empty());
+                return op == ExprOp::Eq ? blank : !blank;
+            }
+            same_kind = cell.type == CellValue::Text;
+            if (same_kind)
+                cmp = wildcard ? (wildcard_match(operand.text, cell.text) ? 0 : 1) : compare_text_ci(cell.text, operand.text);
+            break;
+        }
+        if (!same_kind)
+            return op == ExprOp::Ne;
+        switch (op)
+        {
+        case ExprOp::Eq:
+            return cmp == 0;
+        case ExprOp::Ne:
+            return cmp != 0;
+        case ExprOp::Lt:
+            return cmp < 0;
+        case ExprOp::Le:
+            return cmp <= 0;
+        case ExprOp::Gt:
+            return cmp > 0;
+        default:
+            return cmp >= 0;
+        }
+    }
+};
+
+// Shared body of the *IF/*IFS family: calls fn(r, c) for every position of
+// the first criteria range where all criteria hold.
+template <typename Fn>
+void for_each_criteria_match(FnArgs &a, size_t first_pair, Fn fn)
+{
+    std::vector<Operand> ranges;
+    std::vector<Criterion> criteria;
+    for (size_t i = first_pair; i + 1 < a.count(); i += 2)
+    {
+        ranges.push_back(a.operand(i));
+        CellValue cv = a.value(i + 1);
+        criteria.push_back(Criterion::parse(cv));
+    }
+    if (ranges.empty())
+        return;
+    uint32_t rows, cols;
+    a.wb.dims(ranges[0], rows, cols);
+    for (size_t k = 1; k < ranges.size(); ++k)
+    {
+        if (ranges[k].rows != ranges[0].rows || ranges[k].cols != ranges[0].cols)
+        {
+            a.fail(CellError::Value);
+            return;
+        }
+    }
+    for (uint32_t r = 0; r < rows; ++r)
+    {
+        for (uint32_t c = 0; c < cols; ++c)
+        {
+            bool ok = true;
+            for (size_t k = 0; k < ranges.size() && ok; ++k)
+                ok = criteria[k].matches(a.wb.element(ranges[k], r, c));
+            if (ok)
+                fn(r, c);
+        }
+    }
+}
+
+// Excel's ROUND: half away from zero, on the value as displayed to 15 digits
+// so that 2.675 rounds to 2.68.
+double round_digits(double x, double digits, int mode)
+{
+    int n = static_cast<int>(digits);
+    double scale = std::pow(10.0, n);
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.15g", x * scale);
+    double y = std::strtod(buf, nullptr);
+    if (mode == 0)
+        y = std::round(y);
+    else if (mode > 0)
+        y = y < 0 ? -std::ceil(-y) : std::ceil(y);
+    else
+        y = std::trunc(y);
+    return y / scale;
+}
+
+size_t utf8_offset(const std::string &s, size_t chars)
+{
+    size_t i = 0;
+    while (i < s.size() && chars > 0)
+    {
+        ++i;
+        while (i < s.size() && (static_cast<unsigned char>(s[i]) & 0xC0) == 0x80)
+            ++i;
+        --chars;
+    }
+    return i;
+}
+
+size_t utf8_length(const std::string &s)
+{
+    size_t n = 0;
+    for (unsigned char c : s)
+    {
+        if ((c & 0xC0) != 0x80)
+            ++n;
+    }
+    return n;
+}
+
+std::string ascii_case(std::string s, bool upper)
+{
+    for (auto &c : s)
+        c = static_cast<char>(upper ? std::toupper(static_cast<unsigned char>(c)) : std::tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+
+// TEXT(): dates (yyyy, mmm, dd, hh:mm:ss, AM/PM) and numbers with fixed
+// decimals, thousands separators, percent and literal prefix/suffix.
+std::string format_with_pattern(double v, const std::string &pattern, bool date1904)
+{
+    std::string fmt = pattern;
+    if (fmt.empty() || ascii_case(fmt, false) == "general")
+        return format_general(v);
+    size_t semi = fmt.find(';');
+    if (semi != std::string::npos)
+    {
+        if (v < 0)
+        {
+            fmt = fmt.substr(semi + 1);
+            size_t next = fmt.find(';');
+            if (next != std::string::npos)
+                fmt = fmt.substr(0, next);
+            v = -v;
+        }
+        else
+        {
+            fmt = fmt.substr(0, semi);
+        }
+    }
+    if (number_format_is_date(fmt))
+    {
+        int y, m, d;
+        if (!serial_to_date(v, date1904, y, m, d))
+            return format_general(v);
+        double frac = v - std::floor(v);
+        long secs = static_cast<long>(std::floor(frac * 86400.0 + 0.5));
+        int hh = static_cast<int>(secs / 3600 % 24), mi = static_cast<int>(secs / 60 % 60), ss = static_cast<int>(secs % 60);
+        bool ampm = ascii_case(fmt, true).find("AM/PM") != std::string::npos;
+        static const char *kMonths[] = {"January", "February", "March", "April", "May", "June", "July", "August", "September", "October", "November", "December"};
+        static const char *kDays[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+        int64_t serial_day = static_cast<int64_t>(std::floor(v)) + (date1904 ? 1462 : 0);
+        int dow = static_cast<int>(((serial_day - 1) % 7 + 7) % 7);
+        std::string out;
+        bool last_was_hour = false;
+        for (size_t i = 0; i < fmt.size();)
+        {
+            char c = static_cast<char>(std::tolower(static_cast<unsigned char>(fmt[i])));
+            size_t run = 1;
+            while (i + run < fmt.size() && std::tolower(static_cast<unsigned char>(fmt[i + run])) == c)
+                ++run;
+            char buf[16];
+            if (c == 'y')
+            {
+                std::snprintf(buf, sizeof(buf), run <= 2 ? "%02d" : "%04d", run <= 2 ? y % 100 : y);
+                out += buf;
+            }
+            else if (c == 'm')
+            {
+                // "m" after hours or before seconds means minutes.
+                size_t k = i + run;
+                while (k < fmt.size() && !std::isalpha(static_cast<unsigned char>(fmt[k])))
+                    ++k;
+                bool minutes = last_was_hour || (k < fmt.size() && std::tolower(static_cast<unsigned char>(fmt[k])) == 's');
+                if (minutes)
+                    std::snprintf(buf, sizeof(buf), run >= 2 ? "%02d" : "%d", mi), out += buf;
+                else if (run >= 4)
+                    out += kMonths[m - 1];
+                else if (run == 3)
+                    out += std::string(kMonths[m - 1]).substr(0, 3);
+                else
+                    std::snprintf(buf, sizeof(buf), run == 2 ? "%02d" : "%d", m), out += buf;
+            }
+            else if (c == 'd')
+            {
+                if (run >= 4)
+                    out += kDays[dow];
+                else if (run == 3)
+                    out += std::string(kDays[dow]).substr(0, 3);
+                else
+                    std::snprintf(buf, sizeof(buf), run == 2 ? "%02d" : "%d", d), out += buf;
+            }
+            else if (c == 'h')
+            {
+                int h = ampm ? (hh % 12 == 0 ? 12 : hh % 12) : hh;
+                std::snprintf(buf, sizeof(buf), run >= 2 ? "%02d" : "%d", h);
+                out += buf;
+            }
+            else if (c == 's')
+            {
+                std::snprintf(buf, sizeof(buf), run >= 2 ? "%02d" : "%d", ss);
+                out += buf;
+            }
+            else if (c == 'a' && ascii_case(fmt.substr(i, 5), true) == "AM/PM")
+            {
+                out += hh < 12 ? "AM" : "PM";
+                run = 5;
+            }
+            else if (c == '"')
+            {
+                size_t e = fmt.find('"', i + 1);
+                out += fmt.substr(i + 1, (e == std::string::npos ? fmt.size() : e) - i - 1);
+                run = (e == std::string::npos ? fmt.size() : e + 1) - i;
+            }
+            else if (c == '\\' && i + 1 < fmt.size())
+            {
+                out.push_back(fmt[i + 1]);
+                run = 2;
+            }
+            else
+            {
+                out.append(fmt, i, run);
+            }
+            if (std::isalpha(static_cast<unsigned char>(c)))
+                last_was_hour = c == 'h';
+            i += run;
+        }
+        return out;
+    }
+    std::string prefix, suffix;
+    int decimals = 0, min_int = 0, percents = 0;
+    bool thousands = false, in_number = false, after_point = false, done_number = false;
+    for (size_t i = 0; i < fmt.size(); ++i)
+    {
+        char c = fmt[i];
+        std::string lit;
+        if (c == '"')
+        {
+            size_t e = fmt.find('"', i + 1);
+            lit = fmt.substr(i + 1, (e == std::string::npos ? fmt.size() : e) - i - 1);
+            i = e == std::string::npos ? fmt.size() : e;
+        }
+        else if (c == '\\' && i + 1 < fmt.size())
+            lit = fmt.substr(++i, 1);
+        else if (c == '_' || c == '*')
+        {
+            ++i;
+            continue;
+        }
+        else if ((c == '0' || c == '#' || c == '?') && !done_number)
+        {
+            in_number = true;
+            if (after_point)
+                ++decimals;
+            else if (c == '0')
+                ++min_int;
+            continue;
+        }
+        else if (c == '.' && in_number && !done_number)
+        {
+            after_point = true;
+            continue;
+        }
+        else if (c == ',' && in_number && !after_point && !done_number)
+        {
+            thousands = true;
+            continue;
+        }
+        else if (c == '%')
+        {
+            ++percents;
+            lit = "%";
+        }
+        else
+            lit = std::string(1, c);
+        if (in_number)
+            done_number = true;
+        (done_number ? suffix : prefix) += lit;
+    }
+    for (int i = 0; i < percents; ++i)
+        v *= 100.0;
+    if (!in_number)
+        return prefix + suffix;
+    v = round_digits(v, decimals, 0);
+    char buf[400];
+    std::snprintf(buf, sizeof(buf), "%.*f", decimals, std::fabs(v));
+    std::string num = buf;
+    size_t point = num.find('.');
+    std::string int_part = num.substr(0, point);
+    std::string frac_part = point == std::string::npos ? "" : num.substr(point);
+    if (int_part == "0" && min_int == 0)
+        int_part.clear();
+    while (static_cast<int>(int_part.size()) < min_int)
+        int_part.insert(int_part.begin(), '0');
+    if (thousands)
+    {
+        for (int i = static_cast<int>(int_part.size()) - 3; i > 0; i -= 3)
+            int_part.insert(static_cast<size_t>(i), ",");
+    }
+    bool negative = v < 0 && semi == std::string::npos;
+    return (negative ? "-" : "") + prefix + int_part + frac_part + suffix;
+}
+
+// Position of key along a one-row or one-column operand. mode 0 is an exact
+// match (wildcards allowed for text), 1 the largest value <= key in an
+// ascending list (binary search), -1 the smallest value >= key in a
+// descending one. Returns -1 when nothing matches.
+long match_position(NativeWorkbook &wb, const Operand &vec, const CellValue &key, int mode)
+{
+    uint32_t rows, cols;
+    wb.dims(vec, rows, cols);
+    bool vertical = cols == 1 || vec.rows > 1;
+    uint32_t n = vertical ? rows : cols;
+    auto at = [&](uint32_t i)
+    { return vertical ? wb.element(vec, i, 0) : wb.element(vec, 0, i); };
+    if (mode == 0)
+    {
+        bool wild = key.type == CellValue::Text && has_wildcards(key.text);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            CellValue v = at(i);
+            if (wild ? (v.type == CellValue::Text && wildcard_match(key.text, v.text))
+                     : (v.type == key.type || (key.type == CellValue::Empty && v.type == CellValue::Empty)) && compare_values(v, key) == 0)
+                return static_cast<long>(i);
+        }
+        return -1;
+    }
+    if (mode > 0)
+    {
+        long lo = 0, hi = static_cast<long>(n) - 1, best = -1;
+        while (lo <= hi)
+        {
+            long mid = lo + (hi - lo) / 2;
+            CellValue v = at(static_cast<uint32_t>(mid));
+            if (v.type == CellValue::Empty || compare_values(v, key) <= 0)
+            {
+                if (v.type != CellValue::Empty)
+                    best = mid;
+                lo = mid + 1;
+            }
+            else
+                hi = mid - 1;
+        }
+        return best;
+    }
+    long best = -1;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        CellValue v = at(i);
+        if (compare_values(v, key) < 0)
+            break;
+        best = static_cast<long>(i);
+    }
+    return best;
+}
+
+Operand fn_sum(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double total = 0.0;
+    for_each_number(a, 0, [&](double d)
+                    { total += d; });
+    return a.number_result(total);
+}
+
+Operand fn_product(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double total = 1.0;
+    bool any = false;
+    for_each_number(a, 0, [&](double d)
+                    { total *= d, any = true; });
+    return a.number_result(any ? total : 0.0);
+}
+
+Operand fn_count(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double n = 0;
+    for (size_t i = 0; i < a.count(); ++i)
+    {
+        Operand op = a.operand(i);
+        if (op.kind == Operand::Scalar)
+        {
+            double d;
+            const CellValue &v = op.value;
+            if (v.type == CellValue::Number || v.type == CellValue::Bool || (v.type == CellValue::Text && text_to_number(v.text, d)))
+                ++n;
+            continue;
+        }
+        wb.for_each_value(op, [&](const CellValue &v)
+                          { n += v.type == CellValue::Number ? 1 : 0; });
+    }
+    return a.number_result(n);
+}
+
+Operand fn_counta(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double n = 0;
+    for (size_t i = 0; i < a.count(); ++i)
+    {
+        if (a.missing(i))
+            continue;
+        wb.for_each_value(a.operand(i), [&](const CellValue &v)
+                          { n += v.type != CellValue::Empty ? 1 : 0; });
+    }
+    return a.number_result(n);
+}
+
+Operand fn_countblank(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    Operand op = a.operand(0);
+    double filled = 0;
+    wb.for_each_value(op, [&](const CellValue &v)
+                      { filled += (v.type != CellValue::Empty && !(v.type == CellValue::Text && v.text.empty())) ? 1 : 0; });
+    return a.number_result(static_cast<double>(op.rows) * op.cols - filled);
+}
+
+Operand fn_average(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double total = 0.0, n = 0;
+    for_each_number(a, 0, [&](double d)
+                    { total += d, ++n; });
+    if (!a.failed && n == 0)
+        return a.error_result(CellError::Div0);
+    return a.number_result(total / n);
+}
+
+Operand fn_min_max(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool want_max)
+{
+    FnArgs a(wb, call, ctx);
+    bool any = false;
+    double best = 0.0;
+    for_each_number(a, 0, [&](double d)
+                    {
+        if (!any || (want_max ? d > best : d < best))
+            best = d;
+        any = true; });
+    return a.number_result(best);
+}
+
+Operand fn_median(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::vector<double> v = collect_numbers(a, 0);
+    if (a.failed || v.empty())
+        return a.error_result(CellError::Num);
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return a.number_result(n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2.0);
+}
+
+Operand fn_large_small(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool large)
+{
+    FnArgs a(wb, call, ctx);
+    std::vector<double> v;
+    Operand op = a.operand(0);
+    if (op.kind == Operand::Scalar)
+        v.push_back(a.number(0));
+    else
+        wb.for_each_value(op, [&](const CellValue &c)
+                          {
+            if (c.type == CellValue::Error)
+                a.fail(c.error);
+            else if (c.type == CellValue::Number)
+                v.push_back(c.num); });
+    double k = std::ceil(a.number(1));
+    if (a.failed || k < 1 || k > static_cast<double>(v.size()))
+        return a.error_result(CellError::Num);
+    size_t idx = static_cast<size_t>(k) - 1;
+    if (large)
+        std::nth_element(v.begin(), v.begin() + idx, v.end(), std::greater<double>());
+    else
+        std::nth_element(v.begin(), v.begin() + idx, v.end());
+    return a.number_result(v[idx]);
+}
+
+Operand fn_sumproduct(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    EvalContext actx = ctx;
+    actx.array = true;
+    FnArgs a(wb, call, actx);
+    std::vector<Operand> ops;
+    uint32_t rows = 0, cols = 0;
+    for (size_t i = 0; i < a.count(); ++i)
+    {
+        ops.push_back(a.operand(i));
+        uint32_t r, c;
+        wb.dims(ops.back(), r, c);
+        if (i == 0)
+            rows = r, cols = c;
+        else if (r != rows || c != cols)
+            return a.error_result(CellError::Value);
+    }
+    double total = 0.0;
+    for (uint32_t r = 0; r < rows; ++r)
+    {
+        for (uint32_t c = 0; c < cols; ++c)
+        {
+            double p = 1.0;
+            for (const auto &op : ops)
+            {
+                CellValue v = wb.element(op, r, c);
+                if (v.type == CellValue::Error)
+                    return a.error_result(v.error);
+                p *= v.type == CellValue::Number ? v.num : 0.0;
+            }
+            total += p;
+        }
+    }
+    return a.number_result(total);
+}
+
+// SUMIF / AVERAGEIF / COUNTIF: (range, criteria[, sum_range]).
+Operand fn_if_family(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    Operand range = a.operand(0);
+    Criterion crit = Criterion::parse(a.value(1));
+    Operand values = a.has(2) ? a.operand(2) : range;
+    if (values.kind == Operand::Range)
+    {
+        // Only the top-left of sum_range matters; it takes the criteria range's shape.
+        values.area.r2 = std::min(kSheetMaxRows - 1, values.area.r1 + range.rows - 1);
+        values.area.c2 = std::min(kSheetMaxCols - 1, values.area.c1 + range.cols - 1);
+        values.rows = range.rows;
+        values.cols = range.cols;
+    }
+    uint32_t rows, cols;
+    wb.dims(range, rows, cols);
+    double total = 0.0, n = 0;
+    for (uint32_t r = 0; r < rows; ++r)
+    {
+        for (uint32_t c = 0; c < cols; ++c)
+        {
+            if (!crit.matches(wb.element(range, r, c)))
+                continue;
+            if (kind == 0)
+            {
+                ++n;
+                continue;
+            }
+            CellValue v = wb.element(values, r, c);
+            if (v.type == CellValue::Error)
+                return a.error_result(v.error);
+            if (v.type == CellValue::Number)
+                total += v.num, ++n;
+        }
+    }
+    if (kind == 0)
+        return a.number_result(n);
+    if (kind == 2)
+        return n == 0 ? a.error_result(CellError::Div0) : a.number_result(total / n);
+    return a.number_result(total);
+}
+
+// SUMIFS / AVERAGEIFS: (values, range1, crit1, ...); COUNTIFS: (range1, crit1, ...).
+Operand fn_ifs_family(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    if (kind != 0 && a.count() % 2 == 0)
+        return a.error_result(CellError::Value);
+    if (kind == 0 && a.count() % 2 == 1)
+        return a.error_result(CellError::Value);
+    Operand values = kind == 0 ? Operand() : a.operand(0);
+    double total = 0.0, n = 0;
+    for_each_criteria_match(a, kind == 0 ? 0 : 1, [&](uint32_t r, uint32_t c)
+                            {
+        if (kind == 0)
+        {
+            ++n;
+            return;
+        }
+        CellValue v = wb.element(values, r, c);
+        if (v.type == CellValue::Error)
+            a.fail(v.error);
+        else if (v.type == CellValue::Number)
+            total += v.num, ++n; });
+    if (kind == 0)
+        return a.number_result(n);
+    if (kind == 2)
+        return !a.failed && n == 0 ? a.error_result(CellError::Div0) : a.number_result(total / n);
+    return a.number_result(total);
+}
+
+Operand fn_math1(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, double (*f)(double))
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0);
+    return a.number_result(a.failed ? 0.0 : f(x));
+}
+
+Operand fn_round(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int mode)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0);
+    double n = a.number(1, 0.0);
+    return a.number_result(round_digits(x, n, mode));
+}
+
+Operand fn_ceiling_floor(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool ceiling)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0);
+    double sig = a.number(1, x < 0 ? -1.0 : 1.0);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (sig == 0.0)
+        return a.number_result(0.0);
+    if (x > 0 && sig < 0)
+        return a.error_result(CellError::Num);
+    double q = x / sig;
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.15g", q);
+    q = std::strtod(buf, nullptr);
+    q = ceiling ? std::ceil(q) : std::floor(q);
+    return a.number_result(q * sig);
+}
+
+Operand fn_ceiling_floor_math(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool ceiling)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0);
+    double sig = std::fabs(a.number(1, 1.0));
+    bool away = a.number(2, 0.0) != 0.0;
+    if (a.failed || sig == 0.0)
+        return a.number_result(0.0);
+    double q = x / sig;
+    if (x < 0 && away)
+        q = ceiling ? std::floor(q) : std::ceil(q);
+    else
+        q = ceiling ? std::ceil(q) : std::floor(q);
+    return a.number_result(q * sig);
+}
+
+Operand fn_mod(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0), y = a.number(1);
+    if (!a.failed && y == 0.0)
+        return a.error_result(CellError::Div0);
+    return a.number_result(x - y * std::floor(x / y));
+}
+
+Operand fn_power(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0), y = a.number(1);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    return Operand::scalar(apply_binary(ExprOp::Pow, CellValue::number(x), CellValue::number(y)));
+}
+
+Operand fn_log(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0), base = a.number(1, 10.0);
+    if (!a.failed && (x <= 0 || base <= 0 || base == 1.0))
+        return a.error_result(base == 1.0 ? CellError::Div0 : CellError::Num);
+    return a.number_result(std::log(x) / std::log(base));
+}
+
+Operand fn_mround(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double x = a.number(0), m = a.number(1);
+    if (a.failed || m == 0.0)
+        return a.number_result(0.0);
+    if ((x < 0) != (m < 0) && x != 0.0)
+        return a.error_result(CellError::Num);
+    return a.number_result(round_digits(x / m, 0, 0) * m);
+}
+
+Operand fn_randbetween(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double lo = std::ceil(a.number(0)), hi = std::floor(a.number(1));
+    // Past 2^53 not every integer is a double, and the cast could overflow.
+    static const double kMaxExact = 9007199254740992.0;
+    if (a.failed || lo > hi || lo < -kMaxExact || hi > kMaxExact)
+        return a.error_result(CellError::Num);
+    std::uniform_int_distribution<long long> dist(static_cast<long long>(lo), static_cast<long long>(hi));
+    return a.number_result(static_cast<double>(dist(wb.rng())));
+}
+
+Operand fn_if(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    bool cond = a.boolean(0);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (cond)
+        return a.operand(1);
+    if (!a.has(2))
+        return Operand::scalar(CellValue::boolean(false));
+    return a.operand(2);
+}
+
+Operand fn_ifs(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    for (size_t i = 0; i + 1 < a.count(); i += 2)
+    {
+        bool cond = a.boolean(i);
+        if (a.failed)
+            return a.error_result(CellError::Value);
+        if (cond)
+            return a.operand(i + 1);
+    }
+    return a.error_result(CellError::NA);
+}
+
+Operand fn_iferror(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool only_na)
+{
+    FnArgs a(wb, call, ctx);
+    Operand v = a.operand(0);
+    CellValue s = wb.to_scalar(v, ctx);
+    if (s.type == CellValue::Error && (!only_na || s.error == CellError::NA))
+        return a.operand(1);
+    return v;
+}
+
+// AND / OR / XOR over booleans and numbers; text in references is ignored.
+Operand fn_logical(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    int trues = 0, seen = 0;
+    for (size_t i = 0; i < a.count() && !a.failed; ++i)
+    {
+        Operand op = a.operand(i);
+        if (op.kind == Operand::Scalar)
+        {
+            bool b;
+            CellError e;
+            if (op.value.type == CellValue::Empty)
+                continue;
+            if (!value_to_bool(op.value, b, e))
+                a.fail(e);
+            trues += b ? 1 : 0;
+            ++seen;
+            continue;
+        }
+        wb.for_each_value(op, [&](const CellValue &v)
+                          {
+            if (v.type == CellValue::Error)
+                a.fail(v.error);
+            else if (v.type == CellValue::Number || v.type == CellValue::Bool)
+            {
+                trues += v.num != 0.0 ? 1 : 0;
+                ++seen;
+            } });
+    }
+    if (!a.failed && seen == 0)
+        return a.error_result(CellError::Value);
+    bool r = kind == 0 ? trues == seen : (kind == 1 ? trues > 0 : (trues % 2) == 1);
+    return a.result(CellValue::boolean(r));
+}
+
+Operand fn_switch(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue key = a.value(0);
+    if (key.type == CellValue::Error)
+        return Operand::scalar(key);
+    size_t i = 1;
+    for (; i + 1 < a.count(); i += 2)
+    {
+        CellValue v = a.value(i);
+        if (v.type == CellValue::Error)
+            return Operand::scalar(v);
+        if (v.type == key.type && compare_values(v, key) == 0)
+            return a.operand(i + 1);
+    }
+    return i < a.count() ? a.operand(i) : a.error_result(CellError::NA);
+}
+
+Operand fn_choose(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double idx = std::trunc(a.number(0));
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (idx < 1 || idx >= static_cast<double>(a.count()))
+        return a.error_result(CellError::Value);
+    return a.operand(static_cast<size_t>(idx));
+}
+
+Operand fn_is(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue v = a.value(0);
+    bool r = false;
+    switch (kind)
+    {
+    case 0:
+        r = v.type == CellValue::Empty;
+        break;
+    case 1:
+        r = v.type == CellValue::Number;
+        break;
+    case 2:
+        r = v.type == CellValue::Text;
+        break;
+    case 3:
+        r = v.type != CellValue::Text;
+        break;
+    case 4:
+        r = v.type == CellValue::Bool;
+        break;
+    case 5:
+        r = v.type == CellValue::Error;
+        break;
+    case 6:
+        r = v.type == CellValue::Error && v.error != CellError::NA;
+        break;
+    case 7:
+        r = v.type == CellValue::Error && v.error == CellError::NA;
+        break;
+    default:
+    {
+        double d;
+        CellError e;
+        if (!value_to_number(v, d, e))
+            return Operand::scalar(CellValue::err(e));
+        bool even = std::fmod(std::trunc(std::fabs(d)), 2.0) == 0.0;
+        r = kind == 8 ? even : !even;
+        break;
+    }
+    }
+    return Operand::scalar(CellValue::boolean(r));
+}
+
+// VLOOKUP / HLOOKUP.
+Operand fn_lookup(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool vertical)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue key = a.value(0);
+    if (key.type == CellValue::Error)
+        return Operand::scalar(key);
+    Operand table = a.operand(1);
+    double index = std::trunc(a.number(2));
+    bool approx = a.boolean(3, true);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (table.kind == Operand::Scalar)
+        return a.error_result(CellError::NA);
+    uint32_t limit = vertical ? table.cols : table.rows;
+    if (index < 1)
+        return a.error_result(CellError::Value);
+    if (index > limit)
+        return a.error_result(CellError::Ref);
+    Operand keys = table;
+    if (table.kind == Operand::Range)
+    {
+        if (vertical)
+            keys.area.c2 = keys.area.c1, keys.cols = 1;
+        else
+            keys.area.r2 = keys.area.r1, keys.rows = 1;
+    }
+    else
+    {
+        std::vector<CellValue> cells;
+        for (uint32_t i = 0; i < (vertical ? table.rows : table.cols); ++i)
+            cells.push_back(vertical ? wb.element(table, i, 0) : wb.element(table, 0, i));
+        keys = vertical ? Operand::matrix(table.rows, 1, std::move(cells)) : Operand::matrix(1, table.cols, std::move(cells));
+    }
+    long pos = match_position(wb, keys, key, approx ? 1 : 0);
+    if (pos < 0)
+        return a.error_result(CellError::NA);
+    uint32_t k = static_cast<uint32_t>(index) - 1;
+    return Operand::scalar(vertical ? wb.element(table, static_cast<uint32_t>(pos), k) : wb.element(table, k, static_cast<uint32_t>(pos)));
+}
+
+Operand fn_match(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue key = a.value(0);
+    if (key.type == CellValue::Error)
+        return Operand::scalar(key);
+    Operand vec = a.operand(1);
+    double mode = a.number(2, 1.0);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (vec.rows > 1 && vec.cols > 1)
+        return a.error_result(CellError::NA);
+    long pos = match_position(wb, vec, key, mode > 0 ? 1 : (mode < 0 ? -1 : 0));
+    return pos < 0 ? a.error_result(CellError::NA) : a.number_result(static_cast<double>(pos + 1));
+}
+
+Operand fn_xlookup(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue key = a.value(0);
+    if (key.type == CellValue::Error)
+        return Operand::scalar(key);
+    Operand keys = a.operand(1);
+    Operand values = a.operand(2);
+    int match_mode = static_cast<int>(a.number(4, 0.0));
+    int search_mode = static_cast<int>(a.number(5, 1.0));
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    uint32_t rows, cols;
+    wb.dims(keys, rows, cols);
+    bool vertical = keys.cols == 1;
+    uint32_t n = vertical ? rows : cols;
+    bool wild = match_mode == 2 && key.type == CellValue::Text;
+    long best = -1;
+    CellValue best_value;
+    for (uint32_t step = 0; step < n; ++step)
+    {
+        uint32_t i = search_mode < 0 ? n - 1 - step : step;
+        CellValue v = vertical ? wb.element(keys, i, 0) : wb.element(keys, 0, i);
+        if (wild)
+        {
+            if (v.type == CellValue::Text && wildcard_match(key.text, v.text))
+            {
+                best = i;
+                break;
+            }
+            continue;
+        }
+        if (v.type == key.type && compare_values(v, key) == 0)
+        {
+            best = i;
+            break;
+        }
+        if (match_mode == 0 || v.type != key.type)
+            continue;
+        int cmp = compare_values(v, key);
+        bool candidate = match_mode < 0 ? cmp < 0 : cmp > 0;
+        if (candidate && (best < 0 || (match_mode < 0 ? compare_values(v, best_value) > 0 : compare_values(v, best_value) < 0)))
+        {
+            best = i;
+            best_value = v;
+        }
+    }
+    if (best < 0)
+        return a.has(3) && !a.missing(3) ? a.operand(3) : a.error_result(CellError::NA);
+    uint32_t pos = static_cast<uint32_t>(best);
+    if (values.kind == Operand::Range)
+    {
+        // Return the matching row or column of the result range.
+        CellArea area = values.area;
+        if (vertical)
+            area.r1 = area.r2 = area.r1 + pos;
+        else
+            area.c1 = area.c2 = area.c1 + pos;
+        if (area.r1 > values.area.r2 || area.c1 > values.area.c2)
+            return a.error_result(CellError::Value);
+        return Operand::range(area);
+    }
+    return Operand::scalar(vertical ? wb.element(values, pos, 0) : wb.element(values, 0, pos));
+}
+
+Operand fn_index(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    Operand src = a.operand(0);
+    double row = std::trunc(a.number(1, 0.0));
+    double col = std::trunc(a.number(2, 0.0));
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (row < 0 || col < 0)
+        return a.error_result(CellError::Value);
+    if (a.count() == 2 && src.rows == 1)
+    {
+        // INDEX(row_vector, n) picks a column.
+        col = row;
+        row = 1;
+    }
+    if (row > src.rows || col > src.cols)
+        return a.error_result(CellError::Ref);
+    if (src.kind == Operand::Scalar)
+        return Operand::scalar(src.value);
+    if (src.kind == Operand::Matrix)
+    {
+        if (row == 0 || col == 0)
+        {
+            std::vector<CellValue> cells;
+            uint32_t rows = row == 0 ? src.rows : 1, cols = col == 0 ? src.cols : 1;
+            for (uint32_t r = 0; r < rows; ++r)
+                for (uint32_t c = 0; c < cols; ++c)
+                    cells.push_back(wb.element(src, row == 0 ? r : static_cast<uint32_t>(row) - 1, col == 0 ? c : static_cast<uint32_t>(col) - 1));
+            return Operand::matrix(rows, cols, std::move(cells));
+        }
+        return Operand::scalar(wb.element(src, static_cast<uint32_t>(row) - 1, static_cast<uint32_t>(col) - 1));
+    }
+    CellArea area = src.area;
+    if (row > 0)
+        area.r1 = area.r2 = src.area.r1 + static_cast<uint32_t>(row) - 1;
+    if (col > 0)
+        area.c1 = area.c2 = src.area.c1 + static_cast<uint32_t>(col) - 1;
+    else if (src.cols == 1)
+        area.c2 = area.c1;
+    return Operand::range(area);
+}
+
+Operand fn_row_col(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool row)
+{
+    FnArgs a(wb, call, ctx);
+    if (a.count() == 0)
+        return a.number_result((row ? ctx.row : ctx.col) + 1.0);
+    Operand op = a.operand(0);
+    if (op.kind != Operand::Range)
+        return op.is_error() ? Operand::scalar(op.value) : a.error_result(CellError::Value);
+    return a.number_result((row ? op.area.r1 : op.area.c1) + 1.0);
+}
+
+Operand fn_rows_cols(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool rows)
+{
+    FnArgs a(wb, call, ctx);
+    Operand op = a.operand(0);
+    if (op.is_error())
+        return Operand::scalar(op.value);
+    return a.number_result(rows ? op.rows : op.cols);
+}
+
+Operand fn_text_slice(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    std::string s = a.text(0);
+    if (kind == 2)
+    {
+        // MID(text, start, count)
+        double start = std::trunc(a.number(1)), count = std::trunc(a.number(2));
+        if (!a.failed && (start < 1 || count < 0))
+            return a.error_result(CellError::Value);
+        start = std::min(start, static_cast<double>(utf8_length(s) + 1)); // past the end is the same; keeps the cast defined
+        size_t b = utf8_offset(s, static_cast<size_t>(start) - 1);
+        size_t e = utf8_offset(s, static_cast<size_t>(std::min(start - 1 + count, 1e9)));
+        return a.result(CellValue::string(s.substr(b, e - b)));
+    }
+    double n = std::trunc(a.number(1, 1.0));
+    if (!a.failed && n < 0)
+        return a.error_result(CellError::Value);
+    size_t len = utf8_length(s);
+    size_t count = std::min(static_cast<size_t>(n), len);
+    if (kind == 0)
+        return a.result(CellValue::string(s.substr(0, utf8_offset(s, count))));
+    return a.result(CellValue::string(s.substr(utf8_offset(s, len - count))));
+}
+
+Operand fn_concat(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::string out;
+    for (size_t i = 0; i < a.count() && !a.failed; ++i)
+    {
+        wb.for_each_value(a.operand(i), [&](const CellValue &v)
+                          {
+            if (v.type == CellValue::Error)
+                a.fail(v.error);
+            else
+                out += value_to_text(v); });
+    }
+    return a.result(CellValue::string(out));
+}
+
+Operand fn_textjoin(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::string delim = a.text(0);
+    bool ignore_empty = a.boolean(1);
+    std::string out;
+    bool first = true;
+    for (size_t i = 2; i < a.count() && !a.failed; ++i)
+    {
+        wb.for_each_value(a.operand(i), [&](const CellValue &v)
+                          {
+            if (v.type == CellValue::Error)
+            {
+                a.fail(v.error);
+                return;
+            }
+            std::string t = value_to_text(v);
+            if (ignore_empty && t.empty())
+                return;
+            if (!first)
+                out += delim;
+            out += t;
+            first = false; });
+    }
+    return a.result(CellValue::string(out));
+}
+
+Operand fn_substitute(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::string s = a.text(0), from = a.text(1), to = a.text(2);
+    double which = a.has(3) ? std::trunc(a.number(3)) : 0.0;
+    if (a.failed || from.empty())
+        return a.result(CellValue::string(s));
+    if (a.has(3) && which < 1)
+        return a.error_result(CellError::Value);
+    std::string out;
+    size_t pos = 0, hit = 0;
+    for (size_t at; (at = s.find(from, pos)) != std::string::npos; pos = at + from.size())
+    {
+        ++hit;
+        out.append(s, pos, at - pos);
+        out += (which == 0 || hit == static_cast<size_t>(which)) ? to : from;
+    }
+    out.append(s, pos, std::string::npos);
+    return a.result(CellValue::string(out));
+}
+
+Operand fn_replace(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::string s = a.text(0);
+    double start = std::trunc(a.number(1)), count = std::trunc(a.number(2));
+    std::string with = a.text(3);
+    if (!a.failed && (start < 1 || count < 0))
+        return a.error_result(CellError::Value);
+    start = std::min(start, static_cast<double>(utf8_length(s) + 1));
+    size_t b = utf8_offset(s, static_cast<size_t>(start) - 1);
+    size_t e = utf8_offset(s, static_cast<size_t>(std::min(start - 1 + count, 1e9)));
+    return a.result(CellValue::string(s.substr(0, b) + with + s.substr(e)));
+}
+
+// FIND is case-sensitive without wildcards; SEARCH is neither.
+Operand fn_find(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool search)
+{
+    FnArgs a(wb, call, ctx);
+    std::string needle = a.text(0), hay = a.text(1);
+    double start = std::trunc(a.number(2, 1.0));
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    size_t len = utf8_length(hay);
+    if (start < 1 || start > len + 1)
+        return a.error_result(CellError::Value);
+    size_t from = utf8_offset(hay, static_cast<size_t>(start) - 1);
+    size_t at = std::string::npos;
+    if (!search)
+        at = hay.find(needle, from);
+    else if (has_wildcards(needle))
+        at = wildcard_find(needle, hay, from);
+    else
+        at = ascii_case(hay, false).find(ascii_case(needle, false), from);
+    if (at == std::string::npos)
+        return a.error_result(CellError::Value);
+    return a.number_result(static_cast<double>(utf8_length(hay.substr(0, at)) + 1));
+}
+
+Operand fn_case(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    std::string s = a.text(0);
+    if (kind == 2)
+    {
+        // PROPER: capitalise the first letter of each run of letters.
+        bool prev_alpha = false;
+        for (auto &c : s)
+        {
+            bool alpha = std::isalpha(static_cast<unsigned char>(c)) != 0;
+            c = static_cast<char>(alpha && !prev_alpha ? std::toupper(static_cast<unsigned char>(c)) : std::tolower(static_cast<unsigned char>(c)));
+            prev_alpha = alpha;
+        }
+        return a.result(CellValue::string(s));
+    }
+    return a.result(CellValue::string(ascii_case(s, kind == 0)));
+}
+
+Operand fn_trim(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::string s = a.text(0), out;
+    for (char c : s)
+    {
+        if (c == ' ' && (out.empty() || out.back() == ' '))
+            continue;
+        out.push_back(c);
+    }
+    if (!out.empty() && out.back() == ' ')
+        out.pop_back();
+    return a.result(CellValue::string(out));
+}
+
+Operand fn_rept(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::string s = a.text(0);
+    double n = std::trunc(a.number(1));
+    if (!a.failed && (n < 0 || n * s.size() > 32767))
+        return a.error_result(CellError::Value);
+    std::string out;
+    for (int i = 0; i < static_cast<int>(n) && !a.failed; ++i)
+        out += s;
+    return a.result(CellValue::string(out));
+}
+
+Operand fn_value(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue v = a.value(0);
+    double d;
+    CellError e;
+    if (v.type == CellValue::Bool)
+        return a.error_result(CellError::Value);
+    if (!value_to_number(v, d, e))
+        return Operand::scalar(CellValue::err(e));
+    return a.number_result(d);
+}
+
+Operand fn_text(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    CellValue v = a.value(0);
+    std::string fmt = a.text(1);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (v.type == CellValue::Error)
+        return Operand::scalar(v);
+    double d;
+    CellError e;
+    if (v.type == CellValue::Text && !value_to_number(v, d, e))
+        return Operand::scalar(v);
+    value_to_number(v, d, e);
+    return a.result(CellValue::string(format_with_pattern(d, fmt, wb.date1904())));
+}
+
+Operand fn_char_code(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool to_char)
+{
+    FnArgs a(wb, call, ctx);
+    if (to_char)
+    {
+        double n = std::trunc(a.number(0));
+        if (!a.failed && (n < 1 || n > 255))
+            return a.error_result(CellError::Value);
+        return a.result(CellValue::string(std::string(1, static_cast<char>(static_cast<unsigned char>(n)))));
+    }
+    std::string s = a.text(0);
+    if (!a.failed && s.empty())
+        return a.error_result(CellError::Value);
+    return a.number_result(a.failed ? 0.0 : static_cast<unsigned char>(s[0]));
+}
+
+Operand fn_date(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double y = std::trunc(a.number(0)), m = std::trunc(a.number(1)), d = std::trunc(a.number(2));
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (y >= 0 && y < 1900)
+        y += 1900;
+    if (y < 1900 || y > 9999)
+        return a.error_result(CellError::Num);
+    double serial = date_serial(static_cast<int>(y), static_cast<int>(m), static_cast<int>(d), wb.date1904());
+    if (serial < 0)
+        return a.error_result(CellError::Num);
+    return a.number_result(serial);
+}
+
+// YEAR / MONTH / DAY.
+Operand fn_date_part(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int part)
+{
+    FnArgs a(wb, call, ctx);
+    double serial = a.number(0);
+    int y, m, d;
+    if (!a.failed && !serial_to_date(serial, wb.date1904(), y, m, d))
+        return a.error_result(CellError::Num);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    return a.number_result(part == 0 ? y : (part == 1 ? m : d));
+}
+
+// HOUR / MINUTE / SECOND.
+Operand fn_time_part(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int part)
+{
+    FnArgs a(wb, call, ctx);
+    double serial = a.number(0);
+    if (!a.failed && serial < 0)
+        return a.error_result(CellError::Num);
+    long secs = static_cast<long>(std::floor((serial - std::floor(serial)) * 86400.0 + 0.5)) % 86400;
+    return a.number_result(part == 0 ? secs / 3600 : (part == 1 ? secs / 60 % 60 : secs % 60));
+}
+
+Operand fn_time(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double secs = std::trunc(a.number(0)) * 3600 + std::trunc(a.number(1)) * 60 + std::trunc(a.number(2));
+    if (!a.failed && secs < 0)
+        return a.error_result(CellError::Num);
+    return a.number_result(std::fmod(secs, 86400.0) / 86400.0);
+}
+
+// EDATE / EOMONTH.
+Operand fn_edate(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, bool end_of_month)
+{
+    FnArgs a(wb, call, ctx);
+    double serial = a.number(0), months = std::trunc(a.number(1));
+    int y, m, d;
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (!serial_to_date(serial, wb.date1904(), y, m, d))
+        return a.error_result(CellError::Num);
+    int target = m + static_cast<int>(months);
+    double first_next = date_serial(y, target + 1, 1, wb.date1904());
+    if (end_of_month)
+        return a.number_result(first_next - 1);
+    double first = date_serial(y, target, 1, wb.date1904());
+    double days_in_month = first_next - first;
+    return a.number_result(first + std::min<double>(d, days_in_month) - 1);
+}
+
+Operand fn_weekday(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double serial = std::floor(a.number(0));
+    int type = static_cast<int>(a.number(1, 1.0));
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    if (serial < 0)
+        return a.error_result(CellError::Num);
+    int64_t s = static_cast<int64_t>(serial) + (wb.date1904() ? 1462 : 0);
+    int sunday_based = static_cast<int>(((s - 1) % 7 + 7) % 7); // 0 = Sunday
+    if (type == 1)
+        return a.number_result(sunday_based + 1);
+    if (type == 2)
+        return a.number_result((sunday_based + 6) % 7 + 1);
+    if (type == 3)
+        return a.number_result((sunday_based + 6) % 7);
+    return a.error_result(CellError::Num);
+}
+
+Operand fn_days(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double end = a.number(0), start = a.number(1);
+    return a.number_result(std::floor(end) - std::floor(start));
+}
+
+Operand fn_datedif(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double s = std::floor(a.number(0)), e = std::floor(a.number(1));
+    std::string unit = ascii_case(a.text(2), true);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    int y1, m1, d1, y2, m2, d2;
+    if (s > e || !serial_to_date(s, wb.date1904(), y1, m1, d1) || !serial_to_date(e, wb.date1904(), y2, m2, d2))
+        return a.error_result(CellError::Num);
+    int months = (y2 - y1) * 12 + (m2 - m1) - (d2 < d1 ? 1 : 0);
+    if (unit == "D")
+        return a.number_result(e - s);
+    if (unit == "M")
+        return a.number_result(months);
+    if (unit == "Y")
+        return a.number_result(months / 12);
+    if (unit == "YM")
+        return a.number_result(months % 12);
+    if (unit == "MD")
+    {
+        double anchor = date_serial(y2, d2 >= d1 ? m2 : m2 - 1, d1, wb.date1904());
+        return a.number_result(e - anchor);
+    }
+    if (unit == "YD")
+    {
+        int y = (m2 > m1 || (m2 == m1 && d2 >= d1)) ? y2 : y2 - 1;
+        return a.number_result(e - date_serial(y, m1, d1, wb.date1904()));
+    }
+    return a.error_result(CellError::Num);
+}
+
+// Time value of money: fv + pv*(1+r)^n + pmt*(1+r*type)*((1+r)^n-1)/r = 0.
+double tvm_fv(double rate, double nper, double pmt, double pv, double type)
+{
+    if (rate == 0.0)
+        return -(pv + pmt * nper);
+    double g = std::pow(1 + rate, nper);
+    return -(pv * g + pmt * (1 + rate * type) * (g - 1) / rate);
+}
+
+double tvm_pmt(double rate, double nper, double pv, double fv, double type)
+{
+    if (rate == 0.0)
+        return -(pv + fv) / nper;
+    double g = std::pow(1 + rate, nper);
+    return -(rate * (fv + pv * g)) / ((1 + rate * type) * (g - 1));
+}
+
+double tvm_ipmt(double rate, double per, double nper, double pv, double fv, double type)
+{
+    double pmt = tvm_pmt(rate, nper, pv, fv, type);
+    double interest;
+    if (per == 1)
+        interest = type == 1 ? 0.0 : -pv;
+    else
+        interest = type == 1 ? tvm_fv(rate, per - 2, pmt, pv, 1) - pmt : tvm_fv(rate, per - 1, pmt, pv, 0);
+    return interest * rate;
+}
+
+Operand fn_tvm(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx, int kind)
+{
+    FnArgs a(wb, call, ctx);
+    double rate = a.number(0);
+    switch (kind)
+    {
+    case 0: // PMT(rate, nper, pv, [fv], [type])
+    {
+        double nper = a.number(1), pv = a.number(2), fv = a.number(3, 0.0), type = a.number(4, 0.0) != 0 ? 1 : 0;
+        if (!a.failed && nper == 0)
+            return a.error_result(CellError::Num);
+        return a.number_result(tvm_pmt(rate, nper, pv, fv, type));
+    }
+    case 1: // FV(rate, nper, pmt, [pv], [type])
+    {
+        double nper = a.number(1), pmt = a.number(2), pv = a.number(3, 0.0), type = a.number(4, 0.0) != 0 ? 1 : 0;
+        return a.number_result(tvm_fv(rate, nper, pmt, pv, type));
+    }
+    case 2: // PV(rate, nper, pmt, [fv], [type])
+    {
+        double nper = a.number(1), pmt = a.number(2), fv = a.number(3, 0.0), type = a.number(4, 0.0) != 0 ? 1 : 0;
+        if (rate == 0.0)
+            return a.number_result(-(fv + pmt * nper));
+        double g = std::pow(1 + rate, nper);
+        return a.number_result(-(fv + pmt * (1 + rate * type) * (g - 1) / rate) / g);
+    }
+    case 3: // NPER(rate, pmt, pv, [fv], [type])
+    {
+        double pmt = a.number(1), pv = a.number(2), fv = a.number(3, 0.0), type = a.number(4, 0.0) != 0 ? 1 : 0;
+        if (rate == 0.0)
+            return pmt == 0.0 ? a.error_result(CellError::Num) : a.number_result(-(pv + fv) / pmt);
+        double num = pmt * (1 + rate * type) - fv * rate;
+        double den = pmt * (1 + rate * type) + pv * rate;
+        if (den == 0.0 || num / den <= 0)
+            return a.error_result(CellError::Num);
+        return a.number_result(std::log(num / den) / std::log(1 + rate));
+    }
+    case 4: // IPMT(rate, per, nper, pv, [fv], [type])
+    case 5: // PPMT
+    {
+        double per = a.number(1), nper = a.number(2), pv = a.number(3), fv = a.number(4, 0.0), type = a.number(5, 0.0) != 0 ? 1 : 0;
+        if (!a.failed && (per < 1 || per > nper))
+            return a.error_result(CellError::Num);
+        double ipmt = tvm_ipmt(rate, per, nper, pv, fv, type);
+        return a.number_result(kind == 4 ? ipmt : tvm_pmt(rate, nper, pv, fv, type) - ipmt);
+    }
+    default:
+        return a.error_result(CellError::Value);
+    }
+}
+
+// RATE(nper, pmt, pv, [fv], [type], [guess]) by Newton's method.
+Operand fn_rate(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double nper = a.number(0), pmt = a.number(1), pv = a.number(2), fv = a.number(3, 0.0);
+    double type = a.number(4, 0.0) != 0 ? 1 : 0, rate = a.number(5, 0.1);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    auto f = [&](double r)
+    { return r == 0.0 ? pv + pmt * nper + fv : pv * std::pow(1 + r, nper) + pmt * (1 + r * type) * (std::pow(1 + r, nper) - 1) / r + fv; };
+    for (int i = 0; i < 100; ++i)
+    {
+        double y = f(rate);
+        double h = std::max(1e-7, std::fabs(rate) * 1e-6);
+        double dy = (f(rate + h) - f(rate - h)) / (2 * h);
+        if (dy == 0.0 || !std::isfinite(dy))
+            break;
+        double next = rate - y / dy;
+        if (std::fabs(next - rate) < 1e-10)
+            return a.number_result(next);
+        rate = next;
+        if (rate <= -1.0)
+            break;
+    }
+    return a.error_result(CellError::Num);
+}
+
+Operand fn_npv(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    double rate = a.number(0);
+    double total = 0.0, period = 1.0;
+    for_each_number(a, 1, [&](double d)
+                    { total += d / std::pow(1 + rate, period++); });
+    return a.number_result(total);
+}
+
+Operand fn_irr(NativeWorkbook &wb, const Expr &call, const EvalContext &ctx)
+{
+    FnArgs a(wb, call, ctx);
+    std::vector<double> flows;
+    wb.for_each_value(a.operand(0), [&](const CellValue &v)
+                      {
+        if (v.type == CellValue::Error)
+            a.fail(v.error);
+        else if (v.type == CellValue::Number)
+            flows.push_back(v.num); });
+    double rate = a.number(1, 0.1);
+    if (a.failed)
+        return a.error_result(CellError::Value);
+    for (int i = 0; i < 100; ++i)
+    {
+        double npv = 0.0, d_npv = 0.0;
+        for (size_t t = 0; t < flows.size(); ++t)
+        {
+            double g = std::pow(1 + rate, static_cast<double>(t));
+            npv += flows[t] / g;
+            d_npv -= static_cast<double>(t) * flows[t] / (g * (1 + rate));
+        }
+        if (d_npv == 0.0 || !std::isfinite(d_npv))
+            break;
+        double next = rate - npv / d_npv;
+        if (std::fabs(next - rate) < 1e-10)
+            return a.number_result(next);
+        rate = next;
+        if (rate <= -1.0)
+            break;
+    }
+    return a.error_result(CellError::Num);
+}
+
+double excel_sign(double x) { return x > 0 ? 1.0 : (x < 0 ? -1.0 : 0.0); }
+double excel_sqrt(double x) { return x < 0 ? NAN : std::sqrt(x); }
+double excel_ln(double x) { return x <= 0 ? NAN : std::log(x); }
+double excel_log10(double x) { return x <= 0 ? NAN : std::log10(x); }
+double excel_int(double x) { return std::floor(x); }
+double excel_abs(double x) { return std::fabs(x); }
+double excel_exp(double x) { return std::exp(x); }
+
+// Sorted by family, not name; lookup goes through a hash index.
+static const FunctionDef kFunctions[] = {
+    // math and aggregates
+    {"SUM", 0, 255, 0, fn_sum},
+    {"PRODUCT", 1, 255, 0, fn_product},
+    {"COUNT", 0, 255, 0, fn_count},
+    {"COUNTA", 1, 255, 0, fn_counta},
+    {"COUNTBLANK", 1, 1, 0, fn_countblank},
+    {"AVERAGE", 1, 255, 0, fn_average},
+    {"MIN", 1, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_min_max(w, c, x, false); }},
+    {"MAX", 1, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_min_max(w, c, x, true); }},
+    {"MEDIAN", 1, 255, 0, fn_median},
+    {"LARGE", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_large_small(w, c, x, true); }},
+    {"SMALL", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_large_small(w, c, x, false); }},
+    {"SUMPRODUCT", 1, 255, 0, fn_sumproduct},
+    {"SUMIF", 2, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_if_family(w, c, x, 1); }},
+    {"COUNTIF", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_if_family(w, c, x, 0); }},
+    {"AVERAGEIF", 2, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_if_family(w, c, x, 2); }},
+    {"SUMIFS", 3, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ifs_family(w, c, x, 1); }},
+    {"COUNTIFS", 2, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ifs_family(w, c, x, 0); }},
+    {"AVERAGEIFS", 3, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ifs_family(w, c, x, 2); }},
+    {"ABS", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_abs); }},
+    {"INT", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_int); }},
+    {"SIGN", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_sign); }},
+    {"SQRT", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_sqrt); }},
+    {"EXP", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_exp); }},
+    {"LN", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_ln); }},
+    {"LOG10", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_math1(w, c, x, excel_log10); }},
+    {"LOG", 1, 2, 0, fn_log},
+    {"ROUND", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_round(w, c, x, 0); }},
+    {"ROUNDUP", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_round(w, c, x, 1); }},
+    {"ROUNDDOWN", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_round(w, c, x, -1); }},
+    {"TRUNC", 1, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_round(w, c, x, -1); }},
+    {"MROUND", 2, 2, 0, fn_mround},
+    {"CEILING", 1, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ceiling_floor(w, c, x, true); }},
+    {"FLOOR", 1, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ceiling_floor(w, c, x, false); }},
+    {"CEILING.MATH", 1, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ceiling_floor_math(w, c, x, true); }},
+    {"FLOOR.MATH", 1, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_ceiling_floor_math(w, c, x, false); }},
+    {"MOD", 2, 2, 0, fn_mod},
+    {"POWER", 2, 2, 0, fn_power},
+    {"PI", 0, 0, 0, [](NativeWorkbook &, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::number(3.14159265358979323846)); }},
+    {"RAND", 0, 0, kFnVolatile, [](NativeWorkbook &w, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::number(std::uniform_real_distribution<double>(0.0, 1.0)(w.rng()))); }},
+    {"RANDBETWEEN", 2, 2, kFnVolatile, fn_randbetween},
+    // logical
+    {"IF", 1, 3, 0, fn_if},
+    {"IFS", 2, 254, 0, fn_ifs},
+    {"IFERROR", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_iferror(w, c, x, false); }},
+    {"IFNA", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_iferror(w, c, x, true); }},
+    {"AND", 1, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_logical(w, c, x, 0); }},
+    {"OR", 1, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_logical(w, c, x, 1); }},
+    {"XOR", 1, 255, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_logical(w, c, x, 2); }},
+    {"NOT", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     {
+         FnArgs a(w, c, x);
+         bool b = a.boolean(0);
+         return a.result(CellValue::boolean(!b));
+     }},
+    {"TRUE", 0, 0, 0, [](NativeWorkbook &, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::boolean(true)); }},
+    {"FALSE", 0, 0, 0, [](NativeWorkbook &, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::boolean(false)); }},
+    {"NA", 0, 0, 0, [](NativeWorkbook &, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::err(CellError::NA)); }},
+    {"SWITCH", 3, 255, 0, fn_switch},
+    {"CHOOSE", 2, 255, 0, fn_choose},
+    {"ISBLANK", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 0); }},
+    {"ISNUMBER", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 1); }},
+    {"ISTEXT", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 2); }},
+    {"ISNONTEXT", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 3); }},
+    {"ISLOGICAL", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 4); }},
+    {"ISERROR", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 5); }},
+    {"ISERR", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 6); }},
+    {"ISNA", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 7); }},
+    {"ISEVEN", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 8); }},
+    {"ISODD", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_is(w, c, x, 9); }},
+    // lookup and reference
+    {"VLOOKUP", 3, 4, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_lookup(w, c, x, true); }},
+    {"HLOOKUP", 3, 4, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_lookup(w, c, x, false); }},
+    {"MATCH", 2, 3, 0, fn_match},
+    {"XLOOKUP", 3, 6, 0, fn_xlookup},
+    {"INDEX", 2, 3, 0, fn_index},
+    {"ROW", 0, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_row_col(w, c, x, true); }},
+    {"COLUMN", 0, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_row_col(w, c, x, false); }},
+    {"ROWS", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_rows_cols(w, c, x, true); }},
+    {"COLUMNS", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_rows_cols(w, c, x, false); }},
+    // text
+    {"LEN", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     {
+         FnArgs a(w, c, x);
+         std::string s = a.text(0);
+         return a.number_result(static_cast<double>(utf8_length(s)));
+     }},
+    {"LEFT", 1, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_text_slice(w, c, x, 0); }},
+    {"RIGHT", 1, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_text_slice(w, c, x, 1); }},
+    {"MID", 3, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_text_slice(w, c, x, 2); }},
+    {"UPPER", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_case(w, c, x, 0); }},
+    {"LOWER", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_case(w, c, x, 1); }},
+    {"PROPER", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_case(w, c, x, 2); }},
+    {"TRIM", 1, 1, 0, fn_trim},
+    {"CONCAT", 1, 255, 0, fn_concat},
+    {"CONCATENATE", 1, 255, 0, fn_concat},
+    {"TEXTJOIN", 3, 255, 0, fn_textjoin},
+    {"SUBSTITUTE", 3, 4, 0, fn_substitute},
+    {"REPLACE", 4, 4, 0, fn_replace},
+    {"FIND", 2, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_find(w, c, x, false); }},
+    {"SEARCH", 2, 3, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_find(w, c, x, true); }},
+    {"REPT", 2, 2, 0, fn_rept},
+    {"EXACT", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     {
+         FnArgs a(w, c, x);
+         std::string l = a.text(0), r = a.text(1);
+         return a.result(CellValue::boolean(l == r));
+     }},
+    {"VALUE", 1, 1, 0, fn_value},
+    {"TEXT", 2, 2, 0, fn_text},
+    {"T", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     {
+         CellValue v = w.eval_scalar(c.args[0], x);
+         return Operand::scalar(v.type == CellValue::Text || v.type == CellValue::Error ? v : CellValue::string(""));
+     }},
+    {"N", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     {
+         CellValue v = w.eval_scalar(c.args[0], x);
+         if (v.type == CellValue::Error)
+             return Operand::scalar(v);
+         return Operand::scalar(CellValue::number(v.type == CellValue::Number || v.type == CellValue::Bool ? v.num : 0.0));
+     }},
+    {"CHAR", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_char_code(w, c, x, true); }},
+    {"CODE", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_char_code(w, c, x, false); }},
+    // date and time
+    {"DATE", 3, 3, 0, fn_date},
+    {"YEAR", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_date_part(w, c, x, 0); }},
+    {"MONTH", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_date_part(w, c, x, 1); }},
+    {"DAY", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_date_part(w, c, x, 2); }},
+    {"HOUR", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_time_part(w, c, x, 0); }},
+    {"MINUTE", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_time_part(w, c, x, 1); }},
+    {"SECOND", 1, 1, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_time_part(w, c, x, 2); }},
+    {"TIME", 3, 3, 0, fn_time},
+    {"TODAY", 0, 0, kFnVolatile, [](NativeWorkbook &w, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::number(std::floor(w.now_serial()))); }},
+    {"NOW", 0, 0, kFnVolatile, [](NativeWorkbook &w, const Expr &, const EvalContext &)
+     { return Operand::scalar(CellValue::number(w.now_serial())); }},
+    {"EDATE", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_edate(w, c, x, false); }},
+    {"EOMONTH", 2, 2, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_edate(w, c, x, true); }},
+    {"WEEKDAY", 1, 2, 0, fn_weekday},
+    {"DAYS", 2, 2, 0, fn_days},
+    {"DATEDIF", 3, 3, 0, fn_datedif},
+    // financial
+    {"PMT", 3, 5, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_tvm(w, c, x, 0); }},
+    {"FV", 3, 5, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_tvm(w, c, x, 1); }},
+    {"PV", 3, 5, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_tvm(w, c, x, 2); }},
+    {"NPER", 3, 5, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_tvm(w, c, x, 3); }},
+    {"IPMT", 4, 6, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_tvm(w, c, x, 4); }},
+    {"PPMT", 4, 6, 0, [](NativeWorkbook &w, const Expr &c, const EvalContext &x)
+     { return fn_tvm(w, c, x, 5); }},
+    {"RATE", 3, 6, 0, fn_rate},
+    {"NPV", 2, 255, 0, fn_npv},
+    {"IRR", 1, 2, 0, fn_irr},
+};
+
+const FunctionDef &function_at(uint16_t index)
+{
+    return kFunctions[index];
+}
+
+const FunctionDef *find_function(const std::string &upper_name, uint16_t &index)
+{
+    static const std::unordered_map<std::string, uint16_t> by_name = []
+    {
+        std::unordered_map<std::string, uint16_t> m;
+        for (size_t i = 0; i < sizeof(kFunctions) / sizeof(kFunctions[0]); ++i)
+            m[kFunctions[i].name] = static_cast<uint16_t>(i);
+        return m;
+    }();
+    auto it = by_name.find(upper_name);
+    if (it == by_name.end())
+        return nullptr;
+    index = it->second;
+    return &kFunctions[index];
+}
+
+// -------------------- Native engine: model cache --------------------
+// Shares one parsed WorkbookModel between all sessions that load the same
+// file. Entries hold the model weakly, so it is freed with the last session
+// using it, and are keyed by path plus size and write time so a replaced file
+// is parsed again. Declined workbooks are remembered as well; further loads
+// go straight to Excel without parsing the package each time.
+class ModelCache
+{
+public:
+    std::shared_ptr<const WorkbookModel> get(const fs::path &path, bool &cached, std::string &reason)
+    {
+        std::error_code ec;
+        fs::file_time_type stamp = fs::last_write_time(path, ec);
+        uintmax_t size = fs::file_size(path, ec);
+        std::shared_ptr<Entry> entry;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            prune_locked();
+            std::shared_ptr<Entry> &slot = entries_[path.u8string()];
+            if (!slot)
+                slot = std::make_shared<Entry>();
+            entry = slot;
+        }
+        // Held while parsing: concurrent loads of one workbook wait for a
+        // single parse, loads of other workbooks are not blocked.
+        std::lock_guard<std::mutex> lock(entry->mu);
+        cached = true;
+        if (entry->stamp == stamp && entry->size == size)
+        {
+            if (std::shared_ptr<const WorkbookModel> model = entry->model.lock())
+                return model;
+            if (!entry->declined.empty())
+            {
+                reason = entry->declined;
+                return nullptr;
+            }
+        }
+        cached = false;
+        std::shared_ptr<const WorkbookModel> model = NativeWorkbook::load_model(path, reason);
+        entry->stamp = stamp;
+        entry->size = size;
+        entry->model = model;
+        entry->declined = model ? std::string() : reason;
+        return model;
+    }
+
+private:
+    struct Entry
+    {
+        std::mutex mu;
+        fs::file_time_type stamp{};
+        uintmax_t size = 0;
+        std::weak_ptr<const WorkbookModel> model;
+        std::string declined;
+    };
+
+    void prune_locked()
+    {
+        for (auto it = entries_.begin(); it != entries_.end();)
+        {
+            // use_count 1: no load is in progress on this entry.
+            if (it->second.use_count() == 1 && it->second->model.expired() && it->second->declined.empty())
+                it = entries_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    std::mutex mu_;
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entries_;
+};
+
+// HMAC-SHA256 of `message` as hex, for keys of up to 64 bytes.
+std::string hmac_sha256_hex(const std::string &key, const std::string &message);
+
+// -------------------- Session journal --------------------
+// Append-only log of session state so a restart does not log everyone out.
+// Records: login, logout/expiry, workbook loaded (owner/app/version), workbook
+// closed, and cell edits made since the workbook was loaded. The live state is
+// mirrored in memory; once dead records outnumber live ones the file is
+// rewritten from that state (write tmp + rename, like Database::save).
+// Sessions are recorded under a keyed hash of their token, never the token
+// itself; the key is kept in a file beside the log.
+class SessionJournal
+{
+public:
+    enum class EditKind : uint8_t
+    {
+        Text = 0,
+        Number = 1,
+        Bool = 2
+    };
+
+    struct Edit
+    {
+        std::string sheet;
+        std::string range;
+        EditKind kind = EditKind::Text;
+        std::string text;
+        double number = 0.0;
+        bool flag = false;
+    };
+
+    struct Workbook
+    {
+        std::string owner;
+        std::string app;
+        int version = 0;
+        std::vector<Edit> edits;
+    };
+
+    struct Entry
+    {
+        std::string user;
+        int64_t created_unix_ms = 0;
+        bool has_workbook = false;
+        bool pending = false; // from before the restart and not yet resumed
+        Workbook workbook;
+    };
+
+    explicit SessionJournal(std::string path) : path_(std::move(path)) {}
+
+    // Replays the log into memory and compacts it. Sessions still live when
+    // the server stopped wait to be resumed by their token for `idle_ms`;
+    // those past `max_age_ms` are dropped. Returns how many wait.
+    size_t load(int64_t idle_ms, int64_t max_age_ms)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        load_key_locked();
+        live_.clear();
+        std::ifstream in(path_, std::ios::binary);
+        if (in.is_open())
+        {
+            char magic[4] = {};
+            in.read(magic, 4);
+            std::string format(magic, 4);
+            if (in && (format == "SJ01" || format == "SJ02"))
+            {
+                // SJ01 logs hold raw tokens; they are hashed as read.
+                while (read_record_locked(in, format == "SJ01"))
+                {
+                }
+            }
+            else
+            {
+                ESA_LOG_WARN("Session journal has an unknown format; starting with no sessions");
+            }
+        }
+        in.close();
+        int64_t now = unix_now_ms();
+        for (auto it = live_.begin(); it != live_.end();)
+        {
+            if (now - it->second.created_unix_ms >= max_age_ms)
+            {
+                it = live_.erase(it);
+                continue;
+            }
+            it->second.pending = true;
+            ++it;
+        }
+        pending_until_ms_ = live_.empty() ? 0 : now + idle_ms;
+        compact_locked();
+        return live_.size();
+    }
+
+    // The journalled session of a token from before the restart. False for
+    // tokens it does not know, ones already resumed, and all of them once
+    // the wait is over.
+    bool resume(const std::string &token, Entry &out)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        expire_pending_locked();
+        auto it = live_.find(id_for(token));
+        if (it == live_.end() || !it->second.pending)
+            return false;
+        it->second.pending = false;
+        out = it->second;
+        return true;
+    }
+
+    void record_login(const std::string &token, const std::string &user, int64_t created_unix_ms)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string id = id_for(token);
+        Entry &e = live_[id];
+        e = Entry{};
+        e.user = user;
+        e.created_unix_ms = created_unix_ms;
+        std::string rec;
+        put_u8(rec, 'L');
+        put_string(rec, id);
+        put_string(rec, user);
+        put_i64(rec, created_unix_ms);
+        append_locked(rec);
+    }
+
+    void record_logout(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string id = id_for(token);
+        if (!live_.erase(id))
+            return;
+        std::string rec;
+        put_u8(rec, 'O');
+        put_string(rec, id);
+        append_locked(rec);
+    }
+
+    void record_workbook(const std::string &token, const std::string &owner, const std::string &app, int version)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = live_.find(id_for(token));
+        if (it == live_.end())
+            return;
+        it->second.has_workbook = true;
+        it->second.workbook = Workbook{owner, app, version, {}};
+        std::string rec;
+        put_u8(rec, 'W');
+        put_string(rec, it->first);
+        put_string(rec, owner);
+        put_string(rec, app);
+        put_i64(rec, version);
+        append_locked(rec);
+    }
+
+    void record_close(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = live_.find(id_for(token));
+        if (it == live_.end() || !it->second.has_workbook)
+            return;
+        it->second.has_workbook = false;
+        it->second.workbook = Workbook{};
+        std::string rec;
+        put_u8(rec, 'C');
+        put_string(rec, it->first);
+        append_locked(rec);
+    }
+
+    void record_edit(const std::string &token, const Edit &edit)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = live_.find(id_for(token));
+        if (it == live_.end() || !it->second.has_workbook)
+            return;
+        apply_edit(it->second.workbook, edit);
+        std::string rec;
+        put_u8(rec, 'E');
+        put_string(rec, it->first);
+        put_edit(rec, edit);
+        append_locked(rec);
+    }
+
+    bool workbook_for(const std::string &token, Workbook &out)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = live_.find(id_for(token));
+        if (it == live_.end() || !it->second.has_workbook)
+            return false;
+        out = it->second.workbook;
+        return true;
+    }
+
+private:
+    static constexpr size_t kKeyBytes = 32;
+
+    static int64_t unix_now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    std::string id_for(const std::string &token) const { return hmac_sha256_hex(key_, token); }
+
+    // Reads the hashing key, or makes one when there is none. With a new
+    // key no earlier session can be resumed.
+    void load_key_locked()
+    {
+        fs::path key_path = fs::path(path_).replace_extension(".key");
+        std::ifstream in(key_path, std::ios::binary);
+        std::string key((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+        if (key.size() == kKeyBytes)
+        {
+            key_ = key;
+            return;
+        }
+        key.assign(kKeyBytes, '\0');
+        if (!BCRYPT_SUCCESS(BCryptGenRandom(nullptr, reinterpret_cast<uint8_t *>(&key[0]), static_cast<ULONG>(key.size()), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+        {
+            std::random_device rd;
+            for (auto &c : key)
+                c = static_cast<char>(rd());
+        }
+        std::ofstream out(key_path, std::ios::binary | std::ios::trunc);
+        out.write(key.data(), static_cast<std::streamsize>(key.size()));
+        out.close();
+        if (!out)
+            ESA_LOG_ERROR("Cannot write session journal key " + key_path.u8string() + "; sessions will not survive a restart");
+        key_ = key;
+    }
+
+    // Ends the sessions from before the restart that were not resumed in time.
+    void expire_pending_locked()
+    {
+        if (!pending_until_ms_ || unix_now_ms() < pending_until_ms_)
+            return;
+        pending_until_ms_ = 0;
+        size_t ended = 0;
+        for (auto it = live_.begin(); it != live_.end();)
+        {
+            if (!it->second.pending)
+            {
+                ++it;
+                continue;
+            }
+            std::string rec;
+            put_u8(rec, 'O');
+            put_string(rec, it->first);
+            it = live_.erase(it);
+            append_locked(rec);
+            ++ended;
+        }
+        if (ended)
+            ESA_LOG_INFO("Ended " + std::to_string(ended) + " journalled session(s) not resumed after the restart");
+    }
+
+    // A later write to the same cell range supersedes the earlier one.
+    static void apply_edit(Workbook &wb, const Edit &edit)
+    {
+        std::string sheet_key = normalize_sheet_key(edit.sheet);
+        std::string range_key = to_lower(sanitize_range_address(edit.range));
+        wb.edits.erase(std::remove_if(wb.edits.begin(), wb.edits.end(), [&](const Edit &e)
+                                      { return normalize_sheet_key(e.sheet) == sheet_key &&
+                                               to_lower(sanitize_range_address(e.range)) == range_key; }),
+                       wb.edits.end());
+        wb.edits.push_back(edit);
+    }
+
+    static void put_u8(std::string &out, uint8_t v) { out.push_back(static_cast<char>(v)); }
+
+    static void put_i64(std::string &out, int64_t v) { out.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+
+    static void put_string(std::string &out, const std::string &s)
+    {
+        uint32_t len = static_cast<uint32_t>(s.size());
+        out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        out.append(s);
+    }
+
+    static void put_edit(std::string &out, const Edit &e)
+    {
+        put_string(out, e.sheet);
+        put_string(out, e.range);
+        put_u8(out, static_cast<uint8_t>(e.kind));
+        switch (e.kind)
+        {
+        case EditKind::Number:
+            out.append(reinterpret_cast<const char *>(&e.number), sizeof(e.number));
+            break;
+        case EditKind::Bool:
+            put_u8(out, e.flag ? 1 : 0);
+            break;
+        default:
+            put_string(out, e.text);
+            break;
+        }
+    }
+
+    bool read_record_locked(std::ifstream &in, bool raw_tokens)
+    {
+        auto read_u8 = [&in](uint8_t &v)
+        { return static_cast<bool>(in.read(reinterpret_cast<char *>(&v), 1)); };
+        auto read_i64 = [&in](int64_t &v)
+        { return static_cast<bool>(in.read(reinterpret_cast<char *>(&v), sizeof(v))); };
+        auto read_string = [&in](std::string &s)
+        {
+            uint32_t len = 0;
+            if (!in.read(reinterpret_cast<char *>(&len), sizeof(len)) || len > kMaxBodyBytes)
+                return false;
+            s.resize(len);
+            return len == 0 || static_cast<bool>(in.read(&s[0], len));
+        };
+        uint8_t type = 0;
+        std::string token;
+        if (!read_u8(type) || !read_string(token))
+            return false; // clean EOF or a torn tail from a crash
+        if (raw_tokens)
+            token = id_for(token);
+        ++records_;
+        switch (type)
+        {
+        case 'L':
+        {
+            Entry e;
+            if (!read_string(e.user) || !read_i64(e.created_unix_ms))
+                return false;
+            live_[token] = e;
+            return true;
+        }
+        case 'O':
+            live_.erase(token);
+            return true;
+        case 'W':
+        {
+            Workbook wb;
+            int64_t version = 0;
+            if (!read_string(wb.owner) || !read_string(wb.app) || !read_i64(version))
+                return false;
+            wb.version = static_cast<int>(version);
+            auto it = live_.find(token);
+            if (it != live_.end())
+            {
+                it->second.has_workbook = true;
+                it->second.workbook = wb;
+            }
+            return true;
+        }
+        case 'C':
+        {
+            auto it = live_.find(token);
+            if (it != live_.end())
+            {
+                it->second.has_workbook = false;
+                it->second.workbook = Workbook{};
+            }
+            return true;
+        }
+        case 'E':
+        {
+            Edit e;
+            uint8_t kind = 0;
+            if (!read_string(e.sheet) || !read_string(e.range) || !read_u8(kind))
+                return false;
+            e.kind = static_cast<EditKind>(kind);
+            if (e.kind == EditKind::Number)
+            {
+                if (!in.read(reinterpret_cast<char *>(&e.number), sizeof(e.number)))
+                    return false;
+            }
+            else if (e.kind == EditKind::Bool)
+            {
+                uint8_t flag = 0;
+                if (!read_u8(flag))
+                    return false;
+                e.flag = flag != 0;
+            }
+            else if (!read_string(e.text))
+            {
+                return false;
+            }
+            auto it = live_.find(token);
+            if (it != live_.end() && it->second.has_workbook)
+                apply_edit(it->second.workbook, e);
+            return true;
+        }
+        default:
+            ESA_LOG_WARN("Session journal contains unknown record type; ignoring the remainder");
+            return false;
+        }
+    }
+
+    void append_locked(const std::string &rec)
+    {
+        expire_pending_locked();
+        if (!out_.is_open())
+        {
+            out_.open(path_, std::ios::binary | std::ios::app);
+            if (!out_.is_open())
+            {
+                ESA_LOG_ERROR("Cannot open session journal " + path_);
+                return;
+            }
+        }
+        out_.write(rec.data(), static_cast<std::streamsize>(rec.size()));
+        out_.flush();
+        ++records_;
+        if (records_ > kCompactMinRecords && records_ > live_records_locked() * 2)
+            compact_locked();
+    }
+
+    size_t live_records_locked() const
+    {
+        size_t n = 0;
+        for (auto &kv : live_)
+            n += 1 + (kv.second.has_workbook ? 1 + kv.second.workbook.edits.size() : 0);
+        return n;
+    }
+
+    void compact_locked()
+    {
+        if (out_.is_open())
+            out_.close();
+        std::string tmp = path_ + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+        {
+            ESA_LOG_ERROR("Cannot compact session journal " + path_);
+            return;
+        }
+        std::string buf = "SJ02";
+        for (auto &kv : live_)
+        {
+            const Entry &e = kv.second;
+            put_u8(buf, 'L');
+            put_string(buf, kv.first);
+            put_string(buf, e.user);
+            put_i64(buf, e.created_unix_ms);
+            if (!e.has_workbook)
+                continue;
+            put_u8(buf, 'W');
+            put_string(buf, kv.first);
+            put_string(buf, e.workbook.owner);
+            put_string(buf, e.workbook.app);
+            put_i64(buf, e.workbook.version);
+            for (auto &edit : e.workbook.edits)
+            {
+                put_u8(buf, 'E');
+                put_string(buf, kv.first);
+                put_edit(buf, edit);
+            }
+        }
+        out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        out.close();
+        std::error_code ec;
+        fs::rename(tmp, path_, ec);
+        if (ec)
+        {
+            ESA_LOG_ERROR("Failed to replace session journal: " + ec.message());
+            return;
+        }
+        records_ = live_records_locked();
+    }
+
+    static constexpr size_t kCompactMinRecords = 4096;
+
+    std::string path_;
+    std::string key_;
+    std::ofstream out_;
+    std::unordered_map<std::string, Entry> live_; // by token hash
+    int64_t pending_until_ms_ = 0;
+    size_t records_ = 0;
+    std::mutex mu_;
+};
+
+void edit_to_variant(const SessionJournal::Edit &edit, VARIANT &out)
+{
+    VariantInit(&out);
+    switch (edit.kind)
+    {
+    case SessionJournal::EditKind::Bool:
+        out.vt = VT_BOOL;
+        out.boolVal = edit.flag ? VARIANT_TRUE : VARIANT_FALSE;
+        break;
+    case SessionJournal::EditKind::Number:
+        out.vt = VT_R8;
+        out.dblVal = edit.number;
+        break;
+    default:
+        out.vt = VT_BSTR;
+        out.bstrVal = SysAllocString(std::wstring(edit.text.begin(), edit.text.end()).c_str());
+        break;
+    }
+}
+
+// Client input as the native engine stores it. Text is coerced the way Excel
+// treats typed input: numbers, percentages, TRUE/FALSE and ISO dates.
+bool edit_to_cell_value(const SessionJournal::Edit &edit, bool date1904, CellValue &out, bool &is_date, std::string &err)
+{
+    is_date = false;
+    switch (edit.kind)
+    {
+    case SessionJournal::EditKind::Bool:
+        out = CellValue::boolean(edit.flag);
+        return true;
+    case SessionJournal::EditKind::Number:
+        out = CellValue::number(edit.number);
+        return true;
+    default:
+        break;
+    }
+    const std::string &text = edit.text;
+    double d;
+    int y, m, day;
+    std::string upper = text;
+    for (auto &c : upper)
+        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    if (!text.empty() && text[0] == '=')
+    {
+        err = "setting formulas is not supported by the native engine";
+        return false;
+    }
+    if (text.empty())
+        out = CellValue();
+    else if (text_to_number(text, d))
+        out = CellValue::number(d);
+    else if (upper == "TRUE" || upper == "FALSE")
+        out = CellValue::boolean(upper == "TRUE");
+    else if (parse_iso_date(text, y, m, day) && trim(text).size() == 10)
+    {
+        out = CellValue::number(date_serial(y, m, day, date1904));
+        is_date = true;
+    }
+    else
+        out = CellValue::string(text);
+    return true;
+}
+
+// -------------------- Session store --------------------
+// Tokens are 128 random bits, hex encoded on the wire. The table is split into
+// shards keyed by the token's leading bytes (already uniformly random, so they
+// double as the hash) with a reader/writer lock per shard; authenticate only
+// takes a shared lock. Expiry is driven by a hashed timer wheel: every session
+// sits in exactly one wheel bucket, and a bucket is only inspected when the
+// wheel reaches it, so there are no periodic full scans. Sliding expiry is
+// lazy: verify() just bumps last_seen, and a fired entry whose deadline moved
+// is rescheduled instead of expired.
+class SessionStore
+{
+public:
+    using ExpireCallback = std::function<void(const std::string &token, const std::string &user)>;
+
+    SessionStore() : shards_(kShardCount), wheel_(kWheelSlots) {}
+    ~SessionStore() { stop(); }
+
+    void configure(std::chrono::seconds idle, std::chrono::seconds max_age)
+    {
+        idle_ms_ = std::max<int64_t>(1000, std::chrono::duration_cast<std::chrono::milliseconds>(idle).count());
+        max_age_ms_ = std::max<int64_t>(idle_ms_, std::chrono::duration_cast<std::chrono::milliseconds>(max_age).count());
+    }
+
+    void set_on_expire(ExpireCallback cb) { on_expire_ = std::move(cb); }
+
+    void set_journal(SessionJournal *journal) { journal_ = journal; }
+
+    // Re-inserts a session read back from the journal. Its idle timer restarts
+    // now; the absolute deadline still counts from the original login.
+    bool restore(const std::string &token, const std::string &user, int64_t created_unix_ms)
+    {
+        Key key;
+        if (!decode_key(token, key))
+            return false;
+        int64_t age = std::max<int64_t>(0, unix_now_ms() - created_unix_ms);
+        if (age >= max_age_ms_)
+            return false;
+        int64_t now = now_ms();
+        Shard &shard = shard_for(key);
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mu);
+            auto inserted = shard.sessions.try_emplace(key);
+            if (!inserted.second)
+                return true;
+            Session &s = inserted.first->second;
+            s.user = user;
+            s.created_ms = now - age;
+            s.last_seen_ms.store(now, std::memory_order_relaxed);
+        }
+        size_.fetch_add(1, std::memory_order_relaxed);
+        schedule(key, idle_ms_);
+        return true;
+    }
+
+    void start()
+    {
+        if (ticker_.joinable())
+            return;
+        stopping_ = false;
+        ticker_ = std::thread(&SessionStore::tick_loop, this);
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(wheel_mu_);
+            stopping_ = true;
+        }
+        wheel_cv_.notify_all();
+        if (ticker_.joinable())
+            ticker_.join();
+    }
+
+    std::string login(const std::string &user, std::shared_ptr<const UserRecord> record)
+    {
+        Key key = generate_key();
+        int64_t now = now_ms();
+        Shard &shard = shard_for(key);
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mu);
+            Session &s = shard.sessions[key];
+            s.user = user;
+            s.record = std::move(record);
+            s.created_ms = now;
+            s.last_seen_ms.store(now, std::memory_order_relaxed);
+        }
+        size_.fetch_add(1, std::memory_order_relaxed);
+        schedule(key, idle_ms_);
+        std::string token = encode_key(key);
+        if (journal_)
+            journal_->record_login(token, user, unix_now_ms());
+        return token;
+    }
+
+    void logout(const std::string &token)
+    {
+        Key key;
+        if (!decode_key(token, key))
+            return;
+        Shard &shard = shard_for(key);
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mu);
+            if (!shard.sessions.erase(key))
+                return;
+            size_.fetch_sub(1, std::memory_order_relaxed);
+            // The wheel entry is left behind and discarded when it fires.
+        }
+        if (journal_)
+            journal_->record_logout(token);
+    }
+
+    // Resolves a token and slides its idle deadline. record_out is the cached
+    // user record, or null when it was invalidated and must be reloaded.
+    bool verify(const std::string &token, std::string &user_out, std::shared_ptr<const UserRecord> &record_out)
+    {
+        Key key;
+        if (!decode_key(token, key))
+            return false;
+        int64_t now = now_ms();
+        Shard &shard = shard_for(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mu);
+        auto it = shard.sessions.find(key);
+        if (it == shard.sessions.end())
+            return false;
+        Session &s = it->second;
+        if (now >= deadline_of(s))
+            return false; // expired but not yet reaped by the wheel
+        s.last_seen_ms.store(now, std::memory_order_relaxed);
+        user_out = s.user;
+        record_out = s.record;
+        return true;
+    }
+
+    bool verify(const std::string &token, std::string &user_out)
+    {
+        std::shared_ptr<const UserRecord> ignored;
+        return verify(token, user_out, ignored);
+    }
+
+    // Counts invalidate_user calls. Read it before loading a record from
+    // the database and hand it to cache_user with the record.
+    uint64_t user_generation() const { return user_generation_.load(); }
+
+    // Caches a record loaded while user_generation() was `generation`. One
+    // that a user change may have overtaken since is not kept.
+    void cache_user(const std::string &token, std::shared_ptr<const UserRecord> record, uint64_t generation)
+    {
+        Key key;
+        if (!decode_key(token, key))
+            return;
+        Shard &shard = shard_for(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mu);
+        if (generation != user_generation_.load())
+            return;
+        auto it = shard.sessions.find(key);
+        if (it != shard.sessions.end() && it->second.user == record->name)
+            it->second.record = std::move(record);
+    }
+
+    // Drops the cached record of every session belonging to user; the next
+    // authenticate reloads it from the database.
+    void invalidate_user(const std::string &user)
+    {
+        user_generation_.fetch_add(1);
+        for (auto &shard : shards_)
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mu);
+            for (auto &kv : shard.sessions)
+            {
+                if (kv.second.user == user)
+                    kv.second.record.reset();
+            }
+        }
+    }
+
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kShardCount = 16;   // power of two
+    static constexpr size_t kWheelSlots = 512;  // one slot per tick
+    static constexpr int64_t kTickMs = 1000;
+
+    struct Key
+    {
+        std::array<uint8_t, 16> bytes{};
+        bool operator==(const Key &o) const { return bytes == o.bytes; }
+    };
+
+    // Keys are random, so their bytes serve as hashes as they are: the
+    // first eight bucket a key within its shard, and the last picks the
+    // shard, so a shard's keys do not share the bits the buckets use.
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const
+        {
+            uint64_t h;
+            std::memcpy(&h, k.bytes.data(), sizeof(h));
+            return static_cast<size_t>(h);
+        }
+    };
+
+    struct Session
+    {
+        std::string user;
+        std::shared_ptr<const UserRecord> record;
+        int64_t created_ms = 0;
+        std::atomic<int64_t> last_seen_ms{0};
+    };
+
+    struct Shard
+    {
+        std::shared_mutex mu;
+        std::unordered_map<Key, Session, KeyHash> sessions;
+    };
+
+    struct WheelEntry
+    {
+        Key key;
+        uint32_t rounds = 0;
+    };
+
+    static int64_t unix_now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int64_t deadline_of(const Session &s) const
+    {
+        return std::min(s.last_seen_ms.load(std::memory_order_relaxed) + idle_ms_, s.created_ms + max_age_ms_);
+    }
+
+    Shard &shard_for(const Key &key) { return shards_[key.bytes.back() & (kShardCount - 1)]; }
+
+    void schedule(const Key &key, int64_t delay_ms)
+    {
+        uint64_t ticks = static_cast<uint64_t>(std::max<int64_t>(1, (delay_ms + kTickMs - 1) / kTickMs));
+        std::lock_guard<std::mutex> lock(wheel_mu_);
+        size_t slot = (cursor_ + ticks) % kWheelSlots;
+        wheel_[slot].push_back(WheelEntry{key, static_cast<uint32_t>((ticks - 1) / kWheelSlots)});
+    }
+
+    void tick_loop()
+    {
+        std::unique_lock<std::mutex> lock(wheel_mu_);
+        while (!stopping_)
+        {
+            if (wheel_cv_.wait_for(lock, std::chrono::milliseconds(kTickMs), [this]
+                                   { return stopping_; }))
+                break;
+            cursor_ = (cursor_ + 1) % kWheelSlots;
+            std::vector<WheelEntry> due;
+            std::vector<WheelEntry> pending;
+            for (auto &e : wheel_[cursor_])
+            {
+                if (e.rounds > 0)
+                {
+                    --e.rounds;
+                    pending.push_back(e);
+                }
+                else
+                {
+                    due.push_back(e);
+                }
+            }
+            wheel_[cursor_].swap(pending);
+            lock.unlock();
+            fire(due);
+            lock.lock();
+        }
+    }
+
+    void fire(const std::vector<WheelEntry> &due)
+    {
+        int64_t now = now_ms();
+        std::vector<std::pair<std::string, std::string>> expired;
+        for (const auto &e : due)
+        {
+            Shard &shard = shard_for(e.key);
+            int64_t remaining = 0;
+            {
+                std::unique_lock<std::shared_mutex> lock(shard.mu);
+                auto it = shard.sessions.find(e.key);
+                if (it == shard.sessions.end())
+                    continue; // logged out
+                remaining = deadline_of(it->second) - now;
+                if (remaining <= 0)
+                {
+                    expired.emplace_back(encode_key(e.key), it->second.user);
+                    shard.sessions.erase(it);
+                    size_.fetch_sub(1, std::memory_order_relaxed);
+                    continue;
+                }
+            }
+            schedule(e.key, remaining);
+        }
+        for (const auto &kv : expired)
+        {
+            ESA_LOG_INFO("Session expired token=" + mask_token(kv.first) + " user=" + kv.second);
+            if (journal_)
+                journal_->record_logout(kv.first);
+            if (on_expire_)
+                on_expire_(kv.first, kv.second);
+        }
+    }
+
+    static Key generate_key()
+    {
+        Key key;
+        if (!BCRYPT_SUCCESS(BCryptGenRandom(nullptr, key.bytes.data(), static_cast<ULONG>(key.bytes.size()), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+        {
+            std::random_device rd;
+            for (auto &b : key.bytes)
+                b = static_cast<uint8_t>(rd());
+        }
+        return key;
+    }
+
+    static std::string encode_key(const Key &key)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string out(key.bytes.size() * 2, '0');
+        for (size_t i = 0; i < key.bytes.size(); ++i)
+        {
+            out[2 * i] = hex[key.bytes[i] >> 4];
+            out[2 * i + 1] = hex[key.bytes[i] & 0x0F];
+        }
+        return out;
+    }
+
+    static bool decode_key(const std::string &token, Key &out)
+    {
+        if (token.size() != out.bytes.size() * 2)
+            return false;
+        auto nibble = [](char c) -> int
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        };
+        for (size_t i = 0; i < out.bytes.size(); ++i)
+        {
+            int hi = nibble(token[2 * i]);
+            int lo = nibble(token[2 * i + 1]);
+            if (hi < 0 || lo < 0)
+                return false;
+            out.bytes[i] = static_cast<uint8_t>((hi << 4) | lo);
+        }
+        return true;
+    }
+
+    std::vector<Shard> shards_;
+    std::atomic<size_t> size_{0};
+    std::atomic<uint64_t> user_generation_{0};
+    int64_t idle_ms_ = 60LL * 60 * 1000;
+    int64_t max_age_ms_ = 12LL * 60 * 60 * 1000;
+    ExpireCallback on_expire_;
+    SessionJournal *journal_ = nullptr;
+
+    std::vector<std::vector<WheelEntry>> wheel_;
+    size_t cursor_ = 0;
+    bool stopping_ = false;
+    std::mutex wheel_mu_;
+    std::condition_variable wheel_cv_;
+    std::thread ticker_;
+};
+
+// -------------------- Binary cell encoding --------------------
+// Opt-in wire format for /excel/query, negotiated with
+// "Accept: application/vnd.esa.cells". Values are written column by column
+// so the client can lay typed arrays straight over the buffer instead of
+// parsing text. Little-endian throughout:
+//
+//   header  "ESAC", u8 version, u8 flags (1 = paged), u16 0, u32 rows,
+//           u32 cols, u32 offset, u32 total_rows, u16 length and the
+//           next_page_token
+//   frame   u32 rows, u32 0, then one block per column
+//   end     a frame of 0 rows
+//
+// A column block is u8 encoding, three zero bytes and a u32 argument:
+//   0 empty    nothing follows
+//   1 float64  validity bitmap, f64 per row
+//   2 int32    validity bitmap, i32 per row
+//   3 bool     validity bitmap, value bitmap
+//   4 string   argument = dictionary size; u32 length and UTF-8 bytes per
+//              entry, then a u32 index per row (0xFFFFFFFF for blanks)
+//   5 date     validity bitmap, f64 days since 1970-01-01 per row
+//   6 mixed    argument = payload bytes; u8 tag per row (0 blank, 1 number,
+//              2 bool, 3 string, 4 date), then for each non-blank cell an
+//              f64, a u8, or a u32 length and UTF-8 bytes
+// Bitmaps hold one bit per row, lowest bit first. The header and every
+// section are zero-padded to a multiple of 8 bytes. Error values are blanks,
+// as in the JSON form.
+
+static const char kCellsMediaType[] = "application/vnd.esa.cells";
+
+enum CellColumnEncoding : uint8_t
+{
+    kColumnEmpty,
+    kColumnFloat64,
+    kColumnInt32,
+    kColumnBool,
+    kColumnString,
+    kColumnDate,
+    kColumnMixed
+};
+
+template <typename T>
+void wire_put(std::string &out, T v)
+{
+    char buf[sizeof(T)];
+    std::memcpy(buf, &v, sizeof(T));
+    out.append(buf, sizeof(T));
+}
+
+void wire_pad(std::string &out)
+{
+    out.append((8 - out.size() % 8) % 8, '\0');
+}
+
+void append_cells_header(uint32_t rows, uint32_t cols, bool paged, uint32_t offset, uint32_t total_rows,
+                         const std::string &next_page_token, std::string &out)
+{
+    out += "ESAC";
+    wire_put<uint8_t>(out, 1);
+    wire_put<uint8_t>(out, paged ? 1 : 0);
+    wire_put<uint16_t>(out, 0);
+    wire_put<uint32_t>(out, rows);
+    wire_put<uint32_t>(out, cols);
+    wire_put<uint32_t>(out, offset);
+    wire_put<uint32_t>(out, total_rows);
+    wire_put<uint16_t>(out, static_cast<uint16_t>(next_page_token.size()));
+    out += next_page_token;
+    wire_pad(out);
+}
+
+void append_cells_end(std::string &out)
+{
+    wire_put<uint32_t>(out, 0);
+    wire_put<uint32_t>(out, 0);
+}
+
+void append_cell_column(const CellGrid &grid, uint32_t col, std::string &out)
+{
+    enum
+    {
+        kSeenNumber = 1,
+        kSeenBool = 2,
+        kSeenText = 4,
+        kSeenDate = 8
+    };
+    const uint32_t rows = grid.rows;
+    auto cell = [&](uint32_t r) -> const CellValue &
+    { return grid.values[static_cast<size_t>(r) * grid.cols + col]; };
+    auto is_date = [&](uint32_t r)
+    { return grid.dates[static_cast<size_t>(r) * grid.cols + col] != 0; };
+    unsigned seen = 0;
+    bool integral = true;
+    for (uint32_t r = 0; r < rows; ++r)
+    {
+        const CellValue &v = cell(r);
+        switch (v.type)
+        {
+        case CellValue::Number:
+            if (is_date(r))
+            {
+                seen |= kSeenDate;
+                break;
+            }
+            seen |= kSeenNumber;
+            if (integral && !(v.num >= -2147483648.0 && v.num <= 2147483647.0 && v.num == std::floor(v.num) &&
+                              (v.num != 0.0 || !std::signbit(v.num))))
+                integral = false;
+            break;
+        case CellValue::Bool:
+            seen |= kSeenBool;
+            break;
+        case CellValue::Text:
+            seen |= kSeenText;
+            break;
+        default:
+            break;
+        }
+    }
+    CellColumnEncoding enc = kColumnMixed;
+    if (seen == 0)
+        enc = kColumnEmpty;
+    else if (seen == kSeenNumber)
+        enc = integral ? kColumnInt32 : kColumnFloat64;
+    else if (seen == kSeenBool)
+        enc = kColumnBool;
+    else if (seen == kSeenText)
+        enc = kColumnString;
+    else if (seen == kSeenDate)
+        enc = kColumnDate;
+    wire_put<uint8_t>(out, enc);
+    out.append(3, '\0');
+    size_t arg_at = out.size();
+    wire_put<uint32_t>(out, 0);
+    auto set_arg = [&](uint32_t arg)
+    { std::memcpy(&out[arg_at], &arg, sizeof(arg)); };
+    auto bitmap = [&](bool (*pick)(const CellValue &))
+    {
+        size_t at = out.size();
+        out.append((rows + 7) / 8, '\0');
+        for (uint32_t r = 0; r < rows; ++r)
+        {
+            if (pick(cell(r)))
+                out[at + r / 8] = static_cast<char>(out[at + r / 8] | (1 << (r % 8)));
+        }
+        wire_pad(out);
+    };
+    auto present = [](const CellValue &v)
+    { return v.type == CellValue::Number || v.type == CellValue::Bool || v.type == CellValue::Text; };
+    switch (enc)
+    {
+    case kColumnEmpty:
+        break;
+    case kColumnFloat64:
+    case kColumnDate:
+        bitmap(present);
+        out.reserve(out.size() + static_cast<size_t>(rows) * 8);
+        for (uint32_t r = 0; r < rows; ++r)
+            wire_put<double>(out, cell(r).type == CellValue::Number ? cell(r).num : 0.0);
+        break;
+    case kColumnInt32:
+        bitmap(present);
+        out.reserve(out.size() + static_cast<size_t>(rows) * 4 + 4);
+        for (uint32_t r = 0; r < rows; ++r)
+            wire_put<int32_t>(out, cell(r).type == CellValue::Number ? static_cast<int32_t>(cell(r).num) : 0);
+        wire_pad(out);
+        break;
+    case kColumnBool:
+        bitmap(present);
+        bitmap([](const CellValue &v)
+               { return v.type == CellValue::Bool && v.num != 0.0; });
+        break;
+    case kColumnString:
+    {
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<uint32_t> index(rows, 0xFFFFFFFFu);
+        for (uint32_t r = 0; r < rows; ++r)
+        {
+            const CellValue &v = cell(r);
+            if (v.type != CellValue::Text)
+                continue;
+            auto ins = ids.emplace(v.text, static_cast<uint32_t>(ids.size()));
+            if (ins.second)
+            {
+                wire_put<uint32_t>(out, static_cast<uint32_t>(v.text.size()));
+                out += v.text;
+            }
+            index[r] = ins.first->second;
+        }
+        set_arg(static_cast<uint32_t>(ids.size()));
+        wire_pad(out);
+        out.append(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(uint32_t));
+        wire_pad(out);
+        break;
+    }
+    case kColumnMixed:
+    {
+        size_t tags_at = out.size();
+        out.append(rows, '\0');
+        wire_pad(out);
+        size_t payload_at = out.size();
+        for (uint32_t r = 0; r < rows; ++r)
+        {
+            const CellValue &v = cell(r);
+            uint8_t tag = 0;
+            switch (v.type)
+            {
+            case CellValue::Number:
+                tag = is_date(r) ? 4 : 1;
+                wire_put<double>(out, v.num);
+                break;
+            case CellValue::Bool:
+                tag = 2;
+                wire_put<uint8_t>(out, v.num != 0.0 ? 1 : 0);
+                break;
+            case CellValue::Text:
+                tag = 3;
+                wire_put<uint32_t>(out, static_cast<uint32_t>(v.text.size()));
+                out += v.text;
+                break;
+            default:
+                break;
+            }
+            out[tags_at + r] = static_cast<char>(tag);
+        }
+        set_arg(static_cast<uint32_t>(out.size() - payload_at));
+        wire_pad(out);
+        break;
+    }
+    }
+}
+
+// Appends one frame. `out` must end on an 8-byte boundary, as it does after
+// the header and after every frame.
+void append_cell_frame(const CellGrid &grid, std::string &out)
+{
+    wire_put<uint32_t>(out, grid.rows);
+    wire_put<uint32_t>(out, 0);
+    for (uint32_t c = 0; c < grid.cols; ++c)
+        append_cell_column(grid, c, out);
+}
+
+// -------------------- HTTP compression --------------------
+// Responses are gzip- or deflate-encoded when the client accepts it and the
+// content type is text-like: whole bodies from kMinCompressBytes up, and
+// streamed responses chunk by chunk, each chunk flushed so lines still
+// arrive as they are produced. This runs at zlib's fastest level.
+// UI schemas, cover images and workbook summaries are also deflated once,
+// at the best level, when they are written, into a ".dfl" file beside
+// them. A response that embeds one gets that part spliced in as stored.
+// Deflate blocks can be chained as long as only the last is marked final,
+// so every part is raw deflate ending in a sync flush, and the gzip or zlib
+// header and checksum are written around the whole body.
+// Builds without zlib send everything as is.
+enum class ContentEncoding
+{
+    Identity,
+    Gzip,
+    Deflate
+};
+
+constexpr size_t kMinCompressBytes = 1024;
+
+// Text deflated ahead of time.
+struct DeflatedText
+{
+    uint64_t size = 0; // length of the text
+    uint32_t crc = 0;  // crc32 of the text
+    std::string raw;   // raw deflate blocks, none final, ending byte-aligned
+};
+
+// Marks part of a response body as available already deflated.
+struct BodyFragment
+{
+    size_t offset = 0; // where the text starts in the body
+    std::shared_ptr<const DeflatedText> text;
+};
+
+bool compressible_type(const std::string &content_type)
+{
+    return content_type.rfind("text/", 0) == 0 || content_type.find("json") != std::string::npos ||
+           content_type.find("javascript") != std::string::npos || content_type.find("xml") != std::string::npos ||
+           content_type.find("vnd.esa.cells") != std::string::npos;
+}
+
+// The coding to use for an Accept-Encoding value: gzip when it is
+// acceptable, then deflate. Codings with q=0 are refused.
+ContentEncoding accepted_encoding(const std::string &accept)
+{
+#ifdef ESA_HAVE_ZLIB
+    bool gzip = false, deflate = false;
+    size_t pos = 0;
+    while (pos < accept.size())
+    {
+        size_t end = accept.find(',', pos);
+        if (end == std::string::npos)
+            end = accept.size();
+        std::string item = accept.substr(pos, end - pos);
+        pos = end + 1;
+        double q = 1.0;
+        size_t semi = item.find(';');
+        if (semi != std::string::npos)
+        {
+            size_t qp = item.find("q=", semi);
+            if (qp != std::string::npos)
+                q = std::atof(item.c_str() + qp + 2);
+            item.resize(semi);
+        }
+        item = to_lower(trim(item));
+        if (item == "gzip" || item == "x-gzip" || item == "*")
+            gzip = gzip || q > 0;
+        if (item == "deflate")
+            deflate = q > 0;
+    }
+    if (gzip)
+        return ContentEncoding::Gzip;
+    if (deflate)
+        return ContentEncoding::Deflate;
+#else
+    (void)accept;
+#endif
+    return ContentEncoding::Identity;
+}
+
+fs::path deflated_path(const fs::path &file)
+{
+    fs::path p = file;
+    p += ".dfl";
+    return p;
+}
+
+#ifdef ESA_HAVE_ZLIB
+// .dfl layout: "EDF1", the text's length (u64) and crc32 (u32), little
+// endian, then the raw deflate data.
+std::string deflate_text(const std::string &text)
+{
+    z_stream z{};
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return std::string();
+    std::string out("EDF1", 4);
+    uint64_t size = text.size();
+    uint32_t crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(text.data()), static_cast<uInt>(text.size())));
+    out.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    out.append(reinterpret_cast<const char *>(&crc), sizeof(crc));
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+    z.avail_in = static_cast<uInt>(text.size());
+    char buf[16384];
+    do
+    {
+        z.next_out = reinterpret_cast<Bytef *>(buf);
+        z.avail_out = sizeof(buf);
+        deflate(&z, Z_SYNC_FLUSH);
+        out.append(buf, sizeof(buf) - z.avail_out);
+    } while (z.avail_out == 0);
+    deflateEnd(&z);
+    return out;
+}
+
+std::shared_ptr<const DeflatedText> load_deflated(const fs::path &file)
+{
+    std::ifstream in(deflated_path(file), std::ios::binary);
+    if (!in.is_open())
+        return nullptr;
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < 16 || data.compare(0, 4, "EDF1") != 0)
+        return nullptr;
+    auto text = std::make_shared<DeflatedText>();
+    std::memcpy(&text->size, data.data() + 4, sizeof(text->size));
+    std::memcpy(&text->crc, data.data() + 12, sizeof(text->crc));
+    text->raw = data.substr(16);
+    return text;
+}
+
+// Encodes one response body, given in order as plain text with any
+// deflated fragments of it.
+class BodyEncoder
+{
+public:
+    static std::unique_ptr<BodyEncoder> create(ContentEncoding encoding, int level = Z_BEST_SPEED)
+    {
+        if (encoding == ContentEncoding::Identity)
+            return nullptr;
+        std::unique_ptr<BodyEncoder> e(new BodyEncoder(encoding));
+        if (deflateInit2(&e->z_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return nullptr;
+        e->ready_ = true;
+        return e;
+    }
+
+    ~BodyEncoder()
+    {
+        if (ready_)
+            deflateEnd(&z_);
+    }
+
+    const char *name() const { return gzip_ ? "gzip" : "deflate"; }
+
+    void add(const std::string &plain, const std::vector<BodyFragment> &fragments)
+    {
+        static Counter &spliced = g_metrics.counter("esa_http_precompressed_bytes_total", "Response bytes sent from .dfl files instead of being compressed");
+        size_t at = 0;
+        for (const BodyFragment &f : fragments)
+        {
+            if (!f.text || f.offset < at || f.text->size > plain.size() - f.offset)
+                continue;
+            const char *text = plain.data() + f.offset;
+            size_t size = static_cast<size_t>(f.text->size);
+            // A .dfl older than its file: compress that part like the rest.
+            if (static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(text), static_cast<uInt>(size))) != f.text->crc)
+                continue;
+            compress(plain.data() + at, f.offset - at, Z_SYNC_FLUSH);
+            if (gzip_)
+            {
+                crc_ = static_cast<uint32_t>(crc32_combine(crc_, f.text->crc, static_cast<z_off_t>(size)));
+                total_ += size;
+            }
+            else
+            {
+                checksum(text, size);
+            }
+            out_ += f.text->raw;
+            spliced.add(f.text->raw.size());
+            // Nothing after the fragment may refer back past it.
+            deflateReset(&z_);
+            at = f.offset + size;
+        }
+        compress(plain.data() + at, plain.size() - at, Z_NO_FLUSH);
+    }
+
+    // What is encoded so far, flushed. `last` ends the body.
+    std::string take(bool last)
+    {
+        compress(nullptr, 0, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (last)
+        {
+            uint32_t sum = gzip_ ? crc_ : adler_;
+            if (gzip_)
+            {
+                uint32_t size = static_cast<uint32_t>(total_);
+                for (int i = 0; i < 4; ++i)
+                    out_.push_back(static_cast<char>(sum >> (8 * i)));
+                for (int i = 0; i < 4; ++i)
+                    out_.push_back(static_cast<char>(size >> (8 * i)));
+            }
+            else
+            {
+                for (int i = 3; i >= 0; --i)
+                    out_.push_back(static_cast<char>(sum >> (8 * i)));
+            }
+        }
+        std::string out;
+        out.swap(out_);
+        return out;
+    }
+
+private:
+    explicit BodyEncoder(ContentEncoding encoding) : gzip_(encoding == ContentEncoding::Gzip)
+    {
+        // gzip: no name or mtime, unknown OS. zlib: 32K window; the level
+        // bits are only a hint.
+        out_ = gzip_ ? std::string("\x1f\x8b\x08\0\0\0\0\0\0\xff", 10) : std::string("\x78\x01", 2);
+    }
+
+    void checksum(const char *data, size_t len)
+    {
+        if (gzip_)
+            crc_ = static_cast<uint32_t>(crc32(crc_, reinterpret_cast<const Bytef *>(data), static_cast<uInt>(len)));
+        else
+            adler_ = static_cast<uint32_t>(adler32(adler_, reinterpret_cast<const Bytef *>(data), static_cast<uInt>(len)));
+        total_ += len;
+    }
+
+    void compress(const char *data, size_t len, int flush)
+    {
+        if (len)
+            checksum(data, len);
+        z_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        z_.avail_in = static_cast<uInt>(len);
+        char buf[16384];
+        do
+        {
+            z_.next_out = reinterpret_cast<Bytef *>(buf);
+            z_.avail_out = sizeof(buf);
+            deflate(&z_, flush);
+            out_.append(buf, sizeof(buf) - z_.avail_out);
+        } while (z_.avail_out == 0);
+    }
+
+    z_stream z_{};
+    bool ready_ = false;
+    bool gzip_;
+    uint32_t crc_ = 0;
+    uint32_t adler_ = 1;
+    uint64_t total_ = 0;
+    std::string out_;
+};
+#else
+std::string deflate_text(const std::string &) { return std::string(); }
+
+std::shared_ptr<const DeflatedText> load_deflated(const fs::path &) { return nullptr; }
+
+class BodyEncoder
+{
+public:
+    static std::unique_ptr<BodyEncoder> create(ContentEncoding, int = 1) { return nullptr; }
+    const char *name() const { return "identity"; }
+    void add(const std::string &, const std::vector<BodyFragment> &) {}
+    std::string take(bool) { return std::string(); }
+};
+#endif
+
+// -------------------- HTTP primitives --------------------
+struct HttpRequest
+{
+    std::string method;
+    std::string path;                                    // without the query string
+    std::unordered_map<std::string, std::string> query;  // decoded
+    std::unordered_map<std::string, std::string> params; // path parameters, set by the router
+    UserRecord user;                                     // the caller, on routes that need a session
+    std::string peer;                                    // client IPv4 address
+    std::unordered_map<std::string, std::string> headers;
+    std::string body;
+    size_t bytes_in = 0; // request line, headers and body as read off the wire
+    // Upload chunks are left on the socket for the handler to stream.
+    SOCKET socket = INVALID_SOCKET;
+    uint64_t body_length = 0;
+};
+
+// What a call of a response stream did.
+enum class StreamStep
+{
+    More,  // appended a chunk; call again
+    Done,  // appended the last chunk
+    Failed // stopped short: the connection is closed without the final
+           // chunk, so the client sees a cut-off body, not a complete one
+};
+
+struct HttpResponse
+{
+    int status = 200;
+    std::string content_type = "application/json";
+    std::string body = "{}";
+    std::vector<std::pair<std::string, std::string>> headers; // extra headers, e.g. ETag
+    std::vector<BodyFragment> fragments;                       // parts of body with a .dfl, in order
+    // Sent instead of body, as it is: content cached elsewhere and already
+    // encoded, such as the client's static files.
+    std::shared_ptr<const std::string> shared_body;
+    // When set the response goes out with chunked transfer encoding: body
+    // first, then whatever each call appends, until a call returns Done.
+    std::function<StreamStep(std::string &chunk)> stream;
+};
+
+std::string read_line(SOCKET s)
+{
+    std::string line;
+    char c;
+    while (recv(s, &c, 1, 0) == 1)
+    {
+        if (c == '\r')
+        {
+            recv(s, &c, 1, 0); // consume \n
+            break;
+        }
+        line.push_back(c);
+        if (line.size() > kMaxHeaderLine)
+            return ""; // line too long
+    }
+    return line;
+}
+
+bool read_request(SOCKET s, HttpRequest &req)
+{
+    std::string request_line = read_line(s);
+    if (request_line.empty())
+        return false;
+    req.bytes_in = request_line.size() + 2;
+    std::istringstream rl(request_line);
+    rl >> req.method >> req.path;
+    if (req.method.empty() || req.path.empty())
+        return false;
+    size_t q = req.path.find('?');
+    if (q != std::string::npos)
+    {
+        std::string query = req.path.substr(q + 1);
+        req.path.resize(q);
+        size_t pos = 0;
+        while (pos <= query.size())
+        {
+            size_t end = query.find('&', pos);
+            if (end == std::string::npos)
+                end = query.size();
+            std::string item = query.substr(pos, end - pos);
+            size_t eq = item.find('=');
+            if (!item.empty())
+                req.query[url_decode(item.substr(0, eq))] = eq == std::string::npos ? "" : url_decode(item.substr(eq + 1));
+            pos = end + 1;
+        }
+    }
+    size_t header_count = 0;
+    while (true)
+    {
+        std::string header_line = read_line(s);
+        req.bytes_in += header_line.size() + 2;
+        if (header_line.empty())
+            break;
+        if (++header_count > kMaxHeaders)
+            return false;
+        size_t colon = header_line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string key = header_line.substr(0, colon);
+        std::string val = header_line.substr(colon + 1);
+        while (!val.empty() && (val.front() == ' ' || val.front() == '\t'))
+            val.erase(val.begin());
+        req.headers[key] = val;
+    }
+    auto it = req.headers.find("Content-Length");
+    if (it != req.headers.end())
+    {
+        long long len = 0;
+        try
+        {
+            len = std::stoll(it->second);
+        }
+        catch (...)
+        {
+            return false;
+        }
+        if (len < 0)
+            return false;
+        // The upload handler applies its own, larger limit.
+        if (req.method == "PUT" && req.path.rfind("/uploads/", 0) == 0)
+        {
+            req.socket = s;
+            req.body_length = static_cast<uint64_t>(len);
+            return true;
+        }
+        if (static_cast<size_t>(len) > kMaxBodyBytes)
+            return false;
+        req.body.resize(static_cast<size_t>(len));
+        size_t received = 0;
+        while (received < static_cast<size_t>(len))
+        {
+            int r = recv(s, &req.body[received], static_cast<int>(len - received), 0);
+            if (r <= 0)
+                return false;
+            received += static_cast<size_t>(r);
+        }
+        req.bytes_in += received;
+    }
+    return true;
+}
+
+// Reads off what is left of an upload chunk the handler turned down
+// (401, 404, 409, ...), once the response has gone out. Closing a socket
+// with unread data resets the connection, and the reset can discard the
+// response before the client reads it. Past kMaxDrainBytes, or when the
+// client goes quiet, the rest is left to the reset.
+void discard_body(SOCKET s, uint64_t left)
+{
+    shutdown(s, SD_SEND);
+    DWORD timeout_ms = 5000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout_ms), sizeof(timeout_ms));
+    char buf[16 * 1024];
+    left = std::min<uint64_t>(left, kMaxDrainBytes);
+    while (left > 0)
+    {
+        int n = recv(s, buf, static_cast<int>(std::min<uint64_t>(left, sizeof(buf))), 0);
+        if (n <= 0)
+            break;
+        left -= static_cast<uint64_t>(n);
+    }
+}
+
+// Sends a response head and body with one gather write, without joining
+// them into one buffer first.
+size_t send_gather(SOCKET s, const std::string &head, const std::string &body)
+{
+    size_t total = head.size() + body.size();
+    size_t sent = 0;
+    while (sent < total)
+    {
+        WSABUF bufs[2];
+        DWORD count = 0;
+        if (sent < head.size())
+        {
+            bufs[count].buf = const_cast<char *>(head.data() + sent);
+            bufs[count++].len = static_cast<ULONG>(head.size() - sent);
+        }
+        size_t body_at = sent > head.size() ? sent - head.size() : 0;
+        if (body_at < body.size())
+        {
+            bufs[count].buf = const_cast<char *>(body.data() + body_at);
+            bufs[count++].len = static_cast<ULONG>(std::min<size_t>(body.size() - body_at, 1u << 30));
+        }
+        DWORD n = 0;
+        if (WSASend(s, bufs, count, &n, 0, nullptr, nullptr) != 0 || n == 0)
+            break;
+        sent += n;
+    }
+    return sent;
+}
+
+size_t send_all(SOCKET s, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        int n = send(s, data.data() + sent, static_cast<int>(data.size() - sent), 0);
+        if (n <= 0)
+            break;
+        sent += static_cast<size_t>(n);
+    }
+    return sent;
+}
+
+// Returns the number of bytes handed to the socket. A streamed response stops
+// pulling chunks as soon as the client goes away. `accept` is the coding the
+// client asked for; small and binary bodies are sent as they are regardless.
+size_t send_response(SOCKET s, const HttpResponse &resp, ContentEncoding accept = ContentEncoding::Identity)
+{
+    bool text = compressible_type(resp.content_type);
+    std::unique_ptr<BodyEncoder> encoder;
+    if (text && !resp.shared_body && (resp.stream || resp.body.size() >= kMinCompressBytes))
+        encoder = BodyEncoder::create(accept);
+    std::string packed;
+    if (encoder)
+    {
+        static Counter &gzip_total = g_metrics.counter("esa_http_compressed_total", "Responses sent compressed", metric_label("encoding", "gzip"));
+        static Counter &deflate_total = g_metrics.counter("esa_http_compressed_total", "Responses sent compressed", metric_label("encoding", "deflate"));
+        static Counter &uncompressed_bytes = g_metrics.counter("esa_http_uncompressed_bytes_total", "Size before compression of the bodies sent compressed");
+        (accept == ContentEncoding::Gzip ? gzip_total : deflate_total).add();
+        uncompressed_bytes.add(resp.body.size());
+        encoder->add(resp.body, resp.fragments);
+        if (!resp.stream)
+            packed = encoder->take(true);
+    }
+    const std::string &body = resp.shared_body ? *resp.shared_body : encoder && !resp.stream ? packed : resp.body;
+    std::ostringstream oss;
+    oss << "HTTP/1.1 " << resp.status << "\r\n";
+    oss << "Content-Type: " << resp.content_type << "\r\n";
+    if (encoder)
+        oss << "Content-Encoding: " << encoder->name() << "\r\n";
+    if (text)
+        oss << "Vary: Accept-Encoding\r\n";
+    if (resp.stream)
+        oss << "Transfer-Encoding: chunked\r\n";
+    else
+        oss << "Content-Length: " << body.size() << "\r\n";
+    for (const auto &h : resp.headers)
+        oss << h.first << ": " << h.second << "\r\n";
+    oss << "Access-Control-Allow-Origin: *\r\n";
+    oss << "Access-Control-Allow-Headers: Content-Type, Authorization, If-None-Match, Content-Range, X-Request-Timeout\r\n";
+    oss << "Access-Control-Expose-Headers: ETag, Retry-After\r\n";
+    oss << "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n";
+    oss << "Connection: close\r\n\r\n";
+    if (!resp.stream)
+        return send_gather(s, oss.str(), body);
+    std::string head = oss.str();
+    size_t sent = send_all(s, head);
+    if (sent < head.size())
+        return sent;
+    static Counter &plain_bytes = g_metrics.counter("esa_http_uncompressed_bytes_total", "Size before compression of the bodies sent compressed");
+    std::string chunk = encoder ? encoder->take(false) : resp.body;
+    for (StreamStep step = StreamStep::More;;)
+    {
+        if (!chunk.empty())
+        {
+            char size_line[24];
+            std::snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk.size());
+            std::string frame = size_line + chunk + "\r\n";
+            size_t n = send_all(s, frame);
+            sent += n;
+            if (n < frame.size())
+                return sent;
+        }
+        if (step == StreamStep::Done)
+            break;
+        chunk.clear();
+        step = resp.stream(chunk);
+        if (step == StreamStep::Failed)
+            return sent;
+        if (encoder)
+        {
+            plain_bytes.add(chunk.size());
+            encoder->add(chunk, {});
+            chunk = encoder->take(step == StreamStep::Done);
+        }
+    }
+    return sent + send_all(s, "0\r\n\r\n");
+}
+
+// -------------------- Routing --------------------
+// API routes are registered once at startup in a trie of path segments, so
+// a request is matched in one walk over its path. A segment written :name
+// matches any one segment and reaches the handler URL-decoded as
+// req.params["name"]; a literal segment is tried before a parameter. Each
+// route declares the checks run before its handler, and its pattern is the
+// route label in metrics and the access log.
+class Router
+{
+public:
+    enum Flags : unsigned
+    {
+        kJson = 1, // a body, if typed, must be application/json (415)
+        kAuth = 2, // a live session; the caller is put in req.user (401)
+    };
+
+    using Handler = std::function<HttpResponse(const HttpRequest &)>;
+
+    struct Route
+    {
+        std::string pattern;
+        unsigned flags = 0;
+        Handler handler;
+        int timeout_s = 0; // deadline for its Excel work; 0 for none
+        std::shared_ptr<RouteMetrics> metrics;
+    };
+
+    struct Match
+    {
+        const Route *route = nullptr;
+        std::string pattern; // set whenever the path is known
+        std::string allow;   // methods the path has, when the method is not one
+    };
+
+    void add(const std::string &method, const std::string &pattern, unsigned flags, Handler handler, int timeout_s)
+    {
+        Node *node = &root_;
+        for (const std::string &seg : segments(pattern))
+        {
+            std::unique_ptr<Node> &next = seg[0] == ':' ? node->param : node->children[seg];
+            if (!next)
+                next.reset(new Node);
+            if (seg[0] == ':')
+                node->param_name = seg.substr(1);
+            node = next.get();
+        }
+        node->pattern = pattern;
+        node->routes[method] = Route{pattern, flags, std::move(handler), timeout_s, std::make_shared<RouteMetrics>(method + " " + pattern)};
+    }
+
+    // `path` is without its query string.
+    Match match(const std::string &method, const std::string &path, std::unordered_map<std::string, std::string> &params) const
+    {
+        Match m;
+        std::vector<std::string> segs = segments(path);
+        walk(root_, segs, 0, method, params, m);
+        return m;
+    }
+
+private:
+    struct Node
+    {
+        std::unordered_map<std::string, std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param;
+        std::string param_name;
+        std::string pattern;
+        std::map<std::string, Route> routes; // by method
+    };
+
+    static std::vector<std::string> segments(const std::string &path)
+    {
+        std::vector<std::string> out;
+        size_t pos = 0;
+        while (pos < path.size())
+        {
+            size_t end = path.find('/', pos);
+            if (end == std::string::npos)
+                end = path.size();
+            if (end > pos)
+                out.push_back(path.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        return out;
+    }
+
+    static bool walk(const Node &node, const std::vector<std::string> &segs, size_t i, const std::string &method,
+                     std::unordered_map<std::string, std::string> &params, Match &m)
+    {
+        if (i == segs.size())
+        {
+            if (node.routes.empty())
+                return false;
+            auto it = node.routes.find(method);
+            if (it == node.routes.end())
+            {
+                // Keep looking: a parameter branch may take the method.
+                if (m.pattern.empty())
+                {
+                    m.pattern = node.pattern;
+                    for (const auto &kv : node.routes)
+                        m.allow += (m.allow.empty() ? "" : ", ") + kv.first;
+                }
+                return false;
+            }
+            m.route = &it->second;
+            m.pattern = node.pattern;
+            m.allow.clear();
+            return true;
+        }
+        auto child = node.children.find(segs[i]);
+        if (child != node.children.end() && walk(*child->second, segs, i + 1, method, params, m))
+            return true;
+        if (node.param && walk(*node.param, segs, i + 1, method, params, m))
+        {
+            params[node.param_name] = url_decode(segs[i]);
+            return true;
+        }
+        return false;
+    }
+
+    Node root_;
+};
+
+// -------------------- Rate limiting --------------------
+// Token buckets from the "rate_limits" config, checked in dispatch before a
+// handler parses anything. A request takes one token from the bucket of
+// its route and one from the "*" bucket, each kept per caller. If either
+// is empty it gets 429 with the seconds until a token is back. Failed
+// authentications have a bucket per client address of their own, always
+// on, which is checked before a token is even looked up.
+class RateLimiter
+{
+public:
+    static constexpr double kAuthFailuresPerSecond = 1;
+    static constexpr double kAuthFailureBurst = 20;
+
+    void configure(const std::vector<RateLimit> &limits)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        limits_ = limits;
+        buckets_.clear();
+    }
+
+    bool enabled() const { return !limits_.empty(); }
+
+    // `caller` is the user name, or the client address on routes without
+    // a session; `route` is the route label.
+    bool admit(const std::string &caller, const std::string &route, int &retry_after)
+    {
+        int64_t now = steady_us();
+        std::lock_guard<std::mutex> lock(mu_);
+        std::vector<Bucket *> taken;
+        for (size_t i = 0; i < limits_.size(); ++i)
+        {
+            const RateLimit &limit = limits_[i];
+            if (limit.route != "*" && limit.route != route)
+                continue;
+            auto it = buckets_.find(std::to_string(i) + " " + caller);
+            if (it == buckets_.end())
+                it = buckets_.emplace(std::to_string(i) + " " + caller, Bucket{limit.burst, now}).first;
+            Bucket &b = it->second;
+            b.tokens = std::min(limit.burst, b.tokens + (now - b.stamp_us) / 1e6 * limit.per_second);
+            b.stamp_us = now;
+            if (b.tokens < 1.0)
+            {
+                retry_after = std::max(1, static_cast<int>(std::ceil((1.0 - b.tokens) / limit.per_second)));
+                return false;
+            }
+            taken.push_back(&b);
+        }
+        for (Bucket *b : taken)
+            b->tokens -= 1.0;
+        if (buckets_.size() > kMaxBuckets)
+            prune_locked(now);
+        return true;
+    }
+
+    // Whether `peer` may try to authenticate: false once its failures
+    // have used up their bucket.
+    bool admit_unauthenticated(const std::string &peer, int &retry_after)
+    {
+        int64_t now = steady_us();
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = failures_.find(peer);
+        if (it == failures_.end())
+            return true;
+        Bucket &b = it->second;
+        b.tokens = std::min(kAuthFailureBurst, b.tokens + (now - b.stamp_us) / 1e6 * kAuthFailuresPerSecond);
+        b.stamp_us = now;
+        if (b.tokens >= 1.0)
+            return true;
+        retry_after = std::max(1, static_cast<int>(std::ceil((1.0 - b.tokens) / kAuthFailuresPerSecond)));
+        return false;
+    }
+
+    void note_auth_failure(const std::string &peer)
+    {
+        int64_t now = steady_us();
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = failures_.emplace(peer, Bucket{kAuthFailureBurst, now}).first;
+        Bucket &b = it->second;
+        b.tokens = std::min(kAuthFailureBurst, b.tokens + (now - b.stamp_us) / 1e6 * kAuthFailuresPerSecond);
+        b.stamp_us = now;
+        b.tokens = std::max(0.0, b.tokens - 1.0);
+        if (failures_.size() > kMaxBuckets)
+        {
+            for (auto f = failures_.begin(); f != failures_.end();)
+            {
+                bool full = f->second.tokens + (now - f->second.stamp_us) / 1e6 * kAuthFailuresPerSecond >= kAuthFailureBurst;
+                f = full ? failures_.erase(f) : std::next(f);
+            }
+        }
+    }
+
+private:
+    static const size_t kMaxBuckets = 100000;
+
+    struct Bucket
+    {
+        double tokens;
+        int64_t stamp_us;
+    };
+
+    // Drops buckets that have had time to fill up again; a new one starts
+    // full, so nobody gains from it.
+    void prune_locked(int64_t now)
+    {
+        for (auto it = buckets_.begin(); it != buckets_.end();)
+        {
+            const RateLimit &limit = limits_[std::stoul(it->first)];
+            bool full = it->second.tokens + (now - it->second.stamp_us) / 1e6 * limit.per_second >= limit.burst;
+            it = full ? buckets_.erase(it) : std::next(it);
+        }
+    }
+
+    std::mutex mu_;
+    std::vector<RateLimit> limits_;
+    std::unordered_map<std::string, Bucket> buckets_; // "<limit index> <caller>"
+    std::unordered_map<std::string, Bucket> failures_; // client address -> its failed authentications
+};
+
+// -------------------- Blob store --------------------
+// Workbooks, cover images and UI schemas of app versions are stored once,
+// under blobs/<first two hex digits>/<sha256 of the content>, and hard-linked
+// into every version directory that uses them. A version directory is then
+// a set of names for shared content plus its meta.txt, and publishing a
+// version that reuses a file is a link, not a copy. The link count of a blob
+// is its reference count: at one only the store holds it, and collect_blobs
+// removes it. Where links are not supported (FAT volumes, a store on another
+// drive) files are written as plain copies.
+class Sha256
+{
+public:
+    void update(const char *data, size_t len)
+    {
+        for (size_t i = 0; i < len; ++i)
+        {
+            block_[fill_++] = static_cast<uint8_t>(data[i]);
+            if (fill_ == 64)
+            {
+                compress();
+                fill_ = 0;
+            }
+        }
+        bits_ += static_cast<uint64_t>(len) * 8;
+    }
+
+    std::string hex()
+    {
+        uint64_t bits = bits_;
+        block_[fill_++] = 0x80;
+        if (fill_ > 56)
+        {
+            std::fill(block_ + fill_, block_ + 64, 0);
+            compress();
+            fill_ = 0;
+        }
+        std::fill(block_ + fill_, block_ + 56, 0);
+        for (int i = 0; i < 8; ++i)
+            block_[56 + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        compress();
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (uint32_t v : h_)
+        {
+            for (int shift = 28; shift >= 0; shift -= 4)
+                out.push_back(digits[(v >> shift) & 0xF]);
+        }
+        return out;
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress()
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t(block_[4 * i]) << 24) | (uint32_t(block_[4 * i + 1]) << 16) | (uint32_t(block_[4 * i + 2]) << 8) | block_[4 * i + 3];
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4], f = h_[5], g = h_[6], h = h_[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h_[0] += a;
+        h_[1] += b;
+        h_[2] += c;
+        h_[3] += d;
+        h_[4] += e;
+        h_[5] += f;
+        h_[6] += g;
+        h_[7] += h;
+    }
+
+    uint32_t h_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block_[64] = {};
+    size_t fill_ = 0;
+    uint64_t bits_ = 0;
+};
+
+std::string sha256_hex(const std::string &data)
+{
+    Sha256 h;
+    h.update(data.data(), data.size());
+    return h.hex();
+}
+
+std::string hmac_sha256_hex(const std::string &key, const std::string &message)
+{
+    std::string inner(64, '\x36'), outer(64, '\x5c');
+    for (size_t i = 0; i < key.size() && i < 64; ++i)
+    {
+        inner[i] ^= key[i];
+        outer[i] ^= key[i];
+    }
+    std::string digest = sha256_hex(inner + message);
+    for (size_t i = 0; i < digest.size(); i += 2)
+        outer.push_back(static_cast<char>(std::stoi(digest.substr(i, 2), nullptr, 16)));
+    return sha256_hex(outer);
+}
+
+fs::path blob_root()
+{
+    return fs::path("blobs");
+}
+
+// Held while linking and collecting, so a blob is not removed between
+// being found in the store and being linked.
+std::mutex &blob_mutex()
+{
+    static std::mutex mu;
+    return mu;
+}
+
+// esa_blob_writes_total by result.
+struct BlobWrites
+{
+    Counter &added;
+    Counter &deduplicated;
+    Counter &linked;
+};
+
+const BlobWrites &blob_writes()
+{
+    static const BlobWrites writes{
+        g_metrics.counter("esa_blob_writes_total", "Version files stored", metric_label("result", "new")),
+        g_metrics.counter("esa_blob_writes_total", "Version files stored", metric_label("result", "deduplicated")),
+        g_metrics.counter("esa_blob_writes_total", "Version files stored", metric_label("result", "linked"))};
+    return writes;
+}
+
+// Points `dest` at `blob`, replacing whatever `dest` was. The link is made
+// beside it and renamed over it, as Database::save does with db.bin. Where
+// files cannot be linked (FAT, another volume) `dest` is a copy.
+bool link_blob_locked(const fs::path &blob, const fs::path &dest)
+{
+    std::error_code ec;
+    fs::create_directories(dest.parent_path(), ec);
+    fs::path tmp = dest;
+    tmp += ".tmp";
+    fs::remove(tmp, ec);
+    fs::create_hard_link(blob, tmp, ec);
+    if (ec)
+    {
+        static std::once_flag warned;
+        std::string reason = ec.message();
+        std::call_once(warned, [&]()
+                       { ESA_LOG_WARN("Blob store cannot link files (" + reason + "); app versions are stored as copies"); });
+        ec.clear();
+        if (!fs::copy_file(blob, tmp, ec) || ec)
+            return false;
+    }
+    fs::rename(tmp, dest, ec);
+    return !ec;
+}
+
+// Stores `bytes` and links them at `dest`.
+bool put_blob(const fs::path &dest, const std::string &bytes)
+{
+    std::string digest = sha256_hex(bytes);
+    fs::path blob = blob_root() / digest.substr(0, 2) / digest;
+    std::lock_guard<std::mutex> lock(blob_mutex());
+    std::error_code ec;
+    if (!fs::exists(blob, ec))
+    {
+        fs::create_directories(blob.parent_path(), ec);
+        fs::path tmp = blob;
+        tmp += ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+        out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        out.close();
+        fs::rename(tmp, blob, ec);
+        if (!out || ec)
+            return false;
+        blob_writes().added.add();
+    }
+    else
+    {
+        blob_writes().deduplicated.add();
+    }
+    return link_blob_locked(blob, dest);
+}
+
+// Stores the deflated form of `text` as the .dfl file of `file`, for
+// responses that embed the text to splice in. Best effort: without it the
+// text is compressed when sent.
+void put_deflated(const fs::path &file, const std::string &text)
+{
+    std::string packed = deflate_text(text);
+    if (!packed.empty() && !put_blob(deflated_path(file), packed))
+        ESA_LOG_WARN("Could not store " + deflated_path(file).u8string());
+}
+
+// Makes `dest` share the content of `src`. A file already in the store is
+// linked without being read; one written before the store existed is
+// stored first, and `src` is relinked to it when it can be.
+bool link_blob(const fs::path &src, const fs::path &dest)
+{
+    std::error_code ec;
+    {
+        std::lock_guard<std::mutex> lock(blob_mutex());
+        if (fs::hard_link_count(src, ec) > 1 && !ec)
+        {
+            blob_writes().linked.add();
+            return link_blob_locked(src, dest);
+        }
+    }
+    std::ifstream in(src, std::ios::binary);
+    if (!in.is_open())
+        return false;
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    put_blob(src, bytes); // best effort: src may be open elsewhere
+    return put_blob(dest, bytes);
+}
+
+// Moves a finished file into the store under its digest and links it at
+// `dest`. For uploads, which are hashed as they arrive.
+bool adopt_blob(const fs::path &file, const std::string &digest, const fs::path &dest)
+{
+    fs::path blob = blob_root() / digest.substr(0, 2) / digest;
+    std::lock_guard<std::mutex> lock(blob_mutex());
+    std::error_code ec;
+    if (fs::exists(blob, ec))
+    {
+        fs::remove(file, ec);
+        blob_writes().deduplicated.add();
+    }
+    else
+    {
+        fs::create_directories(blob.parent_path(), ec);
+        fs::rename(file, blob, ec);
+        if (ec)
+            return false;
+        blob_writes().added.add();
+    }
+    return link_blob_locked(blob, dest);
+}
+
+// Removes blobs no version links to any more. Returns the bytes freed.
+uintmax_t collect_blobs()
+{
+    std::lock_guard<std::mutex> lock(blob_mutex());
+    std::error_code ec;
+    uintmax_t freed = 0;
+    size_t removed = 0;
+    for (fs::recursive_directory_iterator it(blob_root(), ec), end; !ec && it != end; it.increment(ec))
+    {
+        std::error_code file_ec;
+        if (!it->is_regular_file(file_ec) || fs::hard_link_count(it->path(), file_ec) != 1 || file_ec)
+            continue;
+        uintmax_t size = fs::file_size(it->path(), file_ec);
+        if (fs::remove(it->path(), file_ec))
+        {
+            freed += size;
+            ++removed;
+        }
+    }
+    if (removed)
+        ESA_LOG_INFO("Blob store freed " + std::to_string(removed) + " file(s), " + std::to_string(freed) + " bytes");
+    return freed;
+}
+
+// -------------------- App management --------------------
+struct AppInfo
+{
+    std::string name;
+    int version = 1;
+    std::string description;
+    bool volatile_checked = false; // workbook scanned at publish for the fields below
+    std::string volatile_features; // e.g. "NOW, external links"; empty when results depend only on inputs
+};
+
+fs::path app_root()
+{
+    return fs::path("app");
+}
+
+bool ensure_dir(const fs::path &p)
+{
+    std::error_code ec;
+    if (fs::exists(p, ec))
+        return true;
+    return fs::create_directories(p, ec);
+}
+
+bool is_safe_name(const std::string &name)
+{
+    if (name.empty() || name.size() > 128)
+        return false;
+    for (char c : name)
+    {
+        if (!(isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.' || c == ' '))
+            return false;
+    }
+    if (name.find("..") != std::string::npos)
+        return false;
+    return name.find_first_of("/\\") == std::string::npos;
+}
+
+std::string to_lower(const std::string &s)
+{
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s)
+        out.push_back(static_cast<char>(::tolower(static_cast<unsigned char>(c))));
+    return out;
+}
+
+std::string to_upper(const std::string &s)
+{
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s)
+        out.push_back(static_cast<char>(::toupper(static_cast<unsigned char>(c))));
+    return out;
+}
+
+std::string normalize_sheet_key(const std::string &name)
+{
+    return to_lower(trim(name));
+}
+
+std::string sanitize_range_address(const std::string &address)
+{
+    std::string trimmed_addr = trim(address);
+    if (trimmed_addr.empty())
+        return trimmed_addr;
+    size_t excl = trimmed_addr.rfind('!');
+    if (excl != std::string::npos)
+        trimmed_addr = trimmed_addr.substr(excl + 1);
+    trimmed_addr = trim(trimmed_addr);
+    if (trimmed_addr.size() >= 2 && ((trimmed_addr.front() == '\'' && trimmed_addr.back() == '\'') ||
+                                     (trimmed_addr.front() == '"' && trimmed_addr.back() == '"')))
+    {
+        trimmed_addr = trimmed_addr.substr(1, trimmed_addr.size() - 2);
+    }
+    return trimmed_addr;
+}
+
+fs::path version_path(const std::string &owner, const std::string &app, int version)
+{
+    return app_root() / owner / app / std::to_string(version);
+}
+
+fs::path app_image_path(const std::string &owner, const std::string &app)
+{
+    return app_root() / owner / app / "cover.png";
+}
+
+fs::path app_image_version_path(const std::string &owner, const std::string &app, int version)
+{
+    return version_path(owner, app, version) / "cover.png";
+}
+
+bool save_app_image(const std::string &owner, const std::string &app, const std::string &image_b64)
+{
+    if (image_b64.empty())
+        return true;
+    std::string bytes = base64_decode(image_b64);
+    if (bytes.empty())
+        return false;
+    // The catalog carries images as base64.
+    put_deflated(app_image_path(owner, app), base64_encode(bytes));
+    return put_blob(app_image_path(owner, app), bytes);
+}
+
+bool save_app_image_version(const std::string &owner, const std::string &app, int version, const std::string &image_b64)
+{
+    if (image_b64.empty())
+        return true;
+    std::string bytes = base64_decode(image_b64);
+    if (bytes.empty())
+        return false;
+    put_deflated(app_image_version_path(owner, app, version), base64_encode(bytes));
+    return put_blob(app_image_version_path(owner, app, version), bytes);
+}
+
+bool copy_app_image_version(const std::string &owner, const std::string &app, int from_version, int to_version)
+{
+    fs::path src = app_image_version_path(owner, app, from_version);
+    if (!fs::exists(src))
+        src = app_image_path(owner, app);
+    if (!fs::exists(src))
+        return false;
+    if (fs::exists(deflated_path(src)))
+        link_blob(deflated_path(src), deflated_path(app_image_version_path(owner, app, to_version)));
+    return link_blob(src, app_image_version_path(owner, app, to_version));
+}
+
+std::string load_app_image_base64(const std::string &owner, const std::string &app)
+{
+    fs::path img_path = app_image_path(owner, app);
+    std::ifstream in(img_path, std::ios::binary);
+    if (!in.is_open())
+        return "";
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    return base64_encode(buffer.str());
+}
+
+std::string load_app_image_base64_version(const std::string &owner, const std::string &app, int version)
+{
+    fs::path img_path = app_image_version_path(owner, app, version);
+    std::ifstream in(img_path, std::ios::binary);
+    if (!in.is_open())
+        return "";
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    return base64_encode(buffer.str());
+}
+
+fs::path app_ui_path(const std::string &owner, const std::string &app)
+{
+    return app_root() / owner / app / "ui.json";
+}
+
+fs::path app_ui_version_path(const std::string &owner, const std::string &app, int version)
+{
+    return version_path(owner, app, version) / "ui.json";
+}
+
+bool save_app_ui(const std::string &owner, const std::string &app, const std::string &json)
+{
+    put_deflated(app_ui_path(owner, app), json);
+    return put_blob(app_ui_path(owner, app), json);
+}
+
+bool save_app_ui_version(const std::string &owner, const std::string &app, int version, const std::string &json)
+{
+    put_deflated(app_ui_version_path(owner, app, version), json);
+    return put_blob(app_ui_version_path(owner, app, version), json);
+}
+
+std::string load_app_ui(const std::string &owner, const std::string &app)
+{
+    fs::path path = app_ui_path(owner, app);
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+        return "";
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    return buffer.str();
+}
+
+std::string load_app_ui_version(const std::string &owner, const std::string &app, int version)
+{
+    fs::path path = app_ui_version_path(owner, app, version);
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+        return "";
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    return buffer.str();
+}
+
+bool write_metadata(const fs::path &p, const AppInfo &info)
+{
+    std::ofstream out(p / "meta.txt", std::ios::trunc);
+    if (!out)
+        return false;
+    out << "name=" << info.name << "\n";
+    out << "version=" << info.version << "\n";
+    out << "description=" << info.description << "\n";
+    if (info.volatile_checked)
+        out << "volatile=" << info.volatile_features << "\n";
+    return true;
+}
+
+bool read_metadata(const fs::path &p, AppInfo &info)
+{
+    std::ifstream in(p / "meta.txt");
+    if (!in)
+        return false;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        if (key == "name")
+            info.name = value;
+        else if (key == "version")
+            info.version = std::atoi(value.c_str());
+        else if (key == "description")
+            info.description = value;
+        else if (key == "volatile")
+        {
+            info.volatile_checked = true;
+            info.volatile_features = value;
+        }
+    }
+    return true;
+}
+
+std::string json_escape(const std::string &s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out.push_back('\\');
+        out.push_back(c);
+    }
+    return out;
+}
+
+std::string variant_to_json(const VARIANT &v)
+{
+    std::string out;
+    append_variant_json(v, out);
+    return out;
+}
+
+// Appends the JSON form of a value read from Excel. Arrays are walked in place
+// through SafeArrayAccessData rather than copied out element by element; a
+// 2-D array from Range.Value is column-major, so element (r, c) sits at
+// r + c * rows.
+void append_variant_json(const VARIANT &v, std::string &out)
+{
+    switch (v.vt)
+    {
+    case VT_EMPTY:
+    case VT_NULL:
+        out += "null";
+        return;
+    case VT_BOOL:
+        out += v.boolVal == VARIANT_TRUE ? "true" : "false";
+        return;
+    case VT_I1:
+        out += std::to_string(static_cast<int>(v.cVal));
+        return;
+    case VT_UI1:
+        out += std::to_string(static_cast<unsigned int>(v.bVal));
+        return;
+    case VT_I2:
+        out += std::to_string(v.iVal);
+        return;
+    case VT_UI2:
+        out += std::to_string(v.uiVal);
+        return;
+    case VT_I4:
+    case VT_INT:
+        out += std::to_string(v.intVal);
+        return;
+    case VT_UI4:
+    case VT_UINT:
+        out += std::to_string(v.uintVal);
+        return;
+    case VT_I8:
+        out += std::to_string(v.llVal);
+        return;
+    case VT_UI8:
+        out += std::to_string(v.ullVal);
+        return;
+    case VT_R4:
+        out += format_json_number(v.fltVal);
+        return;
+    case VT_R8:
+        out += format_json_number(v.dblVal);
+        return;
+    case VT_CY:
+        // Currency is stored as 64-bit integer scaled by 10000
+        out += format_json_number(static_cast<double>(v.cyVal.int64) / 10000.0);
+        return;
+    case VT_DATE:
+    {
+        // OLE Automation date - convert to ISO string
+        SYSTEMTIME st;
+        if (VariantTimeToSystemTime(v.date, &st))
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "\"%04d-%02d-%02d\"", st.wYear, st.wMonth, st.wDay);
+            out += buf;
+        }
+        else
+        {
+            out += format_json_number(v.date); // fallback to raw number
+        }
+        return;
+    }
+    case VT_BSTR:
+    {
+        std::string s;
+        if (v.bstrVal)
+        {
+            UINT len = SysStringLen(v.bstrVal);
+            s.reserve(len);
+            for (UINT i = 0; i < len; ++i)
+                s.push_back(static_cast<char>(v.bstrVal[i]));
+        }
+        out += "\"" + json_escape(s) + "\"";
+        return;
+    }
+    default:
+        break;
+    }
+    if (!(v.vt & VT_ARRAY) || !(v.vt & VT_VARIANT) || !v.parray)
+    {
+        out += "null";
+        return;
+    }
+    SAFEARRAY *arr = v.parray;
+    UINT dims = SafeArrayGetDim(arr);
+    LONG lbound1 = 0, ubound1 = -1, lbound2 = 0, ubound2 = -1;
+    SafeArrayGetLBound(arr, 1, &lbound1);
+    SafeArrayGetUBound(arr, 1, &ubound1);
+    if (dims == 2)
+    {
+        SafeArrayGetLBound(arr, 2, &lbound2);
+        SafeArrayGetUBound(arr, 2, &ubound2);
+    }
+    VARIANT *data = nullptr;
+    if ((dims != 1 && dims != 2) || FAILED(SafeArrayAccessData(arr, reinterpret_cast<void **>(&data))))
+    {
+        out += "null";
+        return;
+    }
+    size_t rows = ubound1 >= lbound1 ? static_cast<size_t>(ubound1 - lbound1 + 1) : 0;
+    size_t cols = ubound2 >= lbound2 ? static_cast<size_t>(ubound2 - lbound2 + 1) : 0;
+    out.push_back('[');
+    for (size_t r = 0; r < rows; ++r)
+    {
+        if (r)
+            out.push_back(',');
+        if (dims == 1)
+        {
+            append_variant_json(data[r], out);
+            continue;
+        }
+        out.push_back('[');
+        for (size_t c = 0; c < cols; ++c)
+        {
+            if (c)
+                out.push_back(',');
+            append_variant_json(data[r + c * rows], out);
+        }
+        out.push_back(']');
+    }
+    out.push_back(']');
+    SafeArrayUnaccessData(arr);
+}
+
+// One value read from Excel as a grid cell. OLE dates count days from
+// 1899-12-30, so they move onto 1970-01-01 by a fixed offset.
+void variant_to_cell(const VARIANT &v, CellValue &cell, uint8_t &date)
+{
+    date = 0;
+    switch (v.vt)
+    {
+    case VT_BOOL:
+        cell = CellValue::boolean(v.boolVal == VARIANT_TRUE);
+        return;
+    case VT_I1:
+        cell = CellValue::number(v.cVal);
+        return;
+    case VT_UI1:
+        cell = CellValue::number(v.bVal);
+        return;
+    case VT_I2:
+        cell = CellValue::number(v.iVal);
+        return;
+    case VT_UI2:
+        cell = CellValue::number(v.uiVal);
+        return;
+    case VT_I4:
+    case VT_INT:
+        cell = CellValue::number(v.intVal);
+        return;
+    case VT_UI4:
+    case VT_UINT:
+        cell = CellValue::number(v.uintVal);
+        return;
+    case VT_I8:
+        cell = CellValue::number(static_cast<double>(v.llVal));
+        return;
+    case VT_UI8:
+        cell = CellValue::number(static_cast<double>(v.ullVal));
+        return;
+    case VT_R4:
+        cell = CellValue::number(v.fltVal);
+        return;
+    case VT_R8:
+        cell = CellValue::number(v.dblVal);
+        return;
+    case VT_CY:
+        cell = CellValue::number(static_cast<double>(v.cyVal.int64) / 10000.0);
+        return;
+    case VT_DATE:
+        cell = CellValue::number(v.date - 25569.0);
+        date = 1;
+        return;
+    case VT_BSTR:
+    {
+        std::string s;
+        if (v.bstrVal)
+        {
+            UINT len = SysStringLen(v.bstrVal);
+            s.reserve(len);
+            for (UINT i = 0; i < len; ++i)
+                s.push_back(static_cast<char>(v.bstrVal[i]));
+        }
+        cell = CellValue::string(std::move(s));
+        return;
+    }
+    default:
+        cell = CellValue(); // blanks and error values, as in the JSON form
+        return;
+    }
+}
+
+// Range.Value as a grid: a scalar is one cell, a 1-D array one row.
+void variant_to_grid(const VARIANT &v, CellGrid &grid)
+{
+    grid.rows = grid.cols = 0;
+    grid.values.clear();
+    grid.dates.clear();
+    if (!(v.vt & VT_ARRAY))
+    {
+        grid.rows = grid.cols = 1;
+        grid.values.resize(1);
+        grid.dates.resize(1);
+        variant_to_cell(v, grid.values[0], grid.dates[0]);
+        return;
+    }
+    if (!(v.vt & VT_VARIANT) || !v.parray)
+        return;
+    SAFEARRAY *arr = v.parray;
+    UINT dims = SafeArrayGetDim(arr);
+    LONG lbound1 = 0, ubound1 = -1, lbound2 = 0, ubound2 = -1;
+    SafeArrayGetLBound(arr, 1, &lbound1);
+    SafeArrayGetUBound(arr, 1, &ubound1);
+    if (dims == 2)
+    {
+        SafeArrayGetLBound(arr, 2, &lbound2);
+        SafeArrayGetUBound(arr, 2, &ubound2);
+    }
+    VARIANT *data = nullptr;
+    if ((dims != 1 && dims != 2) || FAILED(SafeArrayAccessData(arr, reinterpret_cast<void **>(&data))))
+        return;
+    size_t n1 = ubound1 >= lbound1 ? static_cast<size_t>(ubound1 - lbound1 + 1) : 0;
+    size_t n2 = ubound2 >= lbound2 ? static_cast<size_t>(ubound2 - lbound2 + 1) : 0;
+    grid.rows = static_cast<uint32_t>(dims == 1 ? (n1 ? 1 : 0) : n1);
+    grid.cols = static_cast<uint32_t>(dims == 1 ? n1 : n2);
+    grid.values.resize(static_cast<size_t>(grid.rows) * grid.cols);
+    grid.dates.resize(grid.values.size());
+    for (size_t r = 0; r < grid.rows; ++r)
+    {
+        for (size_t c = 0; c < grid.cols; ++c)
+        {
+            size_t i = r * grid.cols + c;
+            variant_to_cell(data[r + c * grid.rows], grid.values[i], grid.dates[i]);
+        }
+    }
+    SafeArrayUnaccessData(arr);
+}
+
+bool user_in_group(const UserRecord &u, const std::string &group)
+{
+    for (auto &g : u.groups)
+    {
+        if (g == group)
+            return true;
+    }
+    return false;
+}
+
+bool is_admin(const UserRecord &u, const Config &cfg)
+{
+    return cfg.admins.count(u.name) > 0;
+}
+
+bool can_access(const AppRecord &app, const UserRecord &u)
+{
+    if (app.public_access)
+        return true;
+    if (app.owner == u.name)
+        return true;
+    if (!app.access_group.empty() && user_in_group(u, app.access_group))
+        return true;
+    return false;
+}
+
+// -------------------- Query cache --------------------
+// Range reads through Excel from workbooks that have not been written to
+// since they were loaded. Such a read depends only on the published file, so
+// one entry serves every session on the same app version. Entries are keyed
+// by source path, sheet and range, evicted least recently used past the size
+// limit, and dropped for a whole app when its files change.
+class QueryCache
+{
+public:
+    explicit QueryCache(const char *metric)
+        : hits_(g_metrics.counter(metric, "Cache lookups and evictions", metric_label("result", "hit"))),
+          misses_(g_metrics.counter(metric, "Cache lookups and evictions", metric_label("result", "miss"))),
+          evicted_(g_metrics.counter(metric, "Cache lookups and evictions", metric_label("result", "evicted")))
+    {
+    }
+
+    void configure(size_t max_bytes)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        max_bytes_ = max_bytes;
+        evict_locked();
+    }
+
+    bool enabled() const { return max_bytes_ > 0; }
+
+    // The file's timestamp keeps sessions that loaded it before an update
+    // from filling entries for the new content. Sheet names and addresses
+    // are case-insensitive and "$" is noise, so "Sheet1!$a$1" and
+    // "SHEET1!A1" share an entry. `state` describes edits the read depends
+    // on, if any.
+    static std::string make_key(const fs::path &source, fs::file_time_type stamp, const std::string &sheet, const std::string &range,
+                                const std::string &state = std::string())
+    {
+        std::string key = source.u8string();
+        key.push_back('\n');
+        key += std::to_string(stamp.time_since_epoch().count());
+        key.push_back('\n');
+        for (char c : sheet)
+            key.push_back(static_cast<char>(toupper(static_cast<unsigned char>(c))));
+        key.push_back('\n');
+        for (char c : range)
+        {
+            if (c != '$' && !isspace(static_cast<unsigned char>(c)))
+                key.push_back(static_cast<char>(toupper(static_cast<unsigned char>(c))));
+        }
+        if (!state.empty())
+        {
+            key.push_back('\n');
+            key += state;
+        }
+        return key;
+    }
+
+    // Counts the lookup as a hit or a miss.
+    bool get(const std::string &key, std::string &json)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = index_.find(key);
+        if (it == index_.end())
+        {
+            misses_.add();
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        json = it->second->json;
+        hits_.add();
+        return true;
+    }
+
+    void put(const std::string &key, const std::string &json)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (key.size() + json.size() > max_bytes_ / 8)
+            return; // one large range should not flush everything else
+        auto it = index_.find(key);
+        if (it != index_.end())
+        {
+            bytes_ -= it->second->key.size() + it->second->json.size();
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+        lru_.push_front(Entry{key, json});
+        index_[key] = lru_.begin();
+        bytes_ += key.size() + json.size();
+        evict_locked();
+    }
+
+    // Drops every entry read from a file under `dir`.
+    void invalidate_under(const fs::path &dir)
+    {
+        std::string prefix = fs::absolute(dir).u8string();
+        prefix.push_back(static_cast<char>(fs::path::preferred_separator));
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto it = lru_.begin(); it != lru_.end();)
+        {
+            if (it->key.compare(0, prefix.size(), prefix) == 0)
+            {
+                bytes_ -= it->key.size() + it->json.size();
+                index_.erase(it->key);
+                it = lru_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    size_t bytes()
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        return bytes_;
+    }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::string json;
+    };
+
+    void evict_locked()
+    {
+        while (bytes_ > max_bytes_ && !lru_.empty())
+        {
+            bytes_ -= lru_.back().key.size() + lru_.back().json.size();
+            index_.erase(lru_.back().key);
+            lru_.pop_back();
+            evicted_.add();
+        }
+    }
+
+    Counter &hits_;
+    Counter &misses_;
+    Counter &evicted_;
+    std::mutex mu_;
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+    size_t max_bytes_ = 0;
+};
+
+// -------------------- Calculator memo --------------------
+// Apps whose UI schema sets "memoize": true are treated as calculators: the
+// outputs are a pure function of the cells the schema binds as inputs. On
+// the Excel engine, input edits are held back and output reads are served
+// from a cache keyed by the input values set so far; Excel is only touched
+// on a miss. Workbooks with volatile functions or external data are found
+// when a version is published and never memoized.
+
+// One cell binding, with its address in a canonical form so differently
+// written references to the same cells compare equal. Names stay as text.
+struct CalcArea
+{
+    std::string sheet; // upper-cased
+    std::string text;  // "A1:B2", or the upper-cased name
+    bool a1 = false;
+    CellArea area;
+
+    static bool parse(const std::string &sheet, const std::string &range, CalcArea &out)
+    {
+        out.sheet = to_upper(trim(sheet));
+        std::string r = trim(range);
+        if (out.sheet.empty() || r.empty())
+            return false;
+        out.a1 = parse_area_address(r, 0, out.area);
+        if (out.a1)
+            out.text = column_name(out.area.c1) + std::to_string(out.area.r1 + 1) + ":" + column_name(out.area.c2) + std::to_string(out.area.r2 + 1);
+        else
+            out.text = to_upper(r);
+        return true;
+    }
+
+    std::string key() const { return sheet + "!" + text; }
+
+    bool covers(const CalcArea &o) const
+    {
+        if (sheet != o.sheet)
+            return false;
+        if (!a1 || !o.a1)
+            return text == o.text;
+        return o.area.r1 >= area.r1 && o.area.r2 <= area.r2 && o.area.c1 >= area.c1 && o.area.c2 <= area.c2;
+    }
+
+    bool overlaps(const CalcArea &o) const
+    {
+        if (sheet != o.sheet)
+            return false;
+        if (!a1 || !o.a1)
+            return text == o.text;
+        return o.area.r1 <= area.r2 && area.r1 <= o.area.r2 && o.area.c1 <= area.c2 && area.c1 <= o.area.c2;
+    }
+};
+
+// The "excel" bindings of a widget schema ({"widgets":[{..., "excel":
+// {"enabled", "sheet", "cell", "mode"}, "children": [...]}]}). Input and
+// bidirectional widgets write their cells; output and bidirectional widgets
+// read them.
+struct CalcSchema
+{
+    bool memoize = false;
+    std::vector<CalcArea> inputs;
+    std::vector<CalcArea> outputs;
+    std::vector<std::pair<std::string, std::string>> output_cells; // the outputs as written, for replies
+
+    static CalcSchema parse(const std::string &schema)
+    {
+        CalcSchema out;
+        out.memoize = extract_json_bool(schema, "memoize", false);
+        size_t pos = 0;
+        while ((pos = schema.find("\"excel\"", pos)) != std::string::npos)
+        {
+            pos += 7;
+            size_t lb = schema.find_first_not_of(" \t\r\n:", pos);
+            if (lb == std::string::npos || schema[lb] != '{')
+                continue;
+            size_t rb = schema.find('}', lb);
+            if (rb == std::string::npos)
+                break;
+            std::string binding = schema.substr(lb, rb - lb + 1);
+            CalcArea area;
+            if (!extract_json_bool(binding, "enabled", false) ||
+                !CalcArea::parse(extract_json_string(binding, "sheet"), extract_json_string(binding, "cell"), area))
+                continue;
+            std::string mode = extract_json_string(binding, "mode");
+            if (mode == "input" || mode == "bidirectional")
+                out.inputs.push_back(area);
+            if (mode == "output" || mode == "bidirectional")
+            {
+                out.outputs.push_back(area);
+                out.output_cells.emplace_back(extract_json_string(binding, "sheet"), extract_json_string(binding, "cell"));
+            }
+        }
+        return out;
+    }
+};
+
+// What makes a workbook's results depend on more than its inputs: volatile
+// functions (in cells or defined names), links to other workbooks and data
+// connections. Returns them as a list, or "" when there are none.
+std::string find_volatile_features(const fs::path &path)
+{
+    static const char *const kVolatile[] = {"NOW", "TODAY", "RAND", "RANDBETWEEN", "RANDARRAY", "OFFSET", "INDIRECT", "CELL", "INFO"};
+    ZipArchive zip;
+    std::string err;
+    if (!zip.open(path, err))
+        return "unreadable package";
+    std::set<std::string> found;
+    auto scan_formula = [&](const std::string &formula)
+    {
+        std::string f = to_upper(formula);
+        for (const char *name : kVolatile)
+        {
+            std::string call = std::string(name) + "(";
+            for (size_t at = f.find(call); at != std::string::npos; at = f.find(call, at + 1))
+            {
+                char before = at ? f[at - 1] : ' ';
+                if (!isalnum(static_cast<unsigned char>(before)) && before != '_')
+                {
+                    found.insert(name);
+                    break;
+                }
+            }
+        }
+        // [1]Sheet!A1 is a cell in another workbook; Table[Column] is not.
+        for (size_t at = f.find('['); at != std::string::npos; at = f.find('[', at + 1))
+        {
+            if (at + 1 < f.size() && isdigit(static_cast<unsigned char>(f[at + 1])))
+            {
+                found.insert("external links");
+                break;
+            }
+        }
+    };
+    for (const std::string &name : zip.names())
+    {
+        if (name.rfind("xl/externallinks/", 0) == 0)
+            found.insert("external links");
+        else if (name == "xl/connections.xml")
+            found.insert("data connections");
+        bool sheet_part = name.rfind("xl/worksheets/", 0) == 0 && name.find('/', 14) == std::string::npos;
+        if (!sheet_part && name != "xl/workbook.xml")
+            continue;
+        std::string xml;
+        if (!zip.read(name, xml))
+            return "unreadable package";
+        XmlScanner x(xml);
+        bool in_formula = false;
+        std::string formula;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Start && (x.is("f") || x.is("definedName")))
+            {
+                in_formula = true;
+                formula.clear();
+            }
+            else if (ev == XmlScanner::Event::Text && in_formula)
+            {
+                x.append_text(formula);
+            }
+            else if (ev == XmlScanner::Event::End && in_formula)
+            {
+                in_formula = false;
+                scan_formula(formula);
+            }
+        }
+    }
+    std::string out;
+    for (const std::string &f : found)
+        out += (out.empty() ? "" : ", ") + f;
+    return out;
+}
+
+// -------------------- Workbook analysis --------------------
+// /excel/analyze for every sheet of a workbook at once. The package is read
+// directly instead of through Excel, so no pool instance is tied up and
+// sheets can be classified on several threads; the cell types follow the
+// same rules as analyze_range.
+class WorkbookAnalyzer
+{
+public:
+    // Larger sheets are cut to this many cells, keeping whole rows.
+    static constexpr size_t kMaxCells = 20000;
+
+    bool open(const fs::path &path, std::string &err)
+    {
+        if (!zip_.open(path, err))
+            return false;
+        std::string workbook_xml, rels_xml, xml;
+        if (!zip_.read("xl/workbook.xml", workbook_xml) || !zip_.read("xl/_rels/workbook.xml.rels", rels_xml))
+        {
+            err = "not an xlsx package";
+            return false;
+        }
+        std::unordered_map<std::string, std::string> rels;
+        {
+            XmlScanner x(rels_xml);
+            for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+            {
+                if (ev == XmlScanner::Event::Start && x.is("Relationship"))
+                    rels[x.attr_or("Id")] = x.attr_or("Target");
+            }
+        }
+        XmlScanner x(workbook_xml);
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev != XmlScanner::Event::Start)
+                continue;
+            if (x.is("sheet"))
+            {
+                std::string target = rels[x.attr_or("id")];
+                // Chart sheets have no cells to analyze.
+                if (target.empty() || target.find("worksheets/") == std::string::npos)
+                    continue;
+                sheets_.push_back({x.attr_or("name"), WorkbookModel::part_path(target)});
+            }
+            else if (x.is("workbookPr"))
+            {
+                std::string v = x.attr_or("date1904");
+                date1904_ = v == "1" || v == "true";
+            }
+        }
+        if (zip_.read("xl/sharedStrings.xml", xml))
+            WorkbookModel::load_shared_strings(xml, shared_strings_);
+        if (zip_.read("xl/styles.xml", xml))
+            load_formats(xml);
+        return true;
+    }
+
+    size_t sheet_count() const { return sheets_.size(); }
+    const std::string &sheet_name(size_t i) const { return sheets_[i].name; }
+
+    // The sheet's used range in the /excel/analyze result shape, with the
+    // range itself and whether it was cut short.
+    bool analyze_sheet(size_t index, std::string &json, std::string &err) const
+    {
+        std::string xml;
+        if (!zip_.read(sheets_[index].part, xml))
+        {
+            err = "missing part " + sheets_[index].part;
+            return false;
+        }
+        std::vector<Cell> cells;
+        std::vector<Validation> lists;
+        if (!scan_sheet(xml, cells, lists, err))
+            return false;
+
+        uint32_t r1 = UINT32_MAX, c1 = UINT32_MAX, r2 = 0, c2 = 0;
+        auto extend = [&](uint32_t r, uint32_t c)
+        {
+            r1 = std::min(r1, r);
+            c1 = std::min(c1, c);
+            r2 = std::max(r2, r);
+            c2 = std::max(c2, c);
+        };
+        for (const Cell &cell : cells)
+        {
+            if (cell.kind != AnalyzedKind::Empty || cell.formula)
+                extend(cell.row, cell.col);
+        }
+        // A dropdown with nothing chosen yet still belongs in the form. Only
+        // the first cell of each validated area counts, since validations
+        // are often set on whole columns.
+        for (const Validation &v : lists)
+        {
+            for (const CellArea &a : v.areas)
+                extend(a.r1, a.c1);
+        }
+        json = "{\"sheet\":\"" + json_escape(sheets_[index].name) + "\"";
+        if (r1 == UINT32_MAX)
+        {
+            json += ",\"range\":\"\",\"result\":{\"cells\":[],\"rowCount\":0,\"colCount\":0}}";
+            return true;
+        }
+        uint32_t cols = c2 - c1 + 1;
+        uint32_t rows = r2 - r1 + 1;
+        bool truncated = static_cast<size_t>(rows) * cols > kMaxCells;
+        if (truncated)
+        {
+            rows = static_cast<uint32_t>(std::max<size_t>(1, kMaxCells / cols));
+            r2 = r1 + rows - 1;
+        }
+        std::vector<const Cell *> grid(static_cast<size_t>(rows) * cols, nullptr);
+        for (const Cell &cell : cells)
+        {
+            if (cell.row >= r1 && cell.row <= r2 && cell.col >= c1 && cell.col <= c2)
+                grid[static_cast<size_t>(cell.row - r1) * cols + (cell.col - c1)] = &cell;
+        }
+        std::vector<const std::string *> options(grid.size(), nullptr);
+        for (const Validation &v : lists)
+        {
+            for (const CellArea &a : v.areas)
+            {
+                for (uint32_t r = std::max(a.r1, r1); r <= std::min(a.r2, r2); ++r)
+                    for (uint32_t c = std::max(a.c1, c1); c <= std::min(a.c2, c2); ++c)
+                        options[static_cast<size_t>(r - r1) * cols + (c - c1)] = &v.formula1;
+            }
+        }
+
+        json += ",\"range\":\"" + column_name(c1) + std::to_string(r1 + 1) + ":" + column_name(c2) + std::to_string(r2 + 1) + "\"";
+        json += ",\"result\":{\"cells\":[";
+        static const Cell blank;
+        for (uint32_t r = 0; r < rows; ++r)
+        {
+            for (uint32_t c = 0; c < cols; ++c)
+            {
+                size_t i = static_cast<size_t>(r) * cols + c;
+                const Cell &cell = grid[i] ? *grid[i] : blank;
+                const std::string &number_format = cell_format(cell.style);
+                if (i)
+                    json.push_back(',');
+                json += "{\"address\":\"" + column_name(c1 + c) + std::to_string(r1 + r + 1) + "\"";
+                json += ",\"row\":" + std::to_string(r1 + r + 1);
+                json += ",\"col\":" + std::to_string(c1 + c + 1);
+                json += ",\"type\":\"" + classify_cell(cell.kind, number_format, cell.formula, options[i] != nullptr) + "\"";
+                json += ",\"value\":" + (cell.value.empty() ? std::string("null") : cell.value);
+                json += cell.formula ? ",\"isFormula\":true" : ",\"isFormula\":false";
+                if (options[i] && !options[i]->empty())
+                    json += ",\"options\":\"" + json_escape(*options[i]) + "\"";
+                if (!number_format.empty())
+                    json += ",\"format\":\"" + json_escape(number_format) + "\"";
+                json.push_back('}');
+            }
+        }
+        json += "],\"rowCount\":" + std::to_string(rows) + ",\"colCount\":" + std::to_string(cols);
+        if (truncated)
+            json += ",\"truncated\":true";
+        json += "}}";
+        return true;
+    }
+
+private:
+    struct SheetPart
+    {
+        std::string name;
+        std::string part;
+    };
+
+    struct Cell
+    {
+        uint32_t row = 0, col = 0;
+        int style = 0;
+        AnalyzedKind kind = AnalyzedKind::Empty;
+        bool formula = false;
+        std::string value; // JSON, as /excel/analyze reports it
+    };
+
+    struct Validation
+    {
+        std::vector<CellArea> areas;
+        std::string formula1; // as Validation.Formula1 reads: a=b,c literal list or =A1:A5
+    };
+
+    // Number format codes by id, as Excel shows them in an en-US locale.
+    static const char *builtin_format(int id)
+    {
+        switch (id)
+        {
+        case 0: return "General";
+        case 1: return "0";
+        case 2: return "0.00";
+        case 3: return "#,##0";
+        case 4: return "#,##0.00";
+        case 5: return "$#,##0_);($#,##0)";
+        case 6: return "$#,##0_);[Red]($#,##0)";
+        case 7: return "$#,##0.00_);($#,##0.00)";
+        case 8: return "$#,##0.00_);[Red]($#,##0.00)";
+        case 9: return "0%";
+        case 10: return "0.00%";
+        case 11: return "0.00E+00";
+        case 12: return "# ?/?";
+        case 13: return "# ?\?/?\?";
+        case 14: return "m/d/yyyy";
+        case 15: return "d-mmm-yy";
+        case 16: return "d-mmm";
+        case 17: return "mmm-yy";
+        case 18: return "h:mm AM/PM";
+        case 19: return "h:mm:ss AM/PM";
+        case 20: return "h:mm";
+        case 21: return "h:mm:ss";
+        case 22: return "m/d/yyyy h:mm";
+        case 37: return "#,##0 ;(#,##0)";
+        case 38: return "#,##0 ;[Red](#,##0)";
+        case 39: return "#,##0.00;(#,##0.00)";
+        case 40: return "#,##0.00;[Red](#,##0.00)";
+        case 41: return "_(* #,##0_);_(* \\(#,##0\\);_(* \"-\"_);_(@_)";
+        case 42: return "_(\"$\"* #,##0_);_(\"$\"* \\(#,##0\\);_(\"$\"* \"-\"_);_(@_)";
+        case 43: return "_(* #,##0.00_);_(* \\(#,##0.00\\);_(* \"-\"?\?_);_(@_)";
+        case 44: return "_(\"$\"* #,##0.00_);_(\"$\"* \\(#,##0.00\\);_(\"$\"* \"-\"?\?_);_(@_)";
+        case 45: return "mm:ss";
+        case 46: return "[h]:mm:ss";
+        case 47: return "mm:ss.0";
+        case 48: return "##0.0E+0";
+        case 49: return "@";
+        default: return "General";
+        }
+    }
+
+    void load_formats(const std::string &xml)
+    {
+        XmlScanner x(xml);
+        std::unordered_map<int, std::string> custom;
+        bool in_cell_xfs = false;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Start)
+            {
+                if (x.is("numFmt"))
+                    custom[std::atoi(x.attr_or("numFmtId", "0").c_str())] = x.attr_or("formatCode");
+                else if (x.is("cellXfs"))
+                    in_cell_xfs = true;
+                else if (x.is("xf") && in_cell_xfs)
+                {
+                    int id = std::atoi(x.attr_or("numFmtId", "0").c_str());
+                    auto it = custom.find(id);
+                    formats_.push_back(it != custom.end() ? it->second : builtin_format(id));
+                    date_styles_.push_back(it != custom.end() ? number_format_is_date(it->second) : WorkbookModel::is_builtin_date_format(id));
+                }
+            }
+            else if (ev == XmlScanner::Event::End && x.is("cellXfs"))
+            {
+                in_cell_xfs = false;
+            }
+        }
+    }
+
+    const std::string &cell_format(int style) const
+    {
+        static const std::string general = "General";
+        return style >= 0 && static_cast<size_t>(style) < formats_.size() ? formats_[style] : general;
+    }
+
+    bool is_date_style(int style) const
+    {
+        return style >= 0 && static_cast<size_t>(style) < date_styles_.size() && date_styles_[style];
+    }
+
+    void set_number(Cell &cell, double num) const
+    {
+        int y, m, d;
+        cell.kind = AnalyzedKind::Number;
+        if (is_date_style(cell.style) && serial_to_date(num, date1904_, y, m, d) && d > 0)
+        {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "\"%04d-%02d-%02d\"", y, m, d);
+            cell.value = buf;
+            cell.kind = AnalyzedKind::Date;
+        }
+        else
+        {
+            cell.value = format_json_number(num);
+        }
+    }
+
+    void set_text(Cell &cell, const std::string &text) const
+    {
+        cell.kind = text.empty() ? AnalyzedKind::Empty : AnalyzedKind::Text;
+        cell.value = "\"" + json_escape(text) + "\"";
+    }
+
+    // A list's Formula1 as the sheet stores it ("a,b" quoted, or a
+    // reference) in the form Excel hands back through COM.
+    static std::string list_formula(const std::string &stored)
+    {
+        if (stored.size() >= 2 && stored.front() == '"' && stored.back() == '"')
+        {
+            std::string out;
+            for (size_t i = 1; i + 1 < stored.size(); ++i)
+            {
+                out.push_back(stored[i]);
+                if (stored[i] == '"' && i + 2 < stored.size() && stored[i + 1] == '"')
+                    ++i;
+            }
+            return out;
+        }
+        return stored.empty() || stored[0] == '=' ? stored : "=" + stored;
+    }
+
+    static void parse_sqref(const std::string &sqref, std::vector<CellArea> &out)
+    {
+        std::istringstream in(sqref);
+        std::string part;
+        while (in >> part)
+        {
+            CellArea a;
+            if (parse_area_address(part, 0, a))
+                out.push_back(a);
+        }
+    }
+
+    bool scan_sheet(const std::string &xml, std::vector<Cell> &cells, std::vector<Validation> &lists, std::string &err) const
+    {
+        XmlScanner x(xml);
+        uint32_t next_row = 0, next_col = 0;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Error)
+            {
+                err = "malformed sheet xml";
+                return false;
+            }
+            if (ev != XmlScanner::Event::Start)
+                continue;
+            if (x.is("row"))
+            {
+                std::string r;
+                next_row = x.attr("r", r) ? static_cast<uint32_t>(std::max(1, std::atoi(r.c_str())) - 1) : next_row + 1;
+                next_col = 0;
+            }
+            else if (x.is("c"))
+            {
+                Cell cell;
+                cell.row = next_row;
+                cell.col = next_col;
+                std::string ref;
+                CellArea a;
+                if (x.attr("r", ref) && parse_area_address(ref, 0, a))
+                {
+                    cell.row = a.r1;
+                    cell.col = a.c1;
+                }
+                next_col = cell.col + 1;
+                cell.style = std::atoi(x.attr_or("s", "0").c_str());
+                std::string type = x.attr_or("t", "n");
+                std::string v_text;
+                bool has_v = false;
+                for (auto cev = x.next(); !(cev == XmlScanner::Event::End && x.is("c")); cev = x.next())
+                {
+                    if (cev == XmlScanner::Event::Eof || cev == XmlScanner::Event::Error)
+                    {
+                        err = "malformed cell";
+                        return false;
+                    }
+                    if (cev != XmlScanner::Event::Start)
+                        continue;
+                    if (x.is("f"))
+                        cell.formula = true;
+                    else if (x.is("v") || x.is("t"))
+                    {
+                        has_v = true;
+                        for (auto tev = x.next(); tev == XmlScanner::Event::Text; tev = x.next())
+                            x.append_text(v_text);
+                    }
+                }
+                if (!has_v)
+                {
+                    // Blank, or a formula never calculated: Excel would
+                    // show its result, so it still reads as a formula.
+                    if (cell.formula)
+                        cell.kind = AnalyzedKind::Other;
+                }
+                else if (type == "s")
+                {
+                    size_t idx = static_cast<size_t>(std::atoll(v_text.c_str()));
+                    set_text(cell, idx < shared_strings_.size() ? shared_strings_[idx] : std::string());
+                }
+                else if (type == "str" || type == "inlineStr")
+                    set_text(cell, v_text);
+                else if (type == "b")
+                {
+                    cell.kind = AnalyzedKind::Bool;
+                    cell.value = v_text == "1" || v_text == "true" ? "true" : "false";
+                }
+                else if (type == "e")
+                    cell.kind = AnalyzedKind::Other; // error values read as null, as on the COM path
+                else if (type == "d")
+                {
+                    int y, m, d;
+                    if (parse_iso_date(v_text, y, m, d))
+                    {
+                        cell.kind = AnalyzedKind::Date;
+                        cell.value = "\"" + v_text.substr(0, 10) + "\"";
+                    }
+                }
+                else if (!v_text.empty())
+                    set_number(cell, std::strtod(v_text.c_str(), nullptr));
+                if (cell.formula || cell.kind != AnalyzedKind::Empty)
+                    cells.push_back(std::move(cell));
+            }
+            else if (x.is("dataValidation"))
+            {
+                // Both the plain form (sqref attribute, <formula1>) and the
+                // x14 extension form (<xm:sqref>, <x14:formula1><xm:f>).
+                bool is_list = x.attr_or("type") == "list";
+                Validation v;
+                std::string sqref = x.attr_or("sqref"), formula1;
+                for (auto vev = x.next(); !(vev == XmlScanner::Event::End && x.is("dataValidation")); vev = x.next())
+                {
+                    if (vev == XmlScanner::Event::Eof || vev == XmlScanner::Event::Error)
+                        break;
+                    if (vev != XmlScanner::Event::Start)
+                        continue;
+                    std::string *target = x.is("formula1") ? &formula1 : x.is("sqref") ? &sqref : nullptr;
+                    if (!target)
+                        continue;
+                    for (auto tev = x.next(); !(tev == XmlScanner::Event::End && (x.is("formula1") || x.is("sqref"))); tev = x.next())
+                    {
+                        if (tev == XmlScanner::Event::Text)
+                            x.append_text(*target);
+                        else if (tev == XmlScanner::Event::Eof || tev == XmlScanner::Event::Error)
+                            break;
+                    }
+                }
+                if (!is_list)
+                    continue;
+                parse_sqref(sqref, v.areas);
+                v.formula1 = list_formula(trim(formula1));
+                if (!v.areas.empty())
+                    lists.push_back(std::move(v));
+            }
+        }
+        return true;
+    }
+
+    ZipArchive zip_;
+    std::vector<SheetPart> sheets_;
+    std::vector<std::string> shared_strings_;
+    std::vector<std::string> formats_;
+    std::vector<bool> date_styles_;
+    bool date1904_ = false;
+};
+
+// One /excel/analyze/workbook request. Worker threads take sheets one at
+// a time and queue each result as it is ready; the response stream takes
+// them in that order. Cancelling stops workers at their next sheet.
+class AnalysisJob : public std::enable_shared_from_this<AnalysisJob>
+{
+public:
+    AnalysisJob(std::string id, std::string user, std::shared_ptr<const WorkbookAnalyzer> analyzer)
+        : id_(std::move(id)), user_(std::move(user)), analyzer_(std::move(analyzer))
+    {
+    }
+
+    const std::string &id() const { return id_; }
+    const std::string &user() const { return user_; }
+    size_t total() const { return analyzer_->sheet_count(); }
+
+    void start(int threads)
+    {
+        size_t n = std::min<size_t>(std::max(1, threads), total());
+        for (size_t i = 0; i < n; ++i)
+        {
+            std::shared_ptr<AnalysisJob> self = shared_from_this();
+            std::thread([self]()
+                        { self->work(); })
+                .detach();
+        }
+    }
+
+    void cancel()
+    {
+        cancelled_.store(true);
+        std::lock_guard<std::mutex> lock(mu_);
+        cv_.notify_all();
+    }
+
+    bool cancelled() const { return cancelled_.load(); }
+
+    // Waits for the next sheet's line. False once every sheet has been
+    // handed out or the job is cancelled.
+    bool next(std::string &line)
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [this]()
+                 { return !ready_.empty() || delivered_ == total() || cancelled_.load(); });
+        if (ready_.empty() || cancelled_.load())
+            return false;
+        line = std::move(ready_.front());
+        ready_.pop_front();
+        ++delivered_;
+        return true;
+    }
+
+private:
+    void work()
+    {
+        for (size_t i = next_sheet_++; i < total() && !cancelled_.load(); i = next_sheet_++)
+        {
+            std::string json, err;
+            {
+                static Histogram &sheet_time = g_metrics.histogram("esa_analysis_sheet_seconds", "Time to analyze one sheet of a workbook job");
+                ScopedTimer timer(sheet_time);
+                if (!analyzer_->analyze_sheet(i, json, err))
+                    json = "{\"sheet\":\"" + json_escape(analyzer_->sheet_name(i)) + "\",\"error\":\"" + json_escape(err) + "\"}";
+            }
+            std::lock_guard<std::mutex> lock(mu_);
+            // Progress goes on each line: sheets finished, out of how many.
+            json.pop_back();
+            json += ",\"done\":" + std::to_string(++finished_) + ",\"total\":" + std::to_string(total()) + "}\n";
+            ready_.push_back(std::move(json));
+            cv_.notify_all();
+        }
+    }
+
+    std::string id_;
+    std::string user_;
+    std::shared_ptr<const WorkbookAnalyzer> analyzer_;
+    std::atomic<size_t> next_sheet_{0};
+    std::atomic<bool> cancelled_{false};
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::string> ready_;
+    size_t finished_ = 0;
+    size_t delivered_ = 0;
+};
+
+// -------------------- Native charts --------------------
+// Charts of an .xlsx as its drawing parts describe them, drawn in-process
+// for sessions on the native engine. Covers column, bar, line, area, pie
+// and scatter charts with axes, gridlines, a title and a legend; the look
+// follows Excel's defaults rather than the chart's own formatting. Other
+// chart types are left to Excel.
+
+uint64_t fnv1a64(const std::string &data, uint64_t h = 1469598103934665603ull)
+{
+    for (unsigned char c : data)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+std::string hex64(uint64_t v)
+{
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(v));
+    return buf;
+}
+
+struct NativeChart
+{
+    enum class Kind
+    {
+        Column,
+        Bar,
+        Line,
+        Area,
+        Pie,
+        Scatter,
+        Other
+    };
+
+    struct Series
+    {
+        std::string name;     // literal name, when there is no name_ref
+        std::string name_ref; // references as written in the chart part
+        std::string cat_ref;  // categories, or x values for scatter
+        std::string val_ref;  // values, or y values for scatter
+    };
+
+    std::string name;
+    uint32_t sheet = 0; // index into the workbook's sheets
+    CellArea anchor;    // cells the chart is drawn over
+    Kind kind = Kind::Other;
+    bool stacked = false;
+    bool percent = false;
+    bool lines = true; // scatter: connect the points
+    std::string title;
+    std::vector<Series> series;
+};
+
+// The charts of one workbook, read once and then looked up by cell.
+class ChartIndex
+{
+public:
+    bool load(const fs::path &path, std::string &err)
+    {
+        ZipArchive zip;
+        std::string workbook_xml, xml;
+        if (!zip.open(path, err))
+            return false;
+        if (!zip.read("xl/workbook.xml", workbook_xml))
+        {
+            err = "not an xlsx package";
+            return false;
+        }
+        std::unordered_map<std::string, std::string> book_rels = read_rels(zip, "xl/workbook.xml");
+        XmlScanner x(workbook_xml);
+        uint32_t sheet = 0;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev != XmlScanner::Event::Start || !x.is("sheet"))
+                continue;
+            sheet_names_.push_back(x.attr_or("name"));
+            std::string sheet_part = resolve_part("xl/workbook.xml", book_rels[x.attr_or("id")]);
+            if (zip.read(sheet_part, xml))
+                load_sheet_charts(zip, sheet, sheet_part, xml);
+            ++sheet;
+        }
+        return true;
+    }
+
+    // The first chart drawn over the given cell of a sheet, by name.
+    const NativeChart *find(const std::string &sheet, uint32_t row, uint32_t col) const
+    {
+        for (const NativeChart &chart : charts_)
+        {
+            if (normalize_sheet_key(sheet_names_[chart.sheet]) == normalize_sheet_key(sheet) &&
+                chart.anchor.contains(0, row, col))
+                return &chart;
+        }
+        return nullptr;
+    }
+
+private:
+    // A part's path from the path of the part whose relationship names it.
+    static std::string resolve_part(const std::string &from, const std::string &target)
+    {
+        if (target.empty())
+            return "";
+        if (target[0] == '/')
+            return target.substr(1);
+        std::string dir = from.substr(0, from.rfind('/') + 1);
+        std::string t = target;
+        while (t.compare(0, 3, "../") == 0)
+        {
+            t = t.substr(3);
+            size_t cut = dir.size() > 1 ? dir.rfind('/', dir.size() - 2) : std::string::npos;
+            dir = cut == std::string::npos ? "" : dir.substr(0, cut + 1);
+        }
+        return dir + t;
+    }
+
+    static std::unordered_map<std::string, std::string> read_rels(const ZipArchive &zip, const std::string &part)
+    {
+        std::unordered_map<std::string, std::string> rels;
+        size_t slash = part.rfind('/') + 1;
+        std::string xml;
+        if (!zip.read(part.substr(0, slash) + "_rels/" + part.substr(slash) + ".rels", xml))
+            return rels;
+        XmlScanner x(xml);
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Start && x.is("Relationship") && x.attr_or("TargetMode") != "External")
+                rels[x.attr_or("Id")] = x.attr_or("Target");
+        }
+        return rels;
+    }
+
+    void load_sheet_charts(const ZipArchive &zip, uint32_t sheet, const std::string &sheet_part, const std::string &sheet_xml)
+    {
+        std::unordered_map<std::string, std::string> rels = read_rels(zip, sheet_part);
+        XmlScanner x(sheet_xml);
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev != XmlScanner::Event::Start || !x.is("drawing"))
+                continue;
+            std::string drawing_part = resolve_part(sheet_part, rels[x.attr_or("id")]);
+            std::string xml;
+            if (zip.read(drawing_part, xml))
+                load_drawing(zip, sheet, drawing_part, xml);
+        }
+    }
+
+    // Anchors of the drawing that hold a chart: the cell box from <from> to
+    // <to> (just <from> for a one-cell anchor), the shape name and the
+    // chart part.
+    void load_drawing(const ZipArchive &zip, uint32_t sheet, const std::string &drawing_part, const std::string &drawing_xml)
+    {
+        std::unordered_map<std::string, std::string> rels = read_rels(zip, drawing_part);
+        XmlScanner x(drawing_xml);
+        NativeChart chart;
+        std::string chart_id, corner, field;
+        uint32_t from_row = 0, from_col = 0, to_row = 0, to_col = 0;
+        bool in_anchor = false;
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Start)
+            {
+                if (x.is("twoCellAnchor") || x.is("oneCellAnchor"))
+                {
+                    in_anchor = true;
+                    chart = NativeChart();
+                    chart_id.clear();
+                    from_row = from_col = to_row = to_col = 0;
+                }
+                else if (in_anchor && (x.is("from") || x.is("to")))
+                    corner = x.name();
+                else if (in_anchor && !corner.empty() && (x.is("row") || x.is("col")))
+                {
+                    field.clear();
+                    bool is_row = x.is("row");
+                    for (auto tev = x.next(); tev == XmlScanner::Event::Text; tev = x.next())
+                        x.append_text(field);
+                    uint32_t v = static_cast<uint32_t>(std::max(0, std::atoi(field.c_str())));
+                    (corner == "from" ? (is_row ? from_row : from_col) : (is_row ? to_row : to_col)) = v;
+                }
+                else if (in_anchor && x.is("cNvPr"))
+                    chart.name = x.attr_or("name");
+                else if (in_anchor && x.is("chart"))
+                    chart_id = x.attr_or("id");
+            }
+            else if (ev == XmlScanner::Event::End)
+            {
+                if (x.is("from") || x.is("to"))
+                    corner.clear();
+                else if (x.is("twoCellAnchor") || x.is("oneCellAnchor"))
+                {
+                    bool one_cell = x.is("oneCellAnchor");
+                    in_anchor = false;
+                    std::string chart_part = resolve_part(drawing_part, rels[chart_id]);
+                    std::string xml;
+                    if (chart_id.empty() || !zip.read(chart_part, xml))
+                        continue;
+                    chart.sheet = sheet;
+                    chart.anchor.sheet = 0;
+                    chart.anchor.r1 = from_row;
+                    chart.anchor.c1 = from_col;
+                    chart.anchor.r2 = one_cell ? from_row : std::max(from_row, to_row);
+                    chart.anchor.c2 = one_cell ? from_col : std::max(from_col, to_col);
+                    load_chart(xml, chart);
+                    charts_.push_back(std::move(chart));
+                }
+            }
+        }
+    }
+
+    // Type, grouping, title and series of the first chart group in the
+    // plot area; a combination chart is drawn as its first group alone.
+    static void load_chart(const std::string &xml, NativeChart &chart)
+    {
+        XmlScanner x(xml);
+        std::vector<std::string> path;
+        bool have_group = false, in_group = false;
+        NativeChart::Series ser;
+        std::string *text = nullptr;
+        std::string slot; // tx, cat, val, xVal or yVal while inside a series
+        for (auto ev = x.next(); ev != XmlScanner::Event::Eof && ev != XmlScanner::Event::Error; ev = x.next())
+        {
+            if (ev == XmlScanner::Event::Text)
+            {
+                if (text)
+                    x.append_text(*text);
+                continue;
+            }
+            std::string name = x.name();
+            if (ev == XmlScanner::Event::End)
+            {
+                if (!path.empty())
+                    path.pop_back();
+                text = nullptr;
+                if (in_group && name == "ser")
+                    chart.series.push_back(ser);
+                else if (in_group && (name == "tx" || name == "cat" || name == "val" || name == "xVal" || name == "yVal"))
+                    slot.clear();
+                else if (in_group && name.size() > 5 && name.compare(name.size() - 5, 5, "Chart") == 0)
+                    in_group = false;
+                continue;
+            }
+            std::string parent = path.empty() ? "" : path.back();
+            path.push_back(name);
+            if (!have_group && parent == "plotArea" && name.size() > 5 && name.compare(name.size() - 5, 5, "Chart") == 0)
+            {
+                have_group = in_group = true;
+                chart.kind = name == "barChart" ? NativeChart::Kind::Column
+                           : name == "lineChart" ? NativeChart::Kind::Line
+                           : name == "areaChart" ? NativeChart::Kind::Area
+                           : name == "pieChart" ? NativeChart::Kind::Pie
+                           : name == "scatterChart" ? NativeChart::Kind::Scatter
+                                                    : NativeChart::Kind::Other;
+            }
+            else if (in_group && name == "barDir")
+            {
+                if (x.attr_or("val") == "bar")
+                    chart.kind = NativeChart::Kind::Bar;
+            }
+            else if (in_group && name == "grouping")
+            {
+                std::string g = x.attr_or("val");
+                chart.stacked = g == "stacked" || g == "percentStacked";
+                chart.percent = g == "percentStacked";
+            }
+            else if (in_group && name == "scatterStyle")
+            {
+                std::string s = x.attr_or("val");
+                chart.lines = s.find("line") != std::string::npos || s.find("smooth") != std::string::npos;
+            }
+            else if (in_group && name == "ser")
+                ser = NativeChart::Series();
+            else if (in_group && parent == "ser" && (name == "tx" || name == "cat" || name == "val" || name == "xVal" || name == "yVal"))
+                slot = name;
+            else if (in_group && !slot.empty() && name == "f")
+                text = slot == "tx" ? &ser.name_ref : (slot == "cat" || slot == "xVal") ? &ser.cat_ref : &ser.val_ref;
+            else if (in_group && slot == "tx" && name == "v")
+                text = &ser.name;
+            else if (name == "t" && std::find(path.begin(), path.end(), "title") != path.end() &&
+                     std::find(path.begin(), path.end(), "plotArea") == path.end())
+                text = &chart.title;
+        }
+    }
+
+    std::vector<std::string> sheet_names_;
+    std::vector<NativeChart> charts_;
+};
+
+// Values of one series, read from the workbook for drawing.
+struct ChartSeriesData
+{
+    std::string name;
+    std::vector<std::string> categories;
+    std::vector<double> xs; // scatter only
+    std::vector<double> values; // NaN where the cell is blank or not a number
+};
+
+// An indexed-colour image with just enough drawing for charts, written out
+// as a PNG.
+class ChartCanvas
+{
+public:
+    enum Color : uint8_t
+    {
+        Background,
+        Grid,
+        Axis,
+        Ink,
+        FirstSeries
+    };
+    static constexpr int kSeriesColors = 8;
+
+    ChartCanvas(int width, int height) : w_(width), h_(height), px_(static_cast<size_t>(width) * height, Background) {}
+
+    int width() const { return w_; }
+    int height() const { return h_; }
+
+    static uint8_t series_color(size_t i) { return static_cast<uint8_t>(FirstSeries + i % kSeriesColors); }
+
+    void fill(int x0, int y0, int x1, int y1, uint8_t c)
+    {
+        if (x0 > x1)
+            std::swap(x0, x1);
+        if (y0 > y1)
+            std::swap(y0, y1);
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, w_);
+        y1 = std::min(y1, h_);
+        for (int y = y0; y < y1; ++y)
+            std::fill(px_.begin() + static_cast<size_t>(y) * w_ + x0, px_.begin() + static_cast<size_t>(y) * w_ + std::max(x0, x1), c);
+    }
+
+    void line(double x0, double y0, double x1, double y1, int thickness, uint8_t c)
+    {
+        int steps = static_cast<int>(std::max(std::fabs(x1 - x0), std::fabs(y1 - y0))) + 1;
+        int lo = thickness / 2, hi = thickness - lo;
+        for (int i = 0; i <= steps; ++i)
+        {
+            int x = static_cast<int>(std::lround(x0 + (x1 - x0) * i / steps));
+            int y = static_cast<int>(std::lround(y0 + (y1 - y0) * i / steps));
+            fill(x - lo, y - lo, x + hi, y + hi, c);
+        }
+    }
+
+    // A pie slice from angle a0 to a1, in radians clockwise from twelve o'clock.
+    void wedge(double cx, double cy, double r, double a0, double a1, uint8_t c)
+    {
+        const double two_pi = 6.283185307179586;
+        for (int y = std::max(0, static_cast<int>(cy - r)); y <= std::min(h_ - 1, static_cast<int>(cy + r)); ++y)
+        {
+            for (int x = std::max(0, static_cast<int>(cx - r)); x <= std::min(w_ - 1, static_cast<int>(cx + r)); ++x)
+            {
+                double dx = x + 0.5 - cx, dy = y + 0.5 - cy;
+                if (dx * dx + dy * dy > r * r)
+                    continue;
+                double a = std::atan2(dx, -dy);
+                if (a < 0)
+                    a += two_pi;
+                if (a >= a0 && a < a1)
+                    px_[static_cast<size_t>(y) * w_ + x] = c;
+            }
+        }
+    }
+
+    // 5x7 capitals, digits and common punctuation; lower case is drawn as
+    // upper case and anything else as '?'.
+    void text(int x, int y, const std::string &s, uint8_t c, int scale = 1)
+    {
+        for (char ch : s)
+        {
+            const uint8_t *g = glyph(ch);
+            for (int row = 0; row < 7; ++row)
+            {
+                for (int col = 0; col < 5; ++col)
+                {
+                    if (g[row] & (0x10 >> col))
+                        fill(x + col * scale, y + row * scale, x + (col + 1) * scale, y + (row + 1) * scale, c);
+                }
+            }
+            x += 6 * scale;
+        }
+    }
+
+    static int text_width(const std::string &s, int scale = 1) { return s.empty() ? 0 : static_cast<int>(s.size()) * 6 * scale - scale; }
+
+    // Text cut to fit a width, with ".." when shortened.
+    static std::string fit(const std::string &s, int width)
+    {
+        if (text_width(s) <= width)
+            return s;
+        size_t keep = static_cast<size_t>(std::max(0, (width + 1) / 6 - 2));
+        return keep ? s.substr(0, keep) + ".." : std::string();
+    }
+
+    std::string png() const
+    {
+        static const uint8_t palette[][3] = {
+            {0xFF, 0xFF, 0xFF}, {0xD9, 0xD9, 0xD9}, {0x8C, 0x8C, 0x8C}, {0x40, 0x40, 0x40},
+            {0x44, 0x72, 0xC4}, {0xED, 0x7D, 0x31}, {0xA5, 0xA5, 0xA5}, {0xFF, 0xC0, 0x00},
+            {0x5B, 0x9B, 0xD5}, {0x70, 0xAD, 0x47}, {0x26, 0x44, 0x78}, {0x9E, 0x48, 0x0E}};
+        std::string raw;
+        raw.reserve(static_cast<size_t>(w_ + 1) * h_);
+        for (int y = 0; y < h_; ++y)
+        {
+            raw.push_back(0); // filter: none
+            raw.append(reinterpret_cast<const char *>(px_.data()) + static_cast<size_t>(y) * w_, w_);
+        }
+        std::string out("\x89PNG\r\n\x1a\n", 8);
+        std::string ihdr;
+        put_be32(ihdr, static_cast<uint32_t>(w_));
+        put_be32(ihdr, static_cast<uint32_t>(h_));
+        ihdr += std::string("\x08\x03\x00\x00\x00", 5); // 8-bit palette indexes
+        put_chunk(out, "IHDR", ihdr);
+        put_chunk(out, "PLTE", std::string(reinterpret_cast<const char *>(palette), sizeof(palette)));
+        put_chunk(out, "IDAT", zlib_deflate(raw, static_cast<size_t>(w_) + 1));
+        put_chunk(out, "IEND", "");
+        return out;
+    }
+
+private:
+    static const uint8_t *glyph(char ch)
+    {
+        static const char kChars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.-,%$:/()+&'_ ?";
+        static const uint8_t kGlyphs[][7] = {
+            {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E},
+            {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}, {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E},
+            {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}, {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E},
+            {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}, {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+            {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}, {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C},
+            {0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11}, {0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E},
+            {0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E}, {0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C},
+            {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F}, {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10},
+            {0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F}, {0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11},
+            {0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E}, {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C},
+            {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F},
+            {0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11}, {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11},
+            {0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, {0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10},
+            {0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D}, {0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11},
+            {0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E}, {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04},
+            {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, {0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04},
+            {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A}, {0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11},
+            {0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04}, {0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F},
+            {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}, {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00},
+            {0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08}, {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03},
+            {0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04}, {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00},
+            {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02},
+            {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, {0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00},
+            {0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D}, {0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00},
+            {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F}, {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+            {0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04}};
+        char up = static_cast<char>(toupper(static_cast<unsigned char>(ch)));
+        const char *at = std::strchr(kChars, up);
+        return kGlyphs[at && up ? at - kChars : sizeof(kChars) - 2];
+    }
+
+    static void put_be32(std::string &out, uint32_t v)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back(static_cast<char>((v >> shift) & 0xFF));
+    }
+
+    static uint32_t crc32(const std::string &a, const std::string &b)
+    {
+        static const std::array<uint32_t, 256> table = []()
+        {
+            std::array<uint32_t, 256> t{};
+            for (uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        uint32_t c = 0xFFFFFFFFu;
+        for (const std::string *s : {&a, &b})
+        {
+            for (unsigned char ch : *s)
+                c = table[(c ^ ch) & 0xFF] ^ (c >> 8);
+        }
+        return c ^ 0xFFFFFFFFu;
+    }
+
+    static void put_chunk(std::string &out, const char *type, const std::string &data)
+    {
+        put_be32(out, static_cast<uint32_t>(data.size()));
+        out += type;
+        out += data;
+        put_be32(out, crc32(type, data));
+    }
+
+    // A zlib stream in one fixed-Huffman block. Charts are mostly flat
+    // colour, so repeats of the previous byte or of the row above are all
+    // the matching it needs.
+    static std::string zlib_deflate(const std::string &in, size_t stride)
+    {
+        static const uint16_t kLenBase[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t kLenExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t kDistBase[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const uint8_t kDistExtra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        std::string out("\x78\x01", 2);
+        uint64_t bits = 0;
+        int count = 0;
+        auto put = [&](uint32_t v, int n)
+        {
+            bits |= static_cast<uint64_t>(v) << count;
+            count += n;
+            while (count >= 8)
+            {
+                out.push_back(static_cast<char>(bits & 0xFF));
+                bits >>= 8;
+                count -= 8;
+            }
+        };
+        // Huffman codes go most significant bit first.
+        auto put_code = [&](uint32_t code, int n)
+        {
+            uint32_t rev = 0;
+            for (int i = 0; i < n; ++i)
+                rev |= ((code >> i) & 1) << (n - 1 - i);
+            put(rev, n);
+        };
+        auto put_symbol = [&](int sym)
+        {
+            if (sym < 144)
+                put_code(0x30 + sym, 8);
+            else if (sym < 256)
+                put_code(0x190 + sym - 144, 9);
+            else if (sym < 280)
+                put_code(sym - 256, 7);
+            else
+                put_code(0xC0 + sym - 280, 8);
+        };
+        put(1, 1); // final block
+        put(1, 2); // fixed codes
+        size_t limit = std::min<size_t>(stride, 32768);
+        for (size_t i = 0; i < in.size();)
+        {
+            size_t best = 0, dist = 0;
+            for (size_t d : {size_t(1), limit})
+            {
+                if (d > i)
+                    continue;
+                size_t n = 0;
+                while (n < 258 && i + n < in.size() && in[i + n] == in[i + n - d])
+                    ++n;
+                if (n > best)
+                {
+                    best = n;
+                    dist = d;
+                }
+            }
+            if (best < 3)
+            {
+                put_symbol(static_cast<unsigned char>(in[i++]));
+                continue;
+            }
+            int lc = 28;
+            while (kLenBase[lc] > best)
+                --lc;
+            put_symbol(257 + lc);
+            put(static_cast<uint32_t>(best - kLenBase[lc]), kLenExtra[lc]);
+            int dc = 29;
+            while (kDistBase[dc] > dist)
+                --dc;
+            put_code(static_cast<uint32_t>(dc), 5);
+            put(static_cast<uint32_t>(dist - kDistBase[dc]), kDistExtra[dc]);
+            i += best;
+        }
+        put_symbol(256);
+        if (count)
+            put(0, 8 - count);
+        uint32_t a = 1, b = 0;
+        for (unsigned char ch : in)
+        {
+            a = (a + ch) % 65521;
+            b = (b + a) % 65521;
+        }
+        put_be32(out, (b << 16) | a);
+        return out;
+    }
+
+    int w_, h_;
+    std::vector<uint8_t> px_;
+};
+
+// Tick values for a value axis: about five steps of 1, 2 or 5 times a
+// power of ten covering [lo, hi]. Returns the number of steps; tick k is
+// at first + k * step. A span too narrow for its magnitude (1e17 and the
+// next double up) has no usable step and gets a single tick at `first`.
+int chart_ticks(double lo, double hi, double &first, double &last, double &step)
+{
+    static const int kMaxSteps = 50;
+    if (!std::isfinite(lo) || !std::isfinite(hi))
+        lo = 0, hi = 1;
+    if (!(hi > lo))
+        hi = lo + 1;
+    double raw = (hi - lo) / 5;
+    double mag = std::pow(10.0, std::floor(std::log10(raw)));
+    double norm = raw / mag;
+    step = (norm <= 1 ? 1 : norm <= 2 ? 2 : norm <= 5 ? 5 : 10) * mag;
+    first = std::floor(lo / step) * step;
+    last = std::ceil(hi / step) * step;
+    double steps = std::round((last - first) / step);
+    if (std::isfinite(step) && step > 0 && first + step != first && steps >= 1 && steps <= kMaxSteps)
+        return static_cast<int>(steps);
+    first = lo;
+    last = hi > lo ? hi : std::nextafter(lo, HUGE_VAL);
+    step = last - first;
+    return 0;
+}
+
+std::string chart_number(double v, bool percent)
+{
+    if (percent)
+        return format_general(std::round(v * 100)) + "%";
+    double a = std::fabs(v);
+    if (a >= 1e9)
+        return format_general(v / 1e9) + "B";
+    if (a >= 1e6)
+        return format_general(v / 1e6) + "M";
+    if (a >= 1e4)
+        return format_general(v / 1e3) + "K";
+    return format_general(std::round(v * 1e6) / 1e6);
+}
+
+// Draws the chart at its anchor's size, taking columns as 64 pixels and
+// rows as 20 as in a default sheet.
+std::string render_chart_png(const NativeChart &chart, const std::vector<ChartSeriesData> &series)
+{
+    int width = std::min(1200, std::max(320, static_cast<int>(chart.anchor.c2 - chart.anchor.c1 + 1) * 64));
+    int height = std::min(800, std::max(200, static_cast<int>(chart.anchor.r2 - chart.anchor.r1 + 1) * 20));
+    ChartCanvas canvas(width, height);
+    int top = 10, bottom = height - 10, left = 10, right = width - 10;
+    if (!chart.title.empty())
+    {
+        std::string title = ChartCanvas::fit(chart.title, (right - left) / 2);
+        canvas.text((width - ChartCanvas::text_width(title, 2)) / 2, top, title, ChartCanvas::Ink, 2);
+        top += 24;
+    }
+    bool pie = chart.kind == NativeChart::Kind::Pie;
+    // Legend along the bottom: series, or the categories of a pie.
+    std::vector<std::string> keys;
+    if (pie && !series.empty())
+        keys = series[0].categories;
+    else if (series.size() > 1)
+    {
+        for (const ChartSeriesData &s : series)
+            keys.push_back(s.name);
+    }
+    if (!keys.empty())
+    {
+        int total = 0;
+        for (const std::string &k : keys)
+            total += 14 + ChartCanvas::text_width(ChartCanvas::fit(k, 120)) + 12;
+        int x = std::max(left, (width - total) / 2);
+        int y = bottom - 8;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            std::string k = ChartCanvas::fit(keys[i], 120);
+            if (x + 14 + ChartCanvas::text_width(k) > right)
+                break;
+            canvas.fill(x, y, x + 8, y + 8, ChartCanvas::series_color(i));
+            canvas.text(x + 12, y, k, ChartCanvas::Ink);
+            x += 14 + ChartCanvas::text_width(k) + 12;
+        }
+        bottom -= 20;
+    }
+
+    if (pie)
+    {
+        const double two_pi = 6.283185307179586;
+        double sum = 0;
+        if (!series.empty())
+        {
+            for (double v : series[0].values)
+                sum += std::isfinite(v) && v > 0 ? v : 0;
+        }
+        double r = std::max(10, std::min(right - left, bottom - top) / 2 - 4);
+        double cx = (left + right) / 2.0, cy = (top + bottom) / 2.0, a = 0;
+        for (size_t i = 0; sum > 0 && i < series[0].values.size(); ++i)
+        {
+            double v = series[0].values[i];
+            if (!std::isfinite(v) || v <= 0)
+                continue;
+            double next = a + two_pi * v / sum;
+            canvas.wedge(cx, cy, r, a, next, ChartCanvas::series_color(i));
+            a = next;
+        }
+        return canvas.png();
+    }
+
+    // Value range, with stacks summed per category.
+    bool scatter = chart.kind == NativeChart::Kind::Scatter;
+    bool horizontal = chart.kind == NativeChart::Kind::Bar;
+    bool bars = horizontal || chart.kind == NativeChart::Kind::Column;
+    size_t points = 0;
+    for (const ChartSeriesData &s : series)
+        points = std::max(points, s.values.size());
+    std::vector<double> pos(points, 0), neg(points, 0);
+    double lo = 0, hi = 0, xlo = 0, xhi = 0;
+    bool have_x = false;
+    for (const ChartSeriesData &s : series)
+    {
+        for (size_t i = 0; i < s.values.size(); ++i)
+        {
+            double v = s.values[i];
+            if (!std::isfinite(v))
+                continue;
+            if (chart.stacked)
+                (v >= 0 ? pos[i] : neg[i]) += v;
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+            if (scatter && i < s.xs.size() && std::isfinite(s.xs[i]))
+            {
+                xlo = have_x ? std::min(xlo, s.xs[i]) : s.xs[i];
+                xhi = have_x ? std::max(xhi, s.xs[i]) : s.xs[i];
+                have_x = true;
+            }
+        }
+    }
+    if (chart.stacked)
+    {
+        lo = hi = 0;
+        for (size_t i = 0; i < points; ++i)
+        {
+            lo = std::min(lo, chart.percent ? (pos[i] - neg[i] > 0 ? neg[i] / (pos[i] - neg[i]) : 0) : neg[i]);
+            hi = std::max(hi, chart.percent ? (pos[i] - neg[i] > 0 ? pos[i] / (pos[i] - neg[i]) : 0) : pos[i]);
+        }
+    }
+    double first, last, step;
+    int ticks = chart_ticks(lo, hi, first, last, step);
+    double xfirst = 0, xlast = 1, xstep = 1;
+    int xticks = 1;
+    if (scatter)
+        xticks = chart_ticks(xlo, xhi, xfirst, xlast, xstep);
+
+    // Plot box, leaving room for tick labels on the value axis and
+    // category labels on the other.
+    int label_w = 0;
+    for (int k = 0; k <= ticks; ++k)
+        label_w = std::max(label_w, ChartCanvas::text_width(chart_number(first + k * step, chart.percent)));
+    int x0 = left + (horizontal ? 60 : label_w + 6), x1 = right - 4;
+    int y0 = top + 4, y1 = bottom - 14;
+    if (x1 - x0 < 20 || y1 - y0 < 20)
+        return canvas.png();
+    auto vmap = [&](double v)
+    {
+        double f = (v - first) / (last - first);
+        return horizontal ? x0 + f * (x1 - x0) : y1 - f * (y1 - y0);
+    };
+    for (int k = 0; k <= ticks; ++k)
+    {
+        double t = first + k * step;
+        double p = vmap(t);
+        std::string label = chart_number(t, chart.percent);
+        if (horizontal)
+        {
+            canvas.line(p, y0, p, y1, 1, ChartCanvas::Grid);
+            int tx = std::min(static_cast<int>(p) - ChartCanvas::text_width(label) / 2, right - ChartCanvas::text_width(label));
+            canvas.text(tx, y1 + 4, label, ChartCanvas::Ink);
+        }
+        else
+        {
+            canvas.line(x0, p, x1, p, 1, ChartCanvas::Grid);
+            canvas.text(x0 - 4 - ChartCanvas::text_width(label), static_cast<int>(p) - 3, label, ChartCanvas::Ink);
+        }
+    }
+    double base = vmap(std::max(first, std::min(0.0, last)));
+    if (horizontal)
+        canvas.line(base, y0, base, y1, 1, ChartCanvas::Axis);
+    else
+        canvas.line(x0, base, x1, base, 1, ChartCanvas::Axis);
+
+    // Category slots along the other axis; scatter maps x values instead.
+    size_t slots = std::max<size_t>(points, 1);
+    double span = horizontal ? y1 - y0 : x1 - x0;
+    double slot = span / slots;
+    auto cmap = [&](size_t i, double frac)
+    {
+        // Excel draws the first category of a bar chart at the bottom.
+        return horizontal ? y1 - (i + frac) * slot : x0 + (i + frac) * slot;
+    };
+    auto xmap = [&](double x)
+    {
+        return x0 + (x - xfirst) / (xlast - xfirst) * (x1 - x0);
+    };
+    if (scatter)
+    {
+        for (int k = 0; k <= xticks; ++k)
+        {
+            double t = xfirst + k * xstep;
+            std::string label = chart_number(t, false);
+            canvas.text(static_cast<int>(xmap(t)) - ChartCanvas::text_width(label) / 2, y1 + 4, label, ChartCanvas::Ink);
+        }
+    }
+    else if (!series.empty())
+    {
+        const std::vector<std::string> &cats = series[0].categories;
+        int room = static_cast<int>(horizontal ? 56 : slot - 2);
+        size_t every = 1;
+        while (!horizontal && every < slots && ChartCanvas::text_width("00000") > room * static_cast<int>(every) && slot * every < 40)
+            ++every;
+        for (size_t i = 0; i < slots; i += every)
+        {
+            std::string label = ChartCanvas::fit(i < cats.size() ? cats[i] : std::to_string(i + 1), horizontal ? room : room * static_cast<int>(every));
+            double c = cmap(i, 0.5);
+            if (horizontal)
+                canvas.text(x0 - 4 - ChartCanvas::text_width(label), static_cast<int>(c) - 3, label, ChartCanvas::Ink);
+            else
+                canvas.text(static_cast<int>(c) - ChartCanvas::text_width(label) / 2, y1 + 4, label, ChartCanvas::Ink);
+        }
+    }
+
+    std::vector<double> up(points, 0), down(points, 0);
+    for (size_t si = 0; si < series.size(); ++si)
+    {
+        const ChartSeriesData &s = series[si];
+        uint8_t color = ChartCanvas::series_color(si);
+        bool have_prev = false;
+        double px = 0, py = 0, pb = 0;
+        for (size_t i = 0; i < s.values.size(); ++i)
+        {
+            double v = s.values[i];
+            if (!std::isfinite(v))
+            {
+                have_prev = false;
+                continue;
+            }
+            double from = 0, to = v;
+            if (chart.stacked)
+            {
+                double total = pos[i] - neg[i];
+                double scale = chart.percent && total > 0 ? 1 / total : 1;
+                double &edge = v >= 0 ? up[i] : down[i];
+                from = edge * scale;
+                edge += v;
+                to = edge * scale;
+            }
+            if (bars)
+            {
+                double group = slot * 0.7;
+                double band = chart.stacked ? group : group / std::max<size_t>(series.size(), 1);
+                double c0 = std::min(cmap(i, 0.15), cmap(i, 0.85)) + (chart.stacked ? 0 : band * si);
+                int a0 = static_cast<int>(std::lround(c0)), a1 = static_cast<int>(std::lround(c0 + band));
+                int b0 = static_cast<int>(std::lround(vmap(from))), b1 = static_cast<int>(std::lround(vmap(to)));
+                if (horizontal)
+                    canvas.fill(b0, a0, b1, std::max(a1, a0 + 1), color);
+                else
+                    canvas.fill(a0, b0, std::max(a1, a0 + 1), b1, color);
+                continue;
+            }
+            double x = scatter ? (i < s.xs.size() && std::isfinite(s.xs[i]) ? xmap(s.xs[i]) : xmap(static_cast<double>(i + 1))) : cmap(i, 0.5);
+            double y = vmap(to);
+            if (chart.kind == NativeChart::Kind::Area)
+            {
+                // Columns of the band between this series and the one below.
+                if (have_prev)
+                {
+                    for (int cx = static_cast<int>(px); cx <= static_cast<int>(x); ++cx)
+                    {
+                        double f = x > px ? (cx - px) / (x - px) : 0;
+                        canvas.fill(cx, static_cast<int>(py + (y - py) * f), cx + 1, static_cast<int>(pb + (vmap(from) - pb) * f), color);
+                    }
+                }
+            }
+            else if (have_prev && (!scatter || chart.lines))
+                canvas.line(px, py, x, y, 2, color);
+            if (scatter)
+                canvas.fill(static_cast<int>(x) - 3, static_cast<int>(y) - 3, static_cast<int>(x) + 4, static_cast<int>(y) + 4, color);
+            px = x;
+            py = y;
+            pb = vmap(from);
+            have_prev = true;
+        }
+    }
+    return canvas.png();
+}
+
+// Chart indexes by workbook file, shared by the sessions that have it open.
+class ChartIndexCache
+{
+public:
+    std::shared_ptr<const ChartIndex> get(const fs::path &path, fs::file_time_type stamp)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto it = entries_.begin(); it != entries_.end();)
+        {
+            if (it->second.index.expired())
+                it = entries_.erase(it);
+            else
+                ++it;
+        }
+        Entry &entry = entries_[path.u8string()];
+        if (entry.stamp == stamp)
+        {
+            if (std::shared_ptr<const ChartIndex> index = entry.index.lock())
+                return index;
+        }
+        auto index = std::make_shared<ChartIndex>();
+        std::string err;
+        if (!index->load(path, err))
+            ESA_LOG_WARN("Could not read charts of " + path.filename().u8string() + ": " + err);
+        entry.stamp = stamp;
+        entry.index = index;
+        return index;
+    }
+
+private:
+    struct Entry
+    {
+        fs::file_time_type stamp{};
+        std::weak_ptr<const ChartIndex> index;
+    };
+
+    std::mutex mu_;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+// Reads what a chart draws from the workbook. `values_json` collects every
+// source range as JSON, which is what the rendered image depends on.
+bool read_chart_series(NativeWorkbook &wb, const NativeChart &chart, std::vector<ChartSeriesData> &out, std::string &values_json, std::string &err)
+{
+    auto read_refs = [&](const std::string &refs, std::vector<CellValue> &cells, std::vector<uint8_t> &dates)
+    {
+        std::vector<ChartRef> parts;
+        split_chart_refs(refs, parts);
+        for (const ChartRef &ref : parts)
+        {
+            CellArea area;
+            if (!wb.resolve_area(ref.sheet, ref.range, area, err))
+                return false;
+            CellGrid grid;
+            wb.read_grid(area, grid);
+            cells.insert(cells.end(), grid.values.begin(), grid.values.end());
+            dates.insert(dates.end(), grid.dates.begin(), grid.dates.end());
+            values_json += wb.query_json(area);
+            values_json.push_back('\n');
+        }
+        return true;
+    };
+    for (const NativeChart::Series &s : chart.series)
+    {
+        ChartSeriesData data;
+        std::vector<CellValue> cells;
+        std::vector<uint8_t> dates;
+        data.name = s.name;
+        if (!s.name_ref.empty())
+        {
+            if (!read_refs(s.name_ref, cells, dates))
+                return false;
+            data.name.clear();
+            for (const CellValue &v : cells)
+                data.name += (data.name.empty() ? "" : " ") + value_to_text(v);
+        }
+        cells.clear();
+        dates.clear();
+        if (!read_refs(s.cat_ref, cells, dates))
+            return false;
+        for (size_t i = 0; i < cells.size(); ++i)
+        {
+            int y = 0, m = 0, d = 0;
+            if (dates[i] && serial_to_date(cells[i].num + 25569, false, y, m, d))
+            {
+                char buf[16];
+                std::snprintf(buf, sizeof(buf), "%d-%02d-%02d", y, m, d);
+                data.categories.push_back(buf);
+            }
+            else
+                data.categories.push_back(value_to_text(cells[i]));
+            data.xs.push_back(cells[i].type == CellValue::Number ? cells[i].num : std::nan(""));
+        }
+        cells.clear();
+        dates.clear();
+        if (!read_refs(s.val_ref, cells, dates))
+            return false;
+        for (const CellValue &v : cells)
+            data.values.push_back(v.type == CellValue::Number ? v.num : std::nan(""));
+        if (data.name.empty())
+            data.name = "Series" + std::to_string(out.size() + 1);
+        out.push_back(std::move(data));
+    }
+    return true;
+}
+
+// -------------------- Uploads --------------------
+// Workbooks too large for a JSON body are sent in raw chunks:
+// POST /uploads declares the size, PUT /uploads/<id> appends bytes at an
+// offset, and /apps, /apps/version or PUT /apps/<name> take the finished
+// upload by id. Chunks go from the socket straight to uploads/<id>.part and
+// are hashed on the way, so finishing an upload is a rename into the blob
+// store. An interrupted upload resumes from the offset GET /uploads/<id>
+// reports, including after a restart; uploads left idle for a day are
+// removed.
+class UploadStore
+{
+public:
+    struct Upload
+    {
+        std::mutex mu;
+        std::string id;
+        std::string user;
+        uint64_t size = 0;
+        uint64_t offset = 0;
+        Sha256 hash;              // of the first `offset` bytes when hashed is set
+        bool hashed = false;
+    };
+
+    static constexpr size_t kChunkBytes = 64 * 1024;
+    static constexpr int kMaxIdleHours = 24;
+    static constexpr size_t kMaxOpenPerUser = 8; // each one holds its declared size of disk
+
+    explicit UploadStore(fs::path dir = fs::path("uploads")) : dir_(std::move(dir)) {}
+
+    std::shared_ptr<Upload> create(const std::string &user, uint64_t size, std::string &err)
+    {
+        prune();
+        std::error_code ec;
+        fs::create_directories(dir_, ec);
+        auto up = std::make_shared<Upload>();
+        up->id = new_id();
+        up->user = user;
+        up->size = size;
+        up->hashed = true;
+        {
+            // Counted and added under one lock, so parallel requests cannot
+            // all pass the check.
+            std::lock_guard<std::mutex> lock(mu_);
+            size_t open = 0;
+            for (const auto &kv : uploads_)
+                open += kv.second->user == user;
+            if (open >= kMaxOpenPerUser)
+            {
+                err = "too many open uploads";
+                return nullptr;
+            }
+            uploads_[up->id] = up;
+        }
+        std::ofstream info(info_path(up->id), std::ios::trunc);
+        std::ofstream part(part_path(up->id), std::ios::binary | std::ios::trunc);
+        info << "user=" << user << "\nsize=" << size << "\n";
+        if (!info || !part)
+        {
+            err = "cannot create upload";
+            std::lock_guard<std::mutex> lock(mu_);
+            uploads_.erase(up->id);
+            return nullptr;
+        }
+        return up;
+    }
+
+    // An upload of `user`, from memory or from the files an earlier run left.
+    std::shared_ptr<Upload> find(const std::string &id, const std::string &user)
+    {
+        if (id.empty() || id.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789") != std::string::npos)
+            return nullptr;
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = uploads_.find(id);
+        if (it != uploads_.end())
+            return it->second->user == user ? it->second : nullptr;
+        std::ifstream info(info_path(id));
+        if (!info)
+            return nullptr;
+        auto up = std::make_shared<Upload>();
+        up->id = id;
+        std::string line;
+        while (std::getline(info, line))
+        {
+            if (line.rfind("user=", 0) == 0)
+                up->user = line.substr(5);
+            else if (line.rfind("size=", 0) == 0)
+                up->size = std::strtoull(line.c_str() + 5, nullptr, 10);
+        }
+        std::error_code ec;
+        up->offset = fs::file_size(part_path(id), ec);
+        if (ec || up->user != user)
+            return nullptr;
+        uploads_[id] = up;
+        return up;
+    }
+
+    // Appends `length` bytes read from the socket at `start`, which must be
+    // the current offset. Whatever arrived before a dropped connection is
+    // kept, so the client can resume from the new offset.
+    bool append(Upload &up, uint64_t start, SOCKET s, uint64_t length, std::string &err)
+    {
+        std::lock_guard<std::mutex> lock(up.mu);
+        if (start != up.offset)
+        {
+            err = "offset mismatch";
+            return false;
+        }
+        if (length > up.size - up.offset)
+        {
+            err = "chunk exceeds declared size";
+            return false;
+        }
+        if (!rehash_locked(up, err))
+            return false;
+        std::ofstream part(part_path(up.id), std::ios::binary | std::ios::app);
+        if (!part)
+        {
+            err = "cannot write upload";
+            return false;
+        }
+        std::vector<char> buf(kChunkBytes);
+        uint64_t left = length;
+        while (left > 0)
+        {
+            int want = static_cast<int>(std::min<uint64_t>(left, buf.size()));
+            int n = recv(s, buf.data(), want, 0);
+            if (n <= 0)
+                break;
+            part.write(buf.data(), n);
+            if (!part)
+            {
+                up.hashed = false; // the file may hold part of this write
+                err = "cannot write upload";
+                return false;
+            }
+            up.hash.update(buf.data(), static_cast<size_t>(n));
+            up.offset += static_cast<uint64_t>(n);
+            left -= static_cast<uint64_t>(n);
+            t_request.streamed_bytes += static_cast<size_t>(n);
+        }
+        part.close();
+        if (left > 0)
+        {
+            err = "connection closed";
+            return false;
+        }
+        return true;
+    }
+
+    // Moves a complete upload into the blob store and links it at `dest`.
+    bool finish(const std::string &id, const std::string &user, const fs::path &dest, std::string &err)
+    {
+        std::shared_ptr<Upload> up = find(id, user);
+        if (!up)
+        {
+            err = "upload not found";
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(up->mu);
+        if (up->offset != up->size)
+        {
+            err = "upload incomplete";
+            return false;
+        }
+        if (!rehash_locked(*up, err))
+            return false;
+        Sha256 hash = up->hash;
+        if (!adopt_blob(part_path(id), hash.hex(), dest))
+        {
+            err = "cannot store upload";
+            return false;
+        }
+        std::error_code ec;
+        fs::remove(info_path(id), ec);
+        std::lock_guard<std::mutex> map_lock(mu_);
+        uploads_.erase(id);
+        return true;
+    }
+
+    void remove(const std::string &id, const std::string &user)
+    {
+        std::shared_ptr<Upload> up = find(id, user);
+        if (!up)
+            return;
+        std::lock_guard<std::mutex> lock(up->mu);
+        std::error_code ec;
+        fs::remove(part_path(id), ec);
+        fs::remove(info_path(id), ec);
+        std::lock_guard<std::mutex> map_lock(mu_);
+        uploads_.erase(id);
+    }
+
+private:
+    fs::path part_path(const std::string &id) const { return dir_ / (id + ".part"); }
+    fs::path info_path(const std::string &id) const { return dir_ / (id + ".info"); }
+
+    static std::string new_id()
+    {
+        static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+        thread_local std::mt19937 rng{std::random_device{}()};
+        std::uniform_int_distribution<int> dist(0, static_cast<int>(sizeof(charset) - 2));
+        std::string id(24, ' ');
+        for (char &c : id)
+            c = charset[dist(rng)];
+        return id;
+    }
+
+    // An upload picked up from disk is hashed from its part file once,
+    // before more bytes are added to it.
+    bool rehash_locked(Upload &up, std::string &err)
+    {
+        if (up.hashed)
+            return true;
+        std::ifstream in(part_path(up.id), std::ios::binary);
+        if (!in)
+        {
+            err = "cannot read upload";
+            return false;
+        }
+        up.hash = Sha256();
+        std::vector<char> buf(kChunkBytes);
+        uint64_t total = 0;
+        while (in.read(buf.data(), static_cast<std::streamsize>(buf.size())) || in.gcount() > 0)
+        {
+            up.hash.update(buf.data(), static_cast<size_t>(in.gcount()));
+            total += static_cast<uint64_t>(in.gcount());
+        }
+        up.offset = total;
+        up.hashed = true;
+        return true;
+    }
+
+    void prune()
+    {
+        std::error_code ec;
+        auto cutoff = fs::file_time_type::clock::now() - std::chrono::hours(kMaxIdleHours);
+        std::vector<std::string> stale;
+        for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec))
+        {
+            std::error_code file_ec;
+            if (it->path().extension() == ".part" && fs::last_write_time(it->path(), file_ec) < cutoff && !file_ec)
+                stale.push_back(it->path().stem().u8string());
+        }
+        for (const std::string &id : stale)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                uploads_.erase(id);
+            }
+            fs::remove(part_path(id), ec);
+            fs::remove(info_path(id), ec);
+            ESA_LOG_INFO("Removed idle upload " + id);
+        }
+    }
+
+    fs::path dir_;
+    std::mutex mu_;
+    std::unordered_map<std::string, std::shared_ptr<Upload>> uploads_;
+};
+
+// -------------------- Version publishing --------------------
+// POST /apps/version answers as soon as the request is checked; the new
+// version is built on a background thread in stages and only becomes the
+// app's latest version once every stage has passed. Progress is read back
+// from POST /apps/version/status. Jobs stay listed for a while after they
+// finish so a client that polls late still sees the outcome.
+class PublishJob
+{
+public:
+    static constexpr int64_t kKeepFinishedUs = 10LL * 60 * 1000000;
+
+    PublishJob(std::string id, std::string user, std::string owner, std::string app, int version)
+        : id_(std::move(id)), user_(std::move(user)), owner_(std::move(owner)), app_(std::move(app)), version_(version)
+    {
+    }
+
+    const std::string &id() const { return id_; }
+    const std::string &user() const { return user_; }
+    const std::string &owner() const { return owner_; }
+    const std::string &app() const { return app_; }
+    int version() const { return version_; }
+
+    void stage(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stage_ = name;
+    }
+
+    void finish(const std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        state_ = error.empty() ? "published" : "failed";
+        error_ = error;
+        finished_us_ = steady_us();
+    }
+
+    bool expired(int64_t now_us) const
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        return finished_us_ && now_us - finished_us_ > kKeepFinishedUs;
+    }
 
-std::string sanitize_range_address(const std::string &address)
-{
-    std::string trimmed_addr = trim(address);
-    if (trimmed_addr.empty())
-        return trimmed_addr;
-    size_t excl = trimmed_addr.rfind('!');
-    if (excl != std::string::npos)
-        trimmed_addr = trimmed_addr.substr(excl + 1);
-    trimmed_addr = trim(trimmed_addr);
-    if (trimmed_addr.size() >= 2 && ((trimmed_addr.front() == '\'' && trimmed_addr.back() == '\'') ||
-                                     (trimmed_addr.front() == '"' && trimmed_addr.back() == '"')))
+    std::string status_json() const
     {
-        trimmed_addr = trimmed_addr.substr(1, trimmed_addr.size() - 2);
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string json = "{\"job\":\"" + id_ + "\",\"state\":\"" + state_ + "\",\"stage\":\"" + stage_ +
+                           "\",\"owner\":\"" + json_escape(owner_) + "\",\"name\":\"" + json_escape(app_) +
+                           "\",\"version\":" + std::to_string(version_);
+        if (!error_.empty())
+            json += ",\"error\":\"" + json_escape(error_) + "\"";
+        return json + "}";
     }
-    return trimmed_addr;
-}
 
-fs::path version_path(const std::string &owner, const std::string &app, int version)
-{
-    return app_root() / owner / app / std::to_string(version);
-}
+private:
+    std::string id_;
+    std::string user_;
+    std::string owner_;
+    std::string app_;
+    int version_ = 0;
+    mutable std::mutex mu_;
+    std::string state_ = "publishing";
+    std::string stage_ = "queued";
+    std::string error_;
+    int64_t finished_us_ = 0;
+};
 
-fs::path app_image_path(const std::string &owner, const std::string &app)
+// What a publish request asked for, carried over to the job's thread.
+struct PublishRequest
 {
-    return app_root() / owner / app / "cover.png";
-}
+    std::string description;
+    std::string file_b64;
+    std::string upload_id;
+    std::string image_b64;
+    std::string schema_json;
+    std::string access_group;
+    bool public_access = false;
+    bool prewarm = true;
+};
 
-fs::path app_image_version_path(const std::string &owner, const std::string &app, int version)
-{
-    return version_path(owner, app, version) / "cover.png";
-}
+// Files next to a published workbook that describe it, written by the
+// publish job and read instead of opening the workbook again.
+const char *const kSheetsFile = "sheets.json";
+const char *const kAnalysisFile = "analysis.ndjson";
 
-bool save_app_image(const std::string &owner, const std::string &app, const std::string &image_b64)
+// Checks that an .xlsx/.xlsm package opens and every worksheet in it parses,
+// then writes the sheet names with their used ranges and the
+// /excel/analyze/workbook lines for each sheet into `dir`.
+bool write_workbook_summary(const fs::path &file, const fs::path &dir, std::string &err)
 {
-    if (image_b64.empty())
-        return true;
-    std::string bytes = base64_decode(image_b64);
-    if (bytes.empty())
-        return false;
-    fs::path img_path = app_image_path(owner, app);
-    if (!ensure_dir(img_path.parent_path()))
+    WorkbookAnalyzer analyzer;
+    if (!analyzer.open(file, err))
         return false;
-    std::ofstream out(img_path, std::ios::binary | std::ios::trunc);
-    if (!out.is_open())
+    std::string names, ranges, lines;
+    for (size_t i = 0; i < analyzer.sheet_count(); ++i)
+    {
+        std::string json;
+        if (!analyzer.analyze_sheet(i, json, err))
+        {
+            err = "sheet '" + analyzer.sheet_name(i) + "': " + err;
+            return false;
+        }
+        std::string sep = i ? "," : "";
+        names += sep + "\"" + json_escape(analyzer.sheet_name(i)) + "\"";
+        ranges += sep + "\"" + json_escape(extract_json_string(json, "range")) + "\"";
+        json.pop_back();
+        lines += json + ",\"done\":" + std::to_string(i + 1) + ",\"total\":" + std::to_string(analyzer.sheet_count()) + "}\n";
+    }
+    // The /excel/sheets response, with each sheet's used range alongside.
+    std::string sheets = "{\"sheets\":[" + names + "],\"ranges\":[" + ranges + "]}";
+    put_deflated(dir / kAnalysisFile, lines);
+    if (!put_blob(dir / kAnalysisFile, lines) || !put_blob(dir / kSheetsFile, sheets))
+    {
+        err = "cannot save workbook summary";
         return false;
-    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    }
     return true;
 }
 
-bool save_app_image_version(const std::string &owner, const std::string &app, int version, const std::string &image_b64)
+bool read_workbook_summary(const fs::path &dir, const char *name, std::string &out)
 {
-    if (image_b64.empty())
-        return true;
-    std::string bytes = base64_decode(image_b64);
-    if (bytes.empty())
-        return false;
-    fs::path img_path = app_image_version_path(owner, app, version);
-    if (!ensure_dir(img_path.parent_path()))
-        return false;
-    std::ofstream out(img_path, std::ios::binary | std::ios::trunc);
-    if (!out.is_open())
+    std::ifstream in(dir / name, std::ios::binary);
+    if (!in.is_open())
         return false;
-    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    out = buffer.str();
     return true;
 }
 
-bool copy_app_image_version(const std::string &owner, const std::string &app, int from_version, int to_version)
+void remove_workbook_summary(const fs::path &dir)
 {
-    fs::path src = app_image_version_path(owner, app, from_version);
-    if (!fs::exists(src))
-        src = app_image_path(owner, app);
-    if (!fs::exists(src))
-        return false;
-    fs::path dst = app_image_version_path(owner, app, to_version);
-    if (!ensure_dir(dst.parent_path()))
-        return false;
     std::error_code ec;
-    fs::copy_file(src, dst, fs::copy_options::overwrite_existing, ec);
-    return !ec;
+    fs::remove(dir / kSheetsFile, ec);
+    fs::remove(dir / kAnalysisFile, ec);
+    fs::remove(deflated_path(dir / kAnalysisFile), ec);
 }
 
-std::string load_app_image_base64(const std::string &owner, const std::string &app)
+// -------------------- Static files --------------------
+// The browser client, served from memory so no separate web server is
+// needed. Every file under client_dir is read once at startup, along with
+// its gzip and deflate forms made at the best level, and tagged with a hash
+// of its content. Pages are rewritten to link their scripts and stylesheets
+// as name?v=<hash>; a request carrying the current hash may be cached for a
+// year, anything else is revalidated through If-None-Match. Pages also get
+// an empty esa-api-base meta tag, which points the client at this server.
+// Changes to the files need a restart.
+class StaticFiles
 {
-    fs::path img_path = app_image_path(owner, app);
-    std::ifstream in(img_path, std::ios::binary);
-    if (!in.is_open())
-        return "";
-    std::ostringstream buffer;
-    buffer << in.rdbuf();
-    return base64_encode(buffer.str());
-}
+public:
+    struct File
+    {
+        std::string content_type;
+        std::string hash; // of the content as served, also the ?v= fingerprint
+        std::shared_ptr<const std::string> identity;
+        std::shared_ptr<const std::string> gzip;    // null when not worth it
+        std::shared_ptr<const std::string> deflate; // likewise
+    };
 
-std::string load_app_image_base64_version(const std::string &owner, const std::string &app, int version)
-{
-    fs::path img_path = app_image_version_path(owner, app, version);
-    std::ifstream in(img_path, std::ios::binary);
-    if (!in.is_open())
-        return "";
-    std::ostringstream buffer;
-    buffer << in.rdbuf();
-    return base64_encode(buffer.str());
-}
+    void load(const fs::path &dir)
+    {
+        files_.clear();
+        std::error_code ec;
+        std::vector<std::pair<std::string, std::string>> pages;
+        for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+        {
+            std::string name = it->path().lexically_relative(dir).generic_u8string();
+            if (!it->is_regular_file() || name.empty() || name[0] == '.')
+                continue;
+            std::ifstream in(it->path(), std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (is_page(name))
+                pages.emplace_back(name, std::move(bytes));
+            else
+                add(name, std::move(bytes));
+        }
+        // Pages last, once the hashes of what they link are known.
+        for (auto &page : pages)
+            add(page.first, fingerprint_links(page.second));
+    }
 
-fs::path app_ui_path(const std::string &owner, const std::string &app)
-{
-    return app_root() / owner / app / "ui.json";
-}
+    size_t size() const { return files_.size(); }
 
-fs::path app_ui_version_path(const std::string &owner, const std::string &app, int version)
+    // `path` is the request path without its query; "/" is index.html.
+    const File *find(const std::string &path) const
+    {
+        std::string name = path == "/" ? "index.html" : path.substr(path.rfind('/', 0) == 0 ? 1 : 0);
+        auto it = files_.find(name);
+        return it == files_.end() ? nullptr : &it->second;
+    }
+
+private:
+    static bool is_page(const std::string &name)
+    {
+        std::string ext = to_lower(fs::path(name).extension().u8string());
+        return ext == ".html" || ext == ".htm";
+    }
+
+    static std::string content_type_of(const std::string &name)
+    {
+        static const std::unordered_map<std::string, std::string> types = {
+            {".html", "text/html; charset=utf-8"},
+            {".htm", "text/html; charset=utf-8"},
+            {".js", "application/javascript; charset=utf-8"},
+            {".css", "text/css; charset=utf-8"},
+            {".json", "application/json"},
+            {".svg", "image/svg+xml"},
+            {".png", "image/png"},
+            {".jpg", "image/jpeg"},
+            {".jpeg", "image/jpeg"},
+            {".gif", "image/gif"},
+            {".ico", "image/x-icon"},
+            {".woff", "font/woff"},
+            {".woff2", "font/woff2"},
+            {".txt", "text/plain; charset=utf-8"}};
+        auto it = types.find(to_lower(fs::path(name).extension().u8string()));
+        return it == types.end() ? "application/octet-stream" : it->second;
+    }
+
+    void add(const std::string &name, std::string bytes)
+    {
+        File f;
+        f.content_type = content_type_of(name);
+        f.hash = sha256_hex(bytes).substr(0, 16);
+        if (compressible_type(f.content_type) && bytes.size() >= kMinCompressBytes)
+        {
+            f.gzip = encode(bytes, ContentEncoding::Gzip);
+            f.deflate = encode(bytes, ContentEncoding::Deflate);
+        }
+        f.identity = std::make_shared<const std::string>(std::move(bytes));
+        files_[name] = std::move(f);
+    }
+
+    static std::shared_ptr<const std::string> encode(const std::string &bytes, ContentEncoding encoding)
+    {
+        std::unique_ptr<BodyEncoder> encoder = BodyEncoder::create(encoding, 9);
+        if (!encoder)
+            return nullptr;
+        encoder->add(bytes, {});
+        return std::make_shared<const std::string>(encoder->take(true));
+    }
+
+    std::string fingerprint_links(std::string page) const
+    {
+        for (const auto &kv : files_)
+        {
+            for (const char *attr : {"src=\"", "href=\""})
+            {
+                std::string from = attr + kv.first + "\"";
+                std::string to = attr + kv.first + "?v=" + kv.second.hash + "\"";
+                for (size_t at = page.find(from); at != std::string::npos; at = page.find(from, at + to.size()))
+                    page.replace(at, from.size(), to);
+            }
+        }
+        size_t head = page.find("<head>");
+        if (head != std::string::npos)
+            page.insert(head + 6, "\n  <meta name=\"esa-api-base\" content=\"\">");
+        return page;
+    }
+
+    std::unordered_map<std::string, File> files_;
+};
+
+// -------------------- Output push --------------------
+// Instead of querying every output again after each edit, a client can list
+// the ranges it shows with POST /excel/subscribe and hold GET /excel/events
+// open. Each write to the session's workbook wakes its streams, which read
+// those ranges again and send, as server-sent events, only the cells that
+// differ from what that stream last sent.
+
+constexpr auto kPushHeartbeat = std::chrono::seconds(15);
+constexpr size_t kPushMaxRanges = 256;
+constexpr uint64_t kPushMaxCells = 65536; // across a session's subscribed ranges
+constexpr size_t kPushMaxStreams = 4;     // per session; a new one closes the oldest
+constexpr size_t kPushWriteLog = 64;
+
+// The subscriptions of one session. `generation` counts changes to its
+// workbook and `revision` changes to the range list; a stream reads again
+// whenever either moves. Cell writes are also kept by generation, so a
+// stream can tell which ranges they may have reached; a load, which changes
+// everything, is not. Closing the workbook ends the streams.
+struct PushChannel
 {
-    return version_path(owner, app, version) / "ui.json";
-}
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<std::pair<std::string, std::string>> ranges; // sheet, range
+    uint64_t generation = 0;
+    uint64_t revision = 0;
+    std::deque<std::pair<uint64_t, std::pair<std::string, std::string>>> writes; // the latest, oldest first
+    std::deque<uint64_t> streams; // open streams, oldest first
+    uint64_t next_stream = 0;
+    bool closed = false;
 
-bool save_app_ui(const std::string &owner, const std::string &app, const std::string &json)
+    // The cells written in the generations after `since`, or false if any
+    // of them was something else or is no longer kept.
+    bool writes_since(uint64_t since, std::vector<std::pair<std::string, std::string>> &out) const
+    {
+        out.clear();
+        for (const auto &w : writes)
+        {
+            if (w.first > since)
+                out.push_back(w.second);
+        }
+        return out.size() == generation - since;
+    }
+};
+
+// The top-level items of a JSON array, as text. False if `json` is not one.
+bool json_array_items(const std::string &json, std::vector<std::string> &items)
 {
-    fs::path path = app_ui_path(owner, app);
-    if (!ensure_dir(path.parent_path()))
-        return false;
-    std::ofstream out(path, std::ios::binary | std::ios::trunc);
-    if (!out.is_open())
+    items.clear();
+    size_t i = json.find_first_not_of(" \t\r\n");
+    if (i == std::string::npos || json[i] != '[')
         return false;
-    out << json;
-    return true;
+    int depth = 0;
+    bool in_string = false;
+    size_t start = i + 1;
+    for (; i < json.size(); ++i)
+    {
+        char c = json[i];
+        if (in_string)
+        {
+            if (c == '\\')
+                ++i;
+            else if (c == '"')
+                in_string = false;
+            continue;
+        }
+        if (c == '"')
+        {
+            in_string = true;
+        }
+        else if (c == '[' || c == '{')
+        {
+            ++depth;
+        }
+        else if ((c == ',' && depth == 1) || ((c == ']' || c == '}') && --depth == 0))
+        {
+            std::string item = trim(json.substr(start, i - start));
+            if (!item.empty())
+                items.push_back(item);
+            start = i + 1;
+            if (depth == 0)
+                return true;
+        }
+    }
+    return false;
 }
 
-bool save_app_ui_version(const std::string &owner, const std::string &app, int version, const std::string &json)
+// The cells of a range value as /excel/query returns it, a scalar or rows
+// of cells, in row order. `cols` is the row length and 0 for a scalar.
+// False when the rows are ragged and cannot be addressed by position.
+bool split_value_cells(const std::string &json, std::vector<std::string> &cells, size_t &cols)
 {
-    fs::path path = app_ui_version_path(owner, app, version);
-    if (!ensure_dir(path.parent_path()))
-        return false;
-    std::ofstream out(path, std::ios::binary | std::ios::trunc);
-    if (!out.is_open())
-        return false;
-    out << json;
+    std::vector<std::string> rows;
+    cells.clear();
+    if (!json_array_items(json, rows))
+    {
+        cells.push_back(trim(json));
+        cols = 0;
+        return true;
+    }
+    if (rows.empty() || rows[0][0] != '[')
+    {
+        cells = std::move(rows); // a single row
+        cols = cells.size();
+        return true;
+    }
+    std::vector<std::string> row;
+    cols = 0;
+    for (size_t r = 0; r < rows.size(); ++r)
+    {
+        if (!json_array_items(rows[r], row) || (r && row.size() != cols))
+            return false;
+        cols = row.size();
+        for (std::string &cell : row)
+            cells.push_back(std::move(cell));
+    }
     return true;
 }
 
-std::string load_app_ui(const std::string &owner, const std::string &app)
+// What one stream last sent for each range.
+struct PushState
 {
-    fs::path path = app_ui_path(owner, app);
-    std::ifstream in(path, std::ios::binary);
-    if (!in.is_open())
-        return "";
-    std::ostringstream buffer;
-    buffer << in.rdbuf();
-    return buffer.str();
-}
+    struct Sent
+    {
+        std::string value; // JSON, or "!" and the error
+        std::vector<std::string> cells;
+        size_t cols = 0;
+        bool split = false;
+    };
 
-std::string load_app_ui_version(const std::string &owner, const std::string &app, int version)
+    uint64_t generation = UINT64_MAX; // nothing sent yet
+    uint64_t revision = UINT64_MAX;
+    std::unordered_map<std::string, Sent> sent; // "sheet!range"
+
+    // Appends the update for one range, read as `value` or failed with
+    // `err`, unless the client already has it. A range whose shape is
+    // unchanged gets the cells that differ as [row, col, value]; the first
+    // read, a new shape, or a change to most cells gets the whole value.
+    // Returns the number of cells sent.
+    size_t diff(const std::string &sheet, const std::string &range, const std::string &value, const std::string &err, std::string &out)
+    {
+        Sent next;
+        next.value = err.empty() ? value : "!" + err;
+        auto it = sent.find(sheet + "!" + range);
+        if (it != sent.end() && it->second.value == next.value)
+            return 0;
+        std::string head = std::string(out.empty() ? "" : ",") + "{\"sheet\":\"" + json_escape(sheet) + "\",\"range\":\"" + json_escape(range) + "\",";
+        size_t count = 0;
+        if (!err.empty())
+        {
+            out += head + "\"error\":\"" + json_escape(err) + "\"}";
+        }
+        else
+        {
+            next.split = split_value_cells(value, next.cells, next.cols);
+            std::string changed;
+            if (it != sent.end() && it->second.split && next.split && it->second.cols == next.cols &&
+                it->second.cells.size() == next.cells.size())
+            {
+                for (size_t i = 0; i < next.cells.size(); ++i)
+                {
+                    if (next.cells[i] == it->second.cells[i])
+                        continue;
+                    size_t row = next.cols ? i / next.cols : 0, col = next.cols ? i % next.cols : 0;
+                    changed += std::string(count++ ? "," : "") + "[" + std::to_string(row) + "," + std::to_string(col) + "," + next.cells[i] + "]";
+                }
+            }
+            if (count && count * 2 <= next.cells.size())
+            {
+                out += head + "\"cells\":[" + changed + "]}";
+            }
+            else
+            {
+                out += head + "\"value\":" + value + "}";
+                count = next.split ? next.cells.size() : 1;
+            }
+        }
+        sent[sheet + "!" + range] = std::move(next);
+        return count;
+    }
+};
+
+// -------------------- Change detection --------------------
+// Which ranges a write can change, found from the workbook's formula graph
+// as the native engine parses it, whichever engine runs the session. With
+// it /excel/set re-reads only the outputs of the app's schema that a write
+// reached, and event streams skip ranges no write since their last read
+// could change. A workbook the native engine declines cannot be traced;
+// then every range counts as changed.
+class OutputTracer
 {
-    fs::path path = app_ui_version_path(owner, app, version);
-    std::ifstream in(path, std::ios::binary);
-    if (!in.is_open())
-        return "";
-    std::ostringstream buffer;
-    buffer << in.rdbuf();
-    return buffer.str();
-}
+public:
+    typedef std::pair<std::string, std::string> Ref; // sheet, range
+
+    // The schema's inputs are traced here, at load, so edits of them find
+    // their outputs without walking the graph.
+    OutputTracer(std::shared_ptr<const WorkbookModel> model, const CalcSchema &schema)
+        : model_(std::move(model)), outputs_(schema.output_cells)
+    {
+        if (!model_)
+            return;
+        for (const CalcArea &in : schema.inputs)
+            downstream({in.sheet, in.text});
+        for (const Ref &out : outputs_)
+        {
+            CellArea area;
+            std::string err;
+            output_areas_.push_back(model_->resolve_area(out.first, out.second, area, err) ? std::make_shared<CellArea>(area) : nullptr);
+        }
+    }
+
+    bool traced() const { return model_ != nullptr; }
+    const std::vector<Ref> &outputs() const { return outputs_; }
+
+    // Whether writing `written` can change a cell of `target`.
+    bool affects(const Ref &written, const Ref &target)
+    {
+        CellArea area;
+        std::string err;
+        std::shared_ptr<const Downstream> down = downstream(written);
+        if (!down || !model_->resolve_area(target.first, target.second, area, err))
+            return true;
+        return reaches(*down, area);
+    }
+
+    // Indexes into outputs() of the ones writing `written` can change.
+    std::vector<size_t> affected_outputs(const Ref &written)
+    {
+        std::vector<size_t> out;
+        std::shared_ptr<const Downstream> down = downstream(written);
+        for (size_t i = 0; i < outputs_.size(); ++i)
+        {
+            if (!down || !output_areas_[i] || reaches(*down, *output_areas_[i]))
+                out.push_back(i);
+        }
+        return out;
+    }
+
+private:
+    static const size_t kMaxTraced = 1024;
+
+    struct Downstream
+    {
+        CellArea written;
+        std::unordered_set<uint32_t> formulas;
+    };
+
+    bool reaches(const Downstream &down, const CellArea &area) const
+    {
+        const CellArea &w = down.written;
+        if (w.sheet == area.sheet && w.r1 <= area.r2 && area.r1 <= w.r2 && w.c1 <= area.c2 && area.c1 <= w.c2)
+            return true;
+        return model_->any_formula_in(area, down.formulas);
+    }
+
+    // Null when the write cannot be traced.
+    std::shared_ptr<const Downstream> downstream(const Ref &written)
+    {
+        if (!model_)
+            return nullptr;
+        auto down = std::make_shared<Downstream>();
+        std::string err;
+        if (!model_->resolve_area(written.first, written.second, down->written, err))
+            return nullptr;
+        const CellArea &w = down->written;
+        std::string key = std::to_string(w.sheet) + ":" + std::to_string(w.r1) + ":" + std::to_string(w.c1) + ":" +
+                          std::to_string(w.r2) + ":" + std::to_string(w.c2);
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            auto it = traced_.find(key);
+            if (it != traced_.end())
+                return it->second;
+        }
+        if (!model_->collect_downstream(w, down->formulas))
+            return nullptr;
+        std::lock_guard<std::mutex> lock(mu_);
+        if (traced_.size() >= kMaxTraced)
+            traced_.clear();
+        traced_[key] = down;
+        return down;
+    }
+
+    std::shared_ptr<const WorkbookModel> model_;
+    std::vector<Ref> outputs_;
+    std::vector<std::shared_ptr<CellArea>> output_areas_; // null when unresolved
+    std::mutex mu_;
+    std::unordered_map<std::string, std::shared_ptr<const Downstream>> traced_; // by written area
+};
+
+// -------------------- Handlers --------------------
+// A session whose workbook is calculated in-process instead of in Excel.
+struct NativeSession
+{
+    std::mutex mu;
+    std::unique_ptr<NativeWorkbook> workbook;
+    fs::path source; // the published file, as for Excel sessions
+    fs::file_time_type stamp{};
+    std::shared_ptr<const ChartIndex> charts; // read on the first chart request
+};
 
-bool write_metadata(const fs::path &p, const AppInfo &info)
+// A memoized calculator app open in Excel. Input edits wait in `pending`
+// until something reads the workbook; the latest value of each input is
+// what cached outputs are keyed by.
+struct CalcSession
 {
-    std::ofstream out(p / "meta.txt", std::ios::trunc);
-    if (!out)
+    std::mutex mu;
+    fs::path source;
+    fs::file_time_type stamp{};
+    CalcSchema schema;
+    std::map<std::string, std::pair<CalcArea, SessionJournal::Edit>> values;
+    std::vector<SessionJournal::Edit> pending;
+
+    bool reads_output(const CalcArea &area) const
+    {
+        for (const CalcArea &out : schema.outputs)
+        {
+            if (out.covers(area))
+                return true;
+        }
         return false;
-    out << "name=" << info.name << "\n";
-    out << "version=" << info.version << "\n";
-    out << "description=" << info.description << "\n";
-    return true;
-}
+    }
 
-std::string json_escape(const std::string &s)
-{
-    std::string out;
-    for (char c : s)
+    // The input values, with text length-prefixed so no two differ only in
+    // where one value ends.
+    std::string state() const
     {
-        if (c == '"' || c == '\\')
-            out.push_back('\\');
-        out.push_back(c);
+        std::string out;
+        for (const auto &kv : values)
+        {
+            const SessionJournal::Edit &e = kv.second.second;
+            out += kv.first;
+            out.push_back('=');
+            switch (e.kind)
+            {
+            case SessionJournal::EditKind::Bool:
+                out += e.flag ? "b1" : "b0";
+                break;
+            case SessionJournal::EditKind::Number:
+                out += "n" + format_json_number(e.number);
+                break;
+            default:
+                out += "t" + std::to_string(e.text.size()) + ":" + e.text;
+                break;
+            }
+            out.push_back(';');
+        }
+        return out;
     }
-    return out;
-}
+};
 
-std::string variant_to_json(const VARIANT &v)
+// Where to store an output read from Excel: only if the workbook is still
+// at the generation it had once the inputs were written.
+struct CalcTicket
 {
-    VARIANT val;
-    VariantInit(&val);
-    VariantCopy(&val, const_cast<VARIANT *>(&v));
-    if (val.vt == VT_EMPTY || val.vt == VT_NULL)
-        return "null";
-    if (val.vt == VT_BOOL)
-        return val.boolVal == VARIANT_TRUE ? "true" : "false";
-    if (val.vt == VT_I1)
-        return std::to_string(static_cast<int>(val.cVal));
-    if (val.vt == VT_UI1)
-        return std::to_string(static_cast<unsigned int>(val.bVal));
-    if (val.vt == VT_I2)
-        return std::to_string(val.iVal);
-    if (val.vt == VT_UI2)
-        return std::to_string(val.uiVal);
-    if (val.vt == VT_I4 || val.vt == VT_INT)
-        return std::to_string(val.intVal);
-    if (val.vt == VT_UI4 || val.vt == VT_UINT)
-        return std::to_string(val.uintVal);
-    if (val.vt == VT_I8)
-        return std::to_string(val.llVal);
-    if (val.vt == VT_UI8)
-        return std::to_string(val.ullVal);
-    if (val.vt == VT_R4)
-        return std::to_string(val.fltVal);
-    if (val.vt == VT_R8)
-        return std::to_string(val.dblVal);
-    if (val.vt == VT_CY)
+    std::string key;
+    uint64_t generation = 0;
+};
+
+class Server
+{
+public:
+    Server(const Config &cfg, ExcelPool &pool, Database &db, SessionJournal &journal)
+        : cfg_(cfg), pool_(pool), db_(db), journal_(journal)
     {
-        // Currency is stored as 64-bit integer scaled by 10000
-        double cyVal = static_cast<double>(val.cyVal.int64) / 10000.0;
-        return std::to_string(cyVal);
+        sessions_.configure(std::chrono::minutes(cfg_.session_idle_minutes), std::chrono::hours(cfg_.session_max_hours));
+        query_cache_.configure(static_cast<size_t>(cfg_.query_cache_mb) * 1024 * 1024);
+        calc_memo_.configure(static_cast<size_t>(cfg_.calc_memo_mb) * 1024 * 1024);
+        chart_cache_.configure(static_cast<size_t>(cfg_.chart_cache_mb) * 1024 * 1024);
+        limiter_.configure(cfg_.rate_limits);
+        add_routes();
+        if (!cfg_.client_dir.empty())
+        {
+            static_files_.load(cfg_.client_dir);
+            if (static_files_.size())
+                ESA_LOG_INFO("Serving " + std::to_string(static_files_.size()) + " client file(s) from " + cfg_.client_dir);
+            else
+                ESA_LOG_INFO("No client files in " + cfg_.client_dir + "; serve the client separately");
+        }
+        int64_t idle_ms = int64_t(cfg_.session_idle_minutes) * 60 * 1000;
+        size_t restored = journal_.load(idle_ms, int64_t(cfg_.session_max_hours) * 3600 * 1000);
+        sessions_.set_journal(&journal_);
+        if (restored)
+            ESA_LOG_INFO(std::to_string(restored) + " session(s) from journal can be resumed");
+        sessions_.set_on_expire([this](const std::string &token, const std::string &)
+                                {
+            std::string err;
+            drop_native_session(token);
+            drop_calc_session(token);
+            drop_output_tracer(token);
+            notify_push(token, nullptr, true);
+            pool_.close_session(token, true, err); });
+        db_.set_user_changed_hook([this](const std::string &name)
+                                  { sessions_.invalidate_user(name); });
     }
-    if (val.vt == VT_DATE)
+
+    ~Server()
     {
-        // OLE Automation date - convert to ISO string
-        SYSTEMTIME st;
-        if (VariantTimeToSystemTime(val.date, &st))
+        db_.set_user_changed_hook(nullptr);
+        sessions_.stop();
+    }
+
+    void start()
+    {
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
         {
-            char buf[32];
-            snprintf(buf, sizeof(buf), "\"%04d-%02d-%02d\"", st.wYear, st.wMonth, st.wDay);
-            return std::string(buf);
+            ESA_LOG_ERROR("WSAStartup failed during server startup");
+            return;
+        }
+        SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listen_socket == INVALID_SOCKET)
+        {
+            ESA_LOG_ERROR("Socket creation failed during server startup");
+            return;
+        }
+        sockaddr_in service{};
+        service.sin_family = AF_INET;
+        service.sin_addr.s_addr = INADDR_ANY;
+        service.sin_port = htons(static_cast<u_short>(cfg_.port));
+        if (bind(listen_socket, reinterpret_cast<SOCKADDR *>(&service), sizeof(service)) == SOCKET_ERROR)
+        {
+            ESA_LOG_ERROR("Server bind failed on port " + std::to_string(cfg_.port));
+            closesocket(listen_socket);
+            return;
+        }
+        listen(listen_socket, kListenBacklog);
+        ESA_LOG_INFO("Server listening on port " + std::to_string(cfg_.port));
+        sessions_.start();
+        running_ = true;
+        while (running_)
+        {
+            sockaddr_in from{};
+            int from_len = sizeof(from);
+            SOCKET client = accept(listen_socket, reinterpret_cast<SOCKADDR *>(&from), &from_len);
+            if (client == INVALID_SOCKET)
+                continue;
+            const unsigned char *ip = reinterpret_cast<const unsigned char *>(&from.sin_addr);
+            std::string peer = std::to_string(ip[0]) + "." + std::to_string(ip[1]) + "." + std::to_string(ip[2]) + "." + std::to_string(ip[3]);
+            std::thread(&Server::handle_client, this, client, peer).detach();
+        }
+        closesocket(listen_socket);
+        WSACleanup();
+    }
+
+private:
+    static constexpr int kRequestTimeout = 30;     // seconds, for routes that set none
+    static constexpr int kMaxRequestTimeout = 3600; // most an X-Request-Timeout header may ask for
+
+    void handle_client(SOCKET client, std::string peer)
+    {
+        static Counter &bytes_in_total = g_metrics.counter("esa_http_received_bytes_total", "Request bytes read");
+        static Counter &bytes_out_total = g_metrics.counter("esa_http_sent_bytes_total", "Response bytes sent");
+        static Counter &cancelled_deadline = g_metrics.counter("esa_requests_cancelled_total", "Requests whose Excel work was abandoned", metric_label("reason", "deadline"));
+        static Counter &cancelled_disconnect = g_metrics.counter("esa_requests_cancelled_total", "Requests whose Excel work was abandoned", metric_label("reason", "disconnect"));
+        active_connections_.fetch_add(1, std::memory_order_relaxed);
+        int64_t start = steady_us();
+        t_request = RequestContext{};
+        t_request.id = next_request_id_.fetch_add(1, std::memory_order_relaxed);
+        t_request.client = client;
+        HttpRequest req;
+        HttpResponse resp;
+        req.peer = std::move(peer);
+        if (!read_request(client, req))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"bad request\"}";
+        }
+        else
+        {
+            resp = dispatch(req);
+        }
+        req.bytes_in += t_request.streamed_bytes;
+        // A streamed body runs as long as its client reads it; the
+        // deadline was for producing the response, not for sending it.
+        t_request.deadline_us = 0;
+        auto accept = req.headers.find("Accept-Encoding");
+        size_t bytes_out = send_response(client, resp, accept == req.headers.end() ? ContentEncoding::Identity : accepted_encoding(accept->second));
+        if (req.socket != INVALID_SOCKET && req.body_length > t_request.streamed_bytes)
+            discard_body(client, req.body_length - t_request.streamed_bytes);
+        closesocket(client);
+        int64_t total_us = steady_us() - start;
+        g_access_log.write(req.method, resp.status, req.bytes_in, bytes_out, total_us);
+        if (RouteMetrics *metrics = t_request.metrics)
+        {
+            metrics->requests(resp.status).add();
+            metrics->latency().record(total_us);
+        }
+        else
+        {
+            // Unmatched paths and preflights, rare enough to look up by name.
+            std::string route = metric_label("route", req.method + " " + t_request.route);
+            g_metrics.counter("esa_http_requests_total", "Requests by route and status", route + "," + metric_label("status", std::to_string(resp.status))).add();
+            g_metrics.histogram("esa_http_request_seconds", "Request latency by route", route).record(total_us);
         }
-        return std::to_string(val.date); // fallback to raw number
+        bytes_in_total.add(req.bytes_in);
+        bytes_out_total.add(bytes_out);
+        if (t_request.cancelled)
+            (t_request.cancelled == 504 ? cancelled_deadline : cancelled_disconnect).add();
+        t_request.client = INVALID_SOCKET;
+        active_connections_.fetch_sub(1, std::memory_order_relaxed);
     }
-    if (val.vt == VT_BSTR)
+
+    void add_routes()
     {
-        std::wstring ws(val.bstrVal ? val.bstrVal : L"");
-        std::string s(ws.begin(), ws.end());
-        VariantClear(&val);
-        return "\"" + json_escape(s) + "\"";
+        // Deadlines in seconds. Streams and uploads run as long as their
+        // client stays; the rest give up their Excel work once overdue.
+        const int kSlow = 120, kUnbounded = 0;
+        auto add = [this](const char *method, const char *pattern, unsigned flags, HttpResponse (Server::*handler)(const HttpRequest &), int timeout_s = kRequestTimeout)
+        {
+            router_.add(method, pattern, flags, [this, handler](const HttpRequest &req)
+                        { return (this->*handler)(req); }, timeout_s);
+        };
+        const unsigned json = Router::kJson, auth = Router::kAuth;
+        add("GET", "/health", 0, &Server::handle_health);
+        add("GET", "/metrics", 0, &Server::handle_metrics);
+        add("POST", "/login", json, &Server::handle_login);
+        add("POST", "/logout", 0, &Server::handle_logout);
+        add("POST", "/excel/load", json | auth, &Server::handle_excel_load, kSlow);
+        add("POST", "/excel/query", json | auth, &Server::handle_excel_query, kSlow);
+        add("POST", "/excel/set", json | auth, &Server::handle_excel_set);
+        add("POST", "/excel/close", auth, &Server::handle_excel_close);
+        add("POST", "/excel/subscribe", json | auth, &Server::handle_excel_subscribe);
+        add("GET", "/excel/events", auth, &Server::handle_excel_events, kUnbounded);
+        add("POST", "/excel/sheets", json | auth, &Server::handle_excel_sheets);
+        add("POST", "/excel/analyze", json | auth, &Server::handle_excel_analyze, kSlow);
+        add("POST", "/excel/analyze/workbook", json | auth, &Server::handle_excel_analyze_workbook, kUnbounded);
+        add("POST", "/excel/analyze/cancel", json | auth, &Server::handle_excel_analyze_cancel);
+        add("POST", "/excel/chart", json | auth, &Server::handle_excel_chart, kSlow);
+        add("POST", "/apps/ui/get", json | auth, &Server::handle_ui_get);
+        add("POST", "/apps/ui/save", json | auth, &Server::handle_ui_save);
+        add("GET", "/apps", auth, &Server::handle_list);
+        add("POST", "/apps", json | auth, &Server::handle_create);
+        add("POST", "/apps/version", json | auth, &Server::handle_version_publish);
+        add("POST", "/apps/version/status", json | auth, &Server::handle_version_status);
+        add("PUT", "/apps/:name", json | auth, &Server::handle_update);
+        add("DELETE", "/apps/:name", auth, &Server::handle_delete);
+        add("POST", "/uploads", json | auth, &Server::handle_upload_create);
+        add("GET", "/uploads/:id", auth, &Server::handle_upload, kUnbounded);
+        add("PUT", "/uploads/:id", auth, &Server::handle_upload, kUnbounded);
+        add("DELETE", "/uploads/:id", auth, &Server::handle_upload);
+        add("GET", "/users", auth, &Server::handle_users_list);
+        add("POST", "/users", json | auth, &Server::handle_users_upsert);
     }
-    if ((val.vt & VT_ARRAY) && (val.vt & VT_VARIANT) && val.parray)
+
+    HttpResponse dispatch(HttpRequest &req)
     {
-        SAFEARRAY *arr = val.parray;
-        LONG lbound1 = 0, ubound1 = -1, lbound2 = 0, ubound2 = -1;
-        UINT dims = SafeArrayGetDim(arr);
-        SafeArrayGetLBound(arr, 1, &lbound1);
-        SafeArrayGetUBound(arr, 1, &ubound1);
-        if (dims >= 2)
+        HttpResponse resp;
+        Router::Match m = router_.match(req.method, req.path, req.params);
+        t_request.route = m.pattern.empty() ? "(unmatched)" : m.pattern;
+        if (req.method == "OPTIONS")
         {
-            SafeArrayGetLBound(arr, 2, &lbound2);
-            SafeArrayGetUBound(arr, 2, &ubound2);
+            resp.status = 200;
+            resp.body = "";
+            return resp;
         }
-        std::ostringstream oss;
-        if (dims == 1)
+        if (m.route)
         {
-            oss << "[";
-            bool first = true;
-            for (LONG i = lbound1; i <= ubound1; ++i)
+            t_request.metrics = m.route->metrics.get();
+            t_request.deadline_us = request_deadline(req, m.route->timeout_s);
+            if ((m.route->flags & Router::kJson) && !require_json(req, resp))
+                return resp;
+            int retry_after = 0;
+            auto refuse = [&]()
             {
-                VARIANT item;
-                VariantInit(&item);
-                LONG idx = i;
-                if (SUCCEEDED(SafeArrayGetElement(arr, &idx, &item)))
+                m.route->metrics->rate_limited().add();
+                resp.status = 429;
+                resp.headers.emplace_back("Retry-After", std::to_string(retry_after));
+                resp.body = "{\"error\":\"rate limit exceeded\",\"retry_after\":" + std::to_string(retry_after) + "}";
+                return resp;
+            };
+            if (m.route->flags & Router::kAuth)
+            {
+                if (!limiter_.admit_unauthenticated(req.peer, retry_after))
+                    return refuse();
+                if (!authenticate(req, req.user, resp))
                 {
-                    if (!first)
-                        oss << ",";
-                    first = false;
-                    oss << variant_to_json(item);
+                    if (resp.status == 401)
+                        limiter_.note_auth_failure(req.peer);
+                    return resp;
                 }
-                VariantClear(&item);
             }
-            oss << "]";
+            if (limiter_.enabled() && !limiter_.admit(req.user.name.empty() ? req.peer : req.user.name, req.method + " " + m.pattern, retry_after))
+                return refuse();
+            resp = m.route->handler(req);
+            std::string reason;
+            if (t_request.cancelled && resp.status >= 400 && request_cancelled(reason))
+            {
+                // The failure was the cancellation. A 499 never reaches
+                // anyone; it is for the access log.
+                resp = HttpResponse{};
+                resp.status = t_request.cancelled;
+                resp.body = "{\"error\":\"" + reason + "\"}";
+            }
+            return resp;
+        }
+        if (req.method == "GET")
+        {
+            if (const StaticFiles::File *file = static_files_.find(req.path))
+                return handle_static(req, *file);
+        }
+        if (!m.allow.empty())
+        {
+            resp.status = 405;
+            resp.headers.emplace_back("Allow", m.allow);
+            resp.body = "{\"error\":\"method not allowed\"}";
+            return resp;
+        }
+        resp.status = 404;
+        resp.body = "{\"error\":\"not found\"}";
+        return resp;
+    }
+
+    // When a request's Excel work is abandoned: the route's deadline, or
+    // sooner if the client sends X-Request-Timeout (seconds, fractions
+    // allowed). A client can shorten a deadline but not lengthen it.
+    static int64_t request_deadline(const HttpRequest &req, int route_timeout_s)
+    {
+        double timeout_s = route_timeout_s;
+        auto it = req.headers.find("X-Request-Timeout");
+        if (it != req.headers.end())
+        {
+            char *end = nullptr;
+            double asked = std::strtod(it->second.c_str(), &end);
+            if (end != it->second.c_str() && std::isfinite(asked) && asked > 0)
+            {
+                asked = std::min<double>(asked, kMaxRequestTimeout);
+                if (timeout_s <= 0 || asked < timeout_s)
+                    timeout_s = asked;
+            }
+        }
+        if (timeout_s <= 0)
+            return 0;
+        return steady_us() + static_cast<int64_t>(timeout_s * 1e6);
+    }
+
+    // Whether the client asked for the binary cell format.
+    static bool accepts_cells(const HttpRequest &req)
+    {
+        auto it = req.headers.find("Accept");
+        return it != req.headers.end() && it->second.find(kCellsMediaType) != std::string::npos;
+    }
+
+    bool require_json(const HttpRequest &req, HttpResponse &resp)
+    {
+        auto it = req.headers.find("Content-Type");
+        if (it == req.headers.end())
+            return true; // allow silent fallback
+        std::string v = it->second;
+        for (auto &c : v)
+            c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        if (v.find("application/json") == std::string::npos)
+        {
+            resp.status = 415;
+            resp.body = "{\"error\":\"content-type must be application/json\"}";
+            return false;
         }
-        else if (dims == 2)
+        return true;
+    }
+
+    std::string bearer_token(const HttpRequest &req)
+    {
+        auto it = req.headers.find("Authorization");
+        if (it == req.headers.end())
+            return "";
+        const std::string &h = it->second;
+        const std::string prefix = "Bearer ";
+        if (h.rfind(prefix, 0) == 0)
+            return h.substr(prefix.size());
+        return "";
+    }
+
+    // Serializes restores of one session; different sessions restore side by
+    // side. The per-token mutex goes once nobody waits on it.
+    class RestoreLock
+    {
+    public:
+        RestoreLock(Server &server, const std::string &token) : server_(server), token_(token)
         {
-            oss << "[";
-            bool first_row = true;
-            for (LONG r = lbound1; r <= ubound1; ++r)
             {
-                if (!first_row)
-                    oss << ",";
-                first_row = false;
-                oss << "[";
-                bool first_col = true;
-                for (LONG c = lbound2; c <= ubound2; ++c)
-                {
-                    VARIANT item;
-                    VariantInit(&item);
-                    LONG idx[2] = {r, c};
-                    if (SUCCEEDED(SafeArrayGetElement(arr, idx, &item)))
-                    {
-                        if (!first_col)
-                            oss << ",";
-                        first_col = false;
-                        oss << variant_to_json(item);
-                    }
-                    VariantClear(&item);
-                }
-                oss << "]";
+                std::lock_guard<std::mutex> lock(server_.restore_mu_);
+                std::shared_ptr<std::mutex> &slot = server_.restoring_[token_];
+                if (!slot)
+                    slot = std::make_shared<std::mutex>();
+                gate_ = slot;
             }
-            oss << "]";
+            gate_->lock();
         }
-        else
+        ~RestoreLock()
+        {
+            gate_->unlock();
+            std::lock_guard<std::mutex> lock(server_.restore_mu_);
+            auto it = server_.restoring_.find(token_);
+            if (it != server_.restoring_.end() && gate_.use_count() == 2)
+                server_.restoring_.erase(it);
+        }
+        RestoreLock(const RestoreLock &) = delete;
+        RestoreLock &operator=(const RestoreLock &) = delete;
+
+    private:
+        Server &server_;
+        std::string token_;
+        std::shared_ptr<std::mutex> gate_;
+    };
+
+    // After a restart the pool starts empty. The first Excel call of a restored
+    // session reopens the workbook it had loaded and replays its edits.
+    bool restore_workbook(const std::string &token, const UserRecord &caller, std::string &err)
+    {
+        if (token.empty() || pool_.has_session(token) || native_session(token))
+            return true;
+        RestoreLock lock(*this, token);
+        if (pool_.has_session(token) || native_session(token))
+            return true;
+        SessionJournal::Workbook wb;
+        if (!journal_.workbook_for(token, wb))
+            return true;
+        AppRecord app;
+        if (!db_.get_app(wb.owner, wb.app, app) || (!can_access(app, caller) && !is_admin(caller, cfg_)))
+        {
+            journal_.record_close(token);
+            return true;
+        }
+        std::string ext = app.file_extension.empty() ? ".xlsx" : app.file_extension;
+        fs::path file_path = version_path(app.owner, app.name, wb.version) / (app.name + ext);
+        if (!fs::exists(file_path))
+        {
+            journal_.record_close(token);
+            return true;
+        }
+        size_t replayed = 0;
+        if (std::shared_ptr<NativeSession> native = load_native(token, file_path))
+        {
+            std::lock_guard<std::mutex> native_lock(native->mu);
+            for (const auto &edit : wb.edits)
+            {
+                std::string set_err;
+                if (apply_native_edit(*native->workbook, edit, set_err))
+                    ++replayed;
+                else
+                    ESA_LOG_WARN("Replay of " + edit.sheet + "!" + edit.range + " failed err=" + set_err);
+            }
+            ESA_LOG_INFO("Restored workbook for user=" + caller.name + " owner=" + app.owner + " app=" + app.name + " version=" + std::to_string(wb.version) + " edits=" + std::to_string(replayed) + " engine=native");
+            start_output_tracer(token, app, wb.version, file_path);
+            return true;
+        }
+        if (!pool_.load_workbook(token, caller.name, file_path, err))
+        {
+            ESA_LOG_ERROR("Could not restore workbook for user=" + caller.name + " app=" + app.name + " err=" + err);
+            return false;
+        }
+        // Once the workbook is open its edits are replayed in full, or the
+        // session would carry on from a state the user never saw.
+        CancelShield shield;
+        for (const auto &edit : wb.edits)
         {
+            VARIANT val;
+            edit_to_variant(edit, val);
+            std::string set_err;
+            if (pool_.set_range_value(token, edit.sheet, edit.range, val, set_err))
+                ++replayed;
+            else
+                ESA_LOG_WARN("Replay of " + edit.sheet + "!" + edit.range + " failed err=" + set_err);
             VariantClear(&val);
-            return "null";
         }
-        VariantClear(&val);
-        return oss.str();
+        ESA_LOG_INFO("Restored workbook for user=" + caller.name + " owner=" + app.owner + " app=" + app.name + " version=" + std::to_string(wb.version) + " edits=" + std::to_string(replayed));
+        start_output_tracer(token, app, wb.version, file_path);
+        return true;
     }
-    VariantClear(&val);
-    return "null";
-}
 
-bool user_in_group(const UserRecord &u, const std::string &group)
-{
-    for (auto &g : u.groups)
+    // Builder routes load workbooks implicitly; keep the journal in step when
+    // they switch a session to a different one.
+    void note_workbook(const std::string &token, const AppRecord &app, int version)
     {
-        if (g == group)
-            return true;
+        SessionJournal::Workbook wb;
+        if (journal_.workbook_for(token, wb) && wb.owner == app.owner && wb.app == app.name && wb.version == version)
+            return;
+        // The session now follows the Excel copy; a native one would be stale.
+        drop_native_session(token);
+        drop_calc_session(token);
+        drop_output_tracer(token);
+        journal_.record_workbook(token, app.owner, app.name, version);
+        notify_push(token);
     }
-    return false;
-}
 
-bool is_admin(const UserRecord &u, const Config &cfg)
-{
-    return cfg.admins.count(u.name) > 0;
-}
+    std::shared_ptr<NativeSession> native_session(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(native_mu_);
+        auto it = native_sessions_.find(token);
+        return it == native_sessions_.end() ? nullptr : it->second;
+    }
 
-bool can_access(const AppRecord &app, const UserRecord &u)
-{
-    if (app.public_access)
-        return true;
-    if (app.owner == u.name)
-        return true;
-    if (!app.access_group.empty() && user_in_group(u, app.access_group))
-        return true;
-    return false;
-}
+    void drop_native_session(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(native_mu_);
+        native_sessions_.erase(token);
+    }
 
-// -------------------- Handlers --------------------
-class Server
-{
-public:
-    Server(const Config &cfg, ExcelPool &pool, Database &db) : cfg_(cfg), pool_(pool), db_(db) {}
+    static std::string generate_job_id()
+    {
+        static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+        thread_local std::mt19937 rng{std::random_device{}()};
+        std::uniform_int_distribution<int> dist(0, static_cast<int>(sizeof(charset) - 2));
+        std::string t(16, ' ');
+        for (char &c : t)
+            c = charset[dist(rng)];
+        return t;
+    }
+
+    std::shared_ptr<CalcSession> calc_session(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(calc_mu_);
+        auto it = calc_sessions_.find(token);
+        return it == calc_sessions_.end() ? nullptr : it->second;
+    }
+
+    void drop_calc_session(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(calc_mu_);
+        calc_sessions_.erase(token);
+    }
 
-    void start()
+    std::shared_ptr<PushChannel> push_channel(const std::string &token)
     {
-        WSADATA wsa;
-        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        std::lock_guard<std::mutex> lock(push_mu_);
+        std::shared_ptr<PushChannel> &channel = push_channels_[token];
+        if (!channel)
+            channel = std::make_shared<PushChannel>();
+        return channel;
+    }
+
+    // Wakes the session's event streams after a change to its workbook:
+    // a write to the cells in `written`, or when that is null anything at
+    // all. With `close` the streams end.
+    void notify_push(const std::string &token, const OutputTracer::Ref *written = nullptr, bool close = false)
+    {
+        std::shared_ptr<PushChannel> channel;
         {
-            log_error("WSAStartup failed during server startup");
-            return;
+            std::lock_guard<std::mutex> lock(push_mu_);
+            auto it = push_channels_.find(token);
+            if (it == push_channels_.end())
+                return;
+            channel = it->second;
+            if (close)
+                push_channels_.erase(it);
         }
-        SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (listen_socket == INVALID_SOCKET)
         {
-            log_error("Socket creation failed during server startup");
-            return;
+            std::lock_guard<std::mutex> lock(channel->mu);
+            ++channel->generation;
+            if (written)
+                channel->writes.emplace_back(channel->generation, *written);
+            if (channel->writes.size() > kPushWriteLog)
+                channel->writes.pop_front();
+            channel->closed = channel->closed || close;
         }
-        sockaddr_in service{};
-        service.sin_family = AF_INET;
-        service.sin_addr.s_addr = INADDR_ANY;
-        service.sin_port = htons(static_cast<u_short>(cfg_.port));
-        if (bind(listen_socket, reinterpret_cast<SOCKADDR *>(&service), sizeof(service)) == SOCKET_ERROR)
+        channel->cv.notify_all();
+    }
+
+    std::shared_ptr<OutputTracer> output_tracer(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(tracer_mu_);
+        auto it = tracers_.find(token);
+        return it == tracers_.end() ? nullptr : it->second;
+    }
+
+    void drop_output_tracer(const std::string &token)
+    {
+        std::lock_guard<std::mutex> lock(tracer_mu_);
+        tracers_.erase(token);
+    }
+
+    // After a load: the outputs the app's schema binds, for /excel/set to
+    // return, and the formula graph to trace writes through. The graph is
+    // the native engine's parsed model, shared with any native sessions of
+    // the version; without one, nothing is traced.
+    void start_output_tracer(const std::string &token, const AppRecord &app, int version, const fs::path &file_path)
+    {
+        std::string schema = load_app_ui_version(app.owner, app.name, version);
+        if (schema.empty())
+            schema = load_app_ui(app.owner, app.name);
+        std::string reason;
+        bool cached = false;
+        std::shared_ptr<const WorkbookModel> model = models_.get(file_path, cached, reason);
+        auto tracer = std::make_shared<OutputTracer>(model, CalcSchema::parse(schema));
+        if (!model && !cached)
+            ESA_LOG_DEBUG("Writes to " + file_path.filename().u8string() + " cannot be traced: " + reason);
+        std::lock_guard<std::mutex> lock(tracer_mu_);
+        tracers_[token] = tracer;
+    }
+
+    // Whether reads of a pristine workbook can be shared between sessions:
+    // only when publish found nothing volatile in its version. NOW() or an
+    // external link differs per read, and versions never checked are
+    // treated as volatile. Looked up once per version file.
+    bool shareable_reads(const ExcelPool::WorkbookState &state)
+    {
+        std::string key = state.source.u8string();
+        std::lock_guard<std::mutex> lock(shareable_mu_);
+        auto it = shareable_.find(key);
+        if (it != shareable_.end() && it->second.first == state.stamp)
+            return it->second.second;
+        AppInfo info;
+        bool shareable = read_metadata(state.source.parent_path(), info) && info.volatile_checked && info.volatile_features.empty();
+        if (shareable_.size() >= kMaxShareableVersions)
+            shareable_.clear();
+        shareable_[key] = std::make_pair(state.stamp, shareable);
+        return shareable;
+    }
+
+    // After an Excel load: memoize if the schema of that version asks for
+    // it and the workbook has nothing volatile. Versions published before
+    // the check existed are scanned here instead.
+    void start_calc_session(const std::string &token, const AppRecord &app, int version)
+    {
+        drop_calc_session(token);
+        ExcelPool::WorkbookState state;
+        if (!calc_memo_.enabled() || !pool_.workbook_state(token, state))
+            return;
+        std::string schema = load_app_ui_version(app.owner, app.name, version);
+        if (schema.empty())
+            schema = load_app_ui(app.owner, app.name);
+        CalcSchema parsed = CalcSchema::parse(schema);
+        if (!parsed.memoize || parsed.outputs.empty())
+            return;
+        AppInfo info;
+        read_metadata(version_path(app.owner, app.name, version), info);
+        std::string features = info.volatile_checked ? info.volatile_features : find_volatile_features(state.source);
+        if (!features.empty())
         {
-            log_error("Server bind failed on port " + std::to_string(cfg_.port));
-            closesocket(listen_socket);
+            ESA_LOG_DEBUG("Not memoizing owner=" + app.owner + " app=" + app.name + " version=" + std::to_string(version) + ": " + features);
             return;
         }
-        listen(listen_socket, kListenBacklog);
-        log_info("Server listening on port " + std::to_string(cfg_.port));
-        running_ = true;
-        while (running_)
+        auto calc = std::make_shared<CalcSession>();
+        calc->source = state.source;
+        calc->stamp = state.stamp;
+        calc->schema = std::move(parsed);
+        std::lock_guard<std::mutex> lock(calc_mu_);
+        calc_sessions_[token] = calc;
+    }
+
+    // Holds back an edit of a declared input. Anything else is left to the
+    // caller to write now, and ends memoization for the session: its state
+    // is no longer described by its inputs. So does an edit that partly
+    // overlaps another input, since then the order of edits matters.
+    bool hold_calc_input(const std::string &token, const SessionJournal::Edit &edit)
+    {
+        std::shared_ptr<CalcSession> calc = calc_session(token);
+        if (!calc)
+            return false;
+        std::lock_guard<std::mutex> lock(calc->mu);
+        CalcArea area;
+        if (!CalcArea::parse(edit.sheet, edit.range, area))
+            return false;
+        bool declared = false;
+        for (const CalcArea &in : calc->schema.inputs)
+            declared = declared || in.covers(area);
+        std::string key = area.key();
+        for (const auto &kv : calc->values)
         {
-            SOCKET client = accept(listen_socket, nullptr, nullptr);
-            if (client == INVALID_SOCKET)
-                continue;
-            std::thread(&Server::handle_client, this, client).detach();
+            if (kv.first != key && kv.second.first.overlaps(area))
+                declared = false;
         }
-        closesocket(listen_socket);
-        WSACleanup();
+        if (!declared)
+            return false;
+        calc->values[key] = {area, edit};
+        calc->pending.push_back(edit);
+        return true;
     }
 
-private:
-    void handle_client(SOCKET client)
+    bool write_calc_inputs_locked(const std::string &token, CalcSession &calc, std::string &err)
     {
-        HttpRequest req;
-        HttpResponse resp;
-        if (!read_request(client, req))
+        size_t done = 0;
+        bool ok = true;
+        for (; done < calc.pending.size() && ok; ++done)
         {
-            resp.status = 400;
-            resp.body = "{\"error\":\"bad request\"}";
+            const SessionJournal::Edit &edit = calc.pending[done];
+            VARIANT val;
+            edit_to_variant(edit, val);
+            ok = pool_.set_range_value(token, edit.sheet, edit.range, val, err);
+            VariantClear(&val);
+            if (!ok)
+                ESA_LOG_WARN("Held input " + edit.sheet + "!" + edit.range + " could not be written err=" + err);
         }
-        else
+        calc.pending.erase(calc.pending.begin(), calc.pending.begin() + done);
+        return ok;
+    }
+
+    // Writes held-back inputs to Excel in the order they were set. With
+    // `stop` the session is no longer memoized afterwards.
+    bool flush_calc_inputs(const std::string &token, bool stop, std::string &err)
+    {
+        std::shared_ptr<CalcSession> calc = calc_session(token);
+        if (!calc)
+            return true;
+        if (stop)
+            drop_calc_session(token);
+        std::lock_guard<std::mutex> lock(calc->mu);
+        return write_calc_inputs_locked(token, *calc, err);
+    }
+
+    // Before an Excel read. A memoized output seen with these inputs before
+    // comes back in `json` with `hit` set. Otherwise held-back inputs are
+    // written so Excel is current, and `ticket` says where to store the
+    // result when the read is memoizable.
+    bool prepare_calc_read(const std::string &token, const std::string &sheet, const std::string &range, bool memoizable,
+                           std::string &json, bool &hit, CalcTicket &ticket, std::string &err)
+    {
+        hit = false;
+        std::shared_ptr<CalcSession> calc = calc_session(token);
+        if (!calc)
+            return true;
+        std::lock_guard<std::mutex> lock(calc->mu);
+        CalcArea area;
+        if (memoizable && CalcArea::parse(sheet, range, area) && calc->reads_output(area))
         {
-            resp = dispatch(req);
+            ticket.key = QueryCache::make_key(calc->source, calc->stamp, area.sheet, area.text, calc->state());
+            hit = calc_memo_.get(ticket.key, json);
+            if (hit)
+                return true;
         }
-        send_response(client, resp);
-        closesocket(client);
+        if (!write_calc_inputs_locked(token, *calc, err))
+            return false;
+        ExcelPool::WorkbookState state;
+        if (ticket.key.empty() || !pool_.workbook_state(token, state))
+            ticket.key.clear();
+        else
+            ticket.generation = state.generation;
+        return true;
     }
 
-    HttpResponse dispatch(const HttpRequest &req)
+    void store_calc_output(const std::string &token, const CalcTicket &ticket, const std::string &json)
     {
-        if (req.method == "OPTIONS")
+        ExcelPool::WorkbookState state;
+        if (!ticket.key.empty() && pool_.workbook_state(token, state) && state.generation == ticket.generation)
+            calc_memo_.put(ticket.key, json);
+    }
+
+    // Opens the workbook in the native engine when enabled. Returns null when
+    // it is disabled or the workbook uses something the engine cannot
+    // calculate; callers then fall back to Excel.
+    std::shared_ptr<NativeSession> load_native(const std::string &token, const fs::path &file_path)
+    {
+        if (!cfg_.native_engine)
+            return nullptr;
+        std::string ext = to_lower(file_path.extension().string());
+        if (ext != ".xlsx")
+            return nullptr;
+        static Histogram &load_seconds = g_metrics.histogram("esa_native_load_seconds", "Native engine workbook parse time");
+        int64_t start = steady_us();
+        std::string reason;
+        bool cached = false;
+        std::shared_ptr<const WorkbookModel> model = models_.get(file_path, cached, reason);
+        static Counter &model_hits = g_metrics.counter("esa_native_model_cache_total", "Native engine model lookups", metric_label("result", "hit"));
+        static Counter &model_misses = g_metrics.counter("esa_native_model_cache_total", "Native engine model lookups", metric_label("result", "miss"));
+        static Counter &excel_loads = g_metrics.counter("esa_workbook_loads_total", "Workbook loads by engine", metric_label("engine", "excel"));
+        static Counter &native_loads = g_metrics.counter("esa_workbook_loads_total", "Workbook loads by engine", metric_label("engine", "native"));
+        (cached ? model_hits : model_misses).add();
+        if (!model)
         {
-            HttpResponse resp;
-            resp.status = 200;
-            resp.body = "";
-            return resp;
+            excel_loads.add();
+            if (!cached)
+                ESA_LOG_INFO("Native engine declined " + file_path.filename().u8string() + ": " + reason + "; using Excel");
+            return nullptr;
         }
-        if (req.method == "GET" && req.path == "/health")
-            return handle_health(req);
-        if (req.method == "POST" && req.path == "/login")
-            return handle_login(req);
-        if (req.method == "POST" && req.path == "/logout")
-            return handle_logout(req);
-        if (req.method == "POST" && req.path == "/excel/load")
-            return handle_excel_load(req);
-        if (req.method == "POST" && req.path == "/excel/query")
-            return handle_excel_query(req);
-        if (req.method == "POST" && req.path == "/excel/set")
-            return handle_excel_set(req);
-        if (req.method == "POST" && req.path == "/excel/close")
-            return handle_excel_close(req);
-        if (req.method == "POST" && req.path == "/excel/sheets")
-            return handle_excel_sheets(req);
-        if (req.method == "POST" && req.path == "/excel/analyze")
-            return handle_excel_analyze(req);
-        if (req.method == "POST" && req.path == "/excel/chart")
-            return handle_excel_chart(req);
-        if (req.method == "POST" && req.path == "/apps/ui/get")
-            return handle_ui_get(req);
-        if (req.method == "POST" && req.path == "/apps/ui/save")
-            return handle_ui_save(req);
-        if (req.method == "GET" && req.path == "/apps")
-            return handle_list(req);
-        if (req.method == "POST" && req.path == "/apps")
-            return handle_create(req);
-        if (req.method == "POST" && req.path == "/apps/version")
-            return handle_version_publish(req);
-        if (req.method == "PUT" && req.path.rfind("/apps/", 0) == 0)
-            return handle_update(req);
-        if (req.method == "DELETE" && req.path.rfind("/apps/", 0) == 0)
-            return handle_delete(req);
-        if (req.method == "GET" && req.path == "/users")
-            return handle_users_list(req);
-        if (req.method == "POST" && req.path == "/users")
-            return handle_users_upsert(req);
-        HttpResponse resp;
-        resp.status = 404;
-        resp.body = "{\"error\":\"not found\"}";
-        return resp;
+        if (!cached)
+        {
+            load_seconds.record(steady_us() - start);
+            ESA_LOG_DEBUG("Native engine parsed " + file_path.filename().u8string() + " sheets=" + std::to_string(model->sheet_count()) + " formulas=" + std::to_string(model->formula_count()) + " cells=" + std::to_string(model->cell_count()));
+        }
+        native_loads.add();
+        auto session = std::make_shared<NativeSession>();
+        session->workbook.reset(new NativeWorkbook(std::move(model)));
+        std::error_code ec;
+        session->source = fs::absolute(file_path, ec);
+        session->stamp = fs::last_write_time(file_path, ec);
+        std::string err;
+        if (pool_.has_session(token))
+            pool_.close_session(token, true, err);
+        std::lock_guard<std::mutex> lock(native_mu_);
+        native_sessions_[token] = session;
+        return session;
     }
 
-    bool require_json(const HttpRequest &req, HttpResponse &resp)
+    bool apply_native_edit(NativeWorkbook &wb, const SessionJournal::Edit &edit, std::string &err)
     {
-        auto it = req.headers.find("Content-Type");
-        if (it == req.headers.end())
-            return true; // allow silent fallback
-        std::string v = it->second;
-        for (auto &c : v)
-            c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
-        if (v.find("application/json") == std::string::npos)
+        CellArea area;
+        CellValue value;
+        bool is_date = false;
+        if (!wb.resolve_area(edit.sheet, edit.range, area, err) || !edit_to_cell_value(edit, wb.date1904(), value, is_date, err))
+            return false;
+        if (!wb.set_value(area, value, is_date))
         {
-            resp.status = 415;
-            resp.body = "{\"error\":\"content-type must be application/json\"}";
+            err = "range too large: at most " + std::to_string(NativeWorkbook::kMaxWriteCells) + " cells per write";
             return false;
         }
         return true;
     }
 
-    std::string bearer_token(const HttpRequest &req)
+    // The journal knows sessions from before a restart only by a hash of
+    // their token, so each goes back in the store on its first request.
+    bool resume_session(const std::string &token)
     {
-        auto it = req.headers.find("Authorization");
-        if (it == req.headers.end())
-            return "";
-        const std::string &h = it->second;
-        const std::string prefix = "Bearer ";
-        if (h.rfind(prefix, 0) == 0)
-            return h.substr(prefix.size());
-        return "";
+        SessionJournal::Entry e;
+        if (!journal_.resume(token, e))
+            return false;
+        if (!sessions_.restore(token, e.user, e.created_unix_ms))
+        {
+            journal_.record_logout(token);
+            return false;
+        }
+        ESA_LOG_INFO("Resumed session token=" + mask_token(token) + " user=" + e.user);
+        return true;
     }
 
     bool authenticate(const HttpRequest &req, UserRecord &user_out, HttpResponse &resp_out)
     {
         std::string token = bearer_token(req);
         std::string uname;
-        if (token.empty() || !sessions_.verify(token, uname))
+        std::shared_ptr<const UserRecord> cached;
+        bool known = !token.empty() && (sessions_.verify(token, uname, cached) ||
+                                        (resume_session(token) && sessions_.verify(token, uname, cached)));
+        if (!known)
         {
             if (!token.empty())
             {
                 std::string err;
+                drop_native_session(token);
+                drop_calc_session(token);
                 pool_.close_session(token, true, err);
             }
             resp_out.status = 401;
             resp_out.body = "{\"error\":\"unauthorized\"}";
             return false;
         }
-        if (!db_.get_user(uname, user_out))
+        if (cached)
         {
-            resp_out.status = 403;
-            resp_out.body = "{\"error\":\"user missing\"}";
-            return false;
+            user_out = *cached;
+        }
+        else
+        {
+            uint64_t generation = sessions_.user_generation();
+            if (!db_.get_user(uname, user_out))
+            {
+                resp_out.status = 403;
+                resp_out.body = "{\"error\":\"user missing\"}";
+                return false;
+            }
+            sessions_.cache_user(token, std::make_shared<const UserRecord>(user_out), generation);
         }
         // force-admin from config
         if (cfg_.admins.count(uname))
             user_out.role = Role::Admin;
+        t_request.user = uname;
         return true;
     }
 
     HttpResponse handle_login(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
         std::string user = extract_json_string(req.body, "username");
         std::string pass = extract_json_string(req.body, "password");
+        t_request.user = user; // attempted name, so failed logins are audited too
+        // Wrong passwords draw on the same per-address bucket as bad tokens.
+        int retry_after = 0;
+        if (!limiter_.admit_unauthenticated(req.peer, retry_after))
+        {
+            if (t_request.metrics)
+                t_request.metrics->rate_limited().add();
+            resp.status = 429;
+            resp.headers.emplace_back("Retry-After", std::to_string(retry_after));
+            resp.body = "{\"error\":\"rate limit exceeded\",\"retry_after\":" + std::to_string(retry_after) + "}";
+            return resp;
+        }
         UserRecord u;
         if (!db_.get_user(user, u) || u.password != pass)
         {
+            limiter_.note_auth_failure(req.peer);
             resp.status = 403;
             resp.body = "{\"error\":\"invalid credentials\"}";
-            log_warn("Invalid login attempt for user=" + user);
+            ESA_LOG_WARN("Invalid login attempt for user=" + user);
             return resp;
         }
+        std::string token = sessions_.login(user, std::make_shared<const UserRecord>(u));
         if (cfg_.admins.count(user))
             u.role = Role::Admin;
-        std::string token = sessions_.login(user);
         resp.body = "{\"token\":\"" + token + "\"}";
-        log_info("User logged in: " + user);
+        ESA_LOG_INFO("User logged in: " + user);
         return resp;
     }
 
@@ -2553,9 +15403,15 @@ private:
         if (!token.empty())
         {
             std::string err;
+            drop_native_session(token);
+            drop_calc_session(token);
+            drop_output_tracer(token);
+            notify_push(token, nullptr, true);
             pool_.close_session(token, true, err);
+            journal_.record_close(token);
             sessions_.logout(token);
-            log_info("Logout completed for token=" + mask_token(token));
+            journal_.record_logout(token); // not yet resumed after a restart
+            ESA_LOG_INFO("Logout completed for token=" + mask_token(token));
         }
         resp.body = "{\"status\":\"ok\"}";
         return resp;
@@ -2568,14 +15424,71 @@ private:
         return resp;
     }
 
-    HttpResponse handle_excel_load(const HttpRequest &req)
+    HttpResponse handle_static(const HttpRequest &req, const StaticFiles::File &file)
     {
+        t_request.route = "(static)";
+        t_request.metrics = &static_metrics_;
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
+        resp.content_type = file.content_type;
+        auto v = req.query.find("v");
+        bool fingerprinted = v != req.query.end() && v->second == file.hash;
+        resp.headers.emplace_back("Cache-Control", fingerprinted ? "public, max-age=31536000, immutable" : "no-cache");
+        auto accept = req.headers.find("Accept-Encoding");
+        ContentEncoding encoding = accept == req.headers.end() ? ContentEncoding::Identity : accepted_encoding(accept->second);
+        // Each coding is its own representation with its own tag; any of
+        // them revalidates, since they share the content hash.
+        std::string coding;
+        resp.shared_body = file.identity;
+        if (encoding == ContentEncoding::Gzip && file.gzip)
+        {
+            coding = "gzip";
+            resp.shared_body = file.gzip;
+        }
+        else if (encoding == ContentEncoding::Deflate && file.deflate)
+        {
+            coding = "deflate";
+            resp.shared_body = file.deflate;
+        }
+        resp.headers.emplace_back("ETag", "\"" + file.hash + (coding.empty() ? "" : "-" + coding) + "\"");
+        auto inm = req.headers.find("If-None-Match");
+        if (inm != req.headers.end() && inm->second.find(file.hash) != std::string::npos)
+        {
+            resp.status = 304;
+            resp.shared_body.reset();
+            resp.body.clear();
             return resp;
+        }
+        if (!coding.empty())
+            resp.headers.emplace_back("Content-Encoding", coding);
+        return resp;
+    }
+
+    HttpResponse handle_metrics(const HttpRequest &)
+    {
+        HttpResponse resp;
+        resp.content_type = "text/plain; version=0.0.4";
+        std::string &out = resp.body;
+        out.clear();
+        g_metrics.render(out);
+        int free_slots = 0, in_use = 0, restarting = 0;
+        pool_.slot_states(free_slots, in_use, restarting);
+        out += "# HELP esa_excel_slots Excel pool slots by state\n# TYPE esa_excel_slots gauge\n";
+        out += "esa_excel_slots{state=\"free\"} " + std::to_string(free_slots) + "\n";
+        out += "esa_excel_slots{state=\"in_use\"} " + std::to_string(in_use) + "\n";
+        out += "esa_excel_slots{state=\"restarting\"} " + std::to_string(restarting) + "\n";
+        out += "# HELP esa_sessions Live login sessions\n# TYPE esa_sessions gauge\n";
+        out += "esa_sessions " + std::to_string(sessions_.size()) + "\n";
+        out += "# HELP esa_query_cache_bytes Size of cached query results\n# TYPE esa_query_cache_bytes gauge\n";
+        out += "esa_query_cache_bytes " + std::to_string(query_cache_.bytes()) + "\n";
+        out += "# HELP esa_http_active_connections Connections currently being served\n# TYPE esa_http_active_connections gauge\n";
+        out += "esa_http_active_connections " + std::to_string(active_connections_.load(std::memory_order_relaxed)) + "\n";
+        return resp;
+    }
+
+    HttpResponse handle_excel_load(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         if (owner.empty())
             owner = caller.name;
@@ -2598,25 +15511,71 @@ private:
         {
             resp.status = 404;
             resp.body = "{\"error\":\"not found\"}";
-            log_warn("Excel load requested for missing app owner=" + owner + " name=" + app_name);
+            ESA_LOG_WARN("Excel load requested for missing app owner=" + owner + " name=" + app_name);
             return resp;
         }
         if (!can_access(app, caller) && !is_admin(caller, cfg_))
         {
             resp.status = 403;
             resp.body = "{\"error\":\"forbidden\"}";
-            log_warn("User " + caller.name + " forbidden to load app owner=" + owner + " name=" + app_name);
+            ESA_LOG_WARN("User " + caller.name + " forbidden to load app owner=" + owner + " name=" + app_name);
             return resp;
         }
         int ver = version > 0 ? version : app.latest_version;
-        log_info("Excel load request user=" + caller.name + " owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
+        ESA_LOG_INFO("Excel load request user=" + caller.name + " owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
         std::string ext = app.file_extension.empty() ? ".xlsx" : app.file_extension;
         fs::path file_path = version_path(app.owner, app.name, ver) / (app.name + ext);
         if (!fs::exists(file_path))
         {
             resp.status = 404;
             resp.body = "{\"error\":\"file not found\"}";
-            log_error("Workbook missing on disk owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
+            ESA_LOG_ERROR("Workbook missing on disk owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
+            return resp;
+        }
+        std::string token = bearer_token(req);
+        if (token.empty())
+        {
+            resp.status = 401;
+            resp.body = "{\"error\":\"missing token\"}";
+            return resp;
+        }
+        std::string err;
+        if (load_native(token, file_path))
+        {
+            drop_calc_session(token);
+            journal_.record_workbook(token, app.owner, app.name, ver);
+            start_output_tracer(token, app, ver, file_path);
+            notify_push(token);
+            resp.body = "{\"status\":\"loaded\",\"version\":" + std::to_string(ver) + ",\"engine\":\"native\"}";
+            return resp;
+        }
+        drop_native_session(token);
+        drop_calc_session(token);
+        if (!pool_.load_workbook(token, caller.name, file_path, err))
+        {
+            resp.status = 503;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            ESA_LOG_ERROR("Excel pool could not load workbook owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver) + " err=" + err);
+            return resp;
+        }
+        journal_.record_workbook(token, app.owner, app.name, ver);
+        start_calc_session(token, app, ver);
+        start_output_tracer(token, app, ver, file_path);
+        notify_push(token);
+        resp.body = "{\"status\":\"loaded\",\"version\":" + std::to_string(ver) + "}";
+        return resp;
+    }
+
+    HttpResponse handle_excel_query(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
+        std::string sheet = extract_json_string(req.body, "sheet");
+        std::string range = extract_json_string(req.body, "range");
+        if (sheet.empty() || range.empty())
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"sheet and range required\"}";
             return resp;
         }
         std::string token = bearer_token(req);
@@ -2626,62 +15585,288 @@ private:
             resp.body = "{\"error\":\"missing token\"}";
             return resp;
         }
-        std::string err;
-        if (!pool_.load_workbook(token, caller.name, file_path, err))
+        std::string json_val;
+        std::string err;
+        if (!restore_workbook(token, caller, err))
+        {
+            resp.status = 503;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
+        QueryPage page;
+        std::string page_key = sheet + "!" + range;
+        if (!parse_query_page(req.body, page_key, page, err))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
+        bool binary = accepts_cells(req);
+        if (std::shared_ptr<NativeSession> native = native_session(token))
+        {
+            CellArea area;
+            {
+                std::lock_guard<std::mutex> lock(native->mu);
+                if (!native->workbook->resolve_area(sheet, range, area, err))
+                {
+                    resp.status = 400;
+                    resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+                    ESA_LOG_WARN("Excel query failed user=" + caller.name + " sheet=" + sheet + " range=" + range + " err=" + err);
+                    return resp;
+                }
+                if (!binary && !page.paged && area.cell_count() <= kQueryBlockCells)
+                {
+                    resp.body = "{\"value\":" + native->workbook->query_json(area) + "}";
+                    return resp;
+                }
+            }
+            // Blocks lock the session one at a time, so edits are not held up
+            // for the length of a large read.
+            RowReader reader = [native, binary](const CellArea &block, std::string &out, std::string &)
+            {
+                if (!binary)
+                {
+                    std::lock_guard<std::mutex> lock(native->mu);
+                    native->workbook->append_rows_json(block, out);
+                    return true;
+                }
+                CellGrid grid;
+                {
+                    std::lock_guard<std::mutex> lock(native->mu);
+                    native->workbook->read_grid(block, grid);
+                }
+                append_cell_frame(grid, out);
+                return true;
+            };
+            return range_response(area, page, page_key, binary, reader, caller);
+        }
+        CalcTicket ticket;
+        bool memo_hit = false;
+        if (!prepare_calc_read(token, sheet, range, !binary && !page.paged, json_val, memo_hit, ticket, err))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
+        if (memo_hit)
+        {
+            resp.body = "{\"value\":" + json_val + "}";
+            return resp;
+        }
+        // A workbook nobody has written to since it was loaded reads the same
+        // as the published file, so its plain reads go through the cache.
+        ExcelPool::WorkbookState state;
+        std::string cache_key;
+        if (!binary && !page.paged && query_cache_.enabled() && pool_.workbook_state(token, state) && state.pristine && shareable_reads(state))
+        {
+            cache_key = QueryCache::make_key(state.source, state.stamp, sheet, range);
+            if (query_cache_.get(cache_key, json_val))
+            {
+                resp.body = "{\"value\":" + json_val + "}";
+                return resp;
+            }
+        }
+        CellArea area;
+        bool rectangular = parse_area_address(sanitize_range_address(range), 0, area);
+        std::string address;
+        if (!rectangular && pool_.range_address(token, sheet, range, address, err))
+            rectangular = parse_area_address(address, 0, area);
+        if (page.paged && !rectangular)
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"paging needs a rectangular cell range\"}";
+            return resp;
+        }
+        if (rectangular && (binary || page.paged || area.cell_count() > kQueryBlockCells))
+        {
+            // Each block is its own Range.Value read, so the slot is free
+            // between blocks and no more than one block is held in memory.
+            RowReader reader = [this, token, sheet, binary](const CellArea &block, std::string &out, std::string &read_err)
+            {
+                std::string block_address = column_name(block.c1) + std::to_string(block.r1 + 1) + ":" +
+                                            column_name(block.c2) + std::to_string(block.r2 + 1);
+                if (binary)
+                {
+                    CellGrid grid;
+                    if (!pool_.query_range_grid(token, sheet, block_address, grid, read_err))
+                        return false;
+                    append_cell_frame(grid, out);
+                    return true;
+                }
+                std::string json;
+                if (!pool_.query_range(token, sheet, block_address, json, read_err))
+                    return false;
+                if (block.cell_count() == 1)
+                    out += "[" + json + "]";
+                else if (json.size() >= 4 && json.compare(0, 2, "[[") == 0)
+                    out.append(json, 1, json.size() - 2);
+                else
+                    out += json;
+                return true;
+            };
+            return range_response(area, page, page_key, binary, reader, caller);
+        }
+        // Ranges that are not a plain block of cells (whole columns and
+        // the like) are answered in JSON even when binary was asked for.
+        if (!pool_.query_range(token, sheet, range, json_val, err))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            ESA_LOG_WARN("Excel query failed user=" + caller.name + " sheet=" + sheet + " range=" + range + " err=" + err);
+            return resp;
+        }
+        // Only if no write started while the value was being read.
+        ExcelPool::WorkbookState after;
+        if (!cache_key.empty() && pool_.workbook_state(token, after) && after.generation == state.generation)
+            query_cache_.put(cache_key, json_val);
+        store_calc_output(token, ticket, json_val);
+        resp.body = "{\"value\":" + json_val + "}";
+        return resp;
+    }
+
+    // Row window of a range query. A limit of 0 runs to the end of the range.
+    struct QueryPage
+    {
+        bool paged = false;
+        uint32_t offset = 0;
+        uint32_t limit = 0;
+    };
+
+    // Appends the rows of one block as "[..],[..]", or as a binary frame.
+    typedef std::function<bool(const CellArea &block, std::string &out, std::string &err)> RowReader;
+
+    // Continuation tokens carry the next offset and the limit, plus a check
+    // of the sheet and range so a token is not replayed against another range.
+    static std::string make_page_token(uint32_t offset, uint32_t limit, const std::string &key)
+    {
+        char buf[48];
+        std::snprintf(buf, sizeof(buf), "%u.%u.%08x", offset, limit, static_cast<unsigned>(std::hash<std::string>()(key) & 0xFFFFFFFFu));
+        return buf;
+    }
+
+    static bool parse_query_page(const std::string &body, const std::string &key, QueryPage &page, std::string &err)
+    {
+        std::string token = extract_json_string(body, "page_token");
+        if (!token.empty())
+        {
+            unsigned offset = 0, limit = 0, check = 0;
+            char extra = 0;
+            if (std::sscanf(token.c_str(), "%u.%u.%x%c", &offset, &limit, &check, &extra) != 3 ||
+                check != static_cast<unsigned>(std::hash<std::string>()(key) & 0xFFFFFFFFu))
+            {
+                err = "invalid page_token";
+                return false;
+            }
+            page.paged = true;
+            page.offset = offset;
+            page.limit = limit;
+            return true;
+        }
+        if (!json_has_key(body, "offset") && !json_has_key(body, "limit"))
+            return true;
+        double offset = extract_json_double(body, "offset", 0.0);
+        double limit = extract_json_double(body, "limit", 0.0);
+        if (offset < 0 || limit < 0 || offset > kSheetMaxRows || limit > kSheetMaxRows)
         {
-            resp.status = 503;
-            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_error("Excel pool could not load workbook owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver) + " err=" + err);
-            return resp;
+            err = "offset and limit must be row counts";
+            return false;
         }
-        resp.body = "{\"status\":\"loaded\",\"version\":" + std::to_string(ver) + "}";
-        return resp;
+        page.paged = true;
+        page.offset = static_cast<uint32_t>(offset);
+        page.limit = static_cast<uint32_t>(limit);
+        return true;
     }
 
-    HttpResponse handle_excel_query(const HttpRequest &req)
+    static bool read_row_block(const CellArea &area, uint32_t first, uint32_t end, uint32_t block_rows, bool binary,
+                               const RowReader &reader, uint32_t &next, std::string &out, std::string &err)
+    {
+        CellArea block = area;
+        uint32_t to = std::min(end, next + block_rows);
+        block.r1 = area.r1 + next;
+        block.r2 = area.r1 + to - 1;
+        if (!binary && next != first)
+            out.push_back(',');
+        if (!reader(block, out, err))
+            return false;
+        next = to;
+        return true;
+    }
+
+    // Writes the rows of `area` as {"value":[...]}, reading them in blocks of
+    // about kQueryBlockCells. A page selects a window of rows and adds the
+    // paging fields. The first block is read before anything is sent, so a
+    // failing read still gets an error status; later blocks are streamed as
+    // they are read. If one of those fails the body is cut off without its
+    // final chunk, so the client cannot take it for complete. In binary
+    // the paging fields go in the header and each block is one frame.
+    HttpResponse range_response(const CellArea &area, const QueryPage &page, const std::string &page_key, bool binary,
+                                const RowReader &reader, const UserRecord &caller)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
-        std::string sheet = extract_json_string(req.body, "sheet");
-        std::string range = extract_json_string(req.body, "range");
-        if (sheet.empty() || range.empty())
+        uint32_t total = area.r2 - area.r1 + 1;
+        uint32_t cols = area.c2 - area.c1 + 1;
+        uint32_t first = std::min(page.offset, total);
+        uint32_t end = page.limit ? static_cast<uint32_t>(std::min<uint64_t>(total, uint64_t(first) + page.limit)) : total;
+        uint32_t block_rows = std::max<uint32_t>(1, static_cast<uint32_t>(kQueryBlockCells / cols));
+        std::string next_token = page.paged && end < total ? make_page_token(end, page.limit, page_key) : "";
+        std::string tail;
+        if (binary)
         {
-            resp.status = 400;
-            resp.body = "{\"error\":\"sheet and range required\"}";
-            return resp;
+            resp.content_type = kCellsMediaType;
+            resp.body.clear();
+            append_cells_header(end - first, cols, page.paged, first, total, next_token, resp.body);
+            append_cells_end(tail);
         }
-        std::string token = bearer_token(req);
-        if (token.empty())
+        else
         {
-            resp.status = 401;
-            resp.body = "{\"error\":\"missing token\"}";
-            return resp;
+            tail = "]";
+            if (page.paged)
+            {
+                tail += ",\"offset\":" + std::to_string(first) + ",\"rows\":" + std::to_string(end - first) +
+                        ",\"total_rows\":" + std::to_string(total);
+                if (!next_token.empty())
+                    tail += ",\"next_page_token\":\"" + next_token + "\"";
+            }
+            tail += "}";
+            resp.body = "{\"value\":[";
         }
-        std::string json_val;
+        uint32_t next = first;
         std::string err;
-        if (!pool_.query_range(token, sheet, range, json_val, err))
+        if (next < end && !read_row_block(area, first, end, block_rows, binary, reader, next, resp.body, err))
         {
             resp.status = 400;
+            resp.content_type = "application/json";
             resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_warn("Excel query failed user=" + caller.name + " sheet=" + sheet + " range=" + range + " err=" + err);
+            ESA_LOG_WARN("Excel query failed user=" + caller.name + " err=" + err);
             return resp;
         }
-        resp.body = "{\"value\":" + json_val + "}";
+        if (next >= end)
+        {
+            resp.body += tail;
+            return resp;
+        }
+        auto cursor = std::make_shared<uint32_t>(next);
+        std::string user = caller.name;
+        resp.stream = [=](std::string &chunk)
+        {
+            std::string read_err;
+            if (!read_row_block(area, first, end, block_rows, binary, reader, *cursor, chunk, read_err))
+            {
+                ESA_LOG_WARN("Streamed query stopped user=" + user + " row=" + std::to_string(*cursor) + " err=" + read_err);
+                return StreamStep::Failed;
+            }
+            if (*cursor < end)
+                return StreamStep::More;
+            chunk += tail;
+            return StreamStep::Done;
+        };
         return resp;
     }
 
     HttpResponse handle_excel_set(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string sheet = extract_json_string(req.body, "sheet");
         std::string range = extract_json_string(req.body, "range");
         if (sheet.empty() || range.empty())
@@ -2690,23 +15875,23 @@ private:
             resp.body = "{\"error\":\"sheet and range required\"}";
             return resp;
         }
-        VARIANT val;
-        VariantInit(&val);
+        SessionJournal::Edit edit;
+        edit.sheet = sheet;
+        edit.range = range;
         if (json_has_key(req.body, "value_bool"))
         {
-            val.vt = VT_BOOL;
-            val.boolVal = extract_json_bool(req.body, "value_bool", false) ? VARIANT_TRUE : VARIANT_FALSE;
+            edit.kind = SessionJournal::EditKind::Bool;
+            edit.flag = extract_json_bool(req.body, "value_bool", false);
         }
         else if (json_has_key(req.body, "value_number"))
         {
-            val.vt = VT_R8;
-            val.dblVal = extract_json_double(req.body, "value_number", 0.0);
+            edit.kind = SessionJournal::EditKind::Number;
+            edit.number = extract_json_double(req.body, "value_number", 0.0);
         }
         else if (json_has_key(req.body, "value"))
         {
-            std::string s = extract_json_string(req.body, "value");
-            val.vt = VT_BSTR;
-            val.bstrVal = SysAllocString(std::wstring(s.begin(), s.end()).c_str());
+            edit.kind = SessionJournal::EditKind::Text;
+            edit.text = extract_json_string(req.body, "value");
         }
         else
         {
@@ -2717,31 +15902,107 @@ private:
         std::string token = bearer_token(req);
         if (token.empty())
         {
-            VariantClear(&val);
             resp.status = 401;
             resp.body = "{\"error\":\"missing token\"}";
             return resp;
         }
         std::string err;
-        bool ok = pool_.set_range_value(token, sheet, range, val, err);
-        VariantClear(&val);
+        if (!restore_workbook(token, caller, err))
+        {
+            resp.status = 503;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
+        bool ok = false;
+        if (std::shared_ptr<NativeSession> native = native_session(token))
+        {
+            std::lock_guard<std::mutex> lock(native->mu);
+            ok = apply_native_edit(*native->workbook, edit, err);
+        }
+        else if (hold_calc_input(token, edit))
+        {
+            ok = true; // written to Excel when something next reads the workbook
+        }
+        else if (flush_calc_inputs(token, true, err))
+        {
+            VARIANT val;
+            edit_to_variant(edit, val);
+            ok = pool_.set_range_value(token, sheet, range, val, err);
+            VariantClear(&val);
+        }
         if (!ok)
         {
             resp.status = 400;
             resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_warn("Excel set failed user=" + caller.name + " sheet=" + sheet + " range=" + range + " err=" + err);
+            ESA_LOG_WARN("Excel set failed user=" + caller.name + " sheet=" + sheet + " range=" + range + " err=" + err);
             return resp;
         }
-        resp.body = "{\"status\":\"updated\"}";
+        journal_.record_edit(token, edit);
+        OutputTracer::Ref written(sheet, range);
+        notify_push(token, &written);
+        resp.body = "{\"status\":\"updated\"";
+        if (extract_json_bool(req.body, "outputs", true))
+            append_affected_outputs(token, caller, written, resp.body);
+        resp.body += "}";
         return resp;
     }
 
+    // Appends ,"outputs":[...] with the schema outputs the write can have
+    // changed, read again, each as {"sheet","range","value"} or with
+    // "error". Native sessions read them under one lock and Excel sessions
+    // in one pool call; memoized sessions go through the memo. Nothing is
+    // added when the schema binds no outputs.
+    void append_affected_outputs(const std::string &token, const UserRecord &caller, const OutputTracer::Ref &written, std::string &out)
+    {
+        std::shared_ptr<OutputTracer> tracer = output_tracer(token);
+        if (!tracer || tracer->outputs().empty())
+            return;
+        static Counter &read_total = g_metrics.counter("esa_output_reads_total", "Schema outputs read again after a write", metric_label("result", "read"));
+        static Counter &skipped_total = g_metrics.counter("esa_output_reads_total", "Schema outputs read again after a write", metric_label("result", "skipped"));
+        std::vector<OutputTracer::Ref> refs;
+        for (size_t i : tracer->affected_outputs(written))
+            refs.push_back(tracer->outputs()[i]);
+        read_total.add(refs.size());
+        skipped_total.add(tracer->outputs().size() - refs.size());
+        std::vector<std::string> values(refs.size()), errs(refs.size());
+        std::string err;
+        if (std::shared_ptr<NativeSession> native = native_session(token))
+        {
+            std::lock_guard<std::mutex> lock(native->mu);
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                CellArea area;
+                if (native->workbook->resolve_area(refs[i].first, refs[i].second, area, errs[i]))
+                    values[i] = native->workbook->query_json(area);
+            }
+        }
+        else if (calc_session(token))
+        {
+            for (size_t i = 0; i < refs.size(); ++i)
+                read_output(token, caller, refs[i].first, refs[i].second, values[i], errs[i]);
+        }
+        else if (!refs.empty() && !pool_.query_ranges(token, refs, values, errs, err))
+        {
+            errs.assign(refs.size(), err);
+        }
+        out += ",\"outputs\":[";
+        for (size_t i = 0; i < refs.size(); ++i)
+        {
+            out += std::string(i ? "," : "") + "{\"sheet\":\"" + json_escape(refs[i].first) + "\",\"range\":\"" + json_escape(refs[i].second) + "\",";
+            if (errs[i].empty())
+                out += "\"value\":" + values[i] + "}";
+            else
+                out += "\"error\":\"" + json_escape(errs[i]) + "\"}";
+        }
+        out += "]";
+        if (!tracer->traced())
+            out += ",\"traced\":false";
+    }
+
     HttpResponse handle_excel_close(const HttpRequest &req)
     {
         HttpResponse resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string token = bearer_token(req);
         if (token.empty())
         {
@@ -2750,25 +16011,257 @@ private:
             return resp;
         }
         std::string err;
+        journal_.record_close(token);
+        bool had_native = native_session(token) != nullptr;
+        drop_native_session(token);
+        drop_calc_session(token);
+        drop_output_tracer(token);
+        notify_push(token, nullptr, true);
+        if (had_native && !pool_.has_session(token))
+        {
+            resp.body = "{\"status\":\"closed\"}";
+            return resp;
+        }
         if (!pool_.close_session(token, true, err))
         {
             resp.status = 400;
             resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_warn("Excel close failed for user=" + caller.name + " err=" + err);
+            ESA_LOG_WARN("Excel close failed for user=" + caller.name + " err=" + err);
             return resp;
         }
         resp.body = "{\"status\":\"closed\",\"session\":\"restarted\"}";
         return resp;
     }
 
-    HttpResponse handle_excel_sheets(const HttpRequest &req)
+    // Replaces the ranges the session's event streams watch:
+    // {"ranges":[{"sheet":"Sheet1","range":"B4"}, ...]}.
+    HttpResponse handle_excel_subscribe(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
+        std::string token = bearer_token(req);
+        if (token.empty())
+        {
+            resp.status = 401;
+            resp.body = "{\"error\":\"missing token\"}";
+            return resp;
+        }
+        size_t key = req.body.find("\"ranges\"");
+        std::vector<std::string> items;
+        if (key == std::string::npos || !json_array_items(req.body.substr(req.body.find(':', key) + 1), items))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"ranges required\"}";
+            return resp;
+        }
+        if (items.size() > kPushMaxRanges)
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"at most " + std::to_string(kPushMaxRanges) + " ranges\"}";
+            return resp;
+        }
+        std::string err;
+        if (!restore_workbook(token, req.user, err))
+        {
+            resp.status = 503;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
             return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
+        }
+        std::vector<std::pair<std::string, std::string>> ranges;
+        uint64_t cells = 0;
+        for (const std::string &item : items)
+        {
+            std::string sheet = extract_json_string(item, "sheet");
+            std::string range = extract_json_string(item, "range");
+            if (sheet.empty() || range.empty())
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"each range needs sheet and range\"}";
+                return resp;
+            }
+            uint64_t range_cells = 0;
+            if (!session_range_cells(token, sheet, range, range_cells, err))
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"" + json_escape(sheet + "!" + range + ": " + err) + "\"}";
+                return resp;
+            }
+            cells += range_cells;
+            if (cells > kPushMaxCells)
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"at most " + std::to_string(kPushMaxCells) + " cells across the ranges\"}";
+                return resp;
+            }
+            ranges.emplace_back(sheet, range);
+        }
+        std::shared_ptr<PushChannel> channel = push_channel(token);
+        {
+            std::lock_guard<std::mutex> lock(channel->mu);
+            channel->ranges = std::move(ranges);
+            ++channel->revision;
+        }
+        channel->cv.notify_all();
+        resp.body = "{\"status\":\"subscribed\",\"ranges\":" + std::to_string(items.size()) + "}";
+        return resp;
+    }
+
+    // Cells in a range of the session's workbook, with names and whole rows
+    // or columns resolved. False for ranges that are not one block.
+    bool session_range_cells(const std::string &token, const std::string &sheet, const std::string &range, uint64_t &cells, std::string &err)
+    {
+        CellArea area;
+        if (parse_area_address(sanitize_range_address(range), 0, area))
+        {
+            cells = area.cell_count();
+            return true;
+        }
+        if (std::shared_ptr<NativeSession> native = native_session(token))
+        {
+            std::lock_guard<std::mutex> lock(native->mu);
+            if (!native->workbook->resolve_area(sheet, range, area, err))
+                return false;
+            cells = area.cell_count();
+            return true;
+        }
+        std::string address;
+        if (!pool_.range_address(token, sheet, range, address, err))
+            return false;
+        address.erase(std::remove(address.begin(), address.end(), '$'), address.end());
+        if (!parse_area_address(address, 0, area))
+        {
+            err = "not a single block of cells";
+            return false;
+        }
+        cells = area.cell_count();
+        return true;
+    }
+
+    // An event stream of changes to the subscribed ranges. The first event
+    // carries every value; later ones what changed since. Comments keep the
+    // connection alive and find clients that have gone. A session keeps at
+    // most kPushMaxStreams; opening another closes its oldest.
+    HttpResponse handle_excel_events(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        std::string token = bearer_token(req);
+        if (token.empty())
+        {
+            resp.status = 401;
+            resp.body = "{\"error\":\"missing token\"}";
             return resp;
+        }
+        static Counter &events_total = g_metrics.counter("esa_push_events_total", "Change events sent to event streams");
+        static Counter &cells_total = g_metrics.counter("esa_push_cells_total", "Cells sent in change events");
+        static Counter &streams_total = g_metrics.counter("esa_push_streams_total", "Event streams opened");
+        streams_total.add();
+        std::shared_ptr<PushChannel> channel = push_channel(token);
+        uint64_t id = 0;
+        {
+            std::lock_guard<std::mutex> lock(channel->mu);
+            id = ++channel->next_stream;
+            channel->streams.push_back(id);
+            if (channel->streams.size() > kPushMaxStreams)
+                channel->streams.pop_front();
+        }
+        channel->cv.notify_all();
+        // Leaves the list when the response goes, however the stream ended.
+        std::shared_ptr<void> guard(nullptr, [channel, id](void *)
+                                    {
+            std::lock_guard<std::mutex> lock(channel->mu);
+            auto it = std::find(channel->streams.begin(), channel->streams.end(), id);
+            if (it != channel->streams.end())
+                channel->streams.erase(it); });
+        auto open = [channel, id]()
+        { return std::find(channel->streams.begin(), channel->streams.end(), id) != channel->streams.end(); };
+        auto state = std::make_shared<PushState>();
+        UserRecord caller = req.user;
+        resp.content_type = "text/event-stream";
+        resp.headers.emplace_back("Cache-Control", "no-cache");
+        resp.body = ": connected\n\n";
+        resp.stream = [this, channel, state, token, caller, guard, open](std::string &chunk)
+        {
+            std::vector<std::pair<std::string, std::string>> ranges, written;
+            uint64_t generation = 0;
+            bool traced = false;
+            {
+                std::unique_lock<std::mutex> lock(channel->mu);
+                bool woken = channel->cv.wait_for(lock, kPushHeartbeat, [&]
+                                                  { return channel->closed || !open() || channel->generation != state->generation || channel->revision != state->revision; });
+                if (channel->closed || !open())
+                {
+                    chunk = "event: closed\ndata: {}\n\n";
+                    return StreamStep::Done;
+                }
+                if (!woken)
+                {
+                    chunk = ": keep-alive\n\n";
+                    return StreamStep::More;
+                }
+                if (channel->revision != state->revision)
+                    state->sent.clear(); // the client starts over with a new list
+                else
+                    traced = state->generation != UINT64_MAX && channel->writes_since(state->generation, written);
+                state->generation = generation = channel->generation;
+                state->revision = channel->revision;
+                ranges = channel->ranges;
+            }
+            std::shared_ptr<OutputTracer> tracer = traced ? output_tracer(token) : nullptr;
+            std::string updates;
+            size_t cells = 0;
+            for (const auto &r : ranges)
+            {
+                if (tracer && tracer->traced() && std::none_of(written.begin(), written.end(), [&](const OutputTracer::Ref &w)
+                                                               { return tracer->affects(w, r); }))
+                    continue; // no write since the last read reaches it
+                std::string value, err;
+                read_output(token, caller, r.first, r.second, value, err);
+                cells += state->diff(r.first, r.second, value, err, updates);
+            }
+            if (updates.empty())
+                return StreamStep::More;
+            chunk = "event: cells\ndata: {\"generation\":" + std::to_string(generation) + ",\"ranges\":[" + updates + "]}\n\n";
+            events_total.add();
+            cells_total.add(cells);
+            return StreamStep::More;
+        };
+        return resp;
+    }
+
+    // Reads a range the way /excel/query would for this session, so event
+    // streams share its engines and caches. `value` is JSON.
+    bool read_output(const std::string &token, const UserRecord &caller, const std::string &sheet, const std::string &range,
+                     std::string &value, std::string &err)
+    {
+        HttpRequest req;
+        req.method = "POST";
+        req.headers["Authorization"] = "Bearer " + token;
+        req.user = caller;
+        req.body = "{\"sheet\":\"" + json_escape(sheet) + "\",\"range\":\"" + json_escape(range) + "\"}";
+        HttpResponse resp = handle_excel_query(req);
+        StreamStep step = resp.stream ? StreamStep::More : StreamStep::Done;
+        while (step == StreamStep::More)
+            step = resp.stream(resp.body);
+        const std::string prefix = "{\"value\":";
+        if (step == StreamStep::Failed)
+        {
+            err = "read failed";
+            return false;
+        }
+        if (resp.status != 200 || resp.body.compare(0, prefix.size(), prefix) != 0)
+        {
+            err = extract_json_string(resp.body, "error");
+            if (err.empty())
+                err = "unreadable range";
+            return false;
+        }
+        value = resp.body.substr(prefix.size(), resp.body.size() - prefix.size() - 1);
+        return true;
+    }
+
+    HttpResponse handle_excel_sheets(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         if (owner.empty())
             owner = caller.name;
@@ -2808,6 +16301,12 @@ private:
             resp.body = "{\"error\":\"file not found\"}";
             return resp;
         }
+        if (read_workbook_summary(file_path.parent_path(), kSheetsFile, resp.body))
+        {
+            static Counter &summaries = g_metrics.counter("esa_workbook_summary_total", "Sheet listings and workbook analyses answered from the publish-time summary", metric_label("route", "/excel/sheets"));
+            summaries.add();
+            return resp;
+        }
         std::string token = bearer_token(req);
         if (token.empty())
         {
@@ -2816,19 +16315,20 @@ private:
             return resp;
         }
         std::string err;
-        if (!pool_.ensure_workbook_loaded(token, caller.name, file_path, err))
+        if (!restore_workbook(token, caller, err) || !pool_.ensure_workbook_loaded(token, caller.name, file_path, err))
         {
             resp.status = 503;
             resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_error("Failed to prepare workbook for sheet listing owner=" + owner + " app=" + app_name + " err=" + err);
+            ESA_LOG_ERROR("Failed to prepare workbook for sheet listing owner=" + owner + " app=" + app_name + " err=" + err);
             return resp;
         }
+        note_workbook(token, app, ver);
         std::vector<std::string> sheets;
         if (!pool_.list_sheets(token, sheets, err))
         {
             resp.status = 400;
             resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_warn("Sheet listing failed owner=" + owner + " app=" + app_name + " err=" + err);
+            ESA_LOG_WARN("Sheet listing failed owner=" + owner + " app=" + app_name + " err=" + err);
             return resp;
         }
         std::ostringstream oss;
@@ -2841,18 +16341,14 @@ private:
         }
         oss << "]}";
         resp.body = oss.str();
-        log_info("Listed " + std::to_string(sheets.size()) + " sheet(s) for owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
+        ESA_LOG_INFO("Listed " + std::to_string(sheets.size()) + " sheet(s) for owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
         return resp;
     }
 
     HttpResponse handle_excel_analyze(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         if (owner.empty())
             owner = caller.name;
@@ -2904,34 +16400,179 @@ private:
             return resp;
         }
         std::string err;
-        if (!pool_.ensure_workbook_loaded(token, caller.name, file_path, err))
+        if (!restore_workbook(token, caller, err) || !pool_.ensure_workbook_loaded(token, caller.name, file_path, err))
+        {
+            resp.status = 503;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            ESA_LOG_ERROR("Failed to prepare workbook for analysis owner=" + owner + " app=" + app_name + " err=" + err);
+            return resp;
+        }
+        note_workbook(token, app, ver);
+        if (!flush_calc_inputs(token, false, err))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
+        // The builder analyzes the same ranges of a version again and again;
+        // while the workbook is as published the result is shared.
+        ExcelPool::WorkbookState state;
+        std::string cache_key;
+        std::string result_json;
+        if (query_cache_.enabled() && pool_.workbook_state(token, state) && state.pristine && shareable_reads(state))
+        {
+            cache_key = QueryCache::make_key(state.source, state.stamp, sheet, range, "analyze");
+            if (query_cache_.get(cache_key, result_json))
+            {
+                resp.body = result_json;
+                return resp;
+            }
+        }
+        if (!pool_.analyze_range(token, sheet, range, result_json, err))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            ESA_LOG_WARN("Range analysis failed owner=" + owner + " app=" + app_name + " sheet=" + sheet + " range=" + range + " err=" + err);
+            return resp;
+        }
+        ExcelPool::WorkbookState after;
+        if (!cache_key.empty() && pool_.workbook_state(token, after) && after.generation == state.generation)
+            query_cache_.put(cache_key, result_json);
+        resp.body = result_json;
+        ESA_LOG_INFO("Analyzed range owner=" + owner + " app=" + app_name + " sheet=" + sheet + " range=" + range);
+        return resp;
+    }
+
+    // Analyzes every sheet of an app version and streams one NDJSON line
+    // per sheet as it finishes. The first line names the job, which
+    // /excel/analyze/cancel takes; dropping the connection cancels it too.
+    HttpResponse handle_excel_analyze_workbook(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
+        std::string owner = extract_json_string(req.body, "owner");
+        if (owner.empty())
+            owner = caller.name;
+        std::string app_name = extract_json_string(req.body, "name");
+        int version = extract_json_int(req.body, "version", 0);
+        if (app_name.empty())
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"missing app name\"}";
+            return resp;
+        }
+        if (!is_safe_name(owner) || !is_safe_name(app_name))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"invalid names\"}";
+            return resp;
+        }
+        AppRecord app;
+        if (!db_.get_app(owner, app_name, app))
+        {
+            resp.status = 404;
+            resp.body = "{\"error\":\"app not found\"}";
+            return resp;
+        }
+        if (app.owner != caller.name && !is_admin(caller, cfg_))
+        {
+            resp.status = 403;
+            resp.body = "{\"error\":\"forbidden\"}";
+            return resp;
+        }
+        int ver = version > 0 ? version : app.latest_version;
+        std::string ext = app.file_extension.empty() ? ".xlsx" : app.file_extension;
+        fs::path file_path = version_path(app.owner, app.name, ver) / (app.name + ext);
+        if (to_lower(ext) != ".xlsx" && to_lower(ext) != ".xlsm")
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"workbook analysis needs an .xlsx or .xlsm file; analyze ranges one at a time\"}";
+            return resp;
+        }
+        std::string lines, sheets;
+        if (read_workbook_summary(file_path.parent_path(), kAnalysisFile, lines) &&
+            read_workbook_summary(file_path.parent_path(), kSheetsFile, sheets))
+        {
+            // Analyzed when the version was published. Same lines as a
+            // live job; there is nothing left to cancel.
+            static Counter &summaries = g_metrics.counter("esa_workbook_summary_total", "Sheet listings and workbook analyses answered from the publish-time summary", metric_label("route", "/excel/analyze/workbook"));
+            summaries.add();
+            std::string names = sheets.substr(0, sheets.find("],\"ranges\"")) + "]";
+            size_t total = static_cast<size_t>(std::count(lines.begin(), lines.end(), '\n'));
+            resp.content_type = "application/x-ndjson";
+            resp.body = "{\"job\":\"" + generate_job_id() + "\",\"total\":" + std::to_string(total) + "," + names.substr(1) + "}\n";
+            resp.fragments.push_back({resp.body.size(), load_deflated(file_path.parent_path() / kAnalysisFile)});
+            resp.body += lines + "{\"complete\":true}\n";
+            return resp;
+        }
+        auto analyzer = std::make_shared<WorkbookAnalyzer>();
+        std::string err;
+        if (!fs::exists(file_path) || !analyzer->open(file_path, err))
+        {
+            resp.status = fs::exists(file_path) ? 400 : 404;
+            resp.body = "{\"error\":\"" + json_escape(err.empty() ? "file not found" : err) + "\"}";
+            return resp;
+        }
+        auto job = std::make_shared<AnalysisJob>(generate_job_id(), caller.name, analyzer);
+        {
+            std::lock_guard<std::mutex> lock(analysis_mu_);
+            for (auto it = analysis_jobs_.begin(); it != analysis_jobs_.end();)
+                it = it->second.expired() ? analysis_jobs_.erase(it) : std::next(it);
+            analysis_jobs_[job->id()] = job;
+        }
+        resp.content_type = "application/x-ndjson";
+        resp.body = "{\"job\":\"" + job->id() + "\",\"total\":" + std::to_string(job->total()) + ",\"sheets\":[";
+        for (size_t i = 0; i < analyzer->sheet_count(); ++i)
+            resp.body += std::string(i ? "," : "") + "\"" + json_escape(analyzer->sheet_name(i)) + "\"";
+        resp.body += "]}\n";
+        ESA_LOG_INFO("Analyzing workbook owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver) +
+                 " sheets=" + std::to_string(job->total()) + " job=" + job->id());
+        job->start(cfg_.analysis_threads);
+        // Goes when the response does, whether the stream ran out or the
+        // client went away.
+        std::shared_ptr<void> guard(nullptr, [this, job](void *)
+                                    {
+            job->cancel();
+            std::lock_guard<std::mutex> lock(analysis_mu_);
+            analysis_jobs_.erase(job->id()); });
+        resp.stream = [job, guard](std::string &chunk)
+        {
+            if (job->next(chunk))
+                return StreamStep::More;
+            chunk = job->cancelled() ? "{\"cancelled\":true}\n" : "{\"complete\":true}\n";
+            return StreamStep::Done;
+        };
+        return resp;
+    }
+
+    HttpResponse handle_excel_analyze_cancel(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
+        std::string id = extract_json_string(req.body, "job");
+        std::shared_ptr<AnalysisJob> job;
         {
-            resp.status = 503;
-            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_error("Failed to prepare workbook for analysis owner=" + owner + " app=" + app_name + " err=" + err);
-            return resp;
+            std::lock_guard<std::mutex> lock(analysis_mu_);
+            auto it = analysis_jobs_.find(id);
+            if (it != analysis_jobs_.end())
+                job = it->second.lock();
         }
-        std::string result_json;
-        if (!pool_.analyze_range(token, sheet, range, result_json, err))
+        if (!job || (job->user() != caller.name && !is_admin(caller, cfg_)))
         {
-            resp.status = 400;
-            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_warn("Range analysis failed owner=" + owner + " app=" + app_name + " sheet=" + sheet + " range=" + range + " err=" + err);
+            resp.status = 404;
+            resp.body = "{\"error\":\"job not found\"}";
             return resp;
         }
-        resp.body = result_json;
-        log_info("Analyzed range owner=" + owner + " app=" + app_name + " sheet=" + sheet + " range=" + range);
+        job->cancel();
+        ESA_LOG_INFO("Cancelled workbook analysis job=" + id + " user=" + caller.name);
+        resp.body = "{\"ok\":true}";
         return resp;
     }
 
     HttpResponse handle_excel_chart(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         if (owner.empty())
             owner = caller.name;
@@ -2983,55 +16624,157 @@ private:
             return resp;
         }
         std::string err;
-        if (!pool_.ensure_workbook_loaded(token, caller.name, file_path, err))
+        if (!restore_workbook(token, caller, err))
         {
             resp.status = 503;
             resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_error("Failed to prepare workbook for chart export owner=" + owner + " app=" + app_name + " err=" + err);
             return resp;
         }
-        std::string base64_image;
-        if (!pool_.export_chart_at_cell(token, sheet, cell, base64_image, err))
+        CellArea cell_area;
+        if (!parse_area_address(sanitize_range_address(cell), 0, cell_area))
         {
             resp.status = 400;
-            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
-            log_warn("Chart export failed owner=" + owner + " app=" + app_name + " sheet=" + sheet + " cell=" + cell + " err=" + err);
+            resp.body = "{\"error\":\"invalid cell reference: " + json_escape(cell) + "\"}";
             return resp;
         }
-        resp.body = "{\"image\":\"" + base64_image + "\"}";
-        log_info("Exported chart owner=" + owner + " app=" + app_name + " sheet=" + sheet + " cell=" + cell);
+
+        // A chart looks the same for as long as the values it is drawn from
+        // do, so images are cached by the workbook file, the chart and a
+        // hash of those values. Native sessions draw the chart themselves;
+        // chart types they cannot draw, and Excel sessions, export it.
+        std::string cache_key, png, values_json, chart_name;
+        std::shared_ptr<NativeSession> native = native_session(token);
+        std::error_code ec;
+        if (native && !(fs::equivalent(native->source, file_path, ec) && !ec))
+            native.reset();
+        const NativeChart *drawn = nullptr;
+        std::vector<ChartSeriesData> series;
+        if (native)
+        {
+            std::lock_guard<std::mutex> lock(native->mu);
+            if (!native->charts)
+                native->charts = chart_indexes_.get(native->source, native->stamp);
+            drawn = native->charts->find(sheet, cell_area.r1, cell_area.c1);
+            if (!drawn)
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"no chart overlapping cell " + json_escape(cell) + "\"}";
+                return resp;
+            }
+            if (drawn->kind == NativeChart::Kind::Other || !read_chart_series(*native->workbook, *drawn, series, values_json, err))
+                drawn = nullptr;
+            else
+            {
+                chart_name = drawn->name;
+                cache_key = QueryCache::make_key(native->source, native->stamp, sheet, chart_name, "chart native " + hex64(fnv1a64(values_json)));
+            }
+        }
+        if (!drawn)
+        {
+            if (!pool_.ensure_workbook_loaded(token, caller.name, file_path, err))
+            {
+                resp.status = 503;
+                resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+                ESA_LOG_ERROR("Failed to prepare workbook for chart export owner=" + owner + " app=" + app_name + " err=" + err);
+                return resp;
+            }
+            note_workbook(token, app, ver);
+            if (!flush_calc_inputs(token, false, err))
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+                return resp;
+            }
+            ExcelPool::ChartInfo info;
+            if (!pool_.find_chart_at_cell(token, sheet, cell, info, err))
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+                ESA_LOG_WARN("Chart export failed owner=" + owner + " app=" + app_name + " sheet=" + sheet + " cell=" + cell + " err=" + err);
+                return resp;
+            }
+            chart_name = info.name;
+            values_json.clear();
+            bool hashed = true;
+            for (const ChartRef &ref : info.sources)
+            {
+                std::string json;
+                hashed = hashed && pool_.query_range(token, ref.sheet, ref.range, json, err);
+                values_json += json + "\n";
+            }
+            ExcelPool::WorkbookState state;
+            if (hashed && pool_.workbook_state(token, state))
+                cache_key = QueryCache::make_key(state.source, state.stamp, sheet, chart_name, "chart excel " + hex64(fnv1a64(values_json)));
+        }
+
+        std::string etag;
+        if (!cache_key.empty())
+        {
+            etag = "\"" + hex64(fnv1a64(cache_key)) + "\"";
+            resp.headers.emplace_back("ETag", etag);
+            auto inm = req.headers.find("If-None-Match");
+            if (inm != req.headers.end() && inm->second.find(etag) != std::string::npos)
+            {
+                static Counter &not_modified = g_metrics.counter("esa_chart_cache_total", "Cache lookups and evictions", metric_label("result", "not_modified"));
+                not_modified.add();
+                resp.status = 304;
+                resp.body.clear();
+                return resp;
+            }
+            if (chart_cache_.enabled())
+                chart_cache_.get(cache_key, png);
+        }
+        if (png.empty())
+        {
+            static Histogram &render_seconds = g_metrics.histogram("esa_chart_render_seconds", "Chart images drawn in-process or exported from Excel");
+            ScopedTimer timer(render_seconds);
+            if (drawn)
+                png = render_chart_png(*drawn, series);
+            else if (!pool_.export_chart_png(token, sheet, chart_name, png, err))
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+                ESA_LOG_WARN("Chart export failed owner=" + owner + " app=" + app_name + " sheet=" + sheet + " cell=" + cell + " err=" + err);
+                return resp;
+            }
+            if (!cache_key.empty() && chart_cache_.enabled())
+                chart_cache_.put(cache_key, png);
+            ESA_LOG_INFO("Rendered chart owner=" + owner + " app=" + app_name + " sheet=" + sheet + " chart=" + chart_name + " engine=" + (drawn ? "native" : "excel"));
+        }
+        auto accept = req.headers.find("Accept");
+        if (accept != req.headers.end() && accept->second.find("image/png") != std::string::npos)
+        {
+            resp.content_type = "image/png";
+            resp.body = std::move(png);
+        }
+        else
+            resp.body = "{\"image\":\"" + base64_encode(png) + "\"}";
         return resp;
     }
 
     HttpResponse handle_list(const HttpRequest &req)
     {
         HttpResponse resp;
-        UserRecord u;
-        if (!authenticate(req, u, resp))
-            return resp;
-        resp.body = list_apps_json(u);
+        resp.body = list_apps_json(req.user, &resp.fragments);
         return resp;
     }
 
     HttpResponse handle_create(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string app_name = extract_json_string(req.body, "name");
         std::string desc = extract_json_string(req.body, "description");
         std::string file_b64 = extract_json_string(req.body, "file_base64");
         std::string access_group = extract_json_string(req.body, "access_group");
         std::string image_b64 = extract_json_string(req.body, "image_base64");
         std::string file_ext = extract_json_string(req.body, "file_extension");
+        std::string upload_id = extract_json_string(req.body, "upload");
         bool is_public = extract_json_bool(req.body, "public", false);
         // Validate and default file extension
         if (file_ext.empty() || (file_ext != ".xlsx" && file_ext != ".xlsm" && file_ext != ".xls"))
             file_ext = ".xlsx";
-        if (app_name.empty() || file_b64.empty())
+        if (app_name.empty() || (file_b64.empty() && upload_id.empty()))
         {
             resp.status = 400;
             resp.body = "{\"error\":\"missing name or file_base64\"}";
@@ -3063,10 +16806,13 @@ private:
             resp.body = "{\"error\":\"cannot create folder\"}";
             return resp;
         }
-        std::string content = base64_decode(file_b64);
-        std::ofstream file(ver_path / (app_name + file_ext), std::ios::binary);
-        file.write(content.data(), static_cast<std::streamsize>(content.size()));
-        file.close();
+        std::string err;
+        if (!store_workbook(file_b64, upload_id, caller.name, ver_path / (app_name + file_ext), err))
+        {
+            resp.status = upload_id.empty() ? 500 : 400;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
         AppInfo info{app_name, 1, desc};
         write_metadata(ver_path, info);
         AppRecord rec{caller.name, app_name, 1, desc, is_public, access_group, file_ext};
@@ -3088,12 +16834,8 @@ private:
     HttpResponse handle_update(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
-        std::string app_name = url_decode(req.path.substr(std::string("/apps/").size()));
+        const UserRecord &caller = req.user;
+        const std::string &app_name = req.params.at("name");
         if (app_name.empty())
         {
             resp.status = 400;
@@ -3122,9 +16864,11 @@ private:
         bool requested_new_version = extract_json_bool(req.body, "new_version", false);
         std::string desc = extract_json_string(req.body, "description");
         std::string file_b64 = extract_json_string(req.body, "file_base64");
+        std::string upload_id = extract_json_string(req.body, "upload");
         std::string access_group = extract_json_string(req.body, "access_group");
         bool public_flag = extract_json_bool(req.body, "public", app.public_access);
         std::string image_b64 = extract_json_string(req.body, "image_base64");
+        bool new_file = !file_b64.empty() || !upload_id.empty();
         if (requested_new_version)
         {
             resp.status = 400;
@@ -3146,11 +16890,24 @@ private:
             return resp;
         }
         std::string ext = app.file_extension.empty() ? ".xlsx" : app.file_extension;
-        if (!file_b64.empty())
+        if (new_file)
         {
-            std::string content = base64_decode(file_b64);
-            std::ofstream file(target_path / (app_name + ext), std::ios::binary | std::ios::trunc);
-            file.write(content.data(), static_cast<std::streamsize>(content.size()));
+            std::string err;
+            if (!store_workbook(file_b64, upload_id, caller.name, target_path / (app_name + ext), err))
+            {
+                resp.status = upload_id.empty() ? 500 : 400;
+                resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+                return resp;
+            }
+            // Described the file just replaced.
+            remove_workbook_summary(target_path);
+            {
+                std::lock_guard<std::mutex> lock(publish_mu_);
+                warm_models_.erase(app.owner + "/" + app.name);
+            }
+            query_cache_.invalidate_under(app_root() / app.owner / app.name);
+            calc_memo_.invalidate_under(app_root() / app.owner / app.name);
+            chart_cache_.invalidate_under(app_root() / app.owner / app.name);
         }
         if (!desc.empty())
             app.description = desc;
@@ -3159,6 +16916,17 @@ private:
         app.public_access = public_flag;
         app.latest_version = ver;
         AppInfo info{app_name, ver, app.description};
+        AppInfo prior;
+        if (new_file)
+        {
+            info.volatile_checked = true;
+            info.volatile_features = find_volatile_features(target_path / (app_name + ext));
+        }
+        else if (read_metadata(target_path, prior))
+        {
+            info.volatile_checked = prior.volatile_checked;
+            info.volatile_features = prior.volatile_features;
+        }
         write_metadata(target_path, info);
         db_.upsert_app(app);
         if (!image_b64.empty())
@@ -3178,11 +16946,7 @@ private:
     HttpResponse handle_version_publish(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         if (owner.empty())
             owner = caller.name;
@@ -3212,109 +16976,250 @@ private:
             resp.body = "{\"error\":\"forbidden\"}";
             return resp;
         }
-        log_info("Version publish requested by " + caller.name + " for owner=" + owner + " app=" + app_name);
-        std::string desc = extract_json_string(req.body, "description");
-        std::string file_b64 = extract_json_string(req.body, "file_base64");
-        std::string image_b64 = extract_json_string(req.body, "image_base64");
-        std::string schema_json = extract_json_string(req.body, "schema_json");
-        std::string access_group = extract_json_string(req.body, "access_group");
-        bool public_flag = extract_json_bool(req.body, "public", app.public_access);
-        if (!access_group.empty() && !is_safe_name(access_group))
+        ESA_LOG_INFO("Version publish requested by " + caller.name + " for owner=" + owner + " app=" + app_name);
+        PublishRequest p;
+        p.description = extract_json_string(req.body, "description");
+        p.file_b64 = extract_json_string(req.body, "file_base64");
+        p.upload_id = extract_json_string(req.body, "upload");
+        p.image_b64 = extract_json_string(req.body, "image_base64");
+        p.schema_json = extract_json_string(req.body, "schema_json");
+        p.access_group = extract_json_string(req.body, "access_group");
+        p.public_access = extract_json_bool(req.body, "public", app.public_access);
+        p.prewarm = extract_json_bool(req.body, "prewarm", true);
+        if (!p.access_group.empty() && !is_safe_name(p.access_group))
         {
             resp.status = 400;
             resp.body = "{\"error\":\"invalid access group\"}";
             return resp;
         }
-        if (!schema_json.empty() && schema_json.size() > 256 * 1024)
+        if (!p.schema_json.empty() && p.schema_json.size() > 256 * 1024)
         {
             resp.status = 400;
             resp.body = "{\"error\":\"schema too large\"}";
             return resp;
         }
+        if (!p.upload_id.empty() && !uploads_.find(p.upload_id, caller.name))
+        {
+            resp.status = 400;
+            resp.body = "{\"error\":\"unknown upload\"}";
+            return resp;
+        }
+        auto job = std::make_shared<PublishJob>(generate_job_id(), caller.name, app.owner, app.name, app.latest_version + 1);
+        {
+            std::lock_guard<std::mutex> lock(publish_mu_);
+            // One publish per app at a time, so two cannot claim the same
+            // version number.
+            if (!publishing_.insert(app.owner + "/" + app.name).second)
+            {
+                resp.status = 409;
+                resp.body = "{\"error\":\"a version of this app is already being published\"}";
+                return resp;
+            }
+            int64_t now = steady_us();
+            for (auto it = publish_jobs_.begin(); it != publish_jobs_.end();)
+                it = it->second->expired(now) ? publish_jobs_.erase(it) : std::next(it);
+            publish_jobs_[job->id()] = job;
+        }
+        std::thread([this, job, p]()
+                    { run_publish(job, p); })
+            .detach();
+        resp.status = 202;
+        resp.body = job->status_json();
+        return resp;
+    }
+
+    void run_publish(const std::shared_ptr<PublishJob> &job, const PublishRequest &p)
+    {
+        static Histogram &publish_time = g_metrics.histogram("esa_publish_seconds", "Time to publish a new app version, from request to activation");
+        std::string err;
+        {
+            ScopedTimer timer(publish_time);
+            if (!build_version(*job, p, err))
+            {
+                std::error_code ec;
+                fs::remove_all(version_path(job->owner(), job->app(), job->version()), ec);
+                collect_blobs();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(publish_mu_);
+            publishing_.erase(job->owner() + "/" + job->app());
+        }
+        job->finish(err);
+        static Counter &published = g_metrics.counter("esa_publish_total", "Version publish jobs by outcome", metric_label("result", "published"));
+        static Counter &failed = g_metrics.counter("esa_publish_total", "Version publish jobs by outcome", metric_label("result", "failed"));
+        (err.empty() ? published : failed).add();
+        std::string what = "owner=" + job->owner() + " app=" + job->app() + " version=" + std::to_string(job->version()) + " job=" + job->id();
+        if (err.empty())
+            ESA_LOG_INFO("Version publish succeeded " + what);
+        else
+            ESA_LOG_WARN("Version publish failed " + what + " err=" + err);
+    }
+
+    // The stages of a publish. Everything is written into the new version's
+    // folder first; the app only moves to it in the last stage.
+    bool build_version(PublishJob &job, const PublishRequest &p, std::string &err)
+    {
+        AppRecord app;
+        if (!db_.get_app(job.owner(), job.app(), app))
+        {
+            err = "app not found";
+            return false;
+        }
+        std::string owner = app.owner;
+        std::string app_name = app.name;
         int prev_version = app.latest_version;
-        int ver = prev_version + 1;
-        fs::path target_path = version_path(app.owner, app.name, ver);
+        int ver = job.version();
+        bool new_file = !p.file_b64.empty() || !p.upload_id.empty();
+
+        job.stage("storing");
+        fs::path target_path = version_path(owner, app_name, ver);
         if (!ensure_dir(target_path))
         {
-            resp.status = 500;
-            resp.body = "{\"error\":\"cannot create folder\"}";
-            return resp;
+            err = "cannot create folder";
+            return false;
         }
         std::string ext = app.file_extension.empty() ? ".xlsx" : app.file_extension;
         fs::path target_file = target_path / (app_name + ext);
-        bool workbook_ready = false;
-        if (!file_b64.empty())
+        fs::path prev_path = version_path(owner, app_name, prev_version);
+        if (new_file)
         {
-            std::string content = base64_decode(file_b64);
-            std::ofstream file(target_file, std::ios::binary | std::ios::trunc);
-            file.write(content.data(), static_cast<std::streamsize>(content.size()));
-            file.close();
-            workbook_ready = true;
+            if (!store_workbook(p.file_b64, p.upload_id, job.user(), target_file, err))
+                return false;
         }
         else
         {
-            fs::path prev_file = version_path(app.owner, app.name, prev_version) / (app_name + ext);
-            std::error_code ec;
-            if (fs::exists(prev_file))
+            fs::path prev_file = prev_path / (app_name + ext);
+            if (!fs::exists(prev_file) || !link_blob(prev_file, target_file))
             {
-                fs::copy_file(prev_file, target_file, fs::copy_options::overwrite_existing, ec);
-                if (!ec)
-                    workbook_ready = true;
+                err = "workbook missing";
+                return false;
             }
         }
-        if (!workbook_ready)
+
+        // Only the xlsx family can be read without Excel; .xls and .xlsb
+        // are published as they are.
+        std::string lower_ext = to_lower(ext);
+        if (lower_ext == ".xlsx" || lower_ext == ".xlsm")
         {
-            resp.status = 400;
-            resp.body = "{\"error\":\"workbook missing\"}";
-            return resp;
+            job.stage("validating");
+            if (!write_workbook_summary(target_file, target_path, err))
+            {
+                err = "workbook does not open: " + err;
+                return false;
+            }
         }
-        std::string schema_payload = schema_json;
+
+        job.stage("saving");
+        std::string schema_payload = p.schema_json;
         if (schema_payload.empty())
-            schema_payload = load_app_ui_version(app.owner, app_name, prev_version);
+            schema_payload = load_app_ui_version(owner, app_name, prev_version);
         if (schema_payload.empty())
-            schema_payload = load_app_ui(app.owner, app_name);
+            schema_payload = load_app_ui(owner, app_name);
         if (schema_payload.empty())
             schema_payload = "{\"components\":[]}";
-        if (!save_app_ui_version(app.owner, app_name, ver, schema_payload) ||
-            !save_app_ui(app.owner, app_name, schema_payload))
+        if (!save_app_ui_version(owner, app_name, ver, schema_payload))
         {
-            resp.status = 500;
-            resp.body = "{\"error\":\"cannot save schema\"}";
-            return resp;
+            err = "cannot save schema";
+            return false;
         }
-        bool had_prior_image = fs::exists(app_image_version_path(app.owner, app.name, prev_version)) ||
-                               fs::exists(app_image_path(app.owner, app.name));
         bool image_ok = true;
-        if (!image_b64.empty())
+        if (!p.image_b64.empty())
+            image_ok = save_app_image_version(owner, app_name, ver, p.image_b64);
+        else if (fs::exists(app_image_version_path(owner, app_name, prev_version)) || fs::exists(app_image_path(owner, app_name)))
+            image_ok = copy_app_image_version(owner, app_name, prev_version, ver);
+        if (!image_ok)
         {
-            image_ok = save_app_image(app.owner, app_name, image_b64) &&
-                       save_app_image_version(app.owner, app_name, ver, image_b64);
+            err = "cannot persist image";
+            return false;
         }
-        else if (had_prior_image)
+        AppInfo info{app_name, ver, p.description.empty() ? app.description : p.description};
+        AppInfo prior;
+        info.volatile_checked = true;
+        if (!new_file && read_metadata(prev_path, prior) && prior.volatile_checked)
+            info.volatile_features = prior.volatile_features; // same workbook as the previous version
+        else
+            info.volatile_features = find_volatile_features(target_file);
+        if (!write_metadata(target_path, info))
         {
-            image_ok = copy_app_image_version(app.owner, app_name, prev_version, ver);
+            err = "cannot write metadata";
+            return false;
         }
-        if (!image_ok)
+
+        // Parsed now and held until the next publish, so the first user of
+        // the version does not wait for it.
+        std::shared_ptr<const WorkbookModel> warm;
+        if (p.prewarm && cfg_.native_engine && lower_ext == ".xlsx")
         {
-            resp.status = 500;
-            resp.body = "{\"error\":\"cannot persist image\"}";
-            return resp;
+            job.stage("prewarming");
+            bool cached = false;
+            std::string reason;
+            warm = models_.get(target_file, cached, reason);
+            if (!warm)
+                ESA_LOG_INFO("Not prewarming version " + std::to_string(ver) + " of owner=" + owner + " app=" + app_name + ": " + reason);
         }
-        if (!desc.empty())
-            app.description = desc;
-        if (!access_group.empty())
-            app.access_group = access_group;
-        app.public_access = public_flag;
+
+        job.stage("activating");
+        // The current schema and image sit outside the version folders and
+        // are only replaced once the version is known to be good.
+        if (!save_app_ui(owner, app_name, schema_payload) ||
+            (!p.image_b64.empty() && !save_app_image(owner, app_name, p.image_b64)))
+        {
+            err = "cannot save current schema or image";
+            return false;
+        }
+        // Re-read: the app may have been edited or removed meanwhile.
+        if (!db_.get_app(owner, app_name, app))
+        {
+            err = "app was deleted";
+            return false;
+        }
+        if (!p.description.empty())
+            app.description = p.description;
+        if (!p.access_group.empty())
+            app.access_group = p.access_group;
+        app.public_access = p.public_access;
         app.latest_version = ver;
-        AppInfo info{app_name, ver, app.description};
-        write_metadata(target_path, info);
         db_.upsert_app(app);
-        log_info("Version publish succeeded owner=" + owner + " app=" + app_name + " version=" + std::to_string(ver));
-        resp.body = "{\"status\":\"version_created\",\"version\":" + std::to_string(ver) + "}";
+        {
+            std::lock_guard<std::mutex> lock(publish_mu_);
+            if (warm)
+                warm_models_[owner + "/" + app_name] = warm;
+            else
+                warm_models_.erase(owner + "/" + app_name);
+        }
+        query_cache_.invalidate_under(app_root() / owner / app_name);
+        calc_memo_.invalidate_under(app_root() / owner / app_name);
+        chart_cache_.invalidate_under(app_root() / owner / app_name);
+        if (!info.volatile_features.empty())
+            ESA_LOG_INFO("Version " + std::to_string(ver) + " of owner=" + owner + " app=" + app_name + " will not be memoized: " + info.volatile_features);
+        return true;
+    }
+
+    HttpResponse handle_version_status(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
+        std::string id = extract_json_string(req.body, "job");
+        std::shared_ptr<PublishJob> job;
+        {
+            std::lock_guard<std::mutex> lock(publish_mu_);
+            auto it = publish_jobs_.find(id);
+            if (it != publish_jobs_.end())
+                job = it->second;
+        }
+        if (!job || (job->user() != caller.name && !is_admin(caller, cfg_)))
+        {
+            resp.status = 404;
+            resp.body = "{\"error\":\"job not found\"}";
+            return resp;
+        }
+        resp.body = job->status_json();
         return resp;
     }
 
-    std::string list_apps_json(const UserRecord &viewer_in)
+    // With `fragments`, notes where each cover image's .dfl fits in.
+    std::string list_apps_json(const UserRecord &viewer_in, std::vector<BodyFragment> *fragments = nullptr)
     {
         UserRecord viewer = viewer_in;
         std::vector<AppRecord> apps = db_.list_apps();
@@ -3335,9 +17240,13 @@ private:
             if (!first)
                 oss << ",";
             first = false;
+            fs::path image_path = app_image_version_path(a.owner, a.name, a.latest_version);
             std::string image_data = load_app_image_base64_version(a.owner, a.name, a.latest_version);
             if (image_data.empty())
+            {
+                image_path = app_image_path(a.owner, a.name);
                 image_data = load_app_image_base64(a.owner, a.name);
+            }
             bool has_ui = fs::exists(app_ui_version_path(a.owner, a.name, a.latest_version)) || fs::exists(app_ui_path(a.owner, a.name));
             oss << "{\"owner\":\"" << json_escape(a.owner) << "\","
                 << "\"name\":\"" << json_escape(a.name) << "\","
@@ -3346,7 +17255,10 @@ private:
                 << "\"public\":" << (a.public_access ? "true" : "false") << ","
                 << "\"access_group\":\"" << json_escape(a.access_group) << "\","
                 << "\"has_ui\":" << (has_ui ? "true" : "false") << ","
-                << "\"image_base64\":\"" << json_escape(image_data) << "\"}";
+                << "\"image_base64\":\"";
+            if (fragments && !image_data.empty())
+                fragments->push_back({static_cast<size_t>(oss.tellp()), load_deflated(image_path)});
+            oss << json_escape(image_data) << "\"}";
         }
         oss << "]";
         return oss.str();
@@ -3355,10 +17267,8 @@ private:
     HttpResponse handle_delete(const HttpRequest &req)
     {
         HttpResponse resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
-        std::string app_name = url_decode(req.path.substr(std::string("/apps/").size()));
+        const UserRecord &caller = req.user;
+        const std::string &app_name = req.params.at("name");
         if (app_name.empty())
         {
             resp.status = 400;
@@ -3387,19 +17297,122 @@ private:
         fs::path base = app_root() / app.owner / app_name;
         std::error_code ec;
         fs::remove_all(base, ec);
+        collect_blobs();
+        {
+            std::lock_guard<std::mutex> lock(publish_mu_);
+            warm_models_.erase(app.owner + "/" + app_name);
+        }
+        query_cache_.invalidate_under(base);
+        calc_memo_.invalidate_under(base);
+        chart_cache_.invalidate_under(base);
         db_.remove_app(app.owner, app_name);
         resp.body = "{\"status\":\"deleted\"}";
         return resp;
     }
 
-    HttpResponse handle_ui_get(const HttpRequest &req)
+    static std::string upload_json(const UploadStore::Upload &up)
+    {
+        return "{\"upload\":\"" + up.id + "\",\"offset\":" + std::to_string(up.offset) + ",\"size\":" + std::to_string(up.size) +
+               ",\"complete\":" + (up.offset == up.size ? "true" : "false") + "}";
+    }
+
+    HttpResponse handle_upload_create(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
+        long long size = extract_json_int(req.body, "size", -1);
+        uint64_t limit = static_cast<uint64_t>(cfg_.upload_max_mb) * 1024 * 1024;
+        if (size <= 0 || static_cast<uint64_t>(size) > limit)
+        {
+            resp.status = size > 0 ? 413 : 400;
+            resp.body = "{\"error\":\"size must be between 1 and " + std::to_string(limit) + " bytes\"}";
+            return resp;
+        }
+        std::string err;
+        std::shared_ptr<UploadStore::Upload> up = uploads_.create(caller.name, static_cast<uint64_t>(size), err);
+        if (!up)
+        {
+            resp.status = err == "too many open uploads" ? 429 : 500;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\"}";
+            return resp;
+        }
+        ESA_LOG_INFO("Upload started id=" + up->id + " user=" + caller.name + " size=" + std::to_string(size));
+        resp.body = upload_json(*up);
+        return resp;
+    }
+
+    // GET reports how much of an upload has arrived, PUT appends a chunk
+    // (raw bytes, placed by "Content-Range: bytes start-end/total" or at
+    // offset 0 without one) and DELETE abandons it.
+    HttpResponse handle_upload(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
+        const UserRecord &caller = req.user;
+        const std::string &id = req.params.at("id");
+        std::shared_ptr<UploadStore::Upload> up = uploads_.find(id, caller.name);
+        if (!up)
+        {
+            resp.status = 404;
+            resp.body = "{\"error\":\"upload not found\"}";
+            return resp;
+        }
+        if (req.method == "DELETE")
+        {
+            uploads_.remove(id, caller.name);
+            resp.body = "{\"status\":\"deleted\"}";
             return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
+        }
+        if (req.method != "PUT")
+        {
+            std::lock_guard<std::mutex> lock(up->mu);
+            resp.body = upload_json(*up);
+            return resp;
+        }
+        uint64_t start = 0;
+        auto range = req.headers.find("Content-Range");
+        if (range != req.headers.end())
+        {
+            unsigned long long first = 0, last = 0, total = 0;
+            if (std::sscanf(range->second.c_str(), "bytes %llu-%llu/%llu", &first, &last, &total) != 3 || total != up->size ||
+                last < first || last - first + 1 != req.body_length)
+            {
+                resp.status = 400;
+                resp.body = "{\"error\":\"bad Content-Range\"}";
+                return resp;
+            }
+            start = first;
+        }
+        std::string err;
+        if (!uploads_.append(*up, start, req.socket, req.body_length, err))
+        {
+            std::lock_guard<std::mutex> lock(up->mu);
+            resp.status = err == "offset mismatch" ? 409 : err == "chunk exceeds declared size" ? 400 : 500;
+            resp.body = "{\"error\":\"" + json_escape(err) + "\",\"offset\":" + std::to_string(up->offset) + "}";
             return resp;
+        }
+        std::lock_guard<std::mutex> lock(up->mu);
+        resp.body = upload_json(*up);
+        return resp;
+    }
+
+    // Writes the workbook of /apps, /apps/version or PUT /apps/<name>, given
+    // either inline as base64 or as a finished upload.
+    bool store_workbook(const std::string &file_b64, const std::string &upload_id, const std::string &user, const fs::path &dest, std::string &err)
+    {
+        if (!upload_id.empty())
+            return uploads_.finish(upload_id, user, dest, err);
+        if (!put_blob(dest, base64_decode(file_b64)))
+        {
+            err = "cannot save workbook";
+            return false;
+        }
+        return true;
+    }
+
+    HttpResponse handle_ui_get(const HttpRequest &req)
+    {
+        HttpResponse resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         std::string app_name = extract_json_string(req.body, "name");
         if (owner.empty())
@@ -3429,23 +17442,26 @@ private:
             resp.body = "{\"error\":\"forbidden\"}";
             return resp;
         }
+        fs::path schema_path = app_ui_version_path(owner, app_name, app.latest_version);
         std::string schema = load_app_ui_version(owner, app_name, app.latest_version);
         if (schema.empty())
+        {
+            schema_path = app_ui_path(owner, app_name);
             schema = load_app_ui(owner, app_name);
+        }
+        resp.body = "{\"owner\":\"" + json_escape(owner) + "\",\"name\":\"" + json_escape(app_name) + "\",\"schema\":";
         if (schema.empty())
             schema = "{\"components\":[]}";
-        resp.body = "{\"owner\":\"" + json_escape(owner) + "\",\"name\":\"" + json_escape(app_name) + "\",\"schema\":" + schema + "}";
+        else
+            resp.fragments.push_back({resp.body.size(), load_deflated(schema_path)});
+        resp.body += schema + "}";
         return resp;
     }
 
     HttpResponse handle_ui_save(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         std::string owner = extract_json_string(req.body, "owner");
         std::string app_name = extract_json_string(req.body, "name");
         std::string schema_json = extract_json_string(req.body, "schema_json");
@@ -3501,9 +17517,7 @@ private:
     HttpResponse handle_users_list(const HttpRequest &req)
     {
         HttpResponse resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         if (!is_admin(caller, cfg_))
         {
             resp.status = 403;
@@ -3542,11 +17556,7 @@ private:
     HttpResponse handle_users_upsert(const HttpRequest &req)
     {
         HttpResponse resp;
-        if (!require_json(req, resp))
-            return resp;
-        UserRecord caller;
-        if (!authenticate(req, caller, resp))
-            return resp;
+        const UserRecord &caller = req.user;
         if (!is_admin(caller, cfg_))
         {
             resp.status = 403;
@@ -3601,13 +17611,157 @@ private:
     const Config &cfg_;
     ExcelPool &pool_;
     Database &db_;
+    SessionJournal &journal_;
+    std::mutex restore_mu_;
+    std::unordered_map<std::string, std::shared_ptr<std::mutex>> restoring_; // token -> restore in progress
+    RouteMetrics static_metrics_{"GET (static)"};
+    static const size_t kMaxShareableVersions = 4096;
+    std::mutex shareable_mu_;
+    std::unordered_map<std::string, std::pair<fs::file_time_type, bool>> shareable_; // version file -> its stamp, shareable
+    std::mutex native_mu_;
+    std::unordered_map<std::string, std::shared_ptr<NativeSession>> native_sessions_;
+    std::mutex calc_mu_;
+    std::unordered_map<std::string, std::shared_ptr<CalcSession>> calc_sessions_;
+    std::mutex push_mu_;
+    std::unordered_map<std::string, std::shared_ptr<PushChannel>> push_channels_;
+    std::mutex tracer_mu_;
+    std::unordered_map<std::string, std::shared_ptr<OutputTracer>> tracers_;
+    std::mutex analysis_mu_;
+    std::unordered_map<std::string, std::weak_ptr<AnalysisJob>> analysis_jobs_;
+    std::mutex publish_mu_;
+    std::unordered_map<std::string, std::shared_ptr<PublishJob>> publish_jobs_;
+    std::unordered_set<std::string> publishing_;                                     // owner/app
+    std::unordered_map<std::string, std::shared_ptr<const WorkbookModel>> warm_models_; // owner/app -> latest version's model
+    ModelCache models_;
+    QueryCache query_cache_{"esa_query_cache_total"};
+    QueryCache calc_memo_{"esa_calc_memo_total"};
+    QueryCache chart_cache_{"esa_chart_cache_total"};
+    ChartIndexCache chart_indexes_;
+    UploadStore uploads_;
+    StaticFiles static_files_;
+    Router router_;
+    RateLimiter limiter_;
     SessionStore sessions_;
+    std::atomic<uint64_t> next_request_id_{1};
+    std::atomic<int> active_connections_{0};
     bool running_ = false;
 };
 
 // -------------------- Entry --------------------
-int main()
+// `esa --bench-wire` compares the JSON and binary forms of a query on a
+// synthetic 5000 x 10 range (ids, prices, categories, dates, flags, names,
+// quantities, a sparse column and a mixed one), encoded in blocks as the
+// server does.
+int run_wire_bench()
+{
+    const uint32_t rows = 5000, cols = 10;
+    static const char *categories[] = {"Hardware", "Software", "Services", "Support", "Training", "Licensing", "Consulting", "Other"};
+    std::mt19937 rng(42);
+    CellGrid grid;
+    grid.rows = rows;
+    grid.cols = cols;
+    grid.values.resize(static_cast<size_t>(rows) * cols);
+    grid.dates.resize(grid.values.size());
+    for (uint32_t r = 0; r < rows; ++r)
+    {
+        CellValue *row = &grid.values[static_cast<size_t>(r) * cols];
+        row[0] = CellValue::number(1000 + r);
+        row[1] = CellValue::number(std::round(std::uniform_real_distribution<double>(1, 5000)(rng) * 100) / 100);
+        row[2] = CellValue::string(categories[rng() % 8]);
+        row[3] = CellValue::number(19000 + rng() % 1500);
+        grid.dates[static_cast<size_t>(r) * cols + 3] = 1;
+        row[4] = CellValue::boolean(rng() % 2 == 0);
+        row[5] = CellValue::number(std::uniform_real_distribution<double>(-1, 1)(rng));
+        row[6] = CellValue::string("Customer " + std::to_string(rng() % 2000));
+        row[7] = CellValue::number(rng() % 250);
+        if (rng() % 10 == 0)
+            row[8] = CellValue::number(std::uniform_real_distribution<double>(0, 100)(rng));
+        row[9] = r % 3 ? CellValue::number(r * 0.5) : CellValue::string("n/a");
+    }
+    const uint32_t block_rows = static_cast<uint32_t>(kQueryBlockCells / cols);
+    auto block_of = [&](uint32_t first, CellGrid &block)
+    {
+        uint32_t to = std::min(rows, first + block_rows);
+        block.rows = to - first;
+        block.cols = cols;
+        block.values.assign(grid.values.begin() + static_cast<size_t>(first) * cols, grid.values.begin() + static_cast<size_t>(to) * cols);
+        block.dates.assign(grid.dates.begin() + static_cast<size_t>(first) * cols, grid.dates.begin() + static_cast<size_t>(to) * cols);
+    };
+    auto encode_json = [&](std::string &out)
+    {
+        out = "{\"value\":[";
+        for (size_t i = 0; i < grid.values.size(); ++i)
+        {
+            const CellValue &v = grid.values[i];
+            out += i % cols ? "," : (i ? "],[" : "[");
+            int y, m, d;
+            if (v.type == CellValue::Text)
+                out += "\"" + json_escape(v.text) + "\"";
+            else if (v.type == CellValue::Bool)
+                out += v.num != 0.0 ? "true" : "false";
+            else if (v.type != CellValue::Number)
+                out += "null";
+            else if (grid.dates[i])
+            {
+                char buf[16];
+                civil_from_days(static_cast<int64_t>(std::floor(v.num)), y, m, d);
+                std::snprintf(buf, sizeof(buf), "\"%04d-%02d-%02d\"", y, m, d);
+                out += buf;
+            }
+            else
+                out += format_json_number(v.num);
+        }
+        out += "]]}";
+    };
+    auto encode_binary = [&](std::string &out)
+    {
+        out.clear();
+        append_cells_header(rows, cols, false, 0, rows, "", out);
+        CellGrid block;
+        for (uint32_t first = 0; first < rows; first += block_rows)
+        {
+            block_of(first, block);
+            append_cell_frame(block, out);
+        }
+        append_cells_end(out);
+    };
+    auto time_ms = [](const std::function<void()> &fn)
+    {
+        double best = 1e300;
+        for (int i = 0; i < 20; ++i)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            fn();
+            best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+        }
+        return best;
+    };
+    std::string json, binary;
+    double json_ms = time_ms([&]
+                             { encode_json(json); });
+    double binary_ms = time_ms([&]
+                               { encode_binary(binary); });
+    std::cout << "wire bench: " << rows << " x " << cols << " cells, best of 20\n";
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "  json    " << json.size() << " bytes, encode " << json_ms << " ms\n";
+    std::cout << "  binary  " << binary.size() << " bytes, encode " << binary_ms << " ms\n";
+#ifdef ESA_HAVE_ZLIB
+    for (const std::string *body : {&json, &binary})
+    {
+        uLongf packed = compressBound(static_cast<uLong>(body->size()));
+        std::vector<Bytef> buf(packed);
+        compress2(buf.data(), &packed, reinterpret_cast<const Bytef *>(body->data()), static_cast<uLong>(body->size()), 6);
+        std::cout << "  " << (body == &json ? "json  " : "binary") << "  deflated " << packed << " bytes\n";
+    }
+#endif
+    std::cout << "Decode times are measured in the browser: esaWireBench(sheet, range) in the console.\n";
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
+    if (argc > 1 && std::string(argv[1]) == "--bench-wire")
+        return run_wire_bench();
     Config cfg = load_config("config.json");
     if (!ensure_dir(app_root()))
     {
@@ -3616,9 +17770,11 @@ int main()
     }
     fs::path log_dir = fs::path("logs");
     ensure_dir(log_dir);
-    g_logger.init(log_dir / "server.log");
-    log_info("ESA server starting up");
+    g_logger.init(log_dir / "server.log", cfg.log_level, cfg.log_overflow);
+    g_access_log.init(log_dir, static_cast<size_t>(std::max(1, cfg.access_log_max_mb)) * 1024 * 1024, cfg.access_log_keep);
+    ESA_LOG_INFO("ESA server starting up");
     Database db("db.bin");
+    SessionJournal journal("sessions.log");
     if (!db.load())
     {
         std::cerr << "Failed to load db.bin\n";
@@ -3645,21 +17801,28 @@ int main()
             db.upsert_user(nu);
         }
     }
+    collect_blobs();
     ExcelPool pool;
     g_excel_pool = &pool;
     SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
     std::atexit([]()
                 {
-        if (g_excel_pool) g_excel_pool->shutdown(); });
+        if (g_excel_pool) g_excel_pool->shutdown();
+        g_access_log.shutdown();
+        g_logger.shutdown(); });
     if (!pool.init(cfg.excel_instances))
     {
         std::cerr << "Excel pool initialization failed\n";
-        log_error("Excel pool initialization failed");
+        ESA_LOG_ERROR("Excel pool initialization failed");
         return 1;
     }
-    log_info("Excel pool ready with " + std::to_string(cfg.excel_instances) + " instance(s)");
-    Server srv(cfg, pool, db);
+    int running = cfg.excel_concurrency ? cfg.excel_concurrency : static_cast<int>(std::thread::hardware_concurrency());
+    pool.set_concurrency(running);
+    ESA_LOG_INFO("Excel pool ready with " + std::to_string(cfg.excel_instances) + " instance(s), " + std::to_string(std::max(1, running)) + " operation(s) at once");
+    Server srv(cfg, pool, db, journal);
     srv.start();
     pool.shutdown();
+    g_access_log.shutdown();
+    g_logger.shutdown();
     return 0;
 }